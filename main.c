@@ -5,119 +5,1363 @@
  *  For modifications: copyright 2015 Zalan Rajna under GNU GPLv3
  */
 
-#include "zindex.h"
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include "znzlib.h"
 
-/* Create zindex index for input file. Default: .idx and .ucs extra files. */
+static const char *usage =
+	"usage: zindex [-n] [-S] [-p] [-o out.gz] file.gz [file.gz.idx file.gz.idx.ucs]\n"
+	"       zindex [-n] [-S] [-p] -c file.gz   (index in the index cache directory)\n"
+	"       zindex [-n] [-S] -e file.gz   (embed index in file.gz)\n"
+	"       zindex [-n] --update file.gz [file.gz.idx file.gz.idx.ucs]\n"
+	"       zindex [-n] [-S] -s store file.gz...   (windows shared in store)\n"
+	"       zindex release file.gz...   (drop index and its stored windows)\n"
+	"       zindex stats [-r min max] file.nii.gz   (voxel statistics of -S)\n"
+	"       zindex adapt [-m min] file.gz   (add access points where reads cluster)\n"
+	"       zindex verify [-j threads] file.gz [file.gz.idx file.gz.idx.ucs]\n"
+	"       zindex replay [-a] [-c cachedir [-m MB]] trace file.gz [file.gz.idx file.gz.idx.ucs]\n"
+	"       zindex convert file.gz index.gzi|index.gzidx   (to file.gz.idx)\n"
+	"       zindex convert -t gzi|gzidx file.gz [index]   (from file.gz.idx)\n"
+	"       zindex transcode [-j threads] [-l level] file.nii.gz [file.nii.zst]\n"
+	"       zindex rechunk [-j threads] [-l level] [-b block] file.nii.gz [file.nii.zch]\n"
+	"  file.gz may be - to index standard input; with -o the compressed\n"
+	"  data is passed through unchanged to out.gz (- for standard output),\n"
+	"  -n counts lines as well, for seeking to a line of a text file,\n"
+	"  -S keeps statistics of the voxels of every volume of a NIfTI image,\n"
+	"  -p writes a preview pyramid of its middle volume to file.gz.idx.prv,\n"
+	"  --update indexes what was appended to file.gz since it was indexed;\n"
+	"  an index that cannot be written next to file.gz goes to the cache\n"
+	"  directory, ZINDEX_INDEX_CACHE or $XDG_CACHE_HOME/zindex\n";
+
+/* Return path with ext appended, or NULL if out of memory */
+static char *index_name(const char *path, const char *ext)
+{
+	size_t argLen;
+	char *name;
+
+	argLen = strlen(path);
+	name = (char *) calloc(argLen + strlen(ext) + 1, sizeof(char));
+	if (name == NULL) {
+		fprintf(stderr,"** ERROR: zindex failed to alloc index name\n");
+		return NULL;
+	}
+	strcpy(name, path);
+	strcpy(name+argLen, ext);
+	return name;
+}
+
+/* Open an index file to be called name for writing, under a temporary name
+   returned in *tmp, to be renamed to name once complete: readers never see
+   a partial index, and an index being rebuilt stays in use until then. */
+static FILE *create_index(const char *name, char **tmp)
+{
+	FILE *f;
+
+	*tmp = (char *) malloc(strlen(name) + 24);
+	if (*tmp == NULL)
+		return NULL;
+	sprintf(*tmp, "%s.%ld", name, (long) getpid());
+	f = fopen(*tmp, "wb");
+	if (f == NULL) {
+		free(*tmp);
+		*tmp = NULL;
+	}
+	return f;
+}
+
+/* Build the index of path and append it to the file as trailing gzip members;
+   the windows are collected in a temporary file on the way */
+static int embed_index(const char *path, int flags)
+{
+	int len;
+	FILE *in;
+	FILE *idxFile;
+	FILE *ucsFile;
+	struct access *index;
+
+	in = fopen(path, "r+b");
+	if (in == NULL) {
+		fprintf(stderr, "zindex: could not open %s for update\n", path);
+		return 1;
+	}
+	idxFile = tmpfile();
+	ucsFile = tmpfile();
+	if (idxFile == NULL || ucsFile == NULL) {
+		fclose(in);
+		if (idxFile != NULL)
+			fclose(idxFile);
+		fprintf(stderr, "zindex: could not create temporary files\n");
+		return 1;
+	}
+	len = build_index_flags(in, NULL, SPAN, flags, idxFile, ucsFile);
+	if (len > 0) {
+		rewind(idxFile);
+		len = read_index(idxFile, &index);
+	}
+	fclose(idxFile);
+	if (len <= 0) {
+		fclose(ucsFile);
+		fclose(in);
+		fprintf(stderr, "zindex: error %i while building index of %s\n", len, path);
+		return 1;
+	}
+	len = write_index_embedded(index, ucsFile, in);
+	free_index(index);
+	fclose(ucsFile);
+	if (fclose(in) != 0 || len <= 0) {
+		fprintf(stderr, "zindex: failed to embed index in %s\n", path);
+		return 1;
+	}
+	fprintf(stdout, "Index embedded in %s with %i access points\n", path, len);
+	return 0;
+}
+
+/* Bring the index of path, a gzip file that is still growing, up to date:
+   index the data appended since the last update, or all of it the first
+   time, which may stop in the middle of a stream, under temporary names */
+static int update_index(const char *path, const char *idxName,
+						const char *ucsName, int flags)
+{
+	int len;
+	int first;
+	FILE *in;
+	FILE *idxFile;
+	FILE *ucsFile;
+	char *idxTmp = NULL;
+	char *ucsTmp = NULL;
+
+	in = fopen(path, "rb");
+	if (in == NULL) {
+		fprintf(stderr, "zindex: could not open %s for reading\n", path);
+		return 1;
+	}
+	idxFile = fopen(idxName, "r+b");
+	first = idxFile == NULL;
+	if (first)
+		idxFile = create_index(idxName, &idxTmp);
+	ucsFile = idxFile == NULL ? NULL : first ? create_index(ucsName, &ucsTmp) :
+		fopen(ucsName, "r+b");
+	if (ucsFile == NULL) {
+		fclose(in);
+		if (idxFile != NULL)
+			fclose(idxFile);
+		if (idxTmp != NULL)
+			remove(idxTmp);
+		free(idxTmp);
+		fprintf(stderr, "zindex: could not open %s for update\n",
+				idxFile == NULL ? idxName : ucsName);
+		return 1;
+	}
+	len = first ? build_index_flags(in, NULL, SPAN, flags | ZI_BUILD_GROWING,
+									idxFile, ucsFile) :
+		zi_update(in, idxFile, ucsFile, SPAN);
+	if (fclose(ucsFile) != 0 && len >= 0)
+		len = Z_ERRNO;
+	if (fclose(idxFile) != 0 && len >= 0)
+		len = Z_ERRNO;
+	fclose(in);
+	if (first) {
+		if (len >= 0 && (rename(ucsTmp, ucsName) != 0 ||
+						 rename(idxTmp, idxName) != 0))
+			len = Z_ERRNO;
+		if (len < 0) {
+			remove(ucsTmp);
+			remove(idxTmp);
+		}
+		free(ucsTmp);
+		free(idxTmp);
+	}
+	if (len < 0) {
+		if (len == Z_STREAM_ERROR)
+			fprintf(stderr, "zindex: index of %s cannot be updated, recreate it\n", path);
+		else
+			fprintf(stderr, "zindex: error %i while updating index of %s\n", len, path);
+		return 1;
+	}
+	if (first)
+		fprintf(stdout, "Index files created with %i access points\n", len);
+	else
+		fprintf(stdout, "Index of %s updated with %i new access points\n", path, len);
+	return 0;
+}
+
+static void report_span(zindexPtr idx, size_t span, int error, void *user)
+{
+	struct idx_point *pIdx = idx->data->idx_list + span;
+
+	fprintf(stderr, "zindex: %s: span %lu (bytes %lli-%lli) %s\n", (const char *) user,
+			(unsigned long) span, (long long) pIdx->out, (long long) pIdx[1].out - 1,
+			error == ZI_CRC_ERROR ? "checksum mismatch" : "decompression error");
+}
+
+/* Check every span of a file against the checksums in its index */
+static int verify_main(int argc, char **argv)
+{
+	int nthread;
+	long bad;
+	zindexPtr idx;
+
+	nthread = 0;
+	if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+		nthread = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc != 2 && argc != 4) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+	idx = argc == 2 ? ziopen_auto(argv[1], "rb") : ziopen(argv[1], argv[2], argv[3], "rb");
+	if (idx == NULL) {
+		fprintf(stderr, "zindex: no usable index for %s\n", argv[1]);
+		return 1;
+	}
+	bad = zi_verify(idx, nthread, report_span, argv[1]);
+	if (bad < 0)
+		fprintf(stderr, "zindex: index of %s has no checksums, recreate it to verify\n", argv[1]);
+	else if (bad == 0)
+		fprintf(stdout, "%s: %li spans OK\n", argv[1], (long) idx->data->have - 1);
+	else
+		fprintf(stderr, "zindex: %s: %li of %li spans damaged\n", argv[1], bad,
+				(long) idx->data->have - 1);
+	ziclose(&idx);
+	return bad == 0 ? 0 : 1;
+}
+
+/* Turn a bgzip or indexed_gzip index of zPath into .idx and .ucs files, the
+   windows copied or, at block starts, left empty */
+static int import_index(const char *zPath, const char *path)
+{
+	int len;
+	size_t i;
+	char magic[5];
+	FILE *in;
+	FILE *zFile;
+	FILE *idxFile;
+	FILE *ucsFile;
+	char *idxName;
+	char *ucsName;
+	char *idxTmp;
+	char *ucsTmp;
+	struct access *index;
+	unsigned char window[WINSIZE];
+
+	in = fopen(path, "rb");
+	zFile = fopen(zPath, "rb");
+	if (in == NULL || zFile == NULL) {
+		if (in != NULL)
+			fclose(in);
+		if (zFile != NULL)
+			fclose(zFile);
+		fprintf(stderr, "zindex: could not open %s for reading\n", in == NULL ? path : zPath);
+		return 1;
+	}
+	if (fread(magic, 5, 1u, in) == 1u && memcmp(magic, "GZIDX", 5) == 0) {
+		rewind(in);
+		len = read_index_gzidx(in, &index);
+	}
+	else {
+		rewind(in);
+		len = read_index_gzi(in, zFile, SPAN, &index);
+	}
+	fclose(zFile);
+	if (len <= 0) {
+		fclose(in);
+		fprintf(stderr, "zindex: %s is no index of %s that zindex can use\n", path, zPath);
+		return 1;
+	}
+
+	idxName = index_name(zPath, ".idx");
+	ucsName = index_name(zPath, ".idx.ucs");
+	idxTmp = ucsTmp = NULL;
+	idxFile = idxName != NULL ? create_index(idxName, &idxTmp) : NULL;
+	ucsFile = ucsName != NULL ? create_index(ucsName, &ucsTmp) : NULL;
+	if (idxFile == NULL || ucsFile == NULL)
+		len = Z_ERRNO;
+	for (i = 0; len > 0 && i < index->have; ++i)
+		if (read_window(index, in, i, window) != Z_OK ||
+			fwrite(window, WINSIZE, 1u, ucsFile) != 1u)
+			len = Z_ERRNO;
+	/* the .ucs has a window for every point, in order */
+	free(index->ucs_offset);
+	index->ucs_offset = NULL;
+	if (len > 0 && write_index(index, idxFile, NULL) < len)
+		len = Z_ERRNO;
+	if (idxFile != NULL && fclose(idxFile) != 0)
+		len = Z_ERRNO;
+	if (ucsFile != NULL && fclose(ucsFile) != 0)
+		len = Z_ERRNO;
+	fclose(in);
+	free_index(index);
+	/* an index already there stays until the new one is complete */
+	if (len > 0 && (rename(ucsTmp, ucsName) != 0 ||
+					rename(idxTmp, idxName) != 0))
+		len = Z_ERRNO;
+	if (len <= 0) {
+		if (idxTmp != NULL)
+			remove(idxTmp);
+		if (ucsTmp != NULL)
+			remove(ucsTmp);
+	}
+	free(idxTmp);
+	free(ucsTmp);
+	if (len > 0)
+		fprintf(stdout, "Index files created with %i access points:\n\t%s\n\t%s\n",
+				len, idxName, ucsName);
+	else
+		fprintf(stderr, "zindex: could not write index files of %s\n", zPath);
+	free(idxName);
+	free(ucsName);
+	return len > 0 ? 0 : 1;
+}
+
+/* Write the index of zPath as a bgzip .gzi (from the BGZF block headers) or
+   an indexed_gzip .gzidx (from any index ziopen_auto() finds) */
+static int export_index(const char *zPath, const char *format, const char *path)
+{
+	int len;
+	FILE *out;
+	FILE *zFile;
+	char *name;
+	zindexPtr idx;
+
+	idx = NULL;
+	zFile = NULL;
+	if (strcmp(format, "gzi") == 0)
+		zFile = fopen(zPath, "rb");
+	else
+		idx = ziopen_auto(zPath, "rb");
+	if (zFile == NULL && idx == NULL) {
+		fprintf(stderr, "zindex: %s\n", strcmp(format, "gzi") == 0 ?
+				"could not open file for reading" : "no usable index, create one first");
+		return 1;
+	}
+	name = path != NULL ? NULL : index_name(zPath, strcmp(format, "gzi") == 0 ? ".gzi" : ".gzidx");
+	if (path == NULL)
+		path = name;
+	out = path != NULL ? fopen(path, "wb") : NULL;
+	if (out == NULL)
+		len = Z_ERRNO;
+	else if (zFile != NULL)
+		len = write_index_gzi(zFile, out);
+	else
+		len = write_index_gzidx(idx->data, idx->ucsFile, idx->zFile, out);
+	if (out != NULL && fclose(out) != 0 && len >= 0)
+		len = Z_ERRNO;
+	if (out != NULL && len < 0)
+		remove(path);	/* nothing usable, not even an empty index */
+	if (zFile != NULL)
+		fclose(zFile);
+	ziclose(&idx);
+	if (len >= 0)
+		fprintf(stdout, "%s written with %i entries\n", path, len);
+	else if (len == Z_DATA_ERROR && zFile != NULL)
+		fprintf(stderr, "zindex: %s is not BGZF, a .gzi cannot describe it\n", zPath);
+	else
+		fprintf(stderr, "zindex: error %i while writing %s\n", len, path != NULL ? path : format);
+	free(name);
+	return len >= 0 ? 0 : 1;
+}
+
+/* Translate between zindex's index and those of other tools */
+static int convert_main(int argc, char **argv)
+{
+	const char *format;
+
+	format = NULL;
+	if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+		format = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
+	if (format != NULL && (argc == 2 || argc == 3) &&
+		(strcmp(format, "gzi") == 0 || strcmp(format, "gzidx") == 0))
+		return export_index(argv[1], format, argc == 3 ? argv[2] : NULL);
+	if (format == NULL && argc == 3)
+		return import_index(argv[1], argv[2]);
+	fprintf(stderr, "%s", usage);
+	return 1;
+}
+
+/* Read the index of path from path.idx if its windows are in a store, NULL
+   if it has none of that kind */
+static struct access *stored_index(const char *path)
+{
+	char *idxName;
+	FILE *idxFile;
+	struct access *index;
+
+	index = NULL;
+	idxName = index_name(path, ".idx");
+	idxFile = idxName != NULL ? fopen(idxName, "rb") : NULL;
+	free(idxName);
+	if (idxFile == NULL)
+		return NULL;
+	if (read_index(idxFile, &index) <= 0)
+		index = NULL;
+	fclose(idxFile);
+	if (index != NULL && index->store == NULL) {
+		free_index(index);
+		index = NULL;
+	}
+	return index;
+}
+
+/* Drop the references of index to the windows of its store; store may be
+   that store already open */
+static int release_windows(struct zi_store *store, struct access *index)
+{
+	int ret;
+
+	if (store != NULL && zi_store_release(store, index) == Z_OK)
+		return Z_OK;
+	store = zi_store_open(index->store);
+	if (store == NULL)
+		return Z_ERRNO;
+	ret = zi_store_release(store, index);
+	if (zi_store_close(store) != Z_OK && ret == Z_OK)
+		ret = Z_ERRNO;
+	return ret;
+}
+
+/* Index each file with its windows deduplicated into the store in dir: only
+   a .idx is written, an index stored before is replaced */
+static int store_index(const char *dir, char **paths, int count, int flags)
+{
+	int i, len, ret;
+	long added;
+	FILE *in;
+	FILE *idxFile;
+	FILE *ucsFile;
+	char *idxName;
+	char *idxTmp;
+	char *ucsName;
+	struct access *index;
+	struct access *old;
+	struct zi_store *store;
+
+	store = zi_store_open(dir);
+	if (store == NULL) {
+		fprintf(stderr, "zindex: could not open window store %s\n", dir);
+		return 1;
+	}
+	ret = 0;
+	for (i = 0; i < count; ++i) {
+		index = NULL;
+		in = fopen(paths[i], "rb");
+		idxFile = tmpfile();
+		ucsFile = tmpfile();
+		len = Z_ERRNO;
+		if (in != NULL && idxFile != NULL && ucsFile != NULL)
+			len = build_index_flags(in, NULL, SPAN, flags, idxFile, ucsFile);
+		if (len > 0) {
+			rewind(idxFile);
+			len = read_index(idxFile, &index);
+		}
+		if (idxFile != NULL)
+			fclose(idxFile);
+		if (in != NULL)
+			fclose(in);
+		added = len > 0 ? zi_store_add(store, index, ucsFile) : len;
+		if (ucsFile != NULL)
+			fclose(ucsFile);
+		if (added < 0) {
+			fprintf(stderr, "zindex: error %li while indexing %s\n", added, paths[i]);
+			free_index(index);
+			ret = 1;
+			continue;
+		}
+
+		/* with the windows on disk, replace the index file, then let go of
+		   the windows of the old */
+		old = stored_index(paths[i]);
+		idxName = index_name(paths[i], ".idx");
+		idxTmp = NULL;
+		idxFile = idxName != NULL && zi_store_sync(store) == Z_OK ?
+			create_index(idxName, &idxTmp) : NULL;
+		if (idxFile != NULL && (write_index(index, idxFile, NULL) < len ||
+				fflush(idxFile) != 0 || fsync(fileno(idxFile)) != 0)) {
+			fclose(idxFile);
+			idxFile = NULL;
+		}
+		if (idxFile == NULL || fclose(idxFile) != 0 || rename(idxTmp, idxName) != 0) {
+			fprintf(stderr, "zindex: could not write %s\n", idxName != NULL ? idxName : paths[i]);
+			if (idxTmp != NULL)
+				remove(idxTmp);
+			zi_store_release(store, index);
+			ret = 1;
+		}
+		else {
+			fprintf(stdout, "%s: %i access points, %li new windows in %s\n",
+					idxName, len, added, dir);
+			if (old != NULL && release_windows(store, old) != Z_OK)
+				fprintf(stderr, "zindex: could not release old windows of %s\n", paths[i]);
+			ucsName = index_name(paths[i], ".idx.ucs");
+			if (ucsName != NULL)
+				remove(ucsName);	/* windows of an earlier index of its own */
+			free(ucsName);
+		}
+		free(idxTmp);
+		free(idxName);
+		free_index(old);
+		free_index(index);
+	}
+	if (zi_store_close(store) != Z_OK) {
+		fprintf(stderr, "zindex: could not update window store %s\n", dir);
+		ret = 1;
+	}
+	return ret;
+}
+
+/* one handle of a trace being replayed */
+struct replay_handle {
+	unsigned long pid;
+	unsigned handle;
+	zindexPtr idx;	/* NULL if its file is not replayed */
+};
+
+static double replay_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long trace_le(const unsigned char *p, int n)
+{
+	unsigned long long val = 0;
+
+	while (n--)
+		val = (val << 8) | p[n];
+	return val;
+}
+
+/* Close the replayed handle h, adding up what its reads did. */
+static void replay_close(struct replay_handle *h, struct zi_io_stats *sum)
+{
+	struct zi_io_stats *st;
+
+	if (h->idx == NULL)
+		return;
+	if (h->idx->io != NULL) {
+		st = ziio_stats(h->idx->io);
+		sum->read += st->read;
+		sum->decoded += st->decoded;
+		sum->hits += st->hits;
+		sum->misses += st->misses;
+	}
+	ziclose(&h->idx);
+}
+
+/* Play back the reads and seeks of a znzlib access trace (ZNZ_TRACE) on
+   zPath, through its index or the one given and the span cache in -c, and
+   report what it took: the handles of every file of the same name as zPath
+   are replayed, or of every file with -a. */
+static int replay_main(int argc, char **argv)
+{
+	int all;
+	const char *cacheDir, *zPath, *base, *name;
+	off_t cacheMax;
+	FILE *trace;
+	unsigned char rec[ZNZ_TRACE_REC];
+	char path[1025], magic[8];
+	struct replay_handle *hs, *h, *more;
+	size_t nh, sh, i, nlat, slat;
+	unsigned long seeks;
+	unsigned long long len, bytes;
+	double *lat, *morelat, t, traced, total;
+	unsigned char *buf;
+	size_t size;
+	struct zi_io_stats sum;
+	zindexPtr idx;
+	int got;
+
+	all = 0;
+	cacheDir = NULL;
+	cacheMax = 0;
+	while (argc > 3 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-a") == 0)
+			all = 1;
+		else if (strcmp(argv[1], "-c") == 0) {
+			cacheDir = argv[2];
+			++argv;
+			--argc;
+		}
+		else if (strcmp(argv[1], "-m") == 0) {
+			cacheMax = (off_t) strtol(argv[2], NULL, 10) << 20;
+			++argv;
+			--argc;
+		}
+		else
+			break;
+		++argv;
+		--argc;
+	}
+	if (argc != 3 && argc != 5) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+	zPath = argv[2];
+	trace = fopen(argv[1], "rb");
+	if (trace == NULL || fread(magic, 8, 1u, trace) != 1u ||
+		memcmp(magic, ZNZ_TRACE_MAGIC, 8) != 0) {
+		fprintf(stderr, "zindex: %s is not an access trace\n", argv[1]);
+		if (trace != NULL)
+			fclose(trace);
+		return 1;
+	}
+	base = strrchr(zPath, '/') != NULL ? strrchr(zPath, '/') + 1 : zPath;
+
+	hs = NULL;
+	nh = sh = 0;
+	lat = NULL;
+	nlat = slat = 0;
+	seeks = 0;
+	bytes = 0;
+	traced = 0;
+	buf = NULL;
+	size = 0;
+	memset(&sum, 0, sizeof(sum));
+	while (fread(rec, ZNZ_TRACE_REC, 1u, trace) == 1u) {
+		len = trace_le(rec + 24, 4);
+		for (i = 0; i < nh; i++)
+			if (hs[i].pid == trace_le(rec + 4, 4) && hs[i].handle == trace_le(rec + 2, 2))
+				break;
+		h = i < nh ? hs + i : NULL;
+		switch (rec[0]) {
+		case ZNZ_TRACE_OPEN:
+			if (len >= sizeof(path) || fread(path, (size_t) len, 1u, trace) != 1u)
+				goto replay_end;
+			path[len] = '\0';
+			name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+			idx = NULL;
+			if (all || strcmp(name, base) == 0) {
+				idx = argc == 5 ? ziopen(zPath, argv[3], argv[4], "rb") : ziopen_auto(zPath, "rb");
+				if (idx == NULL) {
+					fprintf(stderr, "zindex: no usable index for %s\n", zPath);
+					goto replay_end;
+				}
+				if (cacheDir != NULL && zi_disk_cache(idx, cacheDir, cacheMax) != Z_OK)
+					fprintf(stderr, "zindex: no span cache in %s\n", cacheDir);
+				if (idx->io != NULL)
+					memset(ziio_stats(idx->io), 0, sizeof(struct zi_io_stats));
+			}
+			if (h != NULL)		/* handle number used again */
+				replay_close(h, &sum);
+			else {
+				if (nh == sh) {
+					more = (struct replay_handle *) realloc(hs, sizeof(*hs) * (sh ? sh << 1 : 16));
+					if (more == NULL) {
+						ziclose(&idx);
+						goto replay_end;
+					}
+					hs = more;
+					sh = sh ? sh << 1 : 16;
+				}
+				h = hs + nh++;
+				h->pid = (unsigned long) trace_le(rec + 4, 4);
+				h->handle = (unsigned) trace_le(rec + 2, 2);
+			}
+			h->idx = idx;
+			break;
+		case ZNZ_TRACE_SEEK:
+			if (h == NULL || h->idx == NULL)
+				break;
+			ziseek(h->idx, (long) trace_le(rec + 16, 8), SEEK_SET);
+			seeks++;
+			break;
+		case ZNZ_TRACE_READ:
+		case ZNZ_TRACE_MAP:
+			if (h == NULL || h->idx == NULL || len == 0)
+				break;
+			if (len > size) {
+				free(buf);
+				size = (size_t) len;
+				buf = (unsigned char *) malloc(size);
+				if (buf == NULL)
+					goto replay_end;
+			}
+			if (nlat == slat) {
+				morelat = (double *) realloc(lat, sizeof(double) * (slat ? slat << 1 : 1024));
+				if (morelat == NULL)
+					goto replay_end;
+				lat = morelat;
+				slat = slat ? slat << 1 : 1024;
+			}
+			t = replay_clock();
+			ziseek(h->idx, (long) trace_le(rec + 16, 8), SEEK_SET);
+			got = ziread(h->idx, buf, (unsigned) len);
+			lat[nlat++] = replay_clock() - t;
+			traced += trace_le(rec + 28, 4) * 1e-9;
+			if (got > 0)
+				bytes += (unsigned long long) got;
+			break;
+		case ZNZ_TRACE_CLOSE:
+			if (h != NULL) {
+				replay_close(h, &sum);
+				*h = hs[--nh];
+			}
+			break;
+		}
+	}
+
+  replay_end:
+	for (i = 0; i < nh; i++)
+		replay_close(hs + i, &sum);
+	free(hs);
+	free(buf);
+	fclose(trace);
+	fprintf(stdout, "%s: %lu reads of %llu bytes and %lu seeks replayed\n", zPath,
+			(unsigned long) nlat, bytes, seeks);
+	fprintf(stdout, "  decoded %lli bytes (%.2f per byte read), read %lli compressed\n",
+			(long long) sum.decoded, bytes ? (double) sum.decoded / bytes : 0.0,
+			(long long) sum.read);
+	if (sum.hits + sum.misses > 0)
+		fprintf(stdout, "  span cache: %li hits, %li misses (%.1f%% hit)\n", sum.hits,
+				sum.misses, 100.0 * sum.hits / (sum.hits + sum.misses));
+	if (nlat > 0) {
+		for (total = 0, i = 0; i < nlat; i++)
+			total += lat[i];
+		qsort(lat, nlat, sizeof(double), latency_cmp);
+		fprintf(stdout, "  latency per read: mean %.3f ms, median %.3f, 99%% %.3f, max %.3f"
+				" (traced mean %.3f ms)\n", 1e3 * total / nlat, 1e3 * lat[nlat / 2],
+				1e3 * lat[nlat - 1 - nlat / 100], 1e3 * lat[nlat - 1], 1e3 * traced / nlat);
+	}
+	free(lat);
+	return 0;
+}
+
+/* Remove the index files of each file, releasing windows it has in a store */
+static int release_main(int argc, char **argv)
+{
+	int i, ret;
+	char *idxName;
+	char *ucsName;
+	struct access *index;
+
+	if (argc < 2) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+	ret = 0;
+	for (i = 1; i < argc; ++i) {
+		/* the index goes first: windows it still named must not be reused */
+		index = stored_index(argv[i]);
+		idxName = index_name(argv[i], ".idx");
+		ucsName = index_name(argv[i], ".idx.ucs");
+		if (idxName == NULL || (remove(idxName) != 0 && errno != ENOENT)) {
+			fprintf(stderr, "zindex: could not remove %s\n", idxName != NULL ? idxName : argv[i]);
+			ret = 1;
+		}
+		else if (index != NULL && release_windows(NULL, index) != Z_OK) {
+			fprintf(stderr, "zindex: could not release windows of %s in %s\n",
+					argv[i], index->store);
+			ret = 1;
+		}
+		if (ucsName != NULL)
+			remove(ucsName);
+		free(idxName);
+		free(ucsName);
+		free_index(index);
+	}
+	return ret;
+}
+
+/* Print the voxel statistics of every volume (or slice) in the index of a
+   file, with -r only of those that may have values in the range */
+static int stats_main(int argc, char **argv)
+{
+	int ranged;
+	long kept;
+	size_t k;
+	double lo, hi;
+	unsigned char *keep;
+	zindexPtr idx;
+	const struct zone_maps *maps;
+	const struct zone_stats *z;
+
+	ranged = argc == 5 && strcmp(argv[1], "-r") == 0;
+	if (argc != 2 && !ranged) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+	lo = ranged ? atof(argv[2]) : 0;
+	hi = ranged ? atof(argv[3]) : 0;
+	idx = ziopen_auto(argv[argc - 1], "rb");
+	if (idx == NULL) {
+		fprintf(stderr, "zindex: no usable index for %s\n", argv[argc - 1]);
+		return 1;
+	}
+	maps = zi_zones(idx);
+	if (maps == NULL) {
+		fprintf(stderr, "zindex: index of %s has no voxel statistics, recreate it with -S\n",
+				argv[argc - 1]);
+		ziclose(&idx);
+		return 1;
+	}
+	keep = (unsigned char *) malloc(maps->have ? maps->have : 1);
+	if (keep == NULL) {
+		ziclose(&idx);
+		fprintf(stderr, "zindex: out of memory\n");
+		return 1;
+	}
+	kept = ranged ? zi_zone_select(idx, lo, hi, keep) : (long) maps->have;
+	fprintf(stdout, "%s: datatype %i, %lu zones of %lli bytes from offset %lli\n",
+			argv[argc - 1], maps->datatype, (unsigned long) maps->have,
+			(long long) maps->unit, (long long) maps->base);
+	fprintf(stdout, "zone\tmin\tmax\tmean\tnonzero\n");
+	for (k = 0; k < maps->have; ++k) {
+		z = maps->list + k;
+		if (ranged && !keep[k])
+			continue;
+		fprintf(stdout, "%lu\t%g\t%g\t%g\t%llu/%llu\n", (unsigned long) k,
+				z->count ? z->min : 0, z->count ? z->max : 0,
+				z->count ? z->sum / (double) z->count : 0,
+				(unsigned long long) z->nonzero, (unsigned long long) z->count);
+	}
+	if (ranged)
+		fprintf(stdout, "%li of %lu zones may have values in %g..%g\n", kept,
+				(unsigned long) maps->have, lo, hi);
+	free(keep);
+	ziclose(&idx);
+	return 0;
+}
+
+/* Add access points to the index of a file where the reads counted in its
+   .idx.hist cluster, replacing .idx and .idx.ucs */
+static int adapt_main(int argc, char **argv)
+{
+	long added;
+	unsigned long min;
+	int len;
+	off_t base;
+	char *idxName, *ucsName, *histName, *idxTmp;
+	FILE *zFile, *idxFile, *ucsFile, *ucsOut;
+	struct access *index, *dense;
+	struct zi_hist *hist;
+
+	min = 2;
+	if (argc == 4 && strcmp(argv[1], "-m") == 0) {
+		min = strtoul(argv[2], NULL, 10);
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc != 2) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+	idxName = index_name(argv[1], ".idx");
+	ucsName = index_name(argv[1], ".idx.ucs");
+	histName = index_name(argv[1], ".idx.hist");
+	if (idxName == NULL || ucsName == NULL || histName == NULL)
+		return 1;
+	index = NULL;
+	dense = NULL;
+	hist = NULL;
+	zFile = fopen(argv[1], "rb");
+	idxFile = fopen(idxName, "rb");
+	ucsFile = fopen(ucsName, "rb");
+	len = zFile != NULL && idxFile != NULL && ucsFile != NULL ?
+		read_index(idxFile, &index) : 0;
+	if (idxFile != NULL)
+		fclose(idxFile);
+	if (len <= 0 || index->store != NULL) {
+		fprintf(stderr, "zindex: %s has no .idx and .idx.ucs index to adapt\n", argv[1]);
+		added = -1;
+	}
+	else if (zi_hist_read(histName, &hist) != Z_OK) {
+		fprintf(stderr, "zindex: no read counts in %s, read the file with ZINDEX_HIST set first\n",
+				histName);
+		added = -1;
+	}
+	else {
+		/* the new windows go after the old, which the index in place keeps
+		   using until the new one replaces it */
+		ucsOut = fopen(ucsName, "r+b");
+		base = ucsOut != NULL && fseeko(ucsOut, 0, SEEK_END) == 0 ? ftello(ucsOut) : -1;
+		added = base >= 0 ?
+			zi_densify(index, zFile, ucsFile, ucsOut, hist, min, &dense) : Z_ERRNO;
+		if (added > 0 && fsync(fileno(ucsOut)) != 0) {
+			free_index(dense);
+			added = Z_ERRNO;
+		}
+		idxTmp = NULL;
+		if (added > 0) {
+			idxFile = create_index(idxName, &idxTmp);
+			if (idxFile != NULL && (write_index(dense, idxFile, NULL) < (int) dense->have ||
+					fflush(idxFile) != 0 || fsync(fileno(idxFile)) != 0)) {
+				fclose(idxFile);
+				idxFile = NULL;
+			}
+			if (idxFile == NULL || fclose(idxFile) != 0 || rename(idxTmp, idxName) != 0)
+				added = Z_ERRNO;
+			else
+				fprintf(stdout, "%s: %li access points added, %lu in all\n",
+						idxName, added, (unsigned long) dense->have);
+			free_index(dense);
+		}
+		else if (added == 0) {
+			fprintf(stdout, "%s: no access points to add\n", idxName);
+			free_index(dense);
+		}
+		if (added < 0) {
+			fprintf(stderr, "zindex: error %li while adapting index of %s\n", added, argv[1]);
+			if (idxTmp != NULL)
+				remove(idxTmp);
+		}
+		if (added <= 0 && base >= 0 && fflush(ucsOut) == 0)
+			(void) ftruncate(fileno(ucsOut), base);	/* windows nobody uses */
+		if (ucsOut != NULL && fclose(ucsOut) != 0 && added >= 0)
+			added = Z_ERRNO;
+		free(idxTmp);
+	}
+	if (zFile != NULL)
+		fclose(zFile);
+	if (ucsFile != NULL)
+		fclose(ucsFile);
+	free_hist(hist);
+	free_index(index);
+	free(idxName);
+	free(ucsName);
+	free(histName);
+	return added < 0 ? 1 : 0;
+}
+
+/* Rewrite a gzip file as seekable zstd, which znzopen() reads without an
+   index */
+static int transcode_main(int argc, char **argv)
+{
+	int nthread;
+	int level;
+	long len;
+	size_t argLen;
+	gzFile in;
+	FILE *out;
+	char *name;
+	char *tmp;
+	const char *outName;
+
+	nthread = 0;
+	level = 3;
+	while (argc > 2 && (strcmp(argv[1], "-j") == 0 || strcmp(argv[1], "-l") == 0)) {
+		if (argv[1][1] == 'j')
+			nthread = atoi(argv[2]);
+		else
+			level = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+	name = NULL;
+	outName = argv[2];
+	if (argc == 2) {
+		/* file.nii.gz -> file.nii.zst */
+		argLen = strlen(argv[1]);
+		if (argLen > 3 && strcmp(argv[1] + argLen - 3, ".gz") == 0)
+			argLen -= 3;
+		name = (char *) calloc(argLen + 5, sizeof(char));
+		if (name == NULL) {
+			fprintf(stderr, "zindex: out of memory\n");
+			return 1;
+		}
+		memcpy(name, argv[1], argLen);
+		strcpy(name + argLen, ".zst");
+		outName = name;
+	}
+	in = gzopen(argv[1], "rb");
+	if (in == NULL) {
+		fprintf(stderr, "zindex: could not open %s for reading\n", argv[1]);
+		free(name);
+		return 1;
+	}
+	out = create_index(outName, &tmp);	/* in place once complete */
+	if (out == NULL) {
+		gzclose(in);
+		fprintf(stderr, "zindex: could not open %s for writing\n", outName);
+		free(name);
+		return 1;
+	}
+	len = zst_transcode(in, out, nthread, level);
+	gzclose(in);
+	if (fclose(out) != 0 && len >= 0)
+		len = Z_ERRNO;
+	if (len >= 0 && rename(tmp, outName) != 0)
+		len = Z_ERRNO;
+	if (len < 0)
+		remove(tmp);
+	free(tmp);
+	if (len >= 0)
+		fprintf(stdout, "%s written with %li frames\n", outName, len);
+	else if (len == Z_STREAM_ERROR)
+		fprintf(stderr, "zindex: built without zstd support (make HAVE_ZSTD=1)\n");
+	else
+		fprintf(stderr, "zindex: error %li while transcoding %s\n", len, argv[1]);
+	free(name);
+	return len >= 0 ? 0 : 1;
+}
+
+/* Write a 4D image in blocks of voxels by all timepoints, for reading
+   timeseries: zindex rechunk [-j threads] [-l level] [-b block] file.nii.gz
+   [file.nii.zch] */
+static int rechunk_main(int argc, char **argv)
+{
+	int nthread;
+	int level;
+	int block;
+	long len;
+	size_t argLen;
+	gzFile in;
+	FILE *out;
+	char *name;
+	char *tmp;
+	const char *outName;
+
+	nthread = 0;
+	level = Z_DEFAULT_COMPRESSION;
+	block = 0;
+	while (argc > 2 && (strcmp(argv[1], "-j") == 0 || strcmp(argv[1], "-l") == 0 ||
+						strcmp(argv[1], "-b") == 0)) {
+		if (argv[1][1] == 'j')
+			nthread = atoi(argv[2]);
+		else if (argv[1][1] == 'l')
+			level = atoi(argv[2]);
+		else
+			block = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+	name = NULL;
+	outName = argv[2];
+	if (argc == 2) {
+		/* file.nii.gz -> file.nii.zch */
+		argLen = strlen(argv[1]);
+		if (argLen > 3 && strcmp(argv[1] + argLen - 3, ".gz") == 0)
+			argLen -= 3;
+		name = (char *) calloc(argLen + 5, sizeof(char));
+		if (name == NULL) {
+			fprintf(stderr, "zindex: out of memory\n");
+			return 1;
+		}
+		memcpy(name, argv[1], argLen);
+		strcpy(name + argLen, ".zch");
+		outName = name;
+	}
+	in = gzopen(argv[1], "rb");
+	if (in == NULL) {
+		fprintf(stderr, "zindex: could not open %s for reading\n", argv[1]);
+		free(name);
+		return 1;
+	}
+	out = create_index(outName, &tmp);	/* in place once complete */
+	if (out == NULL) {
+		gzclose(in);
+		fprintf(stderr, "zindex: could not open %s for writing\n", outName);
+		free(name);
+		return 1;
+	}
+	len = zi_rechunk(in, out, block, nthread, level);
+	gzclose(in);
+	if (fclose(out) != 0 && len >= 0)
+		len = Z_ERRNO;
+	if (len >= 0 && rename(tmp, outName) != 0)
+		len = Z_ERRNO;
+	if (len < 0)
+		remove(tmp);
+	free(tmp);
+	if (len >= 0)
+		fprintf(stdout, "%s written with %li blocks\n", outName, len);
+	else if (len == Z_DATA_ERROR)
+		fprintf(stderr, "zindex: %s is not a NIfTI image with whole-byte voxels\n", argv[1]);
+	else
+		fprintf(stderr, "zindex: error %li while rechunking %s\n", len, argv[1]);
+	free(name);
+	return len >= 0 ? 0 : 1;
+}
+
+/* Create zindex index for input file. Default: .idx and .ucs extra files,
+   with -e the index is appended to the gzip file itself instead. */
 int main(int argc, char **argv)
 {
 	int ret;
+	int embed;
+	int flags;
+	int preview;
+	int update;
+	int cache;
     long len;
     FILE *in;
-    struct access *index;
+    FILE *out;
+    FILE *msg;
 
-    size_t argLen;
-    char *idxExt;
+    const char *inName;
+    const char *outName;
+    const char *storeName;
 	char *idxName;
-    char *ucsExt;
     char *ucsName;
+    char *prvName;
+    char *idxTmp;
+    char *ucsTmp;
+    const char *nameBase;
 
 	FILE *idxFile;
 	FILE *ucsFile;
+	FILE *prvFile;
+
+	if (argc > 1 && strcmp(argv[1], "verify") == 0)
+		return verify_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "convert") == 0)
+		return convert_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "transcode") == 0)
+		return transcode_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "rechunk") == 0)
+		return rechunk_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "release") == 0)
+		return release_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "stats") == 0)
+		return stats_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "adapt") == 0)
+		return adapt_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "replay") == 0)
+		return replay_main(argc - 1, argv + 1);
 
-    /* open input file */
-    if (argc != 2 && argc != 4) {
-        fprintf(stderr, "usage: zindex file.gz [file.gz.idx file.gz.idx.ucs]\n");
+	/* options */
+	embed = 0;
+	preview = 0;
+	update = 0;
+	cache = 0;
+	flags = 0;
+	outName = NULL;
+	storeName = NULL;
+	while (argc > 2 && argv[1][0] == '-' && argv[1][1] != '\0') {
+		if (strcmp(argv[1], "-e") == 0)
+			embed = 1;
+		else if (strcmp(argv[1], "-n") == 0)
+			flags |= ZI_BUILD_LINES;
+		else if (strcmp(argv[1], "-S") == 0)
+			flags |= ZI_BUILD_STATS;
+		else if (strcmp(argv[1], "-p") == 0)
+			preview = 1;
+		else if (strcmp(argv[1], "--update") == 0)
+			update = 1;
+		else if (strcmp(argv[1], "-c") == 0)
+			cache = 1;
+		else if (strcmp(argv[1], "-o") == 0) {
+			outName = argv[2];
+			++argv;
+			--argc;
+		}
+		else if (strcmp(argv[1], "-s") == 0) {
+			storeName = argv[2];
+			++argv;
+			--argc;
+		}
+		else
+			break;
+		++argv;
+		--argc;
+	}
+    if (storeName != NULL && argc >= 2 && !embed && outName == NULL && !preview)
+    	return store_index(storeName, argv + 1, argc - 1, flags);
+    if ((argc != 2 && argc != 4) || (embed && (argc != 2 || outName != NULL)) ||
+    	storeName != NULL || (preview && embed) ||
+    	(update && (embed || preview || outName != NULL || (flags & ZI_BUILD_STATS) ||
+    				strcmp(argv[1], "-") == 0)) ||
+    	(cache && (argc != 2 || embed || update || strcmp(argv[1], "-") == 0))) {
+        fprintf(stderr, "%s", usage);
         return 1;
     }
-    if (argc==2) {
-		argLen = strlen(argv[1]);
-		idxExt = ".idx";
-		idxName = (char *) calloc(argLen + strlen(idxExt) + 1, sizeof(char));
-		if (idxName == NULL) {
-			fprintf(stderr,"** ERROR: ziopen failed to alloc idxName\n");
-			return 1;
-		}
-		strcpy(idxName, argv[1]);
-		strcpy(idxName+argLen, idxExt);
-		ucsExt = ".idx.ucs";
-		ucsName = (char *) calloc(argLen + strlen(ucsExt) + 1, sizeof(char));
-		if (ucsName == NULL) {
-			free(idxName);
-			fprintf(stderr,"** ERROR: ziopen failed to alloc ucsName\n");
+    if (embed)
+    	return embed_index(argv[1], flags);
+    inName = argv[1];
+
+    /* index names follow the output when indexing a stream */
+    nameBase = inName;
+    if (strcmp(inName, "-") == 0)
+    	nameBase = outName != NULL && strcmp(outName, "-") != 0 ? outName : NULL;
+    if (argc == 2 && nameBase == NULL) {
+    	fprintf(stderr, "zindex: index file names needed when indexing standard input\n%s", usage);
+    	return 1;
+    }
+    if (cache) {
+		ret = zi_cache_names(inName, &idxName, &ucsName, 1);
+		if (ret != Z_OK) {
+			fprintf(stderr, "zindex: no index cache directory for %s\n", inName);
 			return 1;
 		}
-		strcpy(ucsName, argv[1]);
-		strcpy(ucsName+argLen, ucsExt);
+	}
+    else if (argc == 2) {
+		idxName = index_name(nameBase, ".idx");
+		ucsName = index_name(nameBase, ".idx.ucs");
+		if (idxName == NULL || ucsName == NULL)
+			goto return_fail;
 	}
     else {
     	idxName = argv[2];
     	ucsName = argv[3];
     }
+    if (update) {
+    	ret = update_index(inName, idxName, ucsName, flags);
+    	if (argc == 2) {
+    		free(idxName);
+    		free(ucsName);
+    	}
+    	return ret;
+    }
 
-    in = fopen(argv[1], "rb");
+    /* open input and pass-through output */
+    if (strcmp(inName, "-") == 0) {
+    	in = stdin;
+    	inName = "standard input";
+    }
+    else
+    	in = fopen(inName, "rb");
     if (in == NULL) {
-        fprintf(stderr, "zindex: could not open %s for reading\n", argv[1]);
+        fprintf(stderr, "zindex: could not open %s for reading\n", inName);
 		goto return_fail;
     }
-	idxFile = fopen(idxName, "wb");
+    out = NULL;
+    msg = stdout;
+    if (outName != NULL) {
+    	if (strcmp(outName, "-") == 0) {
+    		out = stdout;
+    		msg = stderr;	/* keep the data stream clean */
+    	}
+    	else
+    		out = fopen(outName, "wb");
+    	if (out == NULL) {
+    		fclose(in);
+    		fprintf(stderr, "zindex: could not open %s for writing\n", outName);
+    		goto return_fail;
+    	}
+    }
+	idxFile = create_index(idxName, &idxTmp);
+	if (idxFile == NULL && argc == 2 && !cache && in != stdin &&
+			(errno == EACCES || errno == EROFS || errno == EPERM)) {
+		/* read-only data: the index goes to the cache directory */
+		free(idxName);
+		free(ucsName);
+		idxName = ucsName = NULL;
+		if (zi_cache_names(inName, &idxName, &ucsName, 1) == Z_OK) {
+			cache = 1;
+			idxFile = create_index(idxName, &idxTmp);
+		}
+		if (idxName == NULL) {
+			fclose(in);
+			if (out != NULL)
+				fclose(out);
+			fprintf(stderr, "zindex: could not write the index of %s, nor to the index cache\n", inName);
+			return 1;
+		}
+	}
 	if (idxFile == NULL) {
 		fclose(in);
+		if (out != NULL)
+			fclose(out);
 		fprintf(stderr, "zindex: could not open %s for writing\n", idxName);
 		goto return_fail;
 	}
-    ucsFile = fopen(ucsName, "wb");
+    ucsFile = create_index(ucsName, &ucsTmp);
     if (ucsFile == NULL) {
     	fclose(in);
+		if (out != NULL)
+			fclose(out);
     	fclose(idxFile);
+    	remove(idxTmp);
+    	free(idxTmp);
     	fprintf(stderr, "zindex: could not open %s for writing\n", ucsName);
 		goto return_fail;
     }
-	fprintf(stdout,"Creating index files:\n\t%s\n\t%s\n", idxName, ucsName);
+    prvName = NULL;
+    prvFile = NULL;
+    if (preview && ((prvName = index_name(idxName, ".prv")) == NULL ||
+    				(prvFile = fopen(prvName, "wb")) == NULL)) {
+    	fclose(in);
+		if (out != NULL)
+			fclose(out);
+    	fclose(idxFile);
+    	fclose(ucsFile);
+    	remove(idxTmp);
+    	remove(ucsTmp);
+    	free(idxTmp);
+    	free(ucsTmp);
+    	if (prvName != NULL)
+    		fprintf(stderr, "zindex: could not open %s for writing\n", prvName);
+    	free(prvName);
+		goto return_fail;
+    }
+	fprintf(msg,"Creating index files:\n\t%s\n\t%s\n", idxName, ucsName);
+
+	/* build index, written out as it goes */
+	len = build_index_preview(in, out, SPAN, flags, idxFile, ucsFile, prvFile);
+	if (out != NULL && fclose(out) != 0 && len > 0)
+		len = Z_ERRNO;
+	ret = 0;
+	if (prvFile != NULL) {
+		/* no preview for data other than a NIfTI image */
+		if (ftello(prvFile) == 0 || len <= 0) {
+			fclose(prvFile);
+			remove(prvName);
+		}
+		else if (fclose(prvFile) != 0)
+			len = Z_ERRNO;
+		else
+			fprintf(msg, "Preview written to %s\n", prvName);
+		free(prvName);
+	}
+	if (fclose(ucsFile) != 0 && len > 0)
+		len = Z_ERRNO;
+	if (fclose(idxFile) != 0 && len > 0)
+		len = Z_ERRNO;
+	fclose(in);
+	/* in place whole, the windows first */
+	if (len > 0 && (rename(ucsTmp, ucsName) != 0 ||
+					rename(idxTmp, idxName) != 0))
+		len = Z_ERRNO;
+	if (len <= 0) {
+		remove(idxTmp);
+		remove(ucsTmp);
+	}
+	free(idxTmp);
+	free(ucsTmp);
 	if (argc == 2) {
 		free(idxName);
-		idxName = NULL;
 		free(ucsName);
-		ucsName = NULL;
 	}
-
-	/* build index */
-	len = build_index(in, SPAN, &index);
 	if (len <= 0) {
-		fclose(in);
-		fclose(idxFile);
-		fclose(ucsFile);
 		switch (len) {
 		case Z_MEM_ERROR:
 			fprintf(stderr, "zindex: out of memory\n");
 			break;
 		case Z_DATA_ERROR:
-			fprintf(stderr, "zindex: compressed data error in %s\n", argv[1]);
+			fprintf(stderr, "zindex: compressed data error in %s\n", inName);
 			break;
 		case Z_ERRNO:
-			fprintf(stderr, "zindex: read error on %s\n", argv[1]);
+			fprintf(stderr, "zindex: read error on %s%s%s or write error on index files\n",
+					inName, out != NULL ? ", " : "", out != NULL ? outName : "");
 			break;
 		default:
 			fprintf(stderr, "zindex: error %li while building index\n", len);
 		}
-		goto return_fail;
-	}
-
-	len = write_index(index, idxFile, ucsFile);
-	ret = 0;
-	if (len <= 0) {
-		fprintf(stderr, "zindex: failed to write index files\n");
 		ret = 1;
 	}
-	if (len < index->have) {
-		fprintf(stderr, "zindex: writing index failed, only %li/%li written\n", len, index->have);
-		ret = 1;
-	}
-	fprintf(stdout, "Index files created with %li access points\n", len);
-	fclose(ucsFile);
-	fclose(idxFile);
-	fclose(in);
-
-	free_index(index);
+	else
+		fprintf(msg, "Index files created with %li access points\n", len);
     return ret;
 
 return_fail:
@@ -127,4 +1371,3 @@ return_fail:
 	}
 	return 1;
 }
-
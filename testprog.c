@@ -0,0 +1,201 @@
+/* testprog.c -- round trip check of zindex, run by make check
+ *
+ *  Writes a gzip file of known data, then through the zindex program given
+ *  as argument builds its index, exports it to indexed_gzip and imports it
+ *  back, and indexes a copy of the file growing in two steps with --update.
+ *  After every step the file is opened with its index and read at random
+ *  places against the data; the built index is also checked for format 2
+ *  and verified against its checksums.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include "zindex.h"
+
+#define TEST_SIZE (20L << 20)	/* bytes of data, five spans */
+#define TEST_READS 100			/* random reads after each step */
+#define TEST_READ_MAX 300000	/* longest of them */
+
+static unsigned char *data;
+static unsigned char *got;
+static int failed;
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "testprog: FAILED: %s\n", what);
+	failed++;
+}
+
+/* Text lines with runs of noise, compressible but not too much */
+static void make_data(void)
+{
+	unsigned long r = 12345;
+	long i;
+
+	for (i = 0; i < TEST_SIZE; ++i) {
+		r = r * 1103515245UL + 12345UL;
+		if ((i & 4095) < 512)
+			data[i] = (unsigned char) (r >> 16);
+		else if (i % 61 == 60)
+			data[i] = '\n';
+		else
+			data[i] = (unsigned char) ('a' + (r >> 16) % 8);
+	}
+}
+
+static int write_gz(const char *path)
+{
+	gzFile gz;
+
+	gz = gzopen(path, "wb6");
+	if (gz == NULL)
+		return -1;
+	if (gzwrite(gz, data, (unsigned) TEST_SIZE) != (int) TEST_SIZE) {
+		gzclose(gz);
+		return -1;
+	}
+	return gzclose(gz) == Z_OK ? 0 : -1;
+}
+
+/* Copy len bytes of from, after the first skip, to to opened with mode */
+static int copy_part(const char *from, const char *to, const char *mode,
+					 long skip, long len)
+{
+	FILE *in, *out;
+	unsigned char buf[65536];
+	size_t n;
+	int ret = 0;
+
+	in = fopen(from, "rb");
+	out = fopen(to, mode);
+	if (in == NULL || out == NULL || fseek(in, skip, SEEK_SET) != 0)
+		ret = -1;
+	while (ret == 0 && len > 0) {
+		n = fread(buf, 1, len < (long) sizeof(buf) ? (size_t) len : sizeof(buf), in);
+		if (n == 0 || fwrite(buf, 1, n, out) != n)
+			ret = -1;
+		len -= (long) n;
+	}
+	if (in != NULL)
+		fclose(in);
+	if (out != NULL && fclose(out) != 0)
+		ret = -1;
+	return ret;
+}
+
+static int run(const char *zindex, const char *args)
+{
+	char cmd[1024];
+
+	snprintf(cmd, sizeof(cmd), "%s %s >/dev/null", zindex, args);
+	return system(cmd);
+}
+
+/* Read path with its index at random places, the last one reaching the end,
+   and compare with the data */
+static void check_reads(const char *path, const char *step)
+{
+	char idxName[256], ucsName[256];
+	zindexPtr idx;
+	long offset;
+	int i, len, n;
+
+	snprintf(idxName, sizeof(idxName), "%s.idx", path);
+	snprintf(ucsName, sizeof(ucsName), "%s.idx.ucs", path);
+	idx = ziopen(path, idxName, ucsName, "rb");
+	if (idx == NULL) {
+		fail(step);
+		return;
+	}
+	if (idx->end != TEST_SIZE)
+		fail(step);
+	srand(7);
+	for (i = 0; i < TEST_READS; ++i) {
+		len = 1 + rand() % TEST_READ_MAX;
+		offset = i == TEST_READS - 1 ? TEST_SIZE - len / 2 :
+			(long) ((double) rand() / RAND_MAX * (TEST_SIZE - 1));
+		ziseek(idx, offset, SEEK_SET);
+		n = ziread(idx, got, (unsigned) len);
+		if (offset + len > TEST_SIZE)
+			len = (int) (TEST_SIZE - offset);
+		if (n != len || memcmp(got, data + offset, (size_t) len) != 0) {
+			fail(step);
+			break;
+		}
+	}
+	ziclose(&idx);
+}
+
+int main(int argc, char **argv)
+{
+	const char *zindex = argc > 1 ? argv[1] : "./zindex";
+	char magic[8];
+	zindexPtr idx;
+	FILE *f;
+	long size;
+
+	data = (unsigned char *) malloc(TEST_SIZE);
+	got = (unsigned char *) malloc(TEST_READ_MAX);
+	if (data == NULL || got == NULL) {
+		fprintf(stderr, "testprog: out of memory\n");
+		return 1;
+	}
+	make_data();
+	if (write_gz("testprog.gz") != 0) {
+		fprintf(stderr, "testprog: cannot write testprog.gz\n");
+		return 1;
+	}
+
+	/* build: format 2, reads, checksums */
+	if (run(zindex, "testprog.gz") != 0)
+		fail("build");
+	f = fopen("testprog.gz.idx", "rb");
+	if (f == NULL || fread(magic, 1, 8, f) != 8 ||
+			memcmp(magic, ZI_IDX_MAGIC, 8) != 0)
+		fail("format 2");
+	if (f != NULL)
+		fclose(f);
+	check_reads("testprog.gz", "random reads");
+	idx = ziopen("testprog.gz", "testprog.gz.idx", "testprog.gz.idx.ucs", "rb");
+	if (idx == NULL || zi_verify(idx, 2, NULL, NULL) != 0)
+		fail("verify");
+	ziclose(&idx);
+
+	/* export to indexed_gzip, import back */
+	if (run(zindex, "convert -t gzidx testprog.gz testprog.gzidx") != 0)
+		fail("export");
+	remove("testprog.gz.idx");
+	remove("testprog.gz.idx.ucs");
+	if (run(zindex, "convert testprog.gz testprog.gzidx") != 0)
+		fail("import");
+	check_reads("testprog.gz", "reads after import");
+
+	/* --update of a file growing in two steps, the first cut mid-stream */
+	f = fopen("testprog.gz", "rb");
+	size = f != NULL && fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+	if (f != NULL)
+		fclose(f);
+	if (size <= 0 ||
+			copy_part("testprog.gz", "testprog.up.gz", "wb", 0, size / 3) != 0 ||
+			run(zindex, "--update testprog.up.gz") != 0 ||
+			copy_part("testprog.gz", "testprog.up.gz", "ab", size / 3,
+					  size - size / 3) != 0 ||
+			run(zindex, "--update testprog.up.gz") != 0)
+		fail("update");
+	else
+		check_reads("testprog.up.gz", "reads after update");
+
+	remove("testprog.gz");
+	remove("testprog.gz.idx");
+	remove("testprog.gz.idx.ucs");
+	remove("testprog.gzidx");
+	remove("testprog.up.gz");
+	remove("testprog.up.gz.idx");
+	remove("testprog.up.gz.idx.ucs");
+	free(data);
+	free(got);
+	if (failed)
+		return 1;
+	printf("testprog: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,549 @@
+/* ziadapt.c -- read histograms and access points added where reads cluster
+ *
+ *  A handle tracking its reads (zi_track(), or ZINDEX_HIST in the environment
+ *  for ziopen()) counts where every ziread() starts, per ZI_HIST_BUCKET bytes
+ *  of uncompressed data, and adds the counts to a sidecar file when it is
+ *  closed: the magic "ZIHIST1\n", the bucket size (64 bits) and a count (32)
+ *  per bucket, little-endian, updated under flock() by any number of
+ *  processes.  zi_densify() then gives the index extra access points, with
+ *  their windows, at the last block boundary before each of the buckets read
+ *  most, so that reads there skip a few blocks instead of up to a whole span.
+ *  The rest of the index stays as sparse as it was.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "zindex.h"
+
+#define local static
+
+#define HIST_MAGIC "ZIHIST1\n"
+#define HIST_HEAD 16        /* magic and bucket size */
+
+/* an access point found while inflating a span */
+struct adapt_point {
+    struct idx_point point;
+    off_t lines;                    /* newlines before it */
+    uint32_t pre;                   /* CRC-32 of the span up to it */
+    unsigned char window[WINSIZE];
+};
+
+void free_hist(struct zi_hist *hist)
+{
+    if (hist != NULL) {
+        free(hist->count);
+        free(hist->path);
+        free(hist);
+    }
+}
+
+/* Start counting the reads of idx, to be added to the sidecar at path when
+   idx is closed (kept in memory only if path is NULL). */
+int zi_track(zindexPtr idx, const char *path)
+{
+    struct zi_hist *hist;
+
+    if (idx == NULL)
+        return Z_STREAM_ERROR;
+    hist = calloc(1, sizeof(struct zi_hist));
+    if (hist == NULL)
+        return Z_MEM_ERROR;
+    hist->bucket = ZI_HIST_BUCKET;
+    hist->n = (size_t)(idx->end / ZI_HIST_BUCKET) + 1;
+    hist->count = calloc(hist->n, sizeof(uint32_t));
+    hist->path = path != NULL ? strdup(path) : NULL;
+    if (hist->count == NULL || (path != NULL && hist->path == NULL)) {
+        free_hist(hist);
+        return Z_MEM_ERROR;
+    }
+    free_hist(idx->hist);
+    idx->hist = hist;
+    return Z_OK;
+}
+
+/* Count a read starting at offset. */
+void zi_hist_count(struct zi_hist *hist, off_t offset)
+{
+    size_t b = (size_t)(offset / hist->bucket);
+
+    if (b < hist->n && hist->count[b] != UINT32_MAX)
+        hist->count[b]++;
+}
+
+/* Parse the n bytes of a sidecar at p into a new histogram in *hist. */
+local int hist_parse(const unsigned char *p, size_t n, struct zi_hist **hist)
+{
+    struct zi_hist *h;
+    size_t b;
+
+    if (n < HIST_HEAD || memcmp(p, HIST_MAGIC, 8) != 0 || zi_get_le(p + 8, 8) == 0)
+        return Z_DATA_ERROR;
+    h = calloc(1, sizeof(struct zi_hist));
+    if (h == NULL)
+        return Z_MEM_ERROR;
+    h->bucket = (off_t)zi_get_le(p + 8, 8);
+    h->n = (n - HIST_HEAD) / 4;
+    h->count = calloc(h->n ? h->n : 1, sizeof(uint32_t));
+    if (h->count == NULL) {
+        free(h);
+        return Z_MEM_ERROR;
+    }
+    for (b = 0; b < h->n; ++b)
+        h->count[b] = (uint32_t)zi_get_le(p + HIST_HEAD + 4 * b, 4);
+    *hist = h;
+    return Z_OK;
+}
+
+/* Read all of the file open at fd into a new buffer, its size in *n. */
+local unsigned char *slurp(int fd, size_t *n)
+{
+    struct stat st;
+    unsigned char *buf;
+
+    if (fstat(fd, &st) != 0)
+        return NULL;
+    *n = (size_t)st.st_size;
+    buf = malloc(*n ? *n : 1);
+    if (buf != NULL && *n && pread(fd, buf, *n, 0) != (ssize_t)*n) {
+        free(buf);
+        buf = NULL;
+    }
+    return buf;
+}
+
+/* Read the histogram of the sidecar at path into *hist.  Returns Z_OK,
+   Z_ERRNO if it cannot be read or Z_DATA_ERROR if it is not a histogram. */
+int zi_hist_read(const char *path, struct zi_hist **hist)
+{
+    unsigned char *buf;
+    size_t n;
+    int fd, ret;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return Z_ERRNO;
+    (void)flock(fd, LOCK_SH);
+    buf = slurp(fd, &n);
+    close(fd);
+    if (buf == NULL)
+        return Z_ERRNO;
+    ret = hist_parse(buf, n, hist);
+    free(buf);
+    return ret;
+}
+
+/* Add the counts of hist to its sidecar, and free it.  The sidecar is
+   started anew if it is missing or has other buckets.  Returns Z_OK, or
+   Z_ERRNO if the sidecar cannot be updated. */
+int zi_hist_close(struct zi_hist *hist)
+{
+    struct zi_hist *old;
+    unsigned char *buf;
+    uint64_t sum;
+    size_t n, b;
+    int fd, ret;
+
+    if (hist == NULL)
+        return Z_OK;
+    for (b = 0; b < hist->n && hist->count[b] == 0; ++b)
+        ;
+    if (hist->path == NULL || b == hist->n) {
+        free_hist(hist);
+        return Z_OK;
+    }
+    fd = open(hist->path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+        if (fd >= 0)
+            close(fd);
+        free_hist(hist);
+        return Z_ERRNO;
+    }
+
+    /* merge with what other handles left there */
+    old = NULL;
+    buf = slurp(fd, &n);
+    if (buf != NULL && hist_parse(buf, n, &old) == Z_OK && old->bucket != hist->bucket) {
+        free_hist(old);
+        old = NULL;
+    }
+    free(buf);
+    n = old != NULL && old->n > hist->n ? old->n : hist->n;
+    buf = malloc(HIST_HEAD + 4 * n);
+    ret = buf == NULL ? Z_MEM_ERROR : Z_OK;
+    if (ret == Z_OK) {
+        memcpy(buf, HIST_MAGIC, 8);
+        zi_put_le(buf + 8, (uint64_t)hist->bucket, 8);
+        for (b = 0; b < n; ++b) {
+            sum = (b < hist->n ? hist->count[b] : 0) +
+                  (uint64_t)(old != NULL && b < old->n ? old->count[b] : 0);
+            zi_put_le(buf + HIST_HEAD + 4 * b,
+                      sum > UINT32_MAX ? UINT32_MAX : sum, 4);
+        }
+        if (pwrite(fd, buf, HIST_HEAD + 4 * n, 0) != (ssize_t)(HIST_HEAD + 4 * n) ||
+            ftruncate(fd, (off_t)(HIST_HEAD + 4 * n)) != 0)
+            ret = Z_ERRNO;
+    }
+    free(buf);
+    free_hist(old);
+    close(fd);                      /* and unlock */
+    free_hist(hist);
+    return ret;
+}
+
+/* a bucket worth an access point, and how often it was read */
+struct adapt_target {
+    off_t out;
+    uint32_t count;
+};
+
+local int by_count(const void *a, const void *b)
+{
+    const struct adapt_target *x = a, *y = b;
+
+    return x->count != y->count ? (x->count < y->count ? 1 : -1) :
+           (x->out > y->out) - (x->out < y->out);
+}
+
+local int by_offset(const void *a, const void *b)
+{
+    const struct adapt_target *x = a, *y = b;
+
+    return (x->out > y->out) - (x->out < y->out);
+}
+
+/* Choose where access points are worth adding: the starts of the buckets of
+   hist read at least min times and ZI_ADAPT_NEAR or more after the access
+   point before them, the most read first, no more than the index has points.
+   Returns the number chosen in *target, in order of offset, or negative. */
+local long adapt_targets(struct access *index, const struct zi_hist *hist,
+                         unsigned long min, struct adapt_target **target)
+{
+    struct adapt_target *t;
+    off_t out, end;
+    size_t b, k;
+    long n;
+
+    t = malloc(sizeof(struct adapt_target) * (hist->n ? hist->n : 1));
+    if (t == NULL)
+        return Z_MEM_ERROR;
+    end = index->idx_list[index->have - 1].out;
+    n = 0;
+    for (b = 0; b < hist->n; ++b) {
+        out = hist->bucket * (off_t)b;
+        if (hist->count[b] < min || hist->count[b] == 0 || out >= end)
+            continue;
+        k = find_point(index, out);
+        if (out - index->idx_list[k].out < ZI_ADAPT_NEAR)
+            continue;
+        t[n].out = out;
+        t[n++].count = hist->count[b];
+    }
+    qsort(t, (size_t)n, sizeof(struct adapt_target), by_count);
+    if (n > (long)index->have)
+        n = (long)index->have;
+    qsort(t, (size_t)n, sizeof(struct adapt_target), by_offset);
+    *target = t;
+    return n;
+}
+
+local off_t count_lines(const unsigned char *p, size_t n)
+{
+    const unsigned char *nl;
+    off_t lines = 0;
+
+    while (n > 0 && (nl = memchr(p, '\n', n)) != NULL) {
+        lines++;
+        n -= (size_t)(nl + 1 - p);
+        p = nl + 1;
+    }
+    return lines;
+}
+
+/* Inflate span k of index, from zFile with the window from ucsFile, and put
+   in add[] an access point at the last block boundary at or before each of
+   the nt targets that has one after the previous target, their count in
+   *nadd.  *total is set to the CRC-32 of the whole span. */
+local int adapt_span(struct access *index, size_t k, FILE *zFile,
+                     FILE *ucsFile, const struct adapt_target *target,
+                     size_t nt, struct adapt_point *add, size_t *nadd,
+                     uint32_t *total)
+{
+    struct idx_point *here = index->idx_list + k;
+    struct adapt_point cand;
+    int ret, have, c, raw, trailer;
+    off_t totin, totout, end, lines;
+    uint32_t crc;
+    unsigned produced, left;
+    size_t ti;
+    z_stream strm;
+    unsigned char input[CHUNK];
+    unsigned char window[WINSIZE];
+
+    *nadd = 0;
+    end = here[1].out;
+    if (read_window(index, ucsFile, k, window) != Z_OK ||
+        fseeko(zFile, here->in - (here->bits ? 1 : 0), SEEK_SET) != 0)
+        return Z_ERRNO;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit2(&strm, -15);         /* raw inflate */
+    if (ret != Z_OK)
+        return ret;
+    if (here->bits) {
+        if ((c = getc(zFile)) == EOF) {
+            ret = Z_DATA_ERROR;
+            goto adapt_ret;
+        }
+        (void)inflatePrime(&strm, here->bits, c >> (8 - here->bits));
+    }
+    (void)inflateSetDictionary(&strm, window, WINSIZE);
+
+    /* the window goes on from the one of the point, as a circular buffer */
+    strm.next_out = window;
+    strm.avail_out = WINSIZE;
+    totin = here->in;
+    totout = here->out;
+    lines = 0;
+    crc = 0;
+    have = 0;
+    ti = 0;
+    raw = 1;
+    trailer = 0;
+    while (totout < end) {
+        if (strm.avail_in == 0) {
+            strm.avail_in = fread(input, 1, CHUNK, zFile);
+            if (ferror(zFile)) {
+                ret = Z_ERRNO;
+                goto adapt_ret;
+            }
+            if (strm.avail_in == 0) {
+                ret = Z_DATA_ERROR;
+                goto adapt_ret;
+            }
+            strm.next_in = input;
+        }
+        if (trailer) {                          /* skip the end of a member */
+            c = strm.avail_in < (unsigned)trailer ? (int)strm.avail_in : trailer;
+            strm.next_in += c;
+            strm.avail_in -= (unsigned)c;
+            totin += c;
+            trailer -= c;
+            continue;
+        }
+        if (strm.avail_out == 0) {
+            strm.avail_out = WINSIZE;
+            strm.next_out = window;
+        }
+        totin += strm.avail_in;
+        totout += strm.avail_out;
+        produced = strm.avail_out;
+        ret = inflate(&strm, Z_BLOCK);          /* return at end of block */
+        totin -= strm.avail_in;
+        totout -= strm.avail_out;
+        produced -= strm.avail_out;
+        crc = zi_crc32(crc, strm.next_out - produced, produced);
+        if (index->lines != NULL)
+            lines += count_lines(strm.next_out - produced, produced);
+        if (ret == Z_NEED_DICT)
+            ret = Z_DATA_ERROR;
+        if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+            goto adapt_ret;
+        if (ret == Z_STREAM_END) {
+            if (totout == end)
+                break;
+            /* a gzip member ends in the span, go on with the next one --
+               raw inflate leaves its trailer to us */
+            if (raw)
+                trailer = 8;
+            raw = 0;
+            ret = inflateReset2(&strm, 31);
+            if (ret != Z_OK)
+                goto adapt_ret;
+            continue;
+        }
+        if (!(strm.data_type & 128) || (strm.data_type & 64) ||
+            totout == here->out || totout >= end)
+            continue;
+
+        /* at a block boundary: the targets behind it take the last one */
+        while (ti < nt && target[ti].out < totout) {
+            if (have)
+                add[(*nadd)++] = cand;
+            have = 0;
+            ti++;
+        }
+        if (ti < nt) {
+            cand.point.out = totout;
+            cand.point.in = totin;
+            cand.point.bits = strm.data_type & 7;
+            cand.point.crc = 0;
+            cand.lines = lines;
+            cand.pre = crc;
+            left = strm.avail_out;
+            if (left)
+                memcpy(cand.window, window + WINSIZE - left, left);
+            if (left < WINSIZE)
+                memcpy(cand.window + left, window, WINSIZE - left);
+            have = 1;
+        }
+    }
+    if (ret == Z_OK || ret == Z_BUF_ERROR || ret == Z_STREAM_END) {
+        if (totout != end)
+            ret = Z_DATA_ERROR;
+        else {
+            if (have && ti < nt)
+                add[(*nadd)++] = cand;
+            *total = crc;
+            ret = Z_OK;
+        }
+    }
+
+  adapt_ret:
+    if (ret != Z_OK)
+        *nadd = 0;
+    (void)inflateEnd(&strm);
+    return ret;
+}
+
+/* Append point p of index (possibly p is the output of adapt_span()) to
+   dense with its window at offset *pos of the .ucs: a window of a point added
+   is appended there, at *pos, which is advanced. */
+local int adapt_append(struct access *dense, const struct idx_point *p,
+                       off_t lines, const unsigned char *window, FILE *ucsOut,
+                       off_t *pos)
+{
+    if (window != NULL && fwrite(window, WINSIZE, 1u, ucsOut) != 1u)
+        return Z_ERRNO;
+    dense->ucs_offset[dense->have] = *pos;
+    if (window != NULL)
+        *pos += WINSIZE;
+    dense->idx_list[dense->have] = *p;
+    if (dense->lines != NULL)
+        dense->lines[dense->have] = lines;
+    dense->have++;
+    return Z_OK;
+}
+
+/* Build in *built a copy of index, with its windows read from ucsIn, with
+   access points added where the reads counted in hist cluster (buckets read
+   at least min times).  The windows of the points added are appended to
+   ucsOut, the same .ucs opened for update, and the copy gives the offset of
+   every window there: those of index stay where they are, so that the .ucs
+   still serves index until the copy replaces it.  The line marks, zero runs and zone maps of index are moved
+   to the copy.  Returns the number of points added, or negative on error:
+   ZI_CRC_ERROR if the file no longer matches the checksums of the index. */
+long zi_densify(struct access *index, FILE *zFile, FILE *ucsIn,
+                FILE *ucsOut, const struct zi_hist *hist, unsigned long min,
+                struct access **built)
+{
+    struct access *dense;
+    struct adapt_target *target;
+    struct adapt_point *add;
+    long n, added;
+    size_t k, ti, nt, nadd, i;
+    off_t len, pos, at;
+    uint32_t total, crc;
+    int ret;
+
+    if (index == NULL || index->have == 0 || hist == NULL || hist->bucket <= 0 ||
+        (index->flags & (ZI_ZSTD | ZI_CHUNKED)))
+        return Z_STREAM_ERROR;
+    n = adapt_targets(index, hist, min, &target);
+    if (n < 0)
+        return n;
+    dense = calloc(1, sizeof(struct access));
+    add = NULL;
+    pos = 0;
+    ret = dense == NULL ? Z_MEM_ERROR : Z_OK;
+    if (ret == Z_OK) {
+        dense->size = index->have + (size_t)n;
+        dense->flags = index->flags;
+        dense->idx_list = malloc(sizeof(struct idx_point) * dense->size);
+        dense->ucs_offset = malloc(sizeof(off_t) * dense->size);
+        if (index->lines != NULL)
+            dense->lines = malloc(sizeof(off_t) * dense->size);
+        if (dense->idx_list == NULL || dense->ucs_offset == NULL ||
+            (index->lines != NULL && dense->lines == NULL))
+            ret = Z_MEM_ERROR;
+    }
+    if (ret == Z_OK && (fseeko(ucsOut, 0, SEEK_END) != 0 ||
+                        (pos = ftello(ucsOut)) < 0))
+        ret = Z_ERRNO;
+
+    /* the points of index in order, with the new ones of each span after it */
+    ti = 0;
+    for (k = 0; ret == Z_OK && k < index->have; ++k) {
+        at = index->ucs_offset != NULL ? index->ucs_offset[k] :
+             index->ucs_base + index->ucs_stride * (off_t)k;
+        ret = adapt_append(dense, index->idx_list + k,
+                           index->lines != NULL ? index->lines[k] : 0,
+                           NULL, ucsOut, &at);
+        for (nt = 0; k + 1 < index->have && ti + nt < (size_t)n &&
+             target[ti + nt].out < index->idx_list[k + 1].out; ++nt)
+            ;
+        if (ret != Z_OK || nt == 0)
+            continue;
+        free(add);
+        add = malloc(sizeof(struct adapt_point) * nt);
+        if (add == NULL) {
+            ret = Z_MEM_ERROR;
+            break;
+        }
+        ret = adapt_span(index, k, zFile, ucsIn, target + ti, nt, add, &nadd, &total);
+        ti += nt;
+        if (ret != Z_OK || nadd == 0)
+            continue;
+        if ((index->flags & ZI_HAVE_CRC) && total != index->idx_list[k].crc) {
+            ret = ZI_CRC_ERROR;
+            break;
+        }
+
+        /* split the checksum of the span between its parts: the CRC-32 of
+           a part is that of the span up to its end less the shifted one of
+           the span up to its start */
+        for (i = 0; i <= nadd; ++i) {
+            crc = i < nadd ? add[i].pre : total;
+            len = (i < nadd ? add[i].point.out : index->idx_list[k + 1].out) -
+                  (i ? add[i - 1].point.out : index->idx_list[k].out);
+            crc ^= (uint32_t)crc32_combine(i ? add[i - 1].pre : 0, 0, (z_off_t)len);
+            if (i)
+                add[i - 1].point.crc = crc;
+            else
+                dense->idx_list[dense->have - 1].crc = crc;
+        }
+        for (i = 0; ret == Z_OK && i < nadd; ++i)
+            ret = adapt_append(dense, &add[i].point,
+                               index->lines != NULL ? index->lines[k] + add[i].lines : 0,
+                               add[i].window, ucsOut, &pos);
+    }
+    free(add);
+    free(target);
+    if (ret == Z_OK && fflush(ucsOut) != 0)
+        ret = Z_ERRNO;
+    if (ret != Z_OK) {
+        free_index(dense);
+        return ret;
+    }
+    added = (long)(dense->have - index->have);
+
+    /* the rest of the index does not depend on the points */
+    dense->marks = index->marks;
+    dense->nmarks = index->nmarks;
+    dense->zeros = index->zeros;
+    dense->nzeros = index->nzeros;
+    dense->zones = index->zones;
+    index->marks = NULL;
+    index->nmarks = 0;
+    index->zeros = NULL;
+    index->nzeros = 0;
+    index->zones = NULL;
+    *built = dense;
+    return added;
+}
@@ -0,0 +1,560 @@
+/* ziasync.c -- asynchronous reads of indexed gzip files
+ *
+ *  ziread_async() queues a read on a pool of worker threads owned by the
+ *  zindex handle, each with its own I/O context.  Completion is reported by
+ *  zi_wait(), or by zi_poll() calling the callbacks on the polling thread;
+ *  zi_eventfd() becomes readable whenever there is something to poll, so it
+ *  can be added to an event loop.  A request handle stays valid until zi_wait()
+ *  returns or its callback has returned.
+ *
+ *  Reads are queued by priority class (ziread_prio()), and in a class by
+ *  deadline, then in order; a read past its deadline goes before all the
+ *  others.  A worker decodes a piece of a read at a time, from an access
+ *  point to about ZI_SCHED_PIECE bytes further, and picks again afterwards,
+ *  so that a long read gives way between pieces to a more urgent one and is
+ *  shared by the idle workers meanwhile.  With three workers or more, one is
+ *  kept from bulk reads, for the interactive ones never to wait behind them.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "zindex.h"
+
+#define local static
+
+#define ZI_POOL_MAX 16      /* upper limit of worker threads per handle */
+
+/* request states */
+#define ZI_REQ_QUEUED  0    /* pieces left to decode, maybe some running */
+#define ZI_REQ_RUNNING 1    /* all pieces taken, some running */
+#define ZI_REQ_DONE    2
+
+struct zi_request {
+    off_t offset;
+    unsigned len;
+    unsigned char *buf;
+    zi_callback callback;
+    void *user;
+    volatile int cancel;        /* polled by extract() while running */
+    int state;
+    int result;
+    int prio;                   /* ZI_PRIO_* */
+    uint64_t deadline;          /* monotonic ns, or 0 for none */
+    off_t cursor;               /* start of the next piece to decode */
+    int running;                /* pieces being decoded */
+    long got;                   /* bytes decoded by the pieces done */
+    int error;                  /* first error of a piece, or 0 */
+    struct zi_request *next;
+    struct zi_request *older, *newer;   /* in the list of all of the pool */
+};
+
+struct zi_pool {
+    zindexPtr idx;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* signaled when a request is queued */
+    pthread_cond_t done;        /* broadcast when a request completes */
+    pthread_t *thread;
+    int nthread;
+    int stop;
+    int bulk;                   /* workers decoding bulk pieces */
+    int pieces;                 /* workers decoding any piece */
+    int hold;                   /* no piece to be started, see zi_pool_hold() */
+    struct zi_request *queue[ZI_PRIO_CLASSES];  /* by deadline, then age */
+    struct zi_request *ready;   /* completed requests with callback */
+    struct zi_request *all;     /* every request not freed, newest first */
+    int notify[2];              /* read and write end of the notification */
+};
+
+local pthread_mutex_t pool_create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Wake up the event loop of the handle. */
+local void pool_notify(struct zi_pool *pool)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    unsigned char one = 1;
+#endif
+    ssize_t ret;
+
+    do {
+        ret = write(pool->notify[1], &one, sizeof(one));
+    } while (ret < 0 && errno == EINTR);
+}
+
+/* Consume pending notifications. */
+local void pool_clear(struct zi_pool *pool)
+{
+    unsigned char sink[64];
+
+    while (read(pool->notify[0], sink, sizeof(sink)) > 0)
+        ;
+}
+
+/* Complete req with result, called with the pool locked: the event loop is
+   woken up for a callback, zi_wait() for a request without. */
+local void pool_finish(struct zi_pool *pool, struct zi_request *req, int result)
+{
+    req->result = result;
+    req->state = ZI_REQ_DONE;
+    if (req->callback != NULL) {
+        req->next = pool->ready;
+        pool->ready = req;
+        pool_notify(pool);
+    }
+    pthread_cond_broadcast(&pool->done);
+}
+
+/* Free req, which is no longer queued, called with the pool locked. */
+local void pool_free(struct zi_pool *pool, struct zi_request *req)
+{
+    if (req->older != NULL)
+        req->older->newer = req->newer;
+    if (req->newer != NULL)
+        req->newer->older = req->older;
+    else
+        pool->all = req->older;
+    free(req);
+}
+
+local uint64_t pool_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+/* Insert req in the queue of its class: after those with an earlier or the
+   same deadline, all of them if it has none. */
+local void pool_queue(struct zi_pool *pool, struct zi_request *req)
+{
+    struct zi_request **link;
+
+    for (link = pool->queue + req->prio; *link != NULL; link = &(*link)->next)
+        if (req->deadline != 0 && ((*link)->deadline == 0 ||
+                                   (*link)->deadline > req->deadline))
+            break;
+    req->next = *link;
+    *link = req;
+}
+
+/* Take req out of the queue of its class, called with the pool locked. */
+local void pool_unlink(struct zi_pool *pool, struct zi_request *req)
+{
+    struct zi_request **link;
+
+    for (link = pool->queue + req->prio; *link != NULL; link = &(*link)->next)
+        if (*link == req) {
+            *link = req->next;
+            break;
+        }
+}
+
+/* Return the request to take a piece of next, or NULL if there is nothing a
+   worker may do now: the one most past its deadline, else the first of the
+   most urgent class -- bulk, late or not, only if that leaves a worker
+   free. */
+local struct zi_request *pool_pick(struct zi_pool *pool)
+{
+    struct zi_request *req, *late;
+    uint64_t now;
+    int c, bulk;
+
+    if (pool->hold)
+        return NULL;
+    bulk = pool->nthread < 3 || pool->bulk < pool->nthread - 1;
+    late = NULL;
+    now = 0;
+    for (c = 0; c < ZI_PRIO_CLASSES; c++) {
+        req = pool->queue[c];
+        if (req == NULL || req->deadline == 0 || (c == ZI_PRIO_BULK && !bulk))
+            continue;
+        if (now == 0)
+            now = pool_now();
+        if (req->deadline <= now && (late == NULL || req->deadline < late->deadline))
+            late = req;
+    }
+    if (late != NULL)
+        return late;
+    for (c = 0; c < ZI_PRIO_CLASSES; c++)
+        if (pool->queue[c] != NULL && (c != ZI_PRIO_BULK || bulk))
+            return pool->queue[c];
+    return NULL;
+}
+
+/* Return the length of the next piece of req: from its cursor to the first
+   access point at least ZI_SCHED_PIECE further, or to its end. */
+local unsigned pool_piece(struct zi_pool *pool, struct zi_request *req)
+{
+    struct access *index = pool->idx->data;
+    off_t end, stop;
+    size_t k;
+
+    end = req->offset + (off_t)req->len;
+    if ((index->flags & ZI_CHUNKED) || index->have < 2 ||
+        end - req->cursor <= ZI_SCHED_PIECE)
+        return (unsigned)(end - req->cursor);
+    k = find_point(index, req->cursor);
+    stop = req->cursor + ZI_SCHED_PIECE;
+    while (k + 1 < index->have && index->idx_list[k + 1].out < stop)
+        k++;
+    if (k + 1 < index->have && index->idx_list[k + 1].out < end)
+        end = index->idx_list[k + 1].out;
+    return (unsigned)(end - req->cursor);
+}
+
+local void *pool_worker(void *arg)
+{
+    struct zi_pool *pool = arg;
+    struct zi_request *req;
+    struct zi_io *io;
+    off_t offset;
+    unsigned len;
+    int ret;
+
+    io = ziio_open(ZI_IO_DEPTH);
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && (req = pool_pick(pool)) == NULL)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->stop)
+            break;
+
+        /* take its next piece, and all of it is taken, out of the queue */
+        offset = req->cursor;
+        len = pool_piece(pool, req);
+        req->cursor += (off_t)len;
+        req->running++;
+        if (req->cursor == req->offset + (off_t)req->len) {
+            pool_unlink(pool, req);
+            req->state = ZI_REQ_RUNNING;
+        }
+        if (req->prio == ZI_PRIO_BULK)
+            pool->bulk++;
+        pool->pieces++;
+        if (pool_pick(pool) != NULL)
+            pthread_cond_signal(&pool->work);   /* more for another worker */
+        pthread_mutex_unlock(&pool->lock);
+
+        if (io == NULL)
+            ret = Z_MEM_ERROR;
+        else
+            ret = zi_extract(pool->idx, io, offset,
+                             req->buf + (offset - req->offset), (int)len,
+                             &req->cancel);
+
+        pthread_mutex_lock(&pool->lock);
+        if (req->prio == ZI_PRIO_BULK) {
+            pool->bulk--;
+            pthread_cond_signal(&pool->work);   /* a bulk piece may go */
+        }
+        if (--pool->pieces == 0 && pool->hold)
+            pthread_cond_broadcast(&pool->done);    /* zi_pool_hold() */
+        req->running--;
+        if (ret >= 0)
+            req->got += ret;
+        else if (req->error == 0)
+            req->error = ret;
+        if ((ret < 0 || (unsigned)ret < len) && req->state == ZI_REQ_QUEUED) {
+            /* failed, or the data ends: nothing after it to decode */
+            pool_unlink(pool, req);
+            req->state = ZI_REQ_RUNNING;
+        }
+        if (req->state == ZI_REQ_RUNNING && req->running == 0) {
+            pool_finish(pool, req, req->cancel ? ZI_CANCELED :
+                        req->error != 0 ? req->error : (int)req->got);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    ziio_close(io);
+    return NULL;
+}
+
+/* Number of workers: ZINDEX_THREADS, or the number of online processors. */
+local int pool_size(void)
+{
+    char *env;
+    long n;
+
+    env = getenv("ZINDEX_THREADS");
+    n = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > ZI_POOL_MAX)
+        n = ZI_POOL_MAX;
+    return (int)n;
+}
+
+local int pool_pipe(int fd[2])
+{
+#ifdef __linux__
+    fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd[0] >= 0)
+        return 0;
+#endif
+    if (pipe(fd) != 0)
+        return -1;
+    (void)fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    (void)fcntl(fd[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/* Start the worker pool of idx if not running yet. */
+local struct zi_pool *pool_get(zindexPtr idx)
+{
+    struct zi_pool *pool;
+    int i, n;
+
+    pthread_mutex_lock(&pool_create_lock);
+    pool = idx->pool;
+    if (pool != NULL) {
+        pthread_mutex_unlock(&pool_create_lock);
+        return pool;
+    }
+    pool = calloc(1, sizeof(struct zi_pool));
+    n = pool_size();
+    if (pool == NULL ||
+        (pool->thread = calloc((size_t)n, sizeof(pthread_t))) == NULL) {
+        free(pool);
+        pthread_mutex_unlock(&pool_create_lock);
+        fprintf(stderr,"** ERROR: ziread_async failed to alloc worker pool\n");
+        return NULL;
+    }
+    if (pool_pipe(pool->notify) != 0) {
+        free(pool->thread);
+        free(pool);
+        pthread_mutex_unlock(&pool_create_lock);
+        fprintf(stderr,"** ERROR: ziread_async failed to create event fd\n");
+        return NULL;
+    }
+    pool->idx = idx;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (i = 0; i < n; ++i)
+        if (pthread_create(pool->thread + i, NULL, pool_worker, pool) != 0)
+            break;
+    pool->nthread = i;
+    if (i == 0) {
+        idx->pool = pool;
+        zi_pool_close(idx);
+        pthread_mutex_unlock(&pool_create_lock);
+        fprintf(stderr,"** ERROR: ziread_async failed to start workers\n");
+        return NULL;
+    }
+    idx->pool = pool;
+    pthread_mutex_unlock(&pool_create_lock);
+    return pool;
+}
+
+/* Queue a read of len bytes at offset into buf, which must stay valid until
+   completion, in priority class prio (ZI_PRIO_INTERACTIVE, ZI_PRIO_NORMAL or
+   ZI_PRIO_BULK) and with a deadline in milliseconds from now (0 for none).
+   The file position of idx is neither used nor moved.  If callback is not
+   NULL it is called from zi_poll() once the read completes, unless the
+   request is collected with zi_wait() first.  Returns the request, or NULL
+   on error. */
+struct zi_request * ziread_prio(zindexPtr idx, off_t offset, unsigned len,
+                                void *buf, int prio, unsigned deadline,
+                                zi_callback callback, void *user)
+{
+    struct zi_pool *pool;
+    struct zi_request *req;
+
+    if (idx == NULL || buf == NULL || offset < 0 || len > (unsigned)INT32_MAX ||
+        prio < 0 || prio >= ZI_PRIO_CLASSES)
+        return NULL;
+    if ((pool = pool_get(idx)) == NULL)
+        return NULL;
+    req = (struct zi_request *) calloc(1, sizeof(struct zi_request));
+    if (req == NULL) {
+        fprintf(stderr,"** ERROR: ziread_async failed to alloc request\n");
+        return NULL;
+    }
+    req->offset = offset;
+    req->len = len;
+    req->buf = (unsigned char *) buf;
+    req->callback = callback;
+    req->user = user;
+    req->state = ZI_REQ_QUEUED;
+    req->prio = prio;
+    req->deadline = deadline ? pool_now() + (uint64_t)deadline * 1000000U : 0;
+    req->cursor = offset;
+
+    pthread_mutex_lock(&pool->lock);
+    req->older = pool->all;
+    if (pool->all != NULL)
+        pool->all->newer = req;
+    pool->all = req;
+    pool_queue(pool, req);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return req;
+}
+
+/* Same as ziread_prio() in class ZI_PRIO_NORMAL, without a deadline. */
+struct zi_request * ziread_async(zindexPtr idx, off_t offset, unsigned len,
+                                 void *buf, zi_callback callback, void *user)
+{
+    return ziread_prio(idx, offset, len, buf, ZI_PRIO_NORMAL, 0, callback,
+                       user);
+}
+
+/* Block until req completes, free it and return its result (bytes read,
+   negative error or ZI_CANCELED).  Its callback will not be called. */
+int zi_wait(zindexPtr idx, struct zi_request *req)
+{
+    struct zi_pool *pool;
+    struct zi_request **link;
+    int result;
+
+    if (idx == NULL || req == NULL || (pool = idx->pool) == NULL)
+        return Z_STREAM_ERROR;
+    pthread_mutex_lock(&pool->lock);
+    while (req->state != ZI_REQ_DONE)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    for (link = &pool->ready; *link != NULL; link = &(*link)->next)
+        if (*link == req) {
+            *link = req->next;
+            break;
+        }
+    result = req->result;
+    pool_free(pool, req);
+    pthread_mutex_unlock(&pool->lock);
+    return result;
+}
+
+/* Call the callbacks of all completed requests, in no particular order, and
+   free them.  Returns the number of callbacks called. */
+int zi_poll(zindexPtr idx)
+{
+    struct zi_pool *pool;
+    struct zi_request *req, *next;
+    int n;
+
+    if (idx == NULL || (pool = idx->pool) == NULL)
+        return 0;
+    pool_clear(pool);
+    pthread_mutex_lock(&pool->lock);
+    req = pool->ready;
+    pool->ready = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (n = 0; req != NULL; req = next, ++n) {
+        next = req->next;
+        req->callback(idx, req, req->result, req->user);
+        pthread_mutex_lock(&pool->lock);
+        pool_free(pool, req);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return n;
+}
+
+/* Cancel req: a queued read completes at once with ZI_CANCELED, a running
+   one stops decoding at its next span.  Returns 0, or 1 if it had already
+   completed. */
+int zi_cancel(zindexPtr idx, struct zi_request *req)
+{
+    struct zi_pool *pool;
+    int ret = 0;
+
+    if (idx == NULL || req == NULL || (pool = idx->pool) == NULL)
+        return Z_STREAM_ERROR;
+    pthread_mutex_lock(&pool->lock);
+    req->cancel = 1;
+    if (req->state == ZI_REQ_QUEUED) {
+        /* no more pieces; done now unless some are running */
+        pool_unlink(pool, req);
+        req->state = ZI_REQ_RUNNING;
+        if (req->running == 0)
+            pool_finish(pool, req, ZI_CANCELED);
+    }
+    else if (req->state == ZI_REQ_DONE)
+        ret = 1;
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+/* File descriptor that is readable while zi_poll() has callbacks to call,
+   starting the workers if needed.  Returns -1 on error. */
+int zi_eventfd(zindexPtr idx)
+{
+    struct zi_pool *pool;
+
+    if (idx == NULL || (pool = pool_get(idx)) == NULL)
+        return -1;
+    return pool->notify[0];
+}
+
+/* Keep the workers of idx from the index and the files until
+   zi_pool_release(): wait for the pieces being decoded, then lock the pool,
+   so that reads queued meanwhile wait too.  Used by zi_refresh(). */
+void zi_pool_hold(zindexPtr idx)
+{
+    struct zi_pool *pool;
+
+    pthread_mutex_lock(&pool_create_lock);
+    if (idx == NULL || (pool = idx->pool) == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->hold = 1;
+    while (pool->pieces != 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+}
+
+/* Let the workers of idx go on after zi_pool_hold(). */
+void zi_pool_release(zindexPtr idx)
+{
+    struct zi_pool *pool;
+
+    if (idx != NULL && (pool = idx->pool) != NULL) {
+        pool->hold = 0;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool_create_lock);
+}
+
+/* Stop the workers of idx, dropping queued and uncollected requests, with or
+   without a callback: their handles are no longer valid. */
+void zi_pool_close(zindexPtr idx)
+{
+    struct zi_pool *pool;
+    struct zi_request *req, *next;
+    int i;
+
+    if (idx == NULL || (pool = idx->pool) == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    for (i = 0; i < ZI_PRIO_CLASSES; ++i)
+        for (req = pool->queue[i]; req != NULL; req = req->next)
+            req->cancel = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthread; ++i)
+        pthread_join(pool->thread[i], NULL);
+
+    for (req = pool->all; req != NULL; req = next) {
+        next = req->older;
+        free(req);
+    }
+    close(pool->notify[0]);
+    if (pool->notify[1] != pool->notify[0])
+        close(pool->notify[1]);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->thread);
+    free(pool);
+    idx->pool = NULL;
+}
@@ -0,0 +1,146 @@
+/* zicache.c -- indexes kept in a cache directory, for read-only data
+ *
+ *  Data on a read-only mount cannot have its index next to it.  zindex -c
+ *  (or zindex on such a file) writes the index to a cache directory instead,
+ *  ZINDEX_INDEX_CACHE, else $XDG_CACHE_HOME/zindex or ~/.cache/zindex, and
+ *  ziopen_auto() looks there when the file has no index of its own.  An
+ *  index there is named after a fingerprint of the content of the file: its
+ *  size and a hash of ZI_PRINT_BLOCK bytes at its head, middle and tail, read
+ *  at open without decompressing anything -- so that copies of a dataset on
+ *  several mirrors share one index, and a file that changed misses.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "zindex.h"
+
+#define local static
+
+/* Set *print to a fingerprint of the content of the file open as f and *size
+   to its length.  Returns Z_OK, Z_ERRNO, or Z_STREAM_ERROR if f is not a
+   regular file (a pipe has nothing to be known by). */
+int zi_fingerprint(FILE *f, uint64_t *print, off_t *size)
+{
+    struct stat st;
+    unsigned char *block;
+    off_t at[3];
+    uint32_t crc, adler;
+    ssize_t got;
+    int i;
+
+    if (fstat(fileno(f), &st) != 0)
+        return Z_ERRNO;
+    if (!S_ISREG(st.st_mode))
+        return Z_STREAM_ERROR;
+    block = malloc(ZI_PRINT_BLOCK);
+    if (block == NULL)
+        return Z_ERRNO;
+    at[0] = 0;
+    at[1] = st.st_size / 2 - ZI_PRINT_BLOCK / 2;
+    at[2] = st.st_size - ZI_PRINT_BLOCK;
+    crc = 0;
+    adler = adler32(0L, Z_NULL, 0);
+    for (i = 0; i < 3; i++) {
+        if (at[i] < 0)
+            at[i] = 0;
+        got = pread(fileno(f), block, ZI_PRINT_BLOCK, at[i]);
+        if (got < 0) {
+            free(block);
+            return Z_ERRNO;
+        }
+        crc = zi_crc32(crc, block, (size_t)got);
+        adler = adler32(adler, block, (uInt)got);
+    }
+    free(block);
+    *print = ((uint64_t)crc << 32) | adler;
+    *size = st.st_size;
+    return Z_OK;
+}
+
+/* Return the index cache directory, allocated, NULL if there is none (or
+   ZINDEX_INDEX_CACHE is set empty to turn it off). */
+local char *cache_dir(void)
+{
+    const char *env, *sub;
+    char *dir;
+
+    sub = "";
+    env = getenv("ZINDEX_INDEX_CACHE");
+    if (env == NULL) {
+        sub = "/zindex";
+        env = getenv("XDG_CACHE_HOME");
+        if (env == NULL || *env != '/') {
+            sub = "/.cache/zindex";
+            env = getenv("HOME");
+        }
+    }
+    if (env == NULL || *env == '\0')
+        return NULL;
+    dir = malloc(strlen(env) + strlen(sub) + 1);
+    if (dir != NULL) {
+        strcpy(dir, env);
+        strcat(dir, sub);
+    }
+    return dir;
+}
+
+/* Make dir and the directories above it that are missing. */
+local int make_dirs(char *dir)
+{
+    char *p;
+
+    for (p = dir + 1; *p != '\0'; p++)
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+                *p = '/';
+                return Z_ERRNO;
+            }
+            *p = '/';
+        }
+    return mkdir(dir, 0777) != 0 && errno != EEXIST ? Z_ERRNO : Z_OK;
+}
+
+/* Set *idxName and *ucsName (allocated) to the names of the index of zPath in
+   the index cache directory, made first if make is true.  Returns Z_OK,
+   Z_ERRNO if zPath or the directory cannot be used, Z_STREAM_ERROR if zPath
+   is not a regular file or there is no cache directory, or Z_MEM_ERROR. */
+int zi_cache_names(const char *zPath, char **idxName, char **ucsName, int make)
+{
+    FILE *f;
+    uint64_t print;
+    off_t size;
+    char *dir;
+    int ret;
+
+    f = fopen(zPath, "rb");
+    if (f == NULL)
+        return Z_ERRNO;
+    ret = zi_fingerprint(f, &print, &size);
+    fclose(f);
+    if (ret != Z_OK)
+        return ret;
+    dir = cache_dir();
+    if (dir == NULL)
+        return Z_STREAM_ERROR;
+    if (make && make_dirs(dir) != Z_OK) {
+        free(dir);
+        return Z_ERRNO;
+    }
+    *idxName = malloc(strlen(dir) + 48);
+    *ucsName = malloc(strlen(dir) + 48);
+    if (*idxName == NULL || *ucsName == NULL) {
+        free(*idxName);
+        free(*ucsName);
+        free(dir);
+        return Z_MEM_ERROR;
+    }
+    sprintf(*idxName, "%s/%016llx-%llx.idx", dir, (unsigned long long)print,
+            (unsigned long long)size);
+    sprintf(*ucsName, "%s.ucs", *idxName);
+    free(dir);
+    return Z_OK;
+}
@@ -0,0 +1,707 @@
+/* zichunk.c -- chunked copies of 4D images, for reading timeseries
+ *
+ *  A NIfTI file holds one volume after the other, so the timeseries of a
+ *  single voxel is spread over every span of the file.  zi_rechunk() writes
+ *  a copy of a 4D image as blocks of voxels (ZI_CHUNK_BLOCK on a side by
+ *  default) by all timepoints, each compressed on its own as a zlib stream,
+ *  several at a time.  In a block the timeseries of a voxel is contiguous,
+ *  voxels in x, y, z order.  The file: the magic "ZICHNK1\n", the x, y, z and
+ *  time dimensions (64 bits each), the bytes of a voxel and the block size
+ *  along x, y and z (32 bits each), the length of the NIfTI header with its
+ *  extensions (64), then that header as it was, then the offset and length
+ *  (64 bits each) of every block, x fastest, then the blocks; little-endian.
+ *
+ *  ziopen_chunks() opens such a file as a handle whose data is the original
+ *  NIfTI stream, rebuilt from the blocks, so that ziread() and znzlib read it
+ *  unchanged -- but a volume needs every block, so whole volumes are better
+ *  read from the .nii.gz, which stays the canonical copy.  zi_series() and
+ *  zi_block() read the timeseries of one voxel or of a box of voxels and
+ *  decode only the blocks they touch; on other handles they fall back to a
+ *  pass over the part of every volume that holds the box.  A handle keeps
+ *  up to CHK_CACHE bytes of decoded blocks.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include "zindex.h"
+
+#define local static
+
+#define CHK_MAGIC "ZICHNK1\n"
+#define CHK_HEAD 64                 /* magic, dimensions, sizes, header */
+#define CHK_CACHE (256L << 20)      /* decoded blocks kept by a handle */
+#define CHK_MEMORY (512L << 20)     /* blocks gathered per pass of rechunk */
+
+/* a block: compressed in the file, decoded in memory while it is cached */
+struct chunk {
+    off_t offset;
+    size_t len;
+    unsigned char *data;            /* decoded, or NULL */
+    unsigned long used;             /* clock of the last read */
+};
+
+/* layout and block cache of a chunked file */
+struct zi_chunks {
+    pthread_mutex_t lock;
+    off_t dim[4];                   /* x, y, z and time */
+    off_t block[3];
+    off_t nblock[3];                /* blocks along x, y and z */
+    int bytes;                      /* of a voxel */
+    off_t voxOffset;                /* length of the header */
+    unsigned char *head;
+    size_t nchunk;
+    struct chunk *chunk;
+    size_t cached;                  /* bytes of decoded blocks */
+    unsigned long clock;
+};
+
+/* Voxels of block k along x, y and z, into n; returns the block size in
+   bytes. */
+local size_t chunk_dims(const struct zi_chunks *zc, size_t k, off_t *n)
+{
+    off_t at[3];
+    int i;
+
+    at[0] = (off_t)k % zc->nblock[0];
+    at[1] = (off_t)k / zc->nblock[0] % zc->nblock[1];
+    at[2] = (off_t)k / zc->nblock[0] / zc->nblock[1];
+    for (i = 0; i < 3; ++i) {
+        n[i] = zc->dim[i] - at[i] * zc->block[i];
+        if (n[i] > zc->block[i])
+            n[i] = zc->block[i];
+    }
+    return (size_t)(n[0] * n[1] * n[2] * zc->dim[3] * zc->bytes);
+}
+
+/* Return the block holding voxel (x, y, z), with in *from the offset of its
+   timeseries in the block and in *run the voxels from it to the end of its
+   row in the block. */
+local size_t chunk_at(const struct zi_chunks *zc, off_t x, off_t y, off_t z,
+                      size_t *from, off_t *run)
+{
+    off_t n[3];
+    size_t k;
+
+    k = (size_t)(((z / zc->block[2]) * zc->nblock[1] + y / zc->block[1]) *
+                 zc->nblock[0] + x / zc->block[0]);
+    chunk_dims(zc, k, n);
+    x %= zc->block[0];
+    y %= zc->block[1];
+    z %= zc->block[2];
+    *from = (size_t)(((z * n[1] + y) * n[0] + x) * zc->dim[3] * zc->bytes);
+    *run = n[0] - x;
+    return k;
+}
+
+/* Drop the blocks read longest ago until need more bytes fit in the cache. */
+local void chunk_evict(struct zi_chunks *zc, size_t need)
+{
+    struct chunk *old;
+    off_t n[3];
+    size_t k;
+
+    while (zc->cached > 0 && zc->cached + need > CHK_CACHE) {
+        old = NULL;
+        for (k = 0; k < zc->nchunk; ++k)
+            if (zc->chunk[k].data != NULL &&
+                (old == NULL || zc->chunk[k].used < old->used))
+                old = zc->chunk + k;
+        zc->cached -= chunk_dims(zc, (size_t)(old - zc->chunk), n);
+        free(old->data);
+        old->data = NULL;
+    }
+}
+
+/* Copy count pieces of size bytes, stride bytes apart from offset from of
+   block k, to dst one after the other, decoding the block if it is not in
+   the cache.  Returns Z_OK or an error. */
+local int chunk_gather(zindexPtr idx, size_t k, size_t from, size_t size,
+                       size_t stride, size_t count, unsigned char *dst)
+{
+    struct zi_chunks *zc = idx->chunks;
+    struct chunk *c = zc->chunk + k;
+    unsigned char *comp, *data;
+    uLongf got;
+    off_t n[3];
+    size_t raw, i;
+    int ret;
+
+    pthread_mutex_lock(&zc->lock);
+    if (c->data == NULL) {
+        /* decode without holding the lock, another read may do the same */
+        pthread_mutex_unlock(&zc->lock);
+        raw = chunk_dims(zc, k, n);
+        comp = malloc(c->len);
+        data = malloc(raw);
+        ret = comp == NULL || data == NULL ? Z_MEM_ERROR : Z_OK;
+        if (ret == Z_OK && pread(fileno(idx->zFile), comp, c->len, c->offset) !=
+                           (ssize_t)c->len)
+            ret = Z_ERRNO;
+        got = (uLongf)raw;
+        if (ret == Z_OK && (uncompress(data, &got, comp, (uLong)c->len) != Z_OK ||
+                            got != raw))
+            ret = Z_DATA_ERROR;
+        free(comp);
+        if (ret != Z_OK) {
+            free(data);
+            return ret;
+        }
+        pthread_mutex_lock(&zc->lock);
+        if (c->data == NULL) {
+            chunk_evict(zc, raw);
+            c->data = data;
+            zc->cached += raw;
+        }
+        else
+            free(data);
+    }
+    c->used = ++zc->clock;
+    for (i = 0; i < count; ++i)
+        memcpy(dst + i * size, c->data + from + i * stride, size);
+    pthread_mutex_unlock(&zc->lock);
+    return Z_OK;
+}
+
+/* Rebuild len bytes of the NIfTI stream at offset from the blocks.  Returns
+   the number of bytes copied to buf, or negative on error. */
+int chunks_extract(zindexPtr idx, off_t offset, unsigned char *buf, int len,
+                   const volatile int *cancel)
+{
+    struct zi_chunks *zc = idx->chunks;
+    unsigned char part[32];
+    off_t end, pos, v, t, nvox, run;
+    size_t k, from, skip, n;
+    int b = zc->bytes, ret;
+
+    end = idx->data->idx_list[idx->data->have - 1].out;
+    if (offset + len < end)
+        end = offset + len;
+    nvox = zc->dim[0] * zc->dim[1] * zc->dim[2];
+    for (pos = offset; pos < end; pos += (off_t)n) {
+        if (cancel != NULL && *cancel)
+            return ZI_CANCELED;
+        if (pos < zc->voxOffset) {
+            n = (size_t)((end < zc->voxOffset ? end : zc->voxOffset) - pos);
+            memcpy(buf + (pos - offset), zc->head + pos, n);
+            continue;
+        }
+        v = (pos - zc->voxOffset) / b;
+        skip = (size_t)((pos - zc->voxOffset) % b);
+        t = v / nvox;
+        v %= nvox;
+        k = chunk_at(zc, v % zc->dim[0], v / zc->dim[0] % zc->dim[1],
+                     v / zc->dim[0] / zc->dim[1], &from, &run);
+        from += (size_t)(t * b);
+        if (skip || end - pos < b) {        /* part of a voxel */
+            ret = chunk_gather(idx, k, from, (size_t)b, 0, 1, part);
+            n = (size_t)b - skip;
+            if ((off_t)n > end - pos)
+                n = (size_t)(end - pos);
+            memcpy(buf + (pos - offset), part + skip, n);
+        }
+        else {                              /* voxels to the end of the row */
+            if (run > (end - pos) / b)
+                run = (end - pos) / b;
+            ret = chunk_gather(idx, k, from, (size_t)b,
+                               (size_t)(zc->dim[3] * b), (size_t)run,
+                               buf + (pos - offset));
+            n = (size_t)(run * b);
+        }
+        if (ret != Z_OK)
+            return ret;
+    }
+    return (int)(end > offset ? end - offset : 0);
+}
+
+/* Open the chunked file zPath, NULL if it is not one. */
+zindexPtr ziopen_chunks(const char *zPath, const char *mode)
+{
+    zindexPtr idx;
+    struct zi_chunks *zc;
+    struct access *index;
+    unsigned char head[CHK_HEAD], *table;
+    off_t volume, t, pos;
+    size_t k;
+    int i;
+
+    if (!mode || !strlen(mode) || mode[0]!='r')
+        return NULL; /* writing is not yet supported */
+
+    idx = (zindexPtr) calloc(1,sizeof(struct zindex));
+    if (idx == NULL) {
+        fprintf(stderr,"** ERROR: ziopen failed to alloc zindex\n");
+        return NULL;
+    }
+    if ((idx->zFile = fopen(zPath, mode)) == NULL) {
+        free(idx);
+        return NULL;
+    }
+    /* Give no error message for other files, fall back automatically. */
+    if (pread(fileno(idx->zFile), head, CHK_HEAD, 0) != CHK_HEAD ||
+        memcmp(head, CHK_MAGIC, 8) != 0) {
+        fclose(idx->zFile);
+        free(idx);
+        return NULL;
+    }
+    zc = (struct zi_chunks *) calloc(1, sizeof(struct zi_chunks));
+    if (zc == NULL) {
+        fclose(idx->zFile);
+        free(idx);
+        fprintf(stderr,"** ERROR: ziopen failed to alloc chunks of %s\n", zPath);
+        return NULL;
+    }
+    idx->chunks = zc;
+    pthread_mutex_init(&zc->lock, NULL);
+    zc->nchunk = 1;
+    for (i = 0; i < 4; ++i)
+        zc->dim[i] = (off_t)zi_get_le(head + 8 + 8 * i, 8);
+    zc->bytes = (int)zi_get_le(head + 40, 4);
+    for (i = 0; i < 3; ++i) {
+        zc->block[i] = (off_t)zi_get_le(head + 44 + 4 * i, 4);
+        if (zc->dim[i] < 1 || zc->block[i] < 1)
+            goto chunks_fail;
+        zc->nblock[i] = (zc->dim[i] + zc->block[i] - 1) / zc->block[i];
+        zc->nchunk *= (size_t)zc->nblock[i];
+    }
+    zc->voxOffset = (off_t)zi_get_le(head + 56, 8);
+    if (zc->dim[3] < 1 || zc->bytes < 1 || zc->bytes > 32 || zc->voxOffset < 348)
+        goto chunks_fail;
+    zc->head = (unsigned char *) malloc((size_t)zc->voxOffset);
+    table = (unsigned char *) malloc(16 * zc->nchunk);
+    zc->chunk = (struct chunk *) calloc(zc->nchunk, sizeof(struct chunk));
+    if (zc->head == NULL || table == NULL || zc->chunk == NULL) {
+        free(table);
+        goto chunks_fail;
+    }
+    pos = CHK_HEAD;
+    if (pread(fileno(idx->zFile), zc->head, (size_t)zc->voxOffset, pos) != zc->voxOffset ||
+        pread(fileno(idx->zFile), table, 16 * zc->nchunk, pos + zc->voxOffset) !=
+        (ssize_t)(16 * zc->nchunk)) {
+        free(table);
+        goto chunks_fail;
+    }
+    for (k = 0; k < zc->nchunk; ++k) {
+        zc->chunk[k].offset = (off_t)zi_get_le(table + 16 * k, 8);
+        zc->chunk[k].len = (size_t)zi_get_le(table + 16 * k + 8, 8);
+    }
+    free(table);
+
+    /* access points at the header and every volume, none needs a window */
+    volume = zc->dim[0] * zc->dim[1] * zc->dim[2] * zc->bytes;
+    index = index_point(NULL, 0, 0, 0, -1);
+    for (t = 0; index != NULL && t <= zc->dim[3]; ++t)
+        index = index_point(index, 0, 0, zc->voxOffset + t * volume, -1);
+    if (index == NULL || (idx->io = ziio_open(ZI_IO_DEPTH)) == NULL) {
+        free_index(index);
+        goto chunks_fail;
+    }
+    index->flags |= ZI_CHUNKED;
+    idx->data = index;
+    idx->pos = 0;
+    idx->end = index->idx_list[index->have-1].out; /*last index entry is eof*/
+    return idx;
+
+chunks_fail:
+    fprintf(stderr,"** ERROR: ziopen could not load the chunks of %s\n", zPath);
+    chunks_close(idx);
+    fclose(idx->zFile);
+    free(idx);
+    return NULL;
+}
+
+/* Free the blocks and layout of idx. */
+void chunks_close(zindexPtr idx)
+{
+    struct zi_chunks *zc = idx->chunks;
+    size_t k;
+
+    if (zc == NULL)
+        return;
+    for (k = 0; zc->chunk != NULL && k < zc->nchunk; ++k)
+        free(zc->chunk[k].data);
+    free(zc->chunk);
+    free(zc->head);
+    pthread_mutex_destroy(&zc->lock);
+    free(zc);
+    idx->chunks = NULL;
+}
+
+/* Header of the NIfTI image of idx into nii, with the voxel size in
+   nii->bytes whatever the datatype.  Returns Z_OK, or Z_DATA_ERROR if the
+   data is not a NIfTI image with whole-byte voxels. */
+local int series_header(zindexPtr idx, struct zi_nifti *nii)
+{
+    unsigned char head[540];
+    off_t nvox;
+    int got;
+
+    got = zi_extract(idx, idx->io, 0, head, (int)sizeof(head), NULL);
+    if (got < 0)
+        return got;
+    if (!zi_nifti_header(head, (size_t)got, nii) || nii->datatype == 1)
+        return Z_DATA_ERROR;
+    nvox = nii->dim[0] * nii->dim[1] * nii->dim[2];
+    if (nii->volume % nvox != 0)
+        return Z_DATA_ERROR;
+    nii->bytes = (int)(nii->volume / nvox);
+    return Z_OK;
+}
+
+/* where the fallback of zi_block() puts the pieces of a volume */
+struct block_sink {
+    unsigned char *out;
+    const off_t *origin, *size;
+    const off_t *dim;
+    int bytes;
+    off_t series;                   /* bytes of one timeseries */
+    off_t t;                        /* volume being read */
+    off_t pos;                      /* its byte the next piece starts at */
+};
+
+/* Copy the bytes of the n at p that are in the box to their timeseries. */
+local int block_put(const unsigned char *p, size_t n, void *user)
+{
+    struct block_sink *bs = user;
+    const off_t *o = bs->origin, *s = bs->size;
+    off_t v, x, y, z, m, i;
+    int j;
+
+    while (n > 0) {
+        v = bs->pos / bs->bytes;
+        j = (int)(bs->pos % bs->bytes);
+        x = v % bs->dim[0];
+        y = v / bs->dim[0] % bs->dim[1];
+        z = v / bs->dim[0] / bs->dim[1];
+        m = (bs->dim[0] - x) * bs->bytes - j;   /* to the end of the row */
+        if (m > (off_t)n)
+            m = (off_t)n;
+        if (y >= o[1] && y < o[1] + s[1] && z >= o[2] && z < o[2] + s[2])
+            for (i = 0; i < m; ++i) {
+                if (x >= o[0] && x < o[0] + s[0])
+                    bs->out[(((z - o[2]) * s[1] + y - o[1]) * s[0] + x - o[0]) *
+                            bs->series + bs->t * bs->bytes + j] = p[i];
+                if (++j == bs->bytes) {
+                    j = 0;
+                    x++;
+                }
+            }
+        bs->pos += m;
+        p += m;
+        n -= (size_t)m;
+    }
+    return 0;
+}
+
+/* Read the timeseries of the voxels of a box of idx: size[0] x size[1] x
+   size[2] voxels from (origin[0], origin[1], origin[2]).  buf receives, for
+   every voxel of the box in x, y, z order, its value at every timepoint, as
+   stored in the file.  Only the blocks of the box are decoded if idx is a
+   chunked file (zindex rechunk), otherwise the part of every volume from the
+   first voxel of the box to the last is decoded in turn.
+   Returns the number of bytes read, or negative on error: Z_STREAM_ERROR if
+   the box is not inside the image, Z_DATA_ERROR if it is not a NIfTI image. */
+long zi_block(zindexPtr idx, const off_t *origin, const off_t *size, void *buf)
+{
+    struct zi_chunks *zc;
+    struct zi_nifti nii;
+    struct block_sink bs;
+    unsigned char *out = buf, *row;
+    off_t x, y, z, t, run, nt, vsize, first, last, got;
+    size_t k, from;
+    int b, i, ret;
+
+    if (idx == NULL || origin == NULL || size == NULL || buf == NULL)
+        return Z_STREAM_ERROR;
+    zc = idx->chunks;
+    if (zc != NULL) {
+        nii.dim[0] = zc->dim[0];
+        nii.dim[1] = zc->dim[1];
+        nii.dim[2] = zc->dim[2];
+        nii.volumes = zc->dim[3];
+        nii.bytes = zc->bytes;
+        nii.vox_offset = zc->voxOffset;
+        nii.volume = zc->dim[0] * zc->dim[1] * zc->dim[2] * zc->bytes;
+    }
+    else if ((ret = series_header(idx, &nii)) != Z_OK)
+        return ret;
+    for (i = 0; i < 3; ++i)
+        if (origin[i] < 0 || size[i] < 1 || origin[i] + size[i] > nii.dim[i])
+            return Z_STREAM_ERROR;
+    b = nii.bytes;
+    nt = nii.volumes;
+    vsize = nt * b;                         /* one timeseries */
+
+    if (zc != NULL) {
+        /* a run of voxels along x at a time, each within one block */
+        for (z = 0; z < size[2]; ++z)
+            for (y = 0; y < size[1]; ++y)
+                for (x = 0; x < size[0]; x += run) {
+                    k = chunk_at(zc, origin[0] + x, origin[1] + y, origin[2] + z,
+                                 &from, &run);
+                    if (run > size[0] - x)
+                        run = size[0] - x;
+                    ret = chunk_gather(idx, k, from, (size_t)(run * vsize), 0, 1,
+                                       out + ((z * size[1] + y) * size[0] + x) * vsize);
+                    if (ret != Z_OK)
+                        return ret;
+                }
+        return (long)(size[0] * size[1] * size[2] * vsize);
+    }
+
+    /* volume after volume, decoding the part that holds the box */
+    row = (unsigned char *) malloc(ZI_REDUCE_CHUNK);
+    if (row == NULL)
+        return Z_MEM_ERROR;
+    bs.out = out;
+    bs.origin = origin;
+    bs.size = size;
+    bs.dim = nii.dim;
+    bs.bytes = b;
+    bs.series = vsize;
+    first = ((origin[2] * nii.dim[1] + origin[1]) * nii.dim[0] + origin[0]) * b;
+    last = (((origin[2] + size[2] - 1) * nii.dim[1] + origin[1] + size[1] - 1) *
+            nii.dim[0] + origin[0] + size[0]) * b;
+    for (t = 0; t < nt; ++t) {
+        bs.t = t;
+        bs.pos = first;
+        got = zi_extract_each(idx, idx->io, nii.vox_offset + t * nii.volume + first,
+                              last - first, row, (int)ZI_REDUCE_CHUNK, block_put,
+                              &bs, NULL);
+        if (got != last - first) {
+            free(row);
+            return got < 0 ? (long)got : Z_DATA_ERROR;
+        }
+    }
+    free(row);
+    return (long)(size[0] * size[1] * size[2] * vsize);
+}
+
+/* Read the timeseries of voxel (x, y, z) of idx into buf, as zi_block() does
+   for a box of one voxel. */
+long zi_series(zindexPtr idx, off_t x, off_t y, off_t z, void *buf)
+{
+    off_t origin[3], size[3];
+
+    origin[0] = x;
+    origin[1] = y;
+    origin[2] = z;
+    size[0] = size[1] = size[2] = 1;
+    return zi_block(idx, origin, size, buf);
+}
+
+/* shared state of the compressing threads of one pass */
+struct rechunk_job {
+    unsigned char *raw;             /* the blocks of the pass, decoded */
+    size_t *at;                     /* offset of each in raw, and the end */
+    unsigned char **comp;           /* compressed */
+    uLongf *clen;
+    size_t n;
+    int level;
+    pthread_mutex_t lock;
+    size_t next;                    /* next block to hand out */
+    int ret;                        /* first error */
+};
+
+local void *rechunk_worker(void *arg)
+{
+    struct rechunk_job *job = arg;
+    size_t k, len;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        k = job->next++;
+        ret = job->ret;
+        pthread_mutex_unlock(&job->lock);
+        if (k >= job->n || ret != Z_OK)
+            break;
+        len = job->at[k + 1] - job->at[k];
+        job->clen[k] = compressBound((uLong)len);
+        job->comp[k] = malloc(job->clen[k]);
+        ret = job->comp[k] == NULL ? Z_MEM_ERROR :
+              compress2(job->comp[k], job->clen + k, job->raw + job->at[k],
+                        (uLong)len, job->level);
+        if (ret != Z_OK) {
+            pthread_mutex_lock(&job->lock);
+            if (job->ret == Z_OK)
+                job->ret = ret;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return NULL;
+}
+
+/* Write the 4D NIfTI image read from in to out in the chunked layout, in
+   blocks of block voxels on a side (0 for ZI_CHUNK_BLOCK) by all timepoints,
+   compressed at level on nthread threads (0 for one per processor).  in is
+   read once for every CHK_MEMORY bytes of image, and out has to be
+   seekable.  Returns the number of blocks written, Z_DATA_ERROR if in is not
+   a NIfTI image with whole-byte voxels, or another error. */
+long zi_rechunk(gzFile in, FILE *out, int block, int nthread, int level)
+{
+    struct zi_chunks zc;
+    struct rechunk_job job;
+    pthread_t *thread;
+    struct zi_nifti nii;
+    unsigned char head[CHK_HEAD], *table, *slice, *src;
+    off_t n[3], slab, nvox, x, y, z, t, z0, z1, pos, lx;
+    size_t k, k0, k1, kk, from;
+    long got;
+    int i, b, ret;
+
+    if (in == NULL || out == NULL)
+        return Z_STREAM_ERROR;
+    if (block <= 0)
+        block = ZI_CHUNK_BLOCK;
+    if (nthread <= 0)
+        nthread = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthread <= 0)
+        nthread = 1;
+
+    /* the header, kept as it is with its extensions */
+    memset(&zc, 0, sizeof(zc));
+    zc.head = malloc(540);
+    if (zc.head == NULL)
+        return Z_MEM_ERROR;
+    got = gzread(in, zc.head, 540);
+    if (got < 0 || !zi_nifti_header(zc.head, (size_t)got, &nii) ||
+        nii.datatype == 1 || nii.volume % (nii.dim[0] * nii.dim[1] * nii.dim[2])) {
+        free(zc.head);
+        return Z_DATA_ERROR;
+    }
+    nvox = nii.dim[0] * nii.dim[1] * nii.dim[2];
+    zc.voxOffset = nii.vox_offset;
+    zc.bytes = b = (int)(nii.volume / nvox);
+    zc.nchunk = 1;
+    for (i = 0; i < 3; ++i) {
+        zc.dim[i] = nii.dim[i];
+        zc.block[i] = block < nii.dim[i] ? block : nii.dim[i];
+        zc.nblock[i] = (zc.dim[i] + zc.block[i] - 1) / zc.block[i];
+        zc.nchunk *= (size_t)zc.nblock[i];
+    }
+    zc.dim[3] = nii.volumes;
+    slice = NULL;
+    table = NULL;
+    thread = NULL;
+    ret = Z_OK;
+    if (zc.voxOffset > 540) {
+        src = realloc(zc.head, (size_t)zc.voxOffset);
+        if (src == NULL)
+            ret = Z_MEM_ERROR;
+        else {
+            zc.head = src;
+            if (gzread(in, zc.head + got, (unsigned)(zc.voxOffset - got)) !=
+                zc.voxOffset - got)
+                ret = Z_DATA_ERROR;
+        }
+    }
+
+    /* file header, NIfTI header, and room for the table */
+    memcpy(head, CHK_MAGIC, 8);
+    for (i = 0; i < 4; ++i)
+        zi_put_le(head + 8 + 8 * i, (uint64_t)zc.dim[i], 8);
+    zi_put_le(head + 40, (uint64_t)b, 4);
+    for (i = 0; i < 3; ++i)
+        zi_put_le(head + 44 + 4 * i, (uint64_t)zc.block[i], 4);
+    zi_put_le(head + 56, (uint64_t)zc.voxOffset, 8);
+    table = calloc(zc.nchunk, 16);
+    if (ret == Z_OK && table == NULL)
+        ret = Z_MEM_ERROR;
+    if (ret == Z_OK &&
+        (fwrite(head, CHK_HEAD, 1u, out) != 1u ||
+         fwrite(zc.head, (size_t)zc.voxOffset, 1u, out) != 1u ||
+         fwrite(table, 16, zc.nchunk, out) != zc.nchunk))
+        ret = Z_ERRNO;
+    pos = CHK_HEAD + zc.voxOffset + 16 * (off_t)zc.nchunk;
+
+    /* passes over as many rows of blocks along z as fit in CHK_MEMORY */
+    memset(&job, 0, sizeof(job));
+    job.level = level;
+    slab = zc.dim[0] * zc.dim[1] * zc.block[2] * zc.dim[3] * b;
+    slice = malloc((size_t)(zc.dim[0] * zc.dim[1] * b));
+    thread = calloc((size_t)nthread, sizeof(pthread_t));
+    k = (size_t)(zc.nblock[0] * zc.nblock[1]);     /* blocks per row along z */
+    job.at = malloc(sizeof(size_t) * (k * (size_t)(CHK_MEMORY / slab + 1) + 1));
+    job.comp = calloc(k * (size_t)(CHK_MEMORY / slab + 1), sizeof(unsigned char *));
+    job.clen = malloc(sizeof(uLongf) * k * (size_t)(CHK_MEMORY / slab + 1));
+    if (ret == Z_OK && (slice == NULL || thread == NULL || job.at == NULL ||
+                        job.comp == NULL || job.clen == NULL))
+        ret = Z_MEM_ERROR;
+    pthread_mutex_init(&job.lock, NULL);
+    for (z0 = 0; ret == Z_OK && z0 < zc.dim[2]; z0 = z1) {
+        z1 = z0 + (CHK_MEMORY / slab > 1 ? CHK_MEMORY / slab : 1) * zc.block[2];
+        if (z1 > zc.dim[2])
+            z1 = zc.dim[2];
+        k0 = (size_t)(z0 / zc.block[2]) * k;
+        k1 = (size_t)((z1 + zc.block[2] - 1) / zc.block[2]) * k;
+        job.n = k1 - k0;
+        job.at[0] = 0;
+        for (kk = 0; kk < job.n; ++kk)
+            job.at[kk + 1] = job.at[kk] + chunk_dims(&zc, k0 + kk, n);
+        job.raw = malloc(job.at[job.n]);
+        if (job.raw == NULL) {
+            ret = Z_MEM_ERROR;
+            break;
+        }
+
+        /* the slices z0..z1 of every volume, each voxel to its block */
+        for (t = 0; ret == Z_OK && t < zc.dim[3]; ++t)
+            for (z = z0; z < z1; ++z) {
+                if (gzseek(in, zc.voxOffset + t * nii.volume + z * zc.dim[0] *
+                           zc.dim[1] * b, SEEK_SET) < 0 ||
+                    gzread(in, slice, (unsigned)(zc.dim[0] * zc.dim[1] * b)) !=
+                    zc.dim[0] * zc.dim[1] * b) {
+                    ret = Z_DATA_ERROR;
+                    break;
+                }
+                src = slice;
+                for (y = 0; y < zc.dim[1]; ++y)
+                    for (x = 0; x < zc.dim[0]; x += lx) {
+                        kk = chunk_at(&zc, x, y, z, &from, &lx) - k0;
+                        from += job.at[kk] + (size_t)(t * b);
+                        for (i = 0; i < lx; ++i, src += b, from += (size_t)(zc.dim[3] * b))
+                            memcpy(job.raw + from, src, (size_t)b);
+                    }
+            }
+
+        /* compress the blocks in parallel, then write them in order */
+        job.next = 0;
+        job.ret = ret;
+        for (i = 0; i < nthread; ++i)
+            if (pthread_create(thread + i, NULL, rechunk_worker, &job) != 0)
+                break;
+        if (i == 0)
+            rechunk_worker(&job);
+        while (i-- > 0)
+            pthread_join(thread[i], NULL);
+        ret = job.ret;
+        for (kk = 0; kk < job.n; ++kk) {
+            if (ret == Z_OK && fwrite(job.comp[kk], 1, job.clen[kk], out) != job.clen[kk])
+                ret = Z_ERRNO;
+            zi_put_le(table + 16 * (k0 + kk), (uint64_t)pos, 8);
+            zi_put_le(table + 16 * (k0 + kk) + 8, (uint64_t)job.clen[kk], 8);
+            pos += (off_t)job.clen[kk];
+            free(job.comp[kk]);
+            job.comp[kk] = NULL;
+        }
+        free(job.raw);
+        job.raw = NULL;
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    /* now the table can be filled in */
+    if (ret == Z_OK &&
+        (fseeko(out, CHK_HEAD + zc.voxOffset, SEEK_SET) != 0 ||
+         fwrite(table, 16, zc.nchunk, out) != zc.nchunk || fflush(out) != 0))
+        ret = Z_ERRNO;
+    free(job.at);
+    free(job.comp);
+    free(job.clen);
+    free(thread);
+    free(slice);
+    free(table);
+    free(zc.head);
+    return ret == Z_OK ? (long)zc.nchunk : ret;
+}
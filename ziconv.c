@@ -0,0 +1,408 @@
+/* ziconv.c -- indexes of other gzip random access tools
+ *
+ *  bgzip .gzi: a 64-bit count, then the compressed and uncompressed offset of
+ *  the start of every BGZF block but the first (64 bits each, little-endian).
+ *  The blocks are independent gzip members, so their starts need no window.
+ *
+ *  indexed_gzip .gzidx (version 0 and 1, also written by its zran-based
+ *  tools): "GZIDX", version, flags, compressed and uncompressed size (64
+ *  bits), point spacing and window size (32), number of points (32), then per
+ *  point the compressed offset, uncompressed offset (64), bits (8) and, from
+ *  version 1, a flag (8) telling whether it has a window; then the windows of
+ *  the points having one, in order.  Integers are little-endian.  Access
+ *  points have the same meaning as ours.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include "zindex.h"
+
+#define local static
+
+#define GZIDX_HEAD 35       /* id, version, flags, sizes, spacing, npoints */
+#define GZI_ENTRIES 4096    /* .gzi entries read or written at a time */
+
+/* Parse the gzip member header at pos in fd: return the offset of its deflate
+   data, or -1 if there is no data member there (end of file, something
+   else, an embedded index).  If bsize is not NULL it is set to the size of
+   the whole member from its BGZF extra field, 0 if it has none. */
+local off_t member_start(int fd, off_t pos, off_t *bsize)
+{
+    unsigned char head[1024];
+    ssize_t got;
+    size_t n, xlen, k;
+
+    got = pread(fd, head, sizeof(head), pos);
+    if (got < 10 || head[0] != 0x1f || head[1] != 0x8b || head[2] != 8)
+        return -1;
+    n = 10;
+    if (bsize != NULL)
+        *bsize = 0;
+    if (head[3] & 4) {
+        if ((size_t)got < 12)
+            return -1;
+        xlen = (size_t)zi_get_le(head + 10, 2);
+        if ((size_t)got < 12 + xlen)
+            return -1;
+        for (k = 12; k + 4 <= 12 + xlen; k += 4 + zi_get_le(head + k + 2, 2)) {
+            if (head[k] == 'Z' && (head[k + 1] == 'W' || head[k + 1] == 'X' ||
+                                   head[k + 1] == 'L'))
+                return -1;
+            if (bsize != NULL && head[k] == 'B' && head[k + 1] == 'C' &&
+                zi_get_le(head + k + 2, 2) == 2)
+                *bsize = (off_t)zi_get_le(head + k + 4, 2) + 1;
+        }
+        n = 12 + xlen;
+    }
+    if (head[3] & 8) {                  /* file name */
+        while (n < (size_t)got && head[n] != 0)
+            n++;
+        n++;
+    }
+    if (head[3] & 16) {                 /* comment */
+        while (n < (size_t)got && head[n] != 0)
+            n++;
+        n++;
+    }
+    if (head[3] & 2)                    /* header CRC */
+        n += 2;
+    if (n > (size_t)got)
+        return -1;                      /* longer than we care for */
+    return pos + (off_t)n;
+}
+
+/* Walk the BGZF blocks of fd from in, uncompressed offset out, to the end of
+   the data, reading only their headers and sizes.  Each start of a block
+   that is not empty is passed to entry, if not NULL, and the end of the data and its uncompressed size
+   are left in *in and *out.  Returns Z_OK, or Z_DATA_ERROR if a member is not
+   a BGZF block. */
+local int bgzf_walk(int fd, off_t *in, off_t *out,
+                    int (*entry)(void *, off_t, off_t), void *user)
+{
+    off_t bsize;
+    unsigned char isize[4];
+
+    while (member_start(fd, *in, &bsize) >= 0) {
+        if (bsize < 28 ||
+            pread(fd, isize, 4, *in + bsize - 4) != 4)
+            return Z_DATA_ERROR;
+        if (entry != NULL && zi_get_le(isize, 4) != 0 &&
+            entry(user, *in, *out) != Z_OK)
+            return Z_ERRNO;
+        *in += bsize;
+        *out += (off_t)zi_get_le(isize, 4);
+    }
+    return Z_OK;
+}
+
+/* Load a bgzip .gzi index of the BGZF file zFile, keeping block starts about
+   span bytes of uncompressed data apart as access points.  None needs a
+   window: ucs_offset of the index is all -1.  Returns the number of access
+   points, or negative on error. */
+int read_index_gzi(FILE *gziFile, FILE *zFile, off_t span,
+                   struct access **built)
+{
+    unsigned char buf[16 * GZI_ENTRIES];
+    uint64_t count, i;
+    size_t n, k;
+    off_t in, out, last, start;
+    struct access *index;
+    int fd, ret;
+
+    if (gziFile == NULL || zFile == NULL || span < 0)
+        return Z_STREAM_ERROR;
+    fd = fileno(zFile);
+    if (fread(buf, 8, 1u, gziFile) != 1u)
+        return Z_DATA_ERROR;
+    count = zi_get_le(buf, 8);
+
+    /* the first block has no entry */
+    start = member_start(fd, 0, NULL);
+    if (start < 0)
+        return Z_DATA_ERROR;
+    index = index_point(NULL, 0, start, 0, -1);
+    if (index == NULL)
+        return Z_MEM_ERROR;
+    in = out = last = 0;
+    ret = Z_OK;
+    for (i = 0; i < count && ret == Z_OK; i += n) {
+        n = count - i < GZI_ENTRIES ? (size_t)(count - i) : GZI_ENTRIES;
+        if (fread(buf, 16, n, gziFile) != n) {
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        for (k = 0; k < n; ++k) {
+            in = (off_t)zi_get_le(buf + 16 * k, 8);
+            out = (off_t)zi_get_le(buf + 16 * k + 8, 8);
+            if (out - last <= span)
+                continue;
+            start = member_start(fd, in, NULL);
+            if (start < 0) {
+                ret = Z_DATA_ERROR;
+                break;
+            }
+            index = index_point(index, 0, start, out, -1);
+            if (index == NULL)
+                return Z_MEM_ERROR;
+            last = out;
+        }
+    }
+
+    /* the blocks after the last entry give the end of the data */
+    if (ret == Z_OK)
+        ret = bgzf_walk(fd, &in, &out, NULL, NULL);
+    if (ret == Z_OK && out < index->idx_list[index->have - 1].out)
+        ret = Z_DATA_ERROR;
+    if (ret != Z_OK) {
+        free_index(index);
+        return ret;
+    }
+    index = index_point(index, 0, in, out, -1);
+    if (index == NULL)
+        return Z_MEM_ERROR;
+    *built = index;
+    return (int)index->have;
+}
+
+/* .gzi entries collected while walking the blocks */
+struct gzi_list {
+    FILE *gziFile;
+    unsigned char buf[16 * GZI_ENTRIES];
+    size_t n;
+    uint64_t count;
+};
+
+local int gzi_flush(struct gzi_list *list)
+{
+    if (list->n && fwrite(list->buf, 16, list->n, list->gziFile) != list->n)
+        return Z_ERRNO;
+    list->n = 0;
+    return Z_OK;
+}
+
+local int gzi_entry(void *user, off_t in, off_t out)
+{
+    struct gzi_list *list = user;
+
+    if (in == 0)
+        return Z_OK;
+    zi_put_le(list->buf + 16 * list->n, (uint64_t)in, 8);
+    zi_put_le(list->buf + 16 * list->n + 8, (uint64_t)out, 8);
+    list->count++;
+    if (++list->n == GZI_ENTRIES)
+        return gzi_flush(list);
+    return Z_OK;
+}
+
+/* Write the bgzip .gzi index of the BGZF file zFile to gziFile, from the
+   block headers alone.  gziFile must be seekable.  Returns the number of
+   entries, or negative on error (Z_DATA_ERROR if zFile is not BGZF). */
+int write_index_gzi(FILE *zFile, FILE *gziFile)
+{
+    struct gzi_list *list;
+    off_t in, out, bsize;
+    unsigned char head[8];
+    int ret;
+
+    if (zFile == NULL || gziFile == NULL)
+        return Z_STREAM_ERROR;
+    if (member_start(fileno(zFile), 0, &bsize) < 0 || bsize == 0)
+        return Z_DATA_ERROR;
+    list = malloc(sizeof(struct gzi_list));
+    if (list == NULL)
+        return Z_MEM_ERROR;
+    list->gziFile = gziFile;
+    list->n = 0;
+    list->count = 0;
+    in = out = 0;
+    memset(head, 0, 8);
+    ret = fwrite(head, 8, 1u, gziFile) == 1u ? Z_OK : Z_ERRNO;
+    if (ret == Z_OK)
+        ret = bgzf_walk(fileno(zFile), &in, &out, gzi_entry, list);
+    if (ret == Z_OK)
+        ret = gzi_flush(list);
+    if (ret == Z_OK) {
+        zi_put_le(head, list->count, 8);
+        if (fseeko(gziFile, 0, SEEK_SET) != 0 ||
+            fwrite(head, 8, 1u, gziFile) != 1u || fflush(gziFile) != 0)
+            ret = Z_ERRNO;
+    }
+    if (ret == Z_OK)
+        ret = (int)list->count;
+    free(list);
+    return ret;
+}
+
+/* Load an indexed_gzip index.  Its windows stay in gzidxFile, at the
+   ucs_offset of each point.  Only 32K windows are supported.  Returns the
+   number of access points, or negative on error. */
+int read_index_gzidx(FILE *gzidxFile, struct access **built)
+{
+    unsigned char head[GZIDX_HEAD], rec[18];
+    uint32_t npoints, k;
+    unsigned version, size;
+    off_t base, window, zSize, uSize;
+    struct access *index;
+    int data;
+
+    if (gzidxFile == NULL)
+        return Z_STREAM_ERROR;
+    base = ftello(gzidxFile);
+    if (base < 0 || fread(head, GZIDX_HEAD, 1u, gzidxFile) != 1u ||
+        memcmp(head, "GZIDX", 5) != 0)
+        return Z_DATA_ERROR;
+    version = head[5];
+    zSize = (off_t)zi_get_le(head + 7, 8);
+    uSize = (off_t)zi_get_le(head + 15, 8);
+    npoints = (uint32_t)zi_get_le(head + 31, 4);
+    if (version > 1 || zi_get_le(head + 27, 4) != WINSIZE || npoints == 0 ||
+        uSize == 0)
+        return Z_DATA_ERROR;       /* unknown, other window size, incomplete */
+
+    /* windows follow the points, in the order of the points having one */
+    size = version == 0 ? 17 : 18;
+    window = base + GZIDX_HEAD + (off_t)size * npoints;
+    index = NULL;
+    for (k = 0; k < npoints; ++k) {
+        if (fread(rec, size, 1u, gzidxFile) != 1u) {
+            free_index(index);
+            return Z_DATA_ERROR;
+        }
+        data = version == 0 ? k > 0 : rec[17] != 0;
+        index = index_point(index, rec[16], (off_t)zi_get_le(rec, 8),
+                           (off_t)zi_get_le(rec + 8, 8), data ? window : -1);
+        if (index == NULL)
+            return Z_MEM_ERROR;
+        if (data)
+            window += WINSIZE;
+    }
+
+    /* our last access point is the end of the data */
+    index = index_point(index, 0, zSize, uSize, -1);
+    if (index == NULL)
+        return Z_MEM_ERROR;
+    *built = index;
+    return (int)index->have;
+}
+
+/* Write index as an indexed_gzip index (version 1) of the gzip file zFile to
+   gzidxFile, with the windows from the index or from ucsFile.  Returns the
+   number of points written, or negative on error. */
+int write_index_gzidx(struct access *index, FILE *ucsFile, FILE *zFile,
+                      FILE *gzidxFile)
+{
+    unsigned char head[GZIDX_HEAD], rec[18];
+    unsigned char *window;
+    struct idx_point *pIdx;
+    struct stat st;
+    size_t k, npoints;
+    int ret;
+
+    if (index == NULL || zFile == NULL || gzidxFile == NULL || index->have < 2)
+        return Z_STREAM_ERROR;
+    if (fstat(fileno(zFile), &st) != 0)
+        return Z_ERRNO;
+    npoints = index->have - 1;          /* theirs has no end point */
+    if (npoints > 0xffffffffUL)
+        return Z_DATA_ERROR;
+    memcpy(head, "GZIDX", 5);
+    head[5] = 1;
+    head[6] = 0;
+    zi_put_le(head + 7, (uint64_t)st.st_size, 8);
+    zi_put_le(head + 15, (uint64_t)index->idx_list[npoints].out, 8);
+    zi_put_le(head + 23, SPAN, 4);
+    zi_put_le(head + 27, WINSIZE, 4);
+    zi_put_le(head + 31, (uint64_t)npoints, 4);
+    if (fwrite(head, GZIDX_HEAD, 1u, gzidxFile) != 1u)
+        return Z_ERRNO;
+    for (k = 0; k < npoints; ++k) {
+        pIdx = index->idx_list + k;
+        zi_put_le(rec, (uint64_t)pIdx->in, 8);
+        zi_put_le(rec + 8, (uint64_t)pIdx->out, 8);
+        rec[16] = (unsigned char)pIdx->bits;
+        rec[17] = k > 0 && (index->ucs_offset == NULL || index->ucs_offset[k] >= 0);
+        if (fwrite(rec, 18, 1u, gzidxFile) != 1u)
+            return Z_ERRNO;
+    }
+
+    window = malloc(WINSIZE);
+    if (window == NULL)
+        return Z_MEM_ERROR;
+    ret = (int)npoints;
+    for (k = 1; k < npoints && ret > 0; ++k) {
+        if (index->ucs_offset != NULL && index->ucs_offset[k] < 0)
+            continue;
+        if (read_window(index, ucsFile, k, window) != Z_OK)
+            ret = Z_DATA_ERROR;
+        else if (fwrite(window, WINSIZE, 1u, gzidxFile) != 1u)
+            ret = Z_ERRNO;
+    }
+    free(window);
+    if (ret > 0 && fflush(gzidxFile) != 0)
+        ret = Z_ERRNO;
+    return ret;
+}
+
+/* Open zPath with an index of another tool next to it: zPath.gzidx, or
+   zPath.gzi if zPath is BGZF.  NULL if there is none. */
+zindexPtr ziopen_foreign(const char *zPath, const char *mode)
+{
+    zindexPtr idx;
+    char *name;
+    size_t argLen;
+    int ret;
+
+    if (!mode || !strlen(mode) || mode[0]!='r')
+        return NULL; /* writing is not yet supported */
+
+    argLen = strlen(zPath);
+    name = (char *) calloc(argLen + 7, sizeof(char));
+    idx = (zindexPtr) calloc(1,sizeof(struct zindex));
+    if (name == NULL || idx == NULL) {
+        free(name);
+        free(idx);
+        fprintf(stderr,"** ERROR: ziopen failed to alloc zindex\n");
+        return NULL;
+    }
+    if ((idx->zFile = fopen(zPath, mode)) == NULL) {
+        free(name);
+        free(idx);
+        return NULL;
+    }
+    /* Give no error message for a missing index, fall back automatically. */
+    ret = 0;
+    strcpy(name, zPath);
+    strcpy(name+argLen, ".gzidx");
+    if ((idx->ucsFile = fopen(name, mode)) != NULL) {
+        ret = read_index_gzidx(idx->ucsFile, &(idx->data));
+        if (ret <= 0) {
+            fclose(idx->ucsFile);
+            idx->ucsFile = NULL;
+        }
+    }
+    strcpy(name+argLen, ".gzi");
+    if (ret <= 0 && (idx->idxFile = fopen(name, mode)) != NULL) {
+        ret = read_index_gzi(idx->idxFile, idx->zFile, SPAN, &(idx->data));
+        fclose(idx->idxFile);
+        idx->idxFile = NULL;
+    }
+    free(name);
+    if (ret > 0 && (idx->io = ziio_open(ZI_IO_DEPTH)) == NULL) {
+        free_index(idx->data);
+        ret = Z_MEM_ERROR;
+    }
+    if (ret <= 0) {
+        if (idx->ucsFile != NULL)
+            fclose(idx->ucsFile);
+        fclose(idx->zFile);
+        free(idx);
+        return NULL;
+    }
+
+    idx->pos = 0;
+    idx->end = idx->data->idx_list[idx->data->have-1].out; /*last index entry is eof*/
+    idx->verify = getenv("ZINDEX_VERIFY") != NULL;
+    return idx;
+}
@@ -0,0 +1,277 @@
+/* zicrc.c -- CRC-32 of uncompressed spans and parallel verification
+ *
+ *  zi_crc32() computes the gzip CRC-32 with carry-less multiplication folding
+ *  (PCLMULQDQ, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ *  Instruction", Intel 2009) on x86 or the CRC32 instructions of ARMv8, when
+ *  the processor has them, and with zlib's crc32() otherwise.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include "zindex.h"
+
+#define local static
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZI_CRC_PCLMUL
+#include <immintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define ZI_CRC_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+typedef uint32_t (*crc_func)(uint32_t crc, const unsigned char *buf, size_t len);
+
+local uint32_t crc32_zlib(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    uLong ret = crc;
+
+    while (len > 0) {
+        uInt n = len > 0x40000000u ? 0x40000000u : (uInt)len;
+        ret = crc32(ret, buf, n);
+        buf += n;
+        len -= n;
+    }
+    return (uint32_t)ret;
+}
+
+#ifdef ZI_CRC_PCLMUL
+/* Fold len bytes (a multiple of 16, at least 64) into the inverted crc, and
+   return the inverted result, using the bit-reflected constants of the
+   paper for the gzip polynomial. */
+__attribute__((target("sse4.1,pclmul")))
+local uint32_t crc32_fold(const unsigned char *buf, size_t len, uint32_t crc)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const uint64_t poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    /* four lanes of 128 bits, folded 64 bytes at a time */
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the lanes into one, then the remaining 16 byte blocks */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 to 64 bits, then Barrett reduction to 32 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+local uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    size_t n;
+
+    if (len >= 64) {
+        n = len & ~(size_t)15;
+        crc = ~crc32_fold(buf, n, ~crc);
+        buf += n;
+        len -= n;
+    }
+    return crc32_zlib(crc, buf, len);
+}
+#endif
+
+#ifdef ZI_CRC_ARMV8
+__attribute__((target("+crc")))
+local uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    uint64_t word;
+
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&word, buf, 8);
+        crc = __crc32d(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = __crc32b(crc, *buf++);
+    return ~crc;
+}
+#endif
+
+local crc_func crc_select(void)
+{
+#ifdef ZI_CRC_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        return crc32_pclmul;
+#endif
+#ifdef ZI_CRC_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        return crc32_armv8;
+#endif
+    return crc32_zlib;
+}
+
+/* Update crc with len bytes of buf like zlib's crc32(), start with 0. */
+uint32_t zi_crc32(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    static crc_func func = NULL;    /* a race only selects the same twice */
+
+    if (func == NULL)
+        func = crc_select();
+    return func(crc, buf, len);
+}
+
+/* shared state of the verifying threads */
+struct verify_job {
+    zindexPtr idx;
+    pthread_mutex_t lock;
+    size_t next;                /* next span to hand out */
+    size_t bad;                 /* spans failing the check */
+    zi_verify_report report;
+    void *user;
+};
+
+local void *verify_worker(void *arg)
+{
+    struct verify_job *job = arg;
+    struct access *index = job->idx->data;
+    struct zi_io *io;
+    unsigned char *buf;
+    size_t span, size, len;
+    int ret;
+
+    io = ziio_open(ZI_IO_DEPTH);
+    size = 0;
+    buf = NULL;
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        span = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (span + 1 >= index->have)
+            break;
+        len = (size_t)(index->idx_list[span + 1].out - index->idx_list[span].out);
+        if (len > size) {
+            free(buf);
+            size = len;
+            buf = (unsigned char *) malloc(size);
+        }
+        if (io == NULL || (buf == NULL && len > 0))
+            ret = Z_MEM_ERROR;
+        else
+            ret = zi_verify_span(job->idx, io, span, buf);
+        if (ret != Z_OK) {
+            pthread_mutex_lock(&job->lock);
+            job->bad++;
+            if (job->report != NULL)
+                job->report(job->idx, span, ret, job->user);
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    free(buf);
+    ziio_close(io);
+    return NULL;
+}
+
+/* Check every span of idx against the CRC-32 in its index, decoding them in
+   parallel on nthread threads (0 for one per processor).  report, if not
+   NULL, is called for each failing span with the error (ZI_CRC_ERROR for a
+   mismatch), serialized.  Returns the number of failing spans, or negative
+   if the index has no checksums or the threads cannot be started. */
+long zi_verify(zindexPtr idx, int nthread, zi_verify_report report, void *user)
+{
+    struct verify_job job;
+    pthread_t *thread;
+    int i;
+
+    if (idx == NULL || !(idx->data->flags & ZI_HAVE_CRC))
+        return Z_STREAM_ERROR;
+    if (nthread <= 0)
+        nthread = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthread <= 0)
+        nthread = 1;
+    thread = (pthread_t *) calloc((size_t)nthread, sizeof(pthread_t));
+    if (thread == NULL)
+        return Z_MEM_ERROR;
+    job.idx = idx;
+    job.next = 0;
+    job.bad = 0;
+    job.report = report;
+    job.user = user;
+    pthread_mutex_init(&job.lock, NULL);
+    for (i = 0; i < nthread; ++i)
+        if (pthread_create(thread + i, NULL, verify_worker, &job) != 0)
+            break;
+    if (i == 0)
+        verify_worker(&job);
+    while (i-- > 0)
+        pthread_join(thread[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    free(thread);
+    return (long) job.bad;
+}
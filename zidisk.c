@@ -0,0 +1,304 @@
+/* zidisk.c -- decoded spans kept in a directory on a local disk
+ *
+ *  A handle given a span cache (zi_disk_cache(), or ZINDEX_SPAN_CACHE in the
+ *  environment for ziopen()) keeps every span that its reads decode in a
+ *  file of that directory, and serves later reads of the span, by any
+ *  process, from there with pread() instead of inflating it again.  A file
+ *  is named after the identity of the compressed file -- a hash of its
+ *  device, inode, size and modification time, so that a changed file misses
+ *  -- and the offset of the span in the uncompressed data, and holds its
+ *  bytes only; one of the wrong size is not used.  Spans are written under a
+ *  temporary name and renamed into place, so that no reader sees a partial
+ *  one.  They are not synced: that would put a disk flush in the way of
+ *  every read that misses, and a crash costs no more than entries of a cache
+ *  that refills itself.  The bytes in the directory are counted
+ *  in its file ".lock", under flock(), and when they pass the budget the
+ *  spans used least recently (a hit touches the modification time of its
+ *  file) are removed down to ZI_DISK_LOW of it.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "zindex.h"
+
+#define local static
+
+#define DISK_LOCK ".lock"
+#define DISK_EXT ".span"
+#define DISK_NAME 35        /* 16 + 1 + 12 hex digits, DISK_EXT and '\0' */
+#define DISK_TOUCH 60       /* seconds between touches of a span hit */
+#define DISK_STALE 3600     /* temporary files left this long are removed */
+
+struct zi_disk {
+    char *dir;
+    off_t max;                  /* bytes kept in dir */
+    uint64_t id;                /* identity of the compressed file */
+    int lock;                   /* dir/.lock: flock() and bytes in use */
+    unsigned long tmp;          /* temporary files made */
+    pthread_mutex_t mutex;      /* flock() does not exclude our threads */
+};
+
+/* a span file found in the directory when evicting */
+struct disk_entry {
+    time_t mtime;
+    off_t size;
+    char name[DISK_NAME];
+};
+
+/* Return dir/name of the span starting at start, or NULL if out of memory. */
+local char *span_path(const struct zi_disk *disk, off_t start)
+{
+    char *path;
+
+    path = malloc(strlen(disk->dir) + DISK_NAME + 1);
+    if (path != NULL)
+        sprintf(path, "%s/%016llx-%012llx" DISK_EXT, disk->dir,
+                (unsigned long long)disk->id, (unsigned long long)start);
+    return path;
+}
+
+/* Set *id to a hash of the identity of the file open as f: its device,
+   inode, size and modification time.  Returns Z_OK or Z_ERRNO. */
+int zi_file_id(FILE *f, uint64_t *id)
+{
+    struct stat st;
+    unsigned char ident[40];
+
+    if (fstat(fileno(f), &st) != 0)
+        return Z_ERRNO;
+    zi_put_le(ident, (uint64_t)st.st_dev, 8);
+    zi_put_le(ident + 8, (uint64_t)st.st_ino, 8);
+    zi_put_le(ident + 16, (uint64_t)st.st_size, 8);
+    zi_put_le(ident + 24, (uint64_t)st.st_mtim.tv_sec, 8);
+    zi_put_le(ident + 32, (uint64_t)st.st_mtim.tv_nsec, 8);
+    *id = ((uint64_t)zi_crc32(0, ident, 20) << 32) |
+          zi_crc32(0, ident, sizeof(ident));
+    return Z_OK;
+}
+
+/* Start keeping the spans decoded by reads of idx in dir, which is made if
+   needed, and up to max bytes there -- for max 0, ZINDEX_SPAN_CACHE_MB
+   megabytes from the environment or ZI_DISK_MB.  A dir of NULL does nothing.
+   Returns Z_OK, Z_STREAM_ERROR for a handle other than of gzip data, Z_ERRNO
+   if dir cannot be used, or Z_MEM_ERROR. */
+int zi_disk_cache(zindexPtr idx, const char *dir, off_t max)
+{
+    struct zi_disk *disk;
+    uint64_t id;
+    const char *env;
+    char *path;
+
+    if (idx == NULL || (idx->data->flags & (ZI_ZSTD | ZI_CHUNKED)) ||
+        idx->zFile == NULL)
+        return Z_STREAM_ERROR;
+    if (dir == NULL || *dir == '\0')
+        return Z_OK;
+    if (max <= 0) {
+        env = getenv("ZINDEX_SPAN_CACHE_MB");
+        max = (env != NULL && atol(env) > 0 ? atol(env) : ZI_DISK_MB) << 20;
+    }
+    if (zi_file_id(idx->zFile, &id) != Z_OK ||
+        (mkdir(dir, 0777) != 0 && errno != EEXIST))
+        return Z_ERRNO;
+    disk = calloc(1, sizeof(struct zi_disk));
+    if (disk == NULL || (disk->dir = strdup(dir)) == NULL) {
+        free(disk);
+        return Z_MEM_ERROR;
+    }
+    disk->max = max;
+    disk->id = id;
+    path = malloc(strlen(dir) + sizeof(DISK_LOCK) + 1);
+    if (path == NULL) {
+        free(disk->dir);
+        free(disk);
+        return Z_MEM_ERROR;
+    }
+    sprintf(path, "%s/" DISK_LOCK, dir);
+    disk->lock = open(path, O_RDWR | O_CREAT, 0666);
+    free(path);
+    if (disk->lock < 0) {
+        free(disk->dir);
+        free(disk);
+        return Z_ERRNO;
+    }
+    pthread_mutex_init(&disk->mutex, NULL);
+    zi_disk_close(idx);
+    idx->disk = disk;
+    return Z_OK;
+}
+
+/* Stop keeping the spans of idx on disk; what is there stays. */
+void zi_disk_close(zindexPtr idx)
+{
+    struct zi_disk *disk = idx->disk;
+
+    if (disk == NULL)
+        return;
+    close(disk->lock);
+    pthread_mutex_destroy(&disk->mutex);
+    free(disk->dir);
+    free(disk);
+    idx->disk = NULL;
+}
+
+/* Copy len bytes from offset from of the span of n bytes starting at start
+   to buf, if the span is on disk.  Returns Z_OK, or Z_BUF_ERROR if it is not
+   there (or not whole). */
+int zi_disk_get(struct zi_disk *disk, off_t start, off_t n, off_t from,
+                unsigned char *buf, size_t len)
+{
+    struct stat st;
+    char *path;
+    int fd, ret;
+
+    path = span_path(disk, start);
+    if (path == NULL)
+        return Z_BUF_ERROR;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return Z_BUF_ERROR;
+    ret = fstat(fd, &st) == 0 && st.st_size == n &&
+          pread(fd, buf, len, from) == (ssize_t)len ? Z_OK : Z_BUF_ERROR;
+    if (ret == Z_OK && st.st_mtime < time(NULL) - DISK_TOUCH)
+        (void)futimens(fd, NULL);       /* used recently */
+    close(fd);
+    return ret;
+}
+
+local int entry_cmp(const void *a, const void *b)
+{
+    time_t x = ((const struct disk_entry *)a)->mtime;
+    time_t y = ((const struct disk_entry *)b)->mtime;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Remove the spans of the directory used least recently until the bytes left
+   are ZI_DISK_LOW of the budget, and the temporary files given up on.  Called
+   with the directory locked; returns the bytes left. */
+local off_t disk_evict(struct zi_disk *disk)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    struct disk_entry *list, *more;
+    size_t n, size, i;
+    off_t total;
+    time_t now;
+    int fd;
+
+    fd = open(disk->dir, O_RDONLY | O_DIRECTORY);
+    d = fd < 0 ? NULL : fdopendir(fd);
+    if (d == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    list = NULL;
+    n = size = 0;
+    total = 0;
+    now = time(NULL);
+    while ((de = readdir(d)) != NULL) {
+        i = strlen(de->d_name);
+        if (fstatat(fd, de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (de->d_name[0] == '.' && strcmp(de->d_name, DISK_LOCK) != 0) {
+            if (st.st_mtime < now - DISK_STALE)
+                (void)unlinkat(fd, de->d_name, 0);
+            continue;
+        }
+        if (i + 1 != DISK_NAME || strcmp(de->d_name + i - strlen(DISK_EXT), DISK_EXT) != 0)
+            continue;
+        if (n == size) {
+            more = realloc(list, sizeof(struct disk_entry) * (size ? size << 1 : 256));
+            if (more == NULL)
+                break;
+            list = more;
+            size = size ? size << 1 : 256;
+        }
+        list[n].mtime = st.st_mtime;
+        list[n].size = st.st_size;
+        memcpy(list[n].name, de->d_name, DISK_NAME);
+        total += st.st_size;
+        n++;
+    }
+    qsort(list, n, sizeof(struct disk_entry), entry_cmp);
+    for (i = 0; i < n && total > disk->max / 100 * ZI_DISK_LOW; i++)
+        if (unlinkat(fd, list[i].name, 0) == 0)
+            total -= list[i].size;
+    free(list);
+    closedir(d);
+    return total;
+}
+
+/* Add the n bytes of the span starting at start to the directory, removing
+   older spans if that passes the budget.  This is only a cache: returns
+   Z_OK, or Z_ERRNO if the span could not be added. */
+int zi_disk_put(struct zi_disk *disk, off_t start, const unsigned char *span,
+                size_t n)
+{
+    unsigned char rec[8];
+    char *path, *tmp;
+    off_t used;
+    size_t done;
+    ssize_t got;
+    int fd, ret;
+
+    if ((off_t)n > disk->max / 4)
+        return Z_ERRNO;             /* would push out too much */
+    path = span_path(disk, start);
+    tmp = malloc(strlen(disk->dir) + DISK_NAME + 48);
+    if (path == NULL || tmp == NULL) {
+        free(path);
+        free(tmp);
+        return Z_ERRNO;
+    }
+    pthread_mutex_lock(&disk->mutex);
+    sprintf(tmp, "%s/.%016llx-%012llx.%ld.%lu", disk->dir,
+            (unsigned long long)disk->id, (unsigned long long)start,
+            (long)getpid(), disk->tmp++);
+    pthread_mutex_unlock(&disk->mutex);
+
+    /* written whole before it gets its name */
+    ret = Z_ERRNO;
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd >= 0) {
+        for (done = 0; done < n; done += (size_t)got) {
+            got = write(fd, span + done, n - done);
+            if (got <= 0)
+                break;
+        }
+        if (close(fd) == 0 && done == n && rename(tmp, path) == 0)
+            ret = Z_OK;
+        else
+            (void)unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    if (ret != Z_OK)
+        return ret;
+
+    /* count it in, and make room when over budget */
+    pthread_mutex_lock(&disk->mutex);
+    if (flock(disk->lock, LOCK_EX) == 0) {
+        used = pread(disk->lock, rec, 8, 0) == 8 ? (off_t)zi_get_le(rec, 8) : 0;
+        used += (off_t)n;
+        if (used > disk->max)
+            used = disk_evict(disk);
+        zi_put_le(rec, (uint64_t)used, 8);
+        (void)pwrite(disk->lock, rec, 8, 0);
+        (void)flock(disk->lock, LOCK_UN);
+    }
+    pthread_mutex_unlock(&disk->mutex);
+    return Z_OK;
+}
@@ -0,0 +1,362 @@
+/* ziio.c -- compressed input layer of zindex
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ziio.h"
+#include "zlib.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define local static
+
+#define ZI_IO_ARENA 65536   /* inflate state and window, from zalloc */
+#define ZI_IO_RING_MAX 0x40000000   /* longest read on the ring, whose result
+                                       is an int; the rest is requeued */
+
+struct zi_io {
+    unsigned depth;
+    unsigned char **slot;       /* read buffers, one per slot */
+    size_t *slotSize;           /* allocated size of each buffer */
+    unsigned pending;           /* requests submitted but not reaped */
+    int uring;                  /* 1 if the ring below is in use */
+    z_stream strm;              /* raw inflate reused by the extracts */
+    int strmInit;               /* strm has been through inflateInit2() */
+    unsigned char *scratch;     /* ZI_IO_SCRATCH bytes, then the arena */
+    size_t arenaUsed;           /* of the ZI_IO_ARENA bytes after scratch */
+    struct zi_io_stats stats;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+};
+
+/* Read what is left of req synchronously, retrying short reads and EINTR. */
+local void pread_req(struct zi_ioreq *req)
+{
+    ssize_t got;
+
+    while (req->done < req->len) {
+        got = pread(req->fd, req->buf + req->done, req->len - req->done,
+                    req->offset + (off_t)req->done);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            req->error = errno;
+            break;
+        }
+        if (got == 0)
+            break;                      /* end of file */
+        req->done += (size_t)got;
+    }
+    req->state = ZI_IO_DONE;
+}
+
+/* zalloc of strm: from the arena of the context while it lasts.  The arena is
+   only given back with the context, zlib reuses what it got after a reset. */
+local voidpf arena_alloc(voidpf opaque, uInt items, uInt size)
+{
+    struct zi_io *io = (struct zi_io *)opaque;
+    size_t n = ((size_t)items * size + 15) & ~(size_t)15;
+    voidpf p;
+
+    if (io->arenaUsed + n > ZI_IO_ARENA)
+        return malloc((size_t)items * size);
+    p = io->scratch + ZI_IO_SCRATCH + io->arenaUsed;
+    io->arenaUsed += n;
+    return p;
+}
+
+local void arena_free(voidpf opaque, voidpf ptr)
+{
+    struct zi_io *io = (struct zi_io *)opaque;
+    unsigned char *p = (unsigned char *)ptr;
+
+    if (p < io->scratch + ZI_IO_SCRATCH || p >= io->scratch + ZI_IO_SCRATCH + ZI_IO_ARENA)
+        free(ptr);
+}
+
+/* Create an I/O context with depth buffer slots and, if possible, an
+   io_uring of the same depth.  Returns NULL if out of memory. */
+struct zi_io *ziio_open(unsigned depth)
+{
+    struct zi_io *io;
+
+    if (depth == 0)
+        depth = ZI_IO_DEPTH;
+    io = calloc(1, sizeof(struct zi_io));
+    if (io == NULL)
+        return NULL;
+    io->slot = calloc(depth, sizeof(unsigned char *));
+    io->slotSize = calloc(depth, sizeof(size_t));
+    io->scratch = malloc(ZI_IO_SCRATCH + ZI_IO_ARENA);
+    if (io->slot == NULL || io->slotSize == NULL || io->scratch == NULL) {
+        free(io->slot);
+        free(io->slotSize);
+        free(io->scratch);
+        free(io);
+        return NULL;
+    }
+    io->depth = depth;
+#ifdef HAVE_LIBURING
+    /* io_uring may be missing or forbidden (old kernel, seccomp), then the
+       pread() path is used silently */
+    if (getenv("ZINDEX_NO_URING") == NULL &&
+        io_uring_queue_init(depth + 1, &io->ring, 0) == 0)
+        io->uring = 1;
+#endif
+    return io;
+}
+
+void ziio_close(struct zi_io *io)
+{
+    unsigned i;
+
+    if (io == NULL)
+        return;
+    ziio_drain(io);
+#ifdef HAVE_LIBURING
+    if (io->uring)
+        io_uring_queue_exit(&io->ring);
+#endif
+    if (io->strmInit)
+        (void)inflateEnd(&io->strm);
+    for (i = 0; i < io->depth; ++i)
+        free(io->slot[i]);
+    free(io->slot);
+    free(io->slotSize);
+    free(io->scratch);
+    free(io);
+}
+
+/* Return 1 if reads are really asynchronous in this context. */
+int ziio_async(struct zi_io *io)
+{
+    return io != NULL && io->uring;
+}
+
+/* Return the buffer of slot grown to at least size bytes, or NULL if out of
+   memory.  The buffer stays valid until the next call for the same slot. */
+unsigned char *ziio_buffer(struct zi_io *io, unsigned slot, size_t size)
+{
+    unsigned char *next;
+
+    slot %= io->depth;
+    if (io->slotSize[slot] < size) {
+        next = realloc(io->slot[slot], size);
+        if (next == NULL)
+            return NULL;
+        io->slot[slot] = next;
+        io->slotSize[slot] = size;
+    }
+    return io->slot[slot];
+}
+
+#ifdef HAVE_LIBURING
+/* Queue the rest of req on the ring, or as much of it as one read may take,
+   and submit it.  If the ring takes no entry or the submit fails, the read is
+   done here instead, and the entry left in the ring is turned into a no-op
+   for a later submit not to start it again.  Returns 1 if the read is on the
+   ring, 0 if it is done. */
+local int uring_start(struct zi_io *io, struct zi_ioreq *req)
+{
+    struct io_uring_sqe *sqe;
+    size_t len;
+
+    sqe = io_uring_get_sqe(&io->ring);
+    if (sqe == NULL) {
+        (void)io_uring_submit(&io->ring);
+        sqe = io_uring_get_sqe(&io->ring);
+    }
+    if (sqe != NULL) {
+        len = req->len - req->done;
+        if (len > ZI_IO_RING_MAX)
+            len = ZI_IO_RING_MAX;
+        io_uring_prep_read(sqe, req->fd, req->buf + req->done, (unsigned)len,
+                           req->offset + (off_t)req->done);
+        io_uring_sqe_set_data(sqe, req);
+        if (io_uring_submit(&io->ring) >= 0)
+            return 1;
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+    pread_req(req);
+    return 0;
+}
+
+/* Reap one completion, requeue it if short, and return 0, or -1 on error. */
+local int uring_reap(struct zi_io *io)
+{
+    struct io_uring_cqe *cqe;
+    struct zi_ioreq *req;
+    int ret;
+
+    do {
+        ret = io_uring_wait_cqe(&io->ring, &cqe);
+    } while (ret == -EINTR);
+    if (ret < 0)
+        return -1;
+    req = io_uring_cqe_get_data(cqe);
+    ret = cqe->res;
+    io_uring_cqe_seen(&io->ring, cqe);
+    if (req == NULL)
+        return 0;                       /* no-op left by uring_start() */
+    if (ret == -EINTR || ret == -EAGAIN)
+        ret = 1;
+    else if (ret < 0)
+        req->error = -ret;
+    else if (ret > 0) {
+        req->done += (size_t)ret;
+        ret = req->done < req->len;
+    }
+    if (ret == 1 && uring_start(io, req))
+        return 0;                       /* rest requeued */
+    req->state = ZI_IO_DONE;
+    io->pending--;
+    return 0;
+}
+#endif
+
+/* Start reading req->len bytes at req->offset into req->buf.  Without
+   io_uring, or if the ring does not take it, the read is done here, otherwise
+   it is only queued.  Returns 0; an error of the read is reported by
+   ziio_wait(). */
+int ziio_submit(struct zi_io *io, struct zi_ioreq *req)
+{
+    req->done = 0;
+    req->error = 0;
+    req->state = ZI_IO_PENDING;
+#ifdef HAVE_LIBURING
+    if (io->uring && req->len > 0) {
+        if (uring_start(io, req))
+            io->pending++;
+        return 0;
+    }
+#else
+    (void)io;
+#endif
+    pread_req(req);
+    return 0;
+}
+
+/* Wait for req to complete, return the number of bytes read (short only at end
+   of file) or Z_ERRNO on a read error. */
+long ziio_wait(struct zi_io *io, struct zi_ioreq *req)
+{
+    if (req->state == ZI_IO_IDLE)
+        return Z_ERRNO;
+#ifdef HAVE_LIBURING
+    while (req->state == ZI_IO_PENDING)
+        if (uring_reap(io) != 0)
+            return Z_ERRNO;
+#endif
+    req->state = ZI_IO_IDLE;
+    if (req->error != 0) {
+        errno = req->error;
+        return Z_ERRNO;
+    }
+    io->stats.read += (off_t)req->done;
+    return (long)req->done;
+}
+
+/* Wait for all outstanding requests, so that their buffers can be reused. */
+void ziio_drain(struct zi_io *io)
+{
+#ifdef HAVE_LIBURING
+    while (io->pending > 0)
+        if (uring_reap(io) != 0)
+            break;
+#else
+    (void)io;
+#endif
+}
+
+/* Return the raw inflate stream of the context, ready to start anew, or NULL
+   if out of memory.  Its state is allocated on first use only, later uses
+   just reset it. */
+z_stream *ziio_inflate(struct zi_io *io)
+{
+    z_stream *strm = &io->strm;
+
+    strm->avail_in = 0;
+    strm->next_in = Z_NULL;
+    if (io->strmInit)
+        return inflateReset2(strm, -15) == Z_OK ? strm : NULL;
+    strm->zalloc = arena_alloc;
+    strm->zfree = arena_free;
+    strm->opaque = (voidpf)io;
+    if (inflateInit2(strm, -15) != Z_OK)
+        return NULL;
+    io->strmInit = 1;
+    return strm;
+}
+
+/* Return ZI_IO_SCRATCH bytes of the context for the use of one extract. */
+unsigned char *ziio_scratch(struct zi_io *io)
+{
+    return io->scratch;
+}
+
+/* Return the counts of what was done through the context, to be read or
+   reset by its owner. */
+struct zi_io_stats *ziio_stats(struct zi_io *io)
+{
+    return &io->stats;
+}
+
+/* Map the file open as fd read-only, advising the kernel of the accesses to
+   come (ZI_IO_SEQUENTIAL or ZI_IO_RANDOM) for all of it, and set *size to its
+   length.  Returns NULL if it is not a regular file, is empty or cannot be
+   mapped. */
+unsigned char *ziio_mmap(int fd, off_t *size, int advice)
+{
+    struct stat st;
+    void *base;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        (off_t)(size_t)st.st_size != st.st_size)
+        return NULL;
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    (void)madvise(base, (size_t)st.st_size,
+                  advice == ZI_IO_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+    *size = st.st_size;
+    return base;
+}
+
+void ziio_munmap(unsigned char *base, off_t size)
+{
+    if (base != NULL)
+        (void)munmap(base, (size_t)size);
+}
+
+/* Complete req from the mapping base of the size bytes of its file instead of
+   reading it: its buffer points into the mapping, short past the end, and
+   the pages of the range are asked for at once -- the readahead of the whole
+   range that a read of it would have been. */
+void ziio_mapped(struct zi_ioreq *req, unsigned char *base, off_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t at;
+
+    req->done = 0;
+    if (req->offset < size)
+        req->done = (off_t)req->len < size - req->offset ? req->len :
+                    (size_t)(size - req->offset);
+    req->buf = base + (req->offset < size ? req->offset : size);
+    req->error = 0;
+    req->state = ZI_IO_DONE;
+    if (req->done > 0) {
+        at = (size_t)req->offset & ~(page - 1);
+        (void)madvise(base + at, (size_t)req->offset + req->done - at,
+                      MADV_WILLNEED);
+    }
+}
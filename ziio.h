@@ -0,0 +1,79 @@
+/* ziio.h -- compressed input layer of zindex
+ *
+ *  Reads of compressed span ranges and .ucs windows are queued as requests
+ *  and completed asynchronously through io_uring when built with
+ *  HAVE_LIBURING (and the kernel allows it), otherwise with a synchronous
+ *  pread() at submission time, or served from a mapping of the whole file
+ *  (ziio_mapped()) without a copy.  A context also carries the inflate state
+ *  and scratch buffers of the extracts done through it, allocated once, so
+ *  that a warmed up context decodes without touching the heap.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#ifndef ZIIO_H_
+#define ZIIO_H_
+
+#include <sys/types.h>
+
+#define ZI_IO_DEPTH 8       /* reads in flight (and buffer slots) per context */
+#define ZI_IO_SCRATCH 65536 /* bytes of ziio_scratch() */
+
+/* request states */
+#define ZI_IO_IDLE    0
+#define ZI_IO_PENDING 1
+#define ZI_IO_DONE    2
+
+/* ziio_mmap(): the accesses to come */
+#define ZI_IO_SEQUENTIAL 1
+#define ZI_IO_RANDOM     2
+
+/* one positioned read: len bytes from offset of fd into buf */
+struct zi_ioreq {
+    int fd;
+    off_t offset;
+    size_t len;
+    unsigned char *buf;
+    size_t done;        /* bytes read so far, short only at end of file */
+    int error;          /* errno of a failed read, or 0 */
+    int state;
+};
+
+/* opaque I/O context, one per thread doing extracts */
+struct zi_io;
+
+/* what the extracts through a context did, for tuning (zindex replay) */
+struct zi_io_stats {
+    off_t read;         /* compressed bytes and windows read */
+    off_t decoded;      /* bytes inflated, those skipped over included */
+    long hits;          /* spans copied from a span cache */
+    long misses;        /* spans decoded whole for it */
+};
+
+struct zi_io *ziio_open(unsigned depth);
+
+void ziio_close(struct zi_io *io);
+
+int ziio_async(struct zi_io *io);
+
+unsigned char *ziio_buffer(struct zi_io *io, unsigned slot, size_t size);
+
+int ziio_submit(struct zi_io *io, struct zi_ioreq *req);
+
+long ziio_wait(struct zi_io *io, struct zi_ioreq *req);
+
+void ziio_drain(struct zi_io *io);
+
+struct z_stream_s *ziio_inflate(struct zi_io *io);
+
+unsigned char *ziio_scratch(struct zi_io *io);
+
+struct zi_io_stats *ziio_stats(struct zi_io *io);
+
+unsigned char *ziio_mmap(int fd, off_t *size, int advice);
+
+void ziio_munmap(unsigned char *base, off_t size);
+
+void ziio_mapped(struct zi_ioreq *req, unsigned char *base, off_t size);
+
+#endif /* ZIIO_H_ */
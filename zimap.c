@@ -0,0 +1,196 @@
+/* zimap.c -- read-only pointers into decompressed data
+ *
+ *  zimap() pins the requested bytes in a reference counted buffer of
+ *  decompressed data and returns a pointer into it, to be released with
+ *  ziunmap().  A range within one span pins the whole span, so that further
+ *  maps of that span share the buffer; a range across spans gets a buffer of
+ *  its own.  A few released buffers are kept for reuse.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <pthread.h>
+#include "zindex.h"
+
+#define local static
+
+#define ZI_MAP_IDLE 2       /* released buffers kept for reuse */
+#define ZI_MAP_CHUNK 0x40000000     /* bytes decoded per extract */
+
+struct zi_pin {
+    off_t start;                /* uncompressed offset of data[0] */
+    size_t size;
+    unsigned char *data;
+    int refs;                   /* pointers handed out and not released */
+    struct zi_pin *next;
+};
+
+struct zi_maps {
+    pthread_mutex_t lock;
+    struct zi_pin *head;        /* most recently used first */
+};
+
+local pthread_mutex_t maps_create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+local struct zi_maps *maps_get(zindexPtr idx)
+{
+    struct zi_maps *maps;
+
+    pthread_mutex_lock(&maps_create_lock);
+    maps = idx->maps;
+    if (maps == NULL) {
+        maps = calloc(1, sizeof(struct zi_maps));
+        if (maps != NULL) {
+            pthread_mutex_init(&maps->lock, NULL);
+            idx->maps = maps;
+        }
+    }
+    pthread_mutex_unlock(&maps_create_lock);
+    return maps;
+}
+
+/* Find a buffer holding offset..offset+len and take a reference, called with
+   the maps locked. */
+local struct zi_pin *pin_find(struct zi_maps *maps, off_t offset, size_t len)
+{
+    struct zi_pin *pin, **link;
+
+    for (link = &maps->head; (pin = *link) != NULL; link = &pin->next)
+        if (offset >= pin->start &&
+            offset + (off_t)len <= pin->start + (off_t)pin->size) {
+            *link = pin->next;          /* move to front */
+            pin->next = maps->head;
+            maps->head = pin;
+            pin->refs++;
+            return pin;
+        }
+    return NULL;
+}
+
+/* Free released buffers beyond the ZI_MAP_IDLE most recent ones, called with
+   the maps locked. */
+local void pin_trim(struct zi_maps *maps)
+{
+    struct zi_pin *pin, **link;
+    int idle = 0;
+
+    link = &maps->head;
+    while ((pin = *link) != NULL) {
+        if (pin->refs == 0 && ++idle > ZI_MAP_IDLE) {
+            *link = pin->next;
+            free(pin->data);
+            free(pin);
+        }
+        else
+            link = &pin->next;
+    }
+}
+
+/* Return a read-only pointer to len bytes of uncompressed data at offset,
+   valid until ziunmap() is called with it, or NULL on error or if the range
+   is not all in the file.  Safe to call from several threads. */
+const void * zimap(zindexPtr idx, off_t offset, size_t len)
+{
+    struct zi_maps *maps;
+    struct zi_pin *pin, *other;
+    struct access *index;
+    struct zi_io *io;
+    size_t k, done, n;
+    int got;
+
+    if (idx == NULL || offset < 0 || len == 0 || offset + (off_t)len > idx->end ||
+        (maps = maps_get(idx)) == NULL)
+        return NULL;
+    pthread_mutex_lock(&maps->lock);
+    pin = pin_find(maps, offset, len);
+    pthread_mutex_unlock(&maps->lock);
+    if (pin != NULL)
+        return pin->data + (offset - pin->start);
+
+    /* decode the span holding the range, or just the range */
+    pin = calloc(1, sizeof(struct zi_pin));
+    if (pin == NULL)
+        return NULL;
+    index = idx->data;
+    k = find_point(index, offset);
+    if (offset + (off_t)len <= index->idx_list[k + 1].out) {
+        pin->start = index->idx_list[k].out;
+        pin->size = (size_t)(index->idx_list[k + 1].out - pin->start);
+    }
+    else {
+        pin->start = offset;
+        pin->size = len;
+    }
+    pin->data = malloc(pin->size);
+    io = ziio_open(ZI_IO_DEPTH);
+    got = pin->data != NULL && io != NULL ? 0 : Z_MEM_ERROR;
+    for (done = 0; got >= 0 && done < pin->size; done += (size_t)got) {
+        n = pin->size - done < ZI_MAP_CHUNK ? pin->size - done : ZI_MAP_CHUNK;
+        got = zi_extract(idx, io, pin->start + (off_t)done, pin->data + done,
+                         (int)n, NULL);
+        if (got == 0)
+            got = Z_DATA_ERROR;
+    }
+    ziio_close(io);
+    if (got < 0) {
+        free(pin->data);
+        free(pin);
+        return NULL;
+    }
+
+    /* another thread may have pinned it meanwhile */
+    pthread_mutex_lock(&maps->lock);
+    other = pin_find(maps, offset, len);
+    if (other == NULL) {
+        pin->refs = 1;
+        pin->next = maps->head;
+        maps->head = pin;
+        pin_trim(maps);
+    }
+    pthread_mutex_unlock(&maps->lock);
+    if (other != NULL) {
+        free(pin->data);
+        free(pin);
+        pin = other;
+    }
+    return pin->data + (offset - pin->start);
+}
+
+/* Release a pointer returned by zimap(), return 0, or -1 if it is not one. */
+int ziunmap(zindexPtr idx, const void *ptr)
+{
+    struct zi_maps *maps;
+    struct zi_pin *pin;
+    const unsigned char *p = ptr;
+
+    if (idx == NULL || (maps = idx->maps) == NULL)
+        return -1;
+    pthread_mutex_lock(&maps->lock);
+    for (pin = maps->head; pin != NULL; pin = pin->next)
+        if (pin->refs > 0 && p >= pin->data && p < pin->data + pin->size) {
+            pin->refs--;
+            break;
+        }
+    if (pin != NULL)
+        pin_trim(maps);
+    pthread_mutex_unlock(&maps->lock);
+    return pin != NULL ? 0 : -1;
+}
+
+/* Free all buffers of idx, released or not. */
+void zi_maps_close(zindexPtr idx)
+{
+    struct zi_maps *maps;
+    struct zi_pin *pin, *next;
+
+    if (idx == NULL || (maps = idx->maps) == NULL)
+        return;
+    for (pin = maps->head; pin != NULL; pin = next) {
+        next = pin->next;
+        free(pin->data);
+        free(pin);
+    }
+    pthread_mutex_destroy(&maps->lock);
+    free(maps);
+    idx->maps = NULL;
+}
@@ -5,10 +5,113 @@
  *  For modifications: copyright 2015 Zalan Rajna under GNU GPLv3
  */
 
+#include <unistd.h>
+#include <sys/stat.h>
 #include "zindex.h"
 
 #define local static
 
+/* Make room in the line counts and window offsets of index, where present,
+   for all index->size points. */
+local int grow_extras(struct access *index)
+{
+    off_t *next;
+
+    if (index->lines != NULL) {
+        next = realloc(index->lines, sizeof(off_t) * index->size);
+        if (next == NULL)
+            return Z_MEM_ERROR;
+        index->lines = next;
+    }
+    if (index->ucs_offset != NULL) {
+        next = realloc(index->ucs_offset, sizeof(off_t) * index->size);
+        if (next == NULL)
+            return Z_MEM_ERROR;
+        index->ucs_offset = next;
+    }
+    return Z_OK;
+}
+
+/* Record that there are n newlines before access point k of index. */
+local int set_lines(struct access *index, size_t k, off_t n)
+{
+    if (index->lines == NULL) {
+        index->lines = calloc(index->size, sizeof(off_t));
+        if (index->lines == NULL)
+            return Z_MEM_ERROR;
+    }
+    index->lines[k] = n;
+    return Z_OK;
+}
+
+/* Record that the window of access point k of index is at offset. */
+local int set_window(struct access *index, size_t k, off_t offset)
+{
+    if (index->ucs_offset == NULL) {
+        index->ucs_offset = malloc(sizeof(off_t) * index->size);
+        if (index->ucs_offset == NULL)
+            return Z_MEM_ERROR;
+    }
+    index->ucs_offset[k] = offset;
+    return Z_OK;
+}
+
+/* Append a line mark to index, the list growing in powers of two. */
+local int add_mark(struct access *index, off_t line, off_t out)
+{
+    struct line_mark *next;
+    size_t n = index->nmarks;
+
+    if (n == 0 || (n >= 16 && (n & (n - 1)) == 0)) {
+        next = realloc(index->marks, sizeof(struct line_mark) * (n ? n << 1 : 16));
+        if (next == NULL)
+            return Z_MEM_ERROR;
+        index->marks = next;
+    }
+    index->marks[n].line = line;
+    index->marks[n].out = out;
+    index->nmarks++;
+    return Z_OK;
+}
+
+/* Append a zero run to index, the list growing in powers of two. */
+local int add_zero(struct access *index, off_t start, off_t len)
+{
+    struct zero_run *next;
+    size_t n = index->nzeros;
+
+    if (n == 0 || (n >= 16 && (n & (n - 1)) == 0)) {
+        next = realloc(index->zeros, sizeof(struct zero_run) * (n ? n << 1 : 16));
+        if (next == NULL)
+            return Z_MEM_ERROR;
+        index->zeros = next;
+    }
+    index->zeros[n].start = start;
+    index->zeros[n].len = len;
+    index->nzeros++;
+    return Z_OK;
+}
+
+/* Return the last zero run of index starting at or before offset, NULL if
+   there is none. */
+local struct zero_run *find_zero(struct access *index, off_t offset)
+{
+    size_t lo, hi, mid;
+
+    if (index->nzeros == 0 || index->zeros[0].start > offset)
+        return NULL;
+    lo = 0;
+    hi = index->nzeros - 1;
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        if (index->zeros[mid].start <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return index->zeros + lo;
+}
+
 /* Add an entry to the access point list.  If out of memory, deallocate the
    existing list and return NULL. */
 local struct access *addpoint(struct access *index, int bits,
@@ -37,6 +140,17 @@ local struct access *addpoint(struct access *index, int bits,
         }
         else
         	index->ucs_list = NULL;
+        index->ucs_base = 0;
+        index->ucs_stride = WINSIZE;
+        index->ucs_offset = NULL;
+        index->store = NULL;
+        index->lines = NULL;
+        index->marks = NULL;
+        index->nmarks = 0;
+        index->zeros = NULL;
+        index->nzeros = 0;
+        index->zones = NULL;
+        index->flags = 0;
         index->size = 8;
         index->have = 0;
     }
@@ -50,6 +164,10 @@ local struct access *addpoint(struct access *index, int bits,
             return NULL;
         }
         index->idx_list = idxNext;
+        if (grow_extras(index) != Z_OK) {
+            free_index(index);
+            return NULL;
+        }
         if (window != NULL)
         {
 			ucsNext = realloc(index->ucs_list, sizeof(struct ucs_point) * index->size);
@@ -66,6 +184,7 @@ local struct access *addpoint(struct access *index, int bits,
     idxNext->in = in;
     idxNext->out = out;
 	idxNext->bits = bits;
+	idxNext->crc = 0;
     if (window != NULL)
     {
 		ucsNext = index->ucs_list + index->have;
@@ -81,191 +200,1102 @@ local struct access *addpoint(struct access *index, int bits,
     return index;
 }
 
+/* Append an access point whose window is at window in the window file, -1
+   for none, to index (with ucs_offset), creating it if NULL.  If out of
+   memory, deallocate the index and return NULL. */
+struct access *index_point(struct access *index, int bits, off_t in,
+                           off_t out, off_t window)
+{
+    struct idx_point *idxNext;
+    off_t *ucsNext;
+
+    if (index == NULL) {
+        index = calloc(1, sizeof(struct access));
+        if (index == NULL)
+            return NULL;
+        index->ucs_stride = WINSIZE;
+    }
+    if (index->have == index->size) {
+        index->size = index->size ? index->size << 1 : 64;
+        idxNext = realloc(index->idx_list, sizeof(struct idx_point) * index->size);
+        if (idxNext != NULL)
+            index->idx_list = idxNext;
+        ucsNext = realloc(index->ucs_offset, sizeof(off_t) * index->size);
+        if (ucsNext != NULL)
+            index->ucs_offset = ucsNext;
+        if (idxNext == NULL || ucsNext == NULL) {
+            free_index(index);
+            return NULL;
+        }
+    }
+    idxNext = index->idx_list + index->have;
+    idxNext->out = out;
+    idxNext->in = in;
+    idxNext->bits = bits;
+    idxNext->crc = 0;
+    index->ucs_offset[index->have++] = window;
+    return index;
+}
+
+/* Return the last access point at or before offset (bisection). */
+size_t find_point(struct access *index, off_t offset)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = index->have - 1;
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        if (index->idx_list[mid].out <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Queue the read of the compressed data of span k, up to the next access
+   point -- or with the file of idx mapped, point at it there.  The first span
+   read by an extract also starts with the byte holding the leading bits of
+   its access point. */
+local int queue_span(struct zi_io *io, zindexPtr idx, size_t k, int first,
+                     struct zi_ioreq *req)
+{
+    struct idx_point *pIdx = idx->data->idx_list + k;
+
+    req->fd = fileno(idx->zFile);
+    req->offset = pIdx->in - (first && pIdx->bits ? 1 : 0);
+    req->len = (size_t)(pIdx[1].in - req->offset);
+    if (idx->zMap != NULL) {
+        ziio_mapped(req, idx->zMap, idx->zMapSize);
+        return Z_OK;
+    }
+    req->buf = ziio_buffer(io, (unsigned)k, req->len);
+    if (req->buf == NULL)
+        return Z_MEM_ERROR;
+    return ziio_submit(io, req);
+}
+
+/* running check of the output of extract() against the span checksums */
+struct span_check {
+    struct access *index;
+    size_t span;                /* span being decoded */
+    off_t pos;                  /* uncompressed offset reached */
+    uint32_t crc;               /* of the output of span so far */
+};
+
+/* Add n bytes of output at p to the check, return ZI_CRC_ERROR if a span
+   completed with a wrong checksum. */
+local int check_output(struct span_check *chk, const unsigned char *p,
+                       size_t n)
+{
+    size_t m;
+    off_t end;
+
+    while (n > 0 && chk->span + 1 < chk->index->have) {
+        end = chk->index->idx_list[chk->span + 1].out;
+        m = (off_t)n < end - chk->pos ? n : (size_t)(end - chk->pos);
+        chk->crc = zi_crc32(chk->crc, p, m);
+        chk->pos += (off_t)m;
+        p += m;
+        n -= m;
+        if (chk->pos == end) {
+            if (chk->crc != chk->index->idx_list[chk->span].crc)
+                return ZI_CRC_ERROR;
+            chk->span++;
+            chk->crc = 0;
+        }
+    }
+    return Z_OK;
+}
+
+/* where inflate_range() hands its output when it is not read into a buffer */
+struct range_sink {
+    off_t left;                 /* bytes still to hand over */
+    zi_sink put;
+    void *user;
+};
+
 /* Use the index to read len bytes from offset into buf, return bytes read or
    negative for error (Z_DATA_ERROR or Z_MEM_ERROR).  If data is requested past
    the end of the uncompressed data, then extract() will return a value less
    than len, indicating how much as actually read into buf.  This function
    should not return a data error unless the file was modified since the index
    was generated.  extract() may also return Z_ERRNO if there is an error on
-   reading or seeking the input file. */
-local int extract(FILE *in, struct access *index, FILE *ucsFile,
-				off_t offset, unsigned char *buf, int len)
+   reading the input file.  The compressed data of the spans covering the
+   request and the window are read through io, up to ZI_IO_DEPTH spans ahead
+   of the one being inflated.  If cancel is not NULL and becomes non-zero,
+   extract() gives up at the next window or span and returns ZI_CANCELED.  If
+   verify is true and the index has checksums, every span touched is decoded
+   to its end and checked, failing with ZI_CRC_ERROR on a mismatch.  If sink
+   is not NULL, buf is only a buffer of len bytes: sink->left bytes from
+   offset are handed to sink->put() through it as they are decoded, and Z_OK
+   is returned when they all were. */
+local int inflate_range(zindexPtr idx, struct zi_io *io, off_t offset,
+                        unsigned char *buf, int len,
+                        const volatile int *cancel, int verify,
+                        struct range_sink *sink)
 {
-    int ret, skip;
-    z_stream strm;
-    size_t counter;
+    int ret, skip, fill, have, raw, trailer;
+    long got;
+    z_stream *strm;
+    size_t here, last, next, cur;
+    off_t stop;
+    struct access *index = idx->data;
     struct idx_point *pIdxHere;
     struct ucs_point *pUcsHere;
-    unsigned char input[CHUNK];
-    unsigned char discard[WINSIZE];
-    struct ucs_point ucsHere;
+    unsigned char *discard;
+    struct ucs_point *ucsHere;
+    struct zi_ioreq ucsReq;
+    struct zi_ioreq spanReq[ZI_IO_DEPTH];
+    struct span_check chk;
 
     /* proceed only if something reasonable to do */
-    if (len < 0)
+    if (len <= 0 || index->have == 0 || (sink != NULL && sink->left <= 0))
+        return 0;
+    last = index->have - 1;
+    if (offset >= index->idx_list[last].out)
         return 0;
+    stop = offset + (sink != NULL ? sink->left : len);
+    verify = verify && (index->flags & ZI_HAVE_CRC);
 
-    /* find where in stream to start */
-    pIdxHere = index->idx_list;
-    pUcsHere = index->ucs_list;
-    ret = index->have;
-    counter = 0;
-    while (--ret && pIdxHere[1].out <= offset)
-    {
-        pIdxHere++;
-        if (pUcsHere != NULL)
-        	++pUcsHere;
-        else
-        	++counter;
-    }
-    if (pUcsHere == NULL) {
-    	if (ucsFile == NULL)
-    		return Z_DATA_ERROR;
-    	/*fseeko(ucsFile, (off_t)(WINSIZE * counter), SEEK_SET);*/
-    	fseek(ucsFile, (int) (WINSIZE * counter), SEEK_SET);
-    	if (fread(&ucsHere.window, WINSIZE, 1u, ucsFile) < 1u)
-    		return Z_DATA_ERROR;
-    	/*ucsHere.bits = 0;*/
-    	pUcsHere = &ucsHere;
-    }
-    /* initialize file and inflate state to start there */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit2(&strm, -15);         /* raw inflate */
-    if (ret != Z_OK)
+    /* find where in stream to start, queue the window and the spans */
+    here = find_point(index, offset);
+    if (index->flags & ZI_ZSTD)
+        return zst_extract(idx, io, here, offset, buf, len, cancel);
+    if (index->flags & ZI_CHUNKED)
+        return chunks_extract(idx, offset, buf, len, cancel);
+    discard = ziio_scratch(io);             /* WINSIZE to skip, then window */
+    ucsHere = (struct ucs_point *)(discard + WINSIZE);
+    pIdxHere = index->idx_list + here;
+    if (index->ucs_list != NULL)
+        pUcsHere = index->ucs_list + here;
+    else if (index->ucs_offset != NULL && index->ucs_offset[here] < 0)
+        pUcsHere = NULL;                    /* member start, no window */
+    else {
+        if (idx->ucsFile == NULL)
+            return Z_DATA_ERROR;
+        ucsReq.fd = fileno(idx->ucsFile);
+        ucsReq.offset = index->ucs_offset != NULL ? index->ucs_offset[here] :
+                        index->ucs_base + index->ucs_stride * (off_t)here;
+        ucsReq.len = WINSIZE;
+        ucsReq.buf = ucsHere->window;
+        if (ziio_submit(io, &ucsReq) != Z_OK)
+            return Z_ERRNO;
+        pUcsHere = ucsHere;
+    }
+    ret = Z_OK;
+    for (next = here; ret == Z_OK && next < last && next - here < ZI_IO_DEPTH &&
+         (next == here || index->idx_list[next].out < stop); ++next)
+        ret = queue_span(io, idx, next, next == here,
+                         spanReq + next % ZI_IO_DEPTH);
+
+    /* reset the inflate state of io to start there */
+    strm = NULL;
+    if (ret == Z_OK && (strm = ziio_inflate(io)) == NULL)
+        ret = Z_MEM_ERROR;
+    if (ret != Z_OK) {
+        ziio_drain(io);
         return ret;
-    ret = fseek(in, (long) ( pIdxHere->in - (pIdxHere->bits ? 1 : 0) ), SEEK_SET);
-    if (ret == -1)
+    }
+    if (pUcsHere == ucsHere && ziio_wait(io, &ucsReq) < (long)WINSIZE) {
+        ret = Z_DATA_ERROR;
+        goto extract_ret;
+    }
+    got = ziio_wait(io, spanReq + here % ZI_IO_DEPTH);
+    if (got < 1) {
+        ret = got < 0 ? Z_ERRNO : Z_DATA_ERROR;
         goto extract_ret;
+    }
+    strm->next_in = spanReq[here % ZI_IO_DEPTH].buf;
+    strm->avail_in = (unsigned)got;
     if (pIdxHere->bits) {
-        ret = getc(in);
-        if (ret == -1) {
-          ret = ferror(in) ? Z_ERRNO : Z_DATA_ERROR;
-            goto extract_ret;
-        }
-        (void)inflatePrime(&strm, pIdxHere->bits, ret >> (8 - pIdxHere->bits));
+        ret = *strm->next_in++;
+        strm->avail_in--;
+        (void)inflatePrime(strm, pIdxHere->bits, ret >> (8 - pIdxHere->bits));
     }
-    (void)inflateSetDictionary(&strm, pUcsHere->window, WINSIZE);
+    if (pUcsHere != NULL)
+        (void)inflateSetDictionary(strm, pUcsHere->window, WINSIZE);
+    raw = 1;
+    trailer = 0;
+    cur = here + 1;                         /* next span to inflate */
+    chk.index = index;
+    chk.span = here;
+    chk.pos = pIdxHere->out;
+    chk.crc = 0;
 
-    /* skip uncompressed bytes until offset reached, then satisfy request */
+    /* skip uncompressed bytes until offset reached, then satisfy request, and
+       when verifying go on to the end of the span */
     offset -= pIdxHere->out;
-    strm.avail_in = 0;
     skip = 1;                               /* while skipping to offset */
+    have = 0;
     do {
+        if (cancel != NULL && *cancel) {
+            ret = ZI_CANCELED;
+            goto extract_ret;
+        }
         /* define where to put uncompressed data, and how much */
-        if (offset == 0 && skip) {          /* at offset now */
-            strm.avail_out = len;
-            strm.next_out = buf;
+        fill = 0;
+        if (offset == 0 && (skip || (sink != NULL && sink->left > 0))) {
+            strm->avail_out = sink != NULL && sink->left < len ?
+                              (unsigned)sink->left : (unsigned)len;
+            strm->next_out = buf;           /* at offset now */
             skip = 0;                       /* only do this once */
+            fill = 1;
+        }
+        else if (!skip) {                   /* rest of the span to check */
+            got = (long)(index->idx_list[chk.span + 1].out - chk.pos);
+            strm->avail_out = got < (long)WINSIZE ? (unsigned)got : WINSIZE;
+            strm->next_out = discard;
         }
         if (offset > WINSIZE) {             /* skip WINSIZE bytes */
-            strm.avail_out = WINSIZE;
-            strm.next_out = discard;
+            strm->avail_out = WINSIZE;
+            strm->next_out = discard;
             offset -= WINSIZE;
         }
         else if (offset != 0) {             /* last skip */
-            strm.avail_out = (unsigned)offset;
-            strm.next_out = discard;
+            strm->avail_out = (unsigned)offset;
+            strm->next_out = discard;
             offset = 0;
         }
 
         /* uncompress until avail_out filled, or end of stream */
         do {
-            if (strm.avail_in == 0) {
-                strm.avail_in = fread(input, 1, CHUNK, in);
-                if (ferror(in)) {
-                    ret = Z_ERRNO;
+            if (strm->avail_in == 0) {
+                /* move on to the next span, keep the queue full behind it */
+                if (cur >= last) {
+                    ret = Z_DATA_ERROR;
                     goto extract_ret;
                 }
-                if (strm.avail_in == 0) {
-                    ret = Z_DATA_ERROR;
+                if (cancel != NULL && *cancel) {
+                    ret = ZI_CANCELED;
                     goto extract_ret;
                 }
-                strm.next_in = input;
+                if (cur == next) {
+                    ret = queue_span(io, idx, next, 0,
+                                     spanReq + next % ZI_IO_DEPTH);
+                    if (ret != Z_OK)
+                        goto extract_ret;
+                    next++;
+                }
+                got = ziio_wait(io, spanReq + cur % ZI_IO_DEPTH);
+                if (got < 1) {
+                    ret = got < 0 ? Z_ERRNO : Z_DATA_ERROR;
+                    goto extract_ret;
+                }
+                strm->next_in = spanReq[cur % ZI_IO_DEPTH].buf;
+                strm->avail_in = (unsigned)got;
+                cur++;
+                if (next < last && next - cur < ZI_IO_DEPTH - 1 &&
+                    index->idx_list[next].out < stop) {
+                    ret = queue_span(io, idx, next, 0,
+                                     spanReq + next % ZI_IO_DEPTH);
+                    if (ret != Z_OK)
+                        goto extract_ret;
+                    next++;
+                }
             }
-            ret = inflate(&strm, Z_NO_FLUSH);       /* normal inflate */
+            if (trailer) {                  /* skip the end of a member */
+                got = strm->avail_in < (unsigned)trailer ? (long)strm->avail_in : trailer;
+                strm->next_in += got;
+                strm->avail_in -= (unsigned)got;
+                trailer -= (int)got;
+                if (strm->avail_in == 0)
+                    continue;
+            }
+            got = strm->avail_out;
+            ret = inflate(strm, Z_NO_FLUSH);       /* normal inflate */
             if (ret == Z_NEED_DICT)
                 ret = Z_DATA_ERROR;
             if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
                 goto extract_ret;
+            got -= strm->avail_out;
+            ziio_stats(io)->decoded += got;
+            if (verify) {
+                if (check_output(&chk, strm->next_out - got, (size_t)got) != Z_OK) {
+                    ret = ZI_CRC_ERROR;
+                    goto extract_ret;
+                }
+            }
+            if (ret == Z_STREAM_END) {
+                /* end of a gzip member, go on with the next one if the spans
+                   go on -- raw inflate leaves its trailer to us */
+                if (raw)
+                    trailer = 8;
+                if (cur >= last && strm->avail_in <= (unsigned)trailer)
+                    break;
+                raw = 0;
+                ret = inflateReset2(strm, 31);
+                if (ret != Z_OK)
+                    goto extract_ret;
+            }
+        } while (strm->avail_out != 0);
+        if (fill && sink != NULL) {        /* hand over, reuse buf */
+            got = (long)(strm->next_out - buf);
+            sink->left -= got;
+            if (got > 0 && sink->put(buf, (size_t)got, sink->user) != 0) {
+                ret = ZI_CANCELED;
+                goto extract_ret;
+            }
             if (ret == Z_STREAM_END)
-                break;
-        } while (strm.avail_out != 0);
+                sink->left = 0;             /* the data ends before */
+        }
+        else if (fill)
+            have = len - strm->avail_out;
 
         /* if reach end of stream, then don't keep trying to get more */
         if (ret == Z_STREAM_END)
             break;
         /* do until offset reached and requested data read, or stream ends */
-    } while (skip);
+    } while (skip || (sink != NULL && sink->left > 0) ||
+             (verify && chk.pos != index->idx_list[chk.span].out));
 
-    /* compute number of uncompressed bytes read after offset */
-    ret = skip ? 0 : len - strm.avail_out;
+    /* return number of uncompressed bytes read after offset */
+    ret = have;
 
     /* clean up and return bytes read or error */
   extract_ret:
-    (void)inflateEnd(&strm);
+    ziio_drain(io);
     return ret;
 }
 
+/* Copy want bytes from offset from of the span of n bytes at start to buf if
+   a cache of idx has it: the one in shared memory first (zishm.c), then the
+   one on disk (zidisk.c), a span found there being shared if buf has it all.
+   Returns Z_OK or Z_BUF_ERROR. */
+local int span_cached(zindexPtr idx, off_t start, off_t n, off_t from,
+                      unsigned char *buf, size_t want)
+{
+    if (idx->shm != NULL &&
+        zi_shm_get(idx->shm, start, n, from, buf, want) == Z_OK)
+        return Z_OK;
+    if (idx->disk == NULL ||
+        zi_disk_get(idx->disk, start, n, from, buf, want) != Z_OK)
+        return Z_BUF_ERROR;
+    if (idx->shm != NULL && from == 0 && (off_t)want == n)
+        (void)zi_shm_put(idx->shm, start, buf, want);
+    return Z_OK;
+}
+
+/* Same as inflate_range() without sink, through the span caches of idx if it
+   has any: spans found there are copied from them, the others are decoded
+   whole and added to them.  Not used when verifying. */
+local int cached_range(zindexPtr idx, struct zi_io *io, off_t offset,
+                       unsigned char *buf, int len, const volatile int *cancel,
+                       int verify)
+{
+    struct access *index = idx->data;
+    struct idx_point *span;
+    unsigned char *whole;
+    off_t end, n, from;
+    int done, want, ret;
+
+    if ((idx->disk == NULL && idx->shm == NULL) || verify || (index->flags & (ZI_ZSTD | ZI_CHUNKED)))
+        return inflate_range(idx, io, offset, buf, len, cancel, verify, NULL);
+    end = index->idx_list[index->have - 1].out;
+    if (len <= 0 || offset >= end)
+        return 0;
+    if ((off_t)len > end - offset)
+        len = (int)(end - offset);
+    for (done = 0; done < len; done += want) {
+        span = index->idx_list + find_point(index, offset + done);
+        n = span[1].out - span->out;
+        from = offset + done - span->out;
+        want = n - from < (off_t)(len - done) ? (int)(n - from) : len - done;
+        if (span_cached(idx, span->out, n, from, buf + done,
+                        (size_t)want) == Z_OK) {
+            ziio_stats(io)->hits++;
+            continue;
+        }
+
+        /* not there: decode all of the span, into buf if it is all wanted */
+        whole = NULL;
+        if (n <= ZI_DISK_SPAN)
+            whole = from == 0 && want == n ? buf + done : malloc((size_t)n);
+        if (whole == NULL) {
+            ret = inflate_range(idx, io, offset + done, buf + done, len - done,
+                                cancel, 0, NULL);
+            return ret < 0 ? ret : done + ret;
+        }
+        ziio_stats(io)->misses++;
+        ret = inflate_range(idx, io, span->out, whole, (int)n, cancel, 0, NULL);
+        if (ret == n && idx->shm != NULL)
+            (void)zi_shm_put(idx->shm, span->out, whole, (size_t)n);
+        if (ret == n && idx->disk != NULL)
+            (void)zi_disk_put(idx->disk, span->out, whole, (size_t)n);
+        if (whole != buf + done) {
+            if (ret > from)
+                memcpy(buf + done, whole + from,
+                       (size_t)(ret - from < want ? ret - from : want));
+            free(whole);
+        }
+        if (ret < 0)
+            return ret;
+        if (ret < n)                        /* the data ends before */
+            return done + (ret > from ? (int)(ret - from < want ? ret - from : want) : 0);
+    }
+    return len;
+}
+
+/* Same as inflate_range(), but the parts of the request at the start or end
+   that lie in zero runs of the index are filled in with zeros instead of
+   being inflated -- a read all in one is not decompressed at all.  When
+   verifying, everything is inflated. */
+local int extract(zindexPtr idx, struct zi_io *io, off_t offset,
+                  unsigned char *buf, int len, const volatile int *cancel,
+                  int verify)
+{
+    struct access *index = idx->data;
+    struct zero_run *run;
+    off_t end, stop;
+    int head, ret;
+
+    if (len <= 0 || index->nzeros == 0 || verify)
+        return cached_range(idx, io, offset, buf, len, cancel, verify);
+    end = index->idx_list[index->have - 1].out;
+    if (offset >= end)
+        return 0;
+    if ((off_t)len > end - offset)
+        len = (int)(end - offset);
+    stop = offset + len;
+
+    /* starting in a run: zeros up to its end, the rest decoded */
+    run = find_zero(index, offset);
+    if (run != NULL && offset < run->start + run->len) {
+        head = run->start + run->len < stop ? (int)(run->start + run->len - offset) : len;
+        memset(buf, 0, (size_t)head);
+        if (head == len)
+            return len;
+        ret = extract(idx, io, offset + head, buf + head, len - head, cancel, verify);
+        return ret < 0 ? ret : head + ret;
+    }
+
+    /* ending in a run: decode up to its start only */
+    run = find_zero(index, stop - 1);
+    if (run != NULL && run->start > offset && stop <= run->start + run->len) {
+        ret = cached_range(idx, io, offset, buf, (int)(run->start - offset), cancel,
+                           verify);
+        if (ret != (int)(run->start - offset))
+            return ret;
+        memset(buf + ret, 0, (size_t)(stop - run->start));
+        return len;
+    }
+    return cached_range(idx, io, offset, buf, len, cancel, verify);
+}
+
+/* Thread-safe positioned read of len bytes at offset, not moving the file
+   position of idx.  Each thread has to bring its own I/O context; returns the
+   same as extract(). */
+int zi_extract(zindexPtr idx, struct zi_io *io, off_t offset,
+               unsigned char *buf, int len, const volatile int *cancel)
+{
+    if (idx == NULL || io == NULL)
+        return Z_STREAM_ERROR;
+    return extract(idx, io, offset, buf, len, cancel, idx->verify);
+}
+
+/* Decode len bytes from offset, handing them to put() in pieces of up to
+   size bytes, through buf, as they come out of inflate -- a pass over a
+   region without holding it, the pieces still in cache.  Seekable zstd is
+   decoded a frame at a time instead, a chunked file a volume at a time.  The
+   pieces are size bytes except the last.  Returns the number of bytes
+   handed over (less than len at the end of the data) or a negative error,
+   ZI_CANCELED if put() returned non-zero or cancel became non-zero. */
+off_t zi_extract_each(zindexPtr idx, struct zi_io *io, off_t offset, off_t len,
+                      unsigned char *buf, int size, zi_sink put, void *user,
+                      const volatile int *cancel)
+{
+    struct access *index;
+    struct range_sink sink;
+    unsigned char *frame;
+    off_t done, n;
+    size_t k;
+    int ret, got, i;
+
+    if (idx == NULL || io == NULL || put == NULL || buf == NULL || size <= 0 || len < 0)
+        return Z_STREAM_ERROR;
+    index = idx->data;
+    if (!(index->flags & (ZI_ZSTD | ZI_CHUNKED))) {
+        sink.left = len;
+        sink.put = put;
+        sink.user = user;
+        ret = inflate_range(idx, io, offset, buf, size, cancel, idx->verify, &sink);
+        return ret < 0 ? ret : len - sink.left;
+    }
+
+    /* frames (volumes) are decoded whole, so one at a time */
+    done = 0;
+    while (done < len && offset + done < index->idx_list[index->have - 1].out) {
+        k = find_point(index, offset + done);
+        n = index->idx_list[k + 1].out - (offset + done);
+        if (n > len - done)
+            n = len - done;
+        frame = (unsigned char *) malloc((size_t)n);
+        if (frame == NULL)
+            return Z_MEM_ERROR;
+        got = index->flags & ZI_ZSTD ?
+              zst_extract(idx, io, k, offset + done, frame, (int)n, cancel) :
+              chunks_extract(idx, offset + done, frame, (int)n, cancel);
+        for (i = 0; got > 0 && i < got; i += size)
+            if (put(frame + i, (size_t)(got - i < size ? got - i : size), user) != 0)
+                got = ZI_CANCELED;
+        free(frame);
+        if (got <= 0)
+            return got < 0 ? got : done;
+        done += got;
+    }
+    return done;
+}
+
+/* Decode span of idx completely into buf, which must hold it, and check it
+   against its CRC-32.  Returns Z_OK, ZI_CRC_ERROR or another error. */
+int zi_verify_span(zindexPtr idx, struct zi_io *io, size_t span,
+                   unsigned char *buf)
+{
+    struct access *index;
+    off_t len;
+    int ret;
+
+    if (idx == NULL || io == NULL || span + 1 >= idx->data->have)
+        return Z_STREAM_ERROR;
+    index = idx->data;
+    if (!(index->flags & ZI_HAVE_CRC))
+        return Z_STREAM_ERROR;
+    len = index->idx_list[span + 1].out - index->idx_list[span].out;
+    if (len == 0)
+        return index->idx_list[span].crc == 0 ? Z_OK : ZI_CRC_ERROR;
+    ret = extract(idx, io, index->idx_list[span].out, buf, (int)len, NULL, 1);
+    if (ret >= 0)
+        ret = ret == len ? Z_OK : Z_DATA_ERROR;
+    return ret;
+}
+
+/* Switch checking of the decoded spans against their CRC-32 on or off for all
+   reads of idx, return 1 if the index has checksums to check with. */
+int zi_set_verify(zindexPtr idx, int verify)
+{
+    if (idx == NULL)
+        return 0;
+    idx->verify = verify;
+    return (idx->data->flags & ZI_HAVE_CRC) ? 1 : 0;
+}
+
 /* Deallocate an index built by build_index() */
 void free_index(struct access *index)
 {
     if (index != NULL) {
     	if (index->ucs_list != NULL)
     		free(index->ucs_list);
+        free(index->ucs_offset);
+        free(index->store);
+        free(index->lines);
+        free(index->marks);
+        free(index->zeros);
+        free_zones(index->zones);
         free(index->idx_list);
         free(index);
     }
 }
 
+/* Store the n low bytes of val at p, little-endian. */
+void zi_put_le(unsigned char *p, uint64_t val, int n)
+{
+    while (n--) {
+        *p++ = (unsigned char)(val & 0xff);
+        val >>= 8;
+    }
+}
+
+/* Return the n bytes at p as a little-endian number. */
+uint64_t zi_get_le(const unsigned char *p, int n)
+{
+    uint64_t val = 0;
+
+    while (n--)
+        val = (val << 8) | p[n];
+    return val;
+}
+
+/* Write one record of a format 2 .idx file. */
+local int put_record(FILE *idxFile, uint32_t type, const unsigned char *data,
+                     uint32_t len)
+{
+    unsigned char head[8];
+
+    zi_put_le(head, type, 4);
+    zi_put_le(head + 4, len, 4);
+    if (fwrite(head, 8, 1u, idxFile) != 1u ||
+        (len && fwrite(data, len, 1u, idxFile) != 1u))
+        return Z_ERRNO;
+    return Z_OK;
+}
+
+local int put_point(FILE *idxFile, const struct idx_point *pIdx)
+{
+    unsigned char rec[20];
+
+    zi_put_le(rec, (uint64_t)pIdx->out, 8);
+    zi_put_le(rec + 8, (uint64_t)pIdx->in, 8);
+    zi_put_le(rec + 16, (uint64_t)pIdx->bits, 4);
+    return put_record(idxFile, ZI_REC_POINT, rec, 20);
+}
+
+local int put_crc(FILE *idxFile, size_t span, uint32_t crc)
+{
+    unsigned char rec[12];
+
+    zi_put_le(rec, (uint64_t)span, 8);
+    zi_put_le(rec + 8, crc, 4);
+    return put_record(idxFile, ZI_REC_CRC, rec, 12);
+}
+
+local int put_lines(FILE *idxFile, size_t point, off_t lines)
+{
+    unsigned char rec[16];
+
+    zi_put_le(rec, (uint64_t)point, 8);
+    zi_put_le(rec + 8, (uint64_t)lines, 8);
+    return put_record(idxFile, ZI_REC_LINES, rec, 16);
+}
+
+local int put_window(FILE *idxFile, size_t point, off_t offset)
+{
+    unsigned char rec[16];
+
+    zi_put_le(rec, (uint64_t)point, 8);
+    zi_put_le(rec + 8, (uint64_t)offset, 8);
+    return put_record(idxFile, ZI_REC_WINDOW, rec, 16);
+}
+
+local int put_zero(FILE *idxFile, off_t start, off_t len)
+{
+    unsigned char rec[16];
+
+    zi_put_le(rec, (uint64_t)start, 8);
+    zi_put_le(rec + 8, (uint64_t)len, 8);
+    return put_record(idxFile, ZI_REC_ZERO, rec, 16);
+}
+
+/* Write an open-stream record: the input ends inside a deflate stream at
+   access point k, with trailer bytes of check after the stream. */
+local int put_open(FILE *idxFile, int k, int trailer)
+{
+    unsigned char rec[12];
+
+    zi_put_le(rec, (uint64_t)k, 8);
+    zi_put_le(rec + 8, (uint64_t)trailer, 4);
+    return put_record(idxFile, ZI_REC_OPEN, rec, 12);
+}
+
+/* Write the closing record of an index of have access points, the last one at
+   the end of the data; an index without one is not read. */
+local int put_end(FILE *idxFile, size_t have)
+{
+    unsigned char rec[8];
+
+    zi_put_le(rec, (uint64_t)have, 8);
+    return put_record(idxFile, ZI_REC_END, rec, 8);
+}
+
+local void put_double(unsigned char *p, double val)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &val, 8);
+    zi_put_le(p, bits, 8);
+}
+
+local double get_double(const unsigned char *p)
+{
+    uint64_t bits;
+    double val;
+
+    bits = zi_get_le(p, 8);
+    memcpy(&val, &bits, 8);
+    return val;
+}
+
+/* Write the zone maps: where they are, then the statistics of each zone. */
+local int put_zones(FILE *idxFile, const struct zone_maps *maps)
+{
+    unsigned char rec[48];
+    const struct zone_stats *z;
+    size_t k;
+
+    zi_put_le(rec, (uint64_t)maps->base, 8);
+    zi_put_le(rec + 8, (uint64_t)maps->unit, 8);
+    zi_put_le(rec + 16, (uint64_t)maps->datatype, 4);
+    if (put_record(idxFile, ZI_REC_ZONES, rec, 20) != Z_OK)
+        return Z_ERRNO;
+    for (k = 0; k < maps->have; ++k) {
+        z = maps->list + k;
+        zi_put_le(rec, (uint64_t)k, 8);
+        put_double(rec + 8, z->min);
+        put_double(rec + 16, z->max);
+        put_double(rec + 24, z->sum);
+        zi_put_le(rec + 32, z->count, 8);
+        zi_put_le(rec + 40, z->nonzero, 8);
+        if (put_record(idxFile, ZI_REC_ZONE, rec, 48) != Z_OK)
+            return Z_ERRNO;
+    }
+    return Z_OK;
+}
+
+/* Append the statistics of zone k, given in order, to maps. */
+local int get_zone(struct zone_maps *maps, const unsigned char *rec)
+{
+    struct zone_stats *next, *z;
+    size_t n = maps->have;
+
+    if (zi_get_le(rec, 8) != n)
+        return Z_OK;                        /* out of order, ignored */
+    if (n == 0 || (n >= 16 && (n & (n - 1)) == 0)) {
+        next = realloc(maps->list, sizeof(struct zone_stats) * (n ? n << 1 : 16));
+        if (next == NULL)
+            return Z_MEM_ERROR;
+        maps->list = next;
+    }
+    z = maps->list + n;
+    z->min = get_double(rec + 8);
+    z->max = get_double(rec + 16);
+    z->sum = get_double(rec + 24);
+    z->count = zi_get_le(rec + 32, 8);
+    z->nonzero = zi_get_le(rec + 40, 8);
+    maps->have++;
+    return Z_OK;
+}
+
+local int put_mark(FILE *idxFile, off_t line, off_t out)
+{
+    unsigned char rec[16];
+
+    zi_put_le(rec, (uint64_t)line, 8);
+    zi_put_le(rec + 8, (uint64_t)out, 8);
+    return put_record(idxFile, ZI_REC_LINE_MARK, rec, 16);
+}
+
+/* where build() puts the access points it finds: in memory, or written out to
+   an .idx and .ucs file right away, keeping memory use independent of the
+   size of the input */
+struct builder {
+    struct access *index;       /* in memory, or NULL */
+    FILE *idxFile;              /* or written to these */
+    FILE *ucsFile;
+    size_t have;                /* points so far */
+    int flags;                  /* ZI_BUILD_... */
+    off_t lines;                /* newlines in the output so far */
+    off_t mark;                 /* start of the last line marked */
+    off_t zero;                 /* start of the current zero run, or -1 */
+    int blockZero;              /* the current zero block is zero so far */
+    struct zi_zoner *zoner;     /* voxel statistics, or NULL */
+    FILE *prvFile;              /* preview pyramid goes here, or NULL */
+    struct zi_previewer *previewer;
+    const struct idx_point *from;   /* go on after this point, or NULL */
+    const unsigned char *fromWindow;    /* and its window */
+    int fromTrailer;            /* bytes of the trailer if it is inside a
+                                   deflate stream, 0 at the end of a member */
+    off_t rewrite;              /* .idx offset of its record, moved to the
+                                   start of the next member, or -1 */
+};
+
+/* A block boundary where a stream that is still being written can be taken
+   up again, with the state of the builder there (ZI_BUILD_GROWING). */
+struct open_point {
+    off_t in, out;
+    int bits;
+    unsigned left;              /* as for builder_point() */
+    uint32_t crc;
+    off_t pos;                  /* end of the .idx records */
+    off_t lines, mark, zero;
+    int blockZero;
+    unsigned char window[WINSIZE];
+};
+
+/* Record an access point; crc is that of the span ending here, and the window
+   is the sliding window with left bytes to its end that are older. */
+local int builder_point(struct builder *bld, int bits, off_t in, off_t out,
+                        unsigned left, unsigned char *window, uint32_t crc)
+{
+    struct idx_point point;
+
+    if (bld->idxFile == NULL) {
+        if (bld->index != NULL)
+            bld->index->idx_list[bld->index->have - 1].crc = crc;
+        bld->index = addpoint(bld->index, bits, in, out, left, window);
+        if (bld->index == NULL)
+            return Z_MEM_ERROR;
+        if ((bld->flags & ZI_BUILD_LINES) &&
+            set_lines(bld->index, bld->index->have - 1, bld->lines) != Z_OK)
+            return Z_MEM_ERROR;
+        bld->have++;
+        return Z_OK;
+    }
+
+    /* stream out: window, then point and checksum of the span before it, so
+       that a reader of a growing index never sees a point without window */
+    point.out = out;
+    point.in = in;
+    point.bits = bits;
+    if ((left && fwrite(window + WINSIZE - left, left, 1u, bld->ucsFile) != 1u) ||
+        (left < WINSIZE &&
+         fwrite(window, WINSIZE - left, 1u, bld->ucsFile) != 1u) ||
+        fflush(bld->ucsFile) != 0)
+        return Z_ERRNO;
+    if ((bld->have == 0 && fwrite(ZI_IDX_MAGIC, 8, 1u, bld->idxFile) != 1u) ||
+        put_point(bld->idxFile, &point) != Z_OK ||
+        ((bld->flags & ZI_BUILD_LINES) &&
+         put_lines(bld->idxFile, bld->have, bld->lines) != Z_OK) ||
+        (bld->have > 0 && put_crc(bld->idxFile, bld->have - 1, crc) != Z_OK) ||
+        fflush(bld->idxFile) != 0)
+        return Z_ERRNO;
+    bld->have++;
+    return Z_OK;
+}
+
+/* Move the last point of the index, at the end of a member, to the start of
+   the deflate data of the member appended after it: its record is written
+   over in place. */
+local int builder_rewrite(struct builder *bld, int bits, off_t in)
+{
+    unsigned char rec[28];
+
+    zi_put_le(rec, ZI_REC_POINT, 4);
+    zi_put_le(rec + 4, 20, 4);
+    zi_put_le(rec + 8, (uint64_t)bld->from->out, 8);
+    zi_put_le(rec + 16, (uint64_t)in, 8);
+    zi_put_le(rec + 24, (uint64_t)bits, 4);
+    if (fflush(bld->idxFile) != 0 ||
+        pwrite(fileno(bld->idxFile), rec, sizeof(rec), bld->rewrite) != sizeof(rec))
+        return Z_ERRNO;
+    bld->rewrite = -1;
+    return Z_OK;
+}
+
+/* Count the newlines in the n bytes of output at p, which start at offset out,
+   and mark the start of a line after every ZI_LINE_GAP bytes or more. */
+local int builder_lines(struct builder *bld, const unsigned char *p, size_t n,
+                        off_t out)
+{
+    const unsigned char *start = p, *end = p + n, *nl;
+
+    while (p < end && (nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        p = nl + 1;
+        bld->lines++;
+        if (out + (p - start) - bld->mark < ZI_LINE_GAP)
+            continue;
+        bld->mark = out + (p - start);
+        if (bld->idxFile != NULL) {
+            if (put_mark(bld->idxFile, bld->lines, bld->mark) != Z_OK)
+                return Z_ERRNO;
+        }
+        else if (bld->index != NULL &&
+                 add_mark(bld->index, bld->lines, bld->mark) != Z_OK)
+            return Z_MEM_ERROR;
+    }
+    return Z_OK;
+}
+
+/* End the current zero run at end, recording it if it is long enough. */
+local int builder_zero_end(struct builder *bld, off_t end)
+{
+    off_t start = bld->zero;
+
+    bld->zero = -1;
+    if (start < 0 || end - start < ZI_ZERO_MIN)
+        return Z_OK;
+    if (bld->idxFile != NULL)
+        return put_zero(bld->idxFile, start, end - start);
+    if (bld->index != NULL && add_zero(bld->index, start, end - start) != Z_OK)
+        return Z_MEM_ERROR;
+    return Z_OK;
+}
+
+/* Follow the n bytes of output at p, which start at offset out, in blocks of
+   ZI_ZERO_BLOCK, and record the runs of all-zero blocks. */
+local int builder_zeros(struct builder *bld, const unsigned char *p, size_t n,
+                        off_t out)
+{
+    size_t m;
+    int ret;
+
+    while (n > 0) {
+        m = ZI_ZERO_BLOCK - (size_t)(out % ZI_ZERO_BLOCK);
+        if (m > n)
+            m = n;
+        if (bld->blockZero && (p[0] != 0 || memcmp(p, p + 1, m - 1) != 0))
+            bld->blockZero = 0;
+        p += m;
+        n -= m;
+        out += (off_t)m;
+        if (out % ZI_ZERO_BLOCK == 0) {     /* block complete */
+            if (!bld->blockZero) {
+                ret = builder_zero_end(bld, out - ZI_ZERO_BLOCK);
+                if (ret != Z_OK)
+                    return ret;
+            }
+            else if (bld->zero < 0)
+                bld->zero = out - ZI_ZERO_BLOCK;
+            bld->blockZero = 1;
+        }
+    }
+    return Z_OK;
+}
+
+/* Return 1 if the n bytes at p start another gzip member of data, 0 for
+   anything else, including the members of an embedded index. */
+local int data_member(const unsigned char *p, unsigned n)
+{
+    if (n < 10 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8)
+        return 0;
+    return !((p[3] & 4) && n >= 14 && p[12] == 'Z' &&
+             (p[13] == 'W' || p[13] == 'X' || p[13] == 'L'));
+}
+
+/* Return how much of a mapping of size bytes to feed to inflate from *pos,
+   at most MAP_FEED, and move *pos past it. */
+local unsigned map_take(off_t *pos, off_t size)
+{
+    off_t n = size - *pos < MAP_FEED ? size - *pos : MAP_FEED;
+
+    *pos += n;
+    return (unsigned)n;
+}
+
 /* Make one entire pass through the compressed stream and build an index, with
-   access points about every span bytes of uncompressed output -- span is
-   chosen to balance the speed of random access against the memory requirements
-   of the list, about 32K bytes per access point.  Note that data after the end
-   of the first zlib or gzip stream in the file is ignored.  build_index()
-   returns the number of access points on success (>= 1), Z_MEM_ERROR for out
-   of memory, Z_DATA_ERROR for an error in the input file, or Z_ERRNO for a
-   file read error.  On success, *built points to the resulting index. */
-int build_index(FILE *in, off_t span, struct access **built)
+   access points about every span bytes of uncompressed output, handing them
+   to bld.  Concatenated gzip members are indexed as one stream.  If out is
+   not NULL every byte read from in -- including anything after the end of
+   the stream -- is also copied to out; otherwise, with ZINDEX_MMAP in the
+   environment, a regular file in is mapped and inflated in place instead of
+   being read into a buffer.  Returns Z_OK or an error as build_index(). */
+local int build(FILE *in, FILE *out, off_t span, struct builder *bld)
 {
     int ret;
     off_t totin, totout;        /* our own total counters to avoid 4GB limit */
     off_t last;                 /* totout value of last access point */
-    struct access *index;       /* access points being generated */
+    uint32_t spanCrc;           /* CRC-32 of the output since last point */
+    unsigned produced;          /* output of one inflate() call */
+    int trailer;                /* bytes after the deflate data, 0 if unknown */
+    int raw;                    /* inflating raw deflate data */
+    int open;                   /* the input ends inside a deflate stream */
+    int have;                   /* access points before this pass */
+    struct open_point *bnd;     /* last block boundary, ZI_BUILD_GROWING */
     z_stream strm;
+    unsigned char *map;         /* in mapped (ZINDEX_MMAP), or NULL */
+    off_t mapSize, mapPos;      /* its length, and what was fed to inflate */
     unsigned char input[CHUNK];
     unsigned char window[WINSIZE];
 
-    /* initialize inflate */
+    /* initialize inflate -- raw to take up a deflate stream in the middle */
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
     strm.avail_in = 0;
     strm.next_in = Z_NULL;
-    ret = inflateInit2(&strm, 47);      /* automatic zlib or gzip decoding */
+    raw = bld->from != NULL && bld->fromTrailer != 0;
+    ret = inflateInit2(&strm, raw ? -15 : 47);  /* else zlib or gzip */
     if (ret != Z_OK)
         return ret;
+    bld->zoner = NULL;
+    bld->previewer = NULL;
+    bnd = NULL;
+    map = NULL;
+    mapSize = mapPos = 0;
+    if (((bld->flags & ZI_BUILD_STATS) && (bld->zoner = zoner_open()) == NULL) ||
+        (bld->prvFile != NULL && (bld->previewer = previewer_open()) == NULL) ||
+        ((bld->flags & ZI_BUILD_GROWING) &&
+         (bnd = malloc(sizeof(struct open_point))) == NULL)) {
+        free_zones(zoner_close(bld->zoner));
+        if (bld->previewer != NULL)
+            (void)previewer_close(bld->previewer, NULL);
+        bld->zoner = NULL;
+        bld->previewer = NULL;
+        (void)inflateEnd(&strm);
+        return Z_MEM_ERROR;
+    }
 
     /* inflate the input, maintain a sliding window, and build an index -- this
        also validates the integrity of the compressed data using the check
        information at the end of the gzip or zlib stream */
     totin = totout = last = 0;
-    index = NULL;               /* will be allocated by first addpoint() */
+    spanCrc = 0;
+    trailer = bld->from != NULL ? 8 : 0;
+    open = 0;
+    have = bld->have;
+    memset(window, 0, WINSIZE); /* first window is stored before any output */
+    if (bnd != NULL) {
+        bnd->out = -1;
+        if (bld->from != NULL) {    /* nothing new yet */
+            bnd->out = bld->from->out;
+            bnd->pos = ftello(bld->idxFile);
+            bnd->lines = bld->lines;
+            bnd->mark = bld->mark;
+            bnd->zero = bld->zero;
+            bnd->blockZero = bld->blockZero;
+        }
+    }
+    if (bld->from != NULL) {
+        /* go on from the last point of an index: in is at bld->from->in, or
+           at the byte before it holding its first bits */
+        totin = bld->from->in;
+        totout = last = bld->from->out;
+        if (raw) {
+            trailer = bld->fromTrailer;
+            memcpy(window, bld->fromWindow, WINSIZE);
+            if (bld->from->bits) {
+                int c = getc(in);
+
+                if (c == EOF) {
+                    ret = ferror(in) ? Z_ERRNO : Z_DATA_ERROR;
+                    goto build_ret;
+                }
+                (void)inflatePrime(&strm, bld->from->bits,
+                                   c >> (8 - bld->from->bits));
+            }
+            (void)inflateSetDictionary(&strm, window, WINSIZE);
+        }
+    }
+    /* inflate straight from a mapping of a regular file, when asked to */
+    if (out == NULL && getenv("ZINDEX_MMAP") != NULL &&
+        (mapPos = ftello(in)) >= 0 &&
+        (map = ziio_mmap(fileno(in), &mapSize, ZI_IO_SEQUENTIAL)) != NULL &&
+        mapPos > mapSize) {
+        ziio_munmap(map, mapSize);
+        map = NULL;
+    }
     strm.avail_out = 0;
     do {
         /* get some compressed data from input file */
-        strm.avail_in = fread(input, 1, CHUNK, in);
-        if (ferror(in)) {
-            ret = Z_ERRNO;
-            goto build_index_error;
-        }
         if (strm.avail_in == 0) {
-            ret = Z_DATA_ERROR;
-            goto build_index_error;
+            if (map != NULL) {
+                strm.next_in = map + mapPos;
+                strm.avail_in = map_take(&mapPos, mapSize);
+            }
+            else {
+                strm.next_in = input;
+                strm.avail_in = fread(input, 1, CHUNK, in);
+            }
+            if (ferror(in)) {
+                ret = Z_ERRNO;
+                goto build_ret;
+            }
+            if (strm.avail_in == 0) {
+                if (bnd != NULL) {
+                    open = 1;
+                    break;
+                }
+                ret = Z_DATA_ERROR;
+                goto build_ret;
+            }
+            if (out != NULL &&
+                fwrite(input, 1, strm.avail_in, out) != strm.avail_in) {
+                ret = Z_ERRNO;
+                goto build_ret;
+            }
+            if (trailer == 0)   /* gzip or zlib */
+                trailer = strm.avail_in > 1 && strm.next_in[0] == 0x1f &&
+                          strm.next_in[1] == 0x8b ? 8 : 4;
         }
-        strm.next_in = input;
 
         /* process all of that, or until end of stream */
         do {
@@ -279,13 +1309,33 @@ int build_index(FILE *in, off_t span, struct access **built)
                update the total input and output counters */
             totin += strm.avail_in;
             totout += strm.avail_out;
+            produced = strm.avail_out;
             ret = inflate(&strm, Z_BLOCK);      /* return at end of block */
             totin -= strm.avail_in;
             totout -= strm.avail_out;
+            produced -= strm.avail_out;
+            spanCrc = zi_crc32(spanCrc, strm.next_out - produced, produced);
             if (ret == Z_NEED_DICT)
                 ret = Z_DATA_ERROR;
             if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
-                goto build_index_error;
+                goto build_ret;
+            if (produced) {
+                int err = builder_zeros(bld, strm.next_out - produced,
+                                        produced, totout - produced);
+                if (err == Z_OK && (bld->flags & ZI_BUILD_LINES))
+                    err = builder_lines(bld, strm.next_out - produced,
+                                        produced, totout - produced);
+                if (err == Z_OK && bld->zoner != NULL)
+                    err = zoner_feed(bld->zoner, strm.next_out - produced,
+                                     produced);
+                if (err == Z_OK && bld->previewer != NULL)
+                    err = previewer_feed(bld->previewer, strm.next_out - produced,
+                                         produced);
+                if (err != Z_OK) {
+                    ret = err;
+                    goto build_ret;
+                }
+            }
             if (ret == Z_STREAM_END)
                 break;
             /* if at end of block, consider adding an index entry (note that if
@@ -297,66 +1347,649 @@ int build_index(FILE *in, off_t span, struct access **built)
                index always has at least one access point; we avoid creating an
                access point after the last block by checking bit 6 of data_type
              */
-            if ((strm.data_type & 128) && !(strm.data_type & 64) &&
-                (totout == 0 || totout - last > span)) {
-                index = addpoint(index, strm.data_type & 7, totin,
-                                 totout, strm.avail_out, window);
-                if (index == NULL) {
-                    ret = Z_MEM_ERROR;
-                    goto build_index_error;
+            if ((strm.data_type & 128) && !(strm.data_type & 64)) {
+                if (bld->rewrite >= 0) {
+                    /* the point at the end of the last member moves here */
+                    ret = builder_rewrite(bld, strm.data_type & 7, totin);
+                    if (ret != Z_OK)
+                        goto build_ret;
+                }
+                else if (totout == 0 || totout - last > span) {
+                    ret = builder_point(bld, strm.data_type & 7, totin, totout,
+                                        strm.avail_out, window, spanCrc);
+                    if (ret != Z_OK)
+                        goto build_ret;
+                    spanCrc = 0;
+                    last = totout;
+                }
+                if (bnd != NULL) {
+                    bnd->in = totin;
+                    bnd->out = totout;
+                    bnd->bits = strm.data_type & 7;
+                    bnd->left = strm.avail_out;
+                    bnd->crc = spanCrc;
+                    bnd->pos = ftello(bld->idxFile);
+                    bnd->lines = bld->lines;
+                    bnd->mark = bld->mark;
+                    bnd->zero = bld->zero;
+                    bnd->blockZero = bld->blockZero;
+                    memcpy(bnd->window, window, WINSIZE);
                 }
-                last = totout;
             }
         } while (strm.avail_in != 0);
-    } while (ret != Z_STREAM_END);
 
-    /* ADD AP AFTER LAST BLOCK */
-    index = addpoint(index, strm.data_type & 7, totin, totout, strm.avail_out, window);
-    if (index == NULL) {
-        ret = Z_MEM_ERROR;
-        goto build_index_error;
+        /* at the end of a gzip member, look whether another one follows */
+        if (ret == Z_STREAM_END) {
+            if (strm.avail_in < (unsigned)trailer + 14 && map != NULL)
+                strm.avail_in += map_take(&mapPos, mapSize);    /* follows */
+            else if (strm.avail_in < (unsigned)trailer + 14 && !feof(in)) {
+                size_t got;
+
+                memmove(input, strm.next_in, strm.avail_in);
+                got = fread(input + strm.avail_in, 1, CHUNK - strm.avail_in, in);
+                if (ferror(in) ||
+                    (out != NULL && fwrite(input + strm.avail_in, 1, got, out) != got)) {
+                    ret = Z_ERRNO;
+                    goto build_ret;
+                }
+                strm.next_in = input;
+                strm.avail_in += (unsigned)got;
+            }
+            if (raw) {
+                /* raw inflate leaves the trailer to us -- no check here */
+                if (strm.avail_in < (unsigned)trailer) {
+                    if (bnd == NULL) {
+                        ret = Z_DATA_ERROR;
+                        goto build_ret;
+                    }
+                    open = 1;
+                    break;
+                }
+                strm.next_in += trailer;
+                strm.avail_in -= trailer;
+                totin += trailer;
+                raw = 0;
+                ret = inflateReset2(&strm, 47);
+                if (ret != Z_OK)
+                    goto build_ret;
+            }
+            trailer = 8;
+            if (!data_member(strm.next_in, strm.avail_in))
+                break;
+            ret = inflateReset(&strm);
+            if (ret != Z_OK)
+                goto build_ret;
+        }
+    } while (1);
+
+    if (open) {
+        /* the input stops inside a deflate stream that is still being
+           written: end the index at the last block boundary, with a record
+           for zi_update() to take it up from there */
+        if (bnd->out < 0 || bld->rewrite >= 0) {
+            ret = bld->have ? Z_OK : Z_DATA_ERROR;
+            goto build_ret;
+        }
+        if (fflush(bld->idxFile) != 0 ||
+            ftruncate(fileno(bld->idxFile), bnd->pos) != 0 ||
+            fseeko(bld->idxFile, bnd->pos, SEEK_SET) != 0) {
+            ret = Z_ERRNO;
+            goto build_ret;
+        }
+        bld->lines = bnd->lines;
+        bld->mark = bnd->mark;
+        bld->zero = bnd->zero;
+        bld->blockZero = bnd->blockZero;
+        ret = Z_OK;
+        if (bnd->out > last)
+            ret = builder_point(bld, bnd->bits, bnd->in, bnd->out, bnd->left,
+                                bnd->window, bnd->crc);
+        if (ret == Z_OK)
+            ret = builder_zero_end(bld, bnd->out - bnd->out % ZI_ZERO_BLOCK);
+        if (ret == Z_OK && (bld->have > (size_t)have || bld->from == NULL ||
+                            !bld->fromTrailer))
+            ret = put_open(bld->idxFile, bld->have - 1, trailer);
+        if (ret == Z_OK && fflush(bld->idxFile) != 0)
+            ret = Z_ERRNO;
+        if (ret != Z_OK)
+            goto build_ret;
+    }
+    else {
+        /* a zero run may go on to the end, through a partial last block */
+        ret = builder_zero_end(bld, bld->blockZero ? totout :
+                               totout - totout % ZI_ZERO_BLOCK);
+        if (ret != Z_OK)
+            goto build_ret;
+
+        /* ADD AP AFTER LAST BLOCK */
+        ret = builder_point(bld, strm.data_type & 7, totin, totout,
+                            strm.avail_out, window, spanCrc);
+        if (ret == Z_OK && bld->idxFile != NULL &&
+            (put_end(bld->idxFile, bld->have) != Z_OK ||
+             fflush(bld->idxFile) != 0))
+            ret = Z_ERRNO;
+        if (ret != Z_OK)
+            goto build_ret;
+    }
+
+    /* the voxel statistics go at the end of the index */
+    if (bld->zoner != NULL) {
+        struct zone_maps *maps = zoner_close(bld->zoner);
+
+        bld->zoner = NULL;
+        if (maps != NULL && bld->idxFile != NULL) {
+            ret = put_zones(bld->idxFile, maps);
+            free_zones(maps);
+            if (ret == Z_OK && fflush(bld->idxFile) != 0)
+                ret = Z_ERRNO;
+            if (ret != Z_OK)
+                goto build_ret;
+        }
+        else if (maps != NULL)
+            bld->index->zones = maps;
+    }
+
+    /* and the preview pyramid in a file of its own */
+    if (bld->previewer != NULL) {
+        ret = previewer_close(bld->previewer, bld->prvFile);
+        bld->previewer = NULL;
+        if (ret > 0 && fflush(bld->prvFile) != 0)
+            ret = Z_ERRNO;
+        if (ret < 0)
+            goto build_ret;
+        ret = Z_OK;
+    }
+
+    /* pass through whatever follows the stream */
+    if (out != NULL) {
+        size_t got;
+
+        while ((got = fread(input, 1, CHUNK, in)) > 0)
+            if (fwrite(input, 1, got, out) != got)
+                break;
+        if (ferror(in) || ferror(out) || fflush(out) != 0)
+            ret = Z_ERRNO;
+    }
+
+  build_ret:
+    if (map != NULL) {
+        ziio_munmap(map, mapSize);
+        (void)fseeko(in, mapPos, SEEK_SET);     /* where fread() would be */
+    }
+    free(bnd);
+    if (bld->zoner != NULL) {
+        free_zones(zoner_close(bld->zoner));
+        bld->zoner = NULL;
+    }
+    if (bld->previewer != NULL) {
+        (void)previewer_close(bld->previewer, NULL);
+        bld->previewer = NULL;
+    }
+    (void)inflateEnd(&strm);
+    return ret;
+}
+
+/* Make one entire pass through the compressed stream and build an index, with
+   access points about every span bytes of uncompressed output -- span is
+   chosen to balance the speed of random access against the memory requirements
+   of the list, about 32K bytes per access point.  Note that data after the end
+   of the last gzip member or of a zlib stream is ignored.  build_index()
+   returns the number of access points on success (>= 1), Z_MEM_ERROR for out
+   of memory, Z_DATA_ERROR for an error in the input file, or Z_ERRNO for a
+   file read error.  On success, *built points to the resulting index. */
+int build_index(FILE *in, off_t span, struct access **built)
+{
+    return build_index_tee(in, NULL, span, built);
+}
+
+/* Same as build_index(), but if out is not NULL every byte read from in --
+   including anything after the end of the stream -- is also copied to out, so
+   that a stream can be indexed while it is being copied.  A write error on
+   out is reported as Z_ERRNO. */
+int build_index_tee(FILE *in, FILE *out, off_t span, struct access **built)
+{
+    int ret;
+    struct access *index;
+    struct builder bld;
+
+    bld.index = NULL;           /* will be allocated by first addpoint() */
+    bld.idxFile = NULL;
+    bld.ucsFile = NULL;
+    bld.have = 0;
+    bld.flags = 0;
+    bld.lines = 0;
+    bld.mark = 0;
+    bld.zero = -1;
+    bld.blockZero = 1;
+    bld.prvFile = NULL;
+    bld.from = NULL;
+    bld.fromTrailer = 0;
+    bld.rewrite = -1;
+    ret = build(in, out, span, &bld);
+    index = bld.index;
+    if (ret != Z_OK) {
+        free_index(index);
+        return ret;
     }
 
-    /* clean up and return index (release unused entries in list) */
-    (void)inflateEnd(&strm);
+    /* release unused entries in list */
+    index->flags |= ZI_HAVE_CRC;
     index->idx_list = realloc(index->idx_list, sizeof(struct idx_point) * index->have);
     index->ucs_list = realloc(index->ucs_list, sizeof(struct ucs_point) * index->have);
     index->size = index->have;
     *built = index;
     return index->size;
+}
 
-    /* return error */
-  build_index_error:
-    (void)inflateEnd(&strm);
-    if (index != NULL)
+/* Same as build_index_tee(), but the index is written to idxFile and ucsFile
+   (format 2) while it is built, one access point and window at a time, so
+   that memory use stays the same for any size of input.  Returns the number of
+   access points written, or negative on error. */
+int build_index_stream(FILE *in, FILE *out, off_t span, FILE *idxFile,
+                       FILE *ucsFile)
+{
+    return build_index_flags(in, out, span, 0, idxFile, ucsFile);
+}
+
+/* Same as build_index_stream(), with the extras of flags recorded in the
+   index as well: ZI_BUILD_LINES counts the lines before every access point
+   and marks a line start about every ZI_LINE_GAP bytes, for zi_seek_line(). */
+int build_index_flags(FILE *in, FILE *out, off_t span, int flags,
+                      FILE *idxFile, FILE *ucsFile)
+{
+    return build_index_preview(in, out, span, flags, idxFile, ucsFile, NULL);
+}
+
+/* Same as build_index_flags(), and if prvFile is not NULL the preview pyramid
+   of a NIfTI image is written to it (zipreview.c), in the same pass; nothing
+   is written there for other data. */
+int build_index_preview(FILE *in, FILE *out, off_t span, int flags,
+                        FILE *idxFile, FILE *ucsFile, FILE *prvFile)
+{
+    int ret;
+    struct builder bld;
+
+    if (idxFile == NULL || ucsFile == NULL)
+        return Z_STREAM_ERROR;
+    bld.index = NULL;
+    bld.idxFile = idxFile;
+    bld.ucsFile = ucsFile;
+    bld.have = 0;
+    bld.flags = flags;
+    bld.lines = 0;
+    bld.mark = 0;
+    bld.zero = -1;
+    bld.blockZero = 1;
+    bld.prvFile = prvFile;
+    bld.from = NULL;
+    bld.fromTrailer = 0;
+    bld.rewrite = -1;
+    ret = build(in, out, span, &bld);
+    if (ret == Z_OK && fflush(ucsFile) != 0)
+        ret = Z_ERRNO;
+    return ret == Z_OK ? (int)bld.have : ret;
+}
+
+/* Find in the .idx records of idxFile, after its magic, the offset of the
+   record of the last access point of the index as last completed in *last,
+   where the records of that index end in *end (anything after is left from
+   an update that did not finish), and whether the input ends in a deflate
+   stream after that point: *trailer is then the number of bytes of its
+   trailer, else 0. */
+local int scan_open(FILE *idxFile, off_t *last, off_t *end, int *trailer)
+{
+    unsigned char head[8], rec[12];
+    uint32_t type, len;
+    off_t point;
+
+    point = -1;
+    *last = -1;
+    *end = -1;
+    *trailer = 0;
+    if (fseeko(idxFile, 8, SEEK_SET) != 0)
+        return Z_ERRNO;
+    while (fread(head, 8, 1u, idxFile) == 1u) {
+        type = (uint32_t)zi_get_le(head, 4);
+        len = (uint32_t)zi_get_le(head + 4, 4);
+        if (type == ZI_REC_POINT)
+            point = ftello(idxFile) - 8;
+        if ((type == ZI_REC_OPEN && len >= 12) || (type == ZI_REC_END && len >= 8)) {
+            if (fread(rec, len >= 12 ? 12 : 8, 1u, idxFile) != 1u)
+                break;
+            *trailer = type == ZI_REC_OPEN ? (int)zi_get_le(rec + 8, 4) : 0;
+            len -= len >= 12 ? 12 : 8;
+            *last = point;
+            *end = ftello(idxFile) + (off_t)len;
+        }
+        if (fseeko(idxFile, (off_t)len, SEEK_CUR) != 0)
+            return Z_ERRNO;
+    }
+    if (ferror(idxFile))
+        return Z_ERRNO;
+    return *last < 0 ? Z_DATA_ERROR : Z_OK;
+}
+
+/* Extend the index in idxFile and ucsFile, both open for reading and writing,
+   to the data appended to the gzip file zFile since the index was built with
+   ZI_BUILD_GROWING or last updated: inflating goes on from the last access
+   point, into new gzip members or the rest of a stream that was still being
+   written, and the new points are appended.  Returns the number of access
+   points added, 0 if there is nothing new, or negative on error --
+   Z_STREAM_ERROR for an index of format 1 or with its windows in a store or
+   placed by zi_densify(). */
+int zi_update(FILE *zFile, FILE *idxFile, FILE *ucsFile, off_t span)
+{
+    int ret, trailer;
+    size_t have;
+    off_t last, end;
+    struct access *index;
+    struct idx_point from;
+    struct builder bld;
+    unsigned char window[WINSIZE], head[14];
+    char magic[8];
+
+    if (zFile == NULL || idxFile == NULL || ucsFile == NULL)
+        return Z_STREAM_ERROR;
+    if (fseeko(idxFile, 0, SEEK_SET) != 0)
+        return Z_ERRNO;
+    if (fread(magic, 8, 1u, idxFile) != 1u ||
+        memcmp(magic, ZI_IDX_MAGIC, 8) != 0)
+        return Z_STREAM_ERROR;
+    ret = scan_open(idxFile, &last, &end, &trailer);
+    if (ret != Z_OK)
+        return ret;
+    if (fseeko(idxFile, 0, SEEK_SET) != 0)
+        return Z_ERRNO;
+    index = NULL;
+    ret = read_index(idxFile, &index);
+    if (ret <= 0)
+        return ret < 0 ? ret : Z_DATA_ERROR;
+    if (index->store != NULL || index->ucs_offset != NULL) {
         free_index(index);
-    return ret;
+        return Z_STREAM_ERROR;
+    }
+    have = index->have;
+    from = index->idx_list[have - 1];
+    if (read_window(index, ucsFile, have - 1, window) != Z_OK) {
+        free_index(index);
+        return Z_DATA_ERROR;
+    }
+
+    /* after the end of a member, only another member of data is indexed */
+    if (!trailer) {
+        ssize_t got = pread(fileno(zFile), head, sizeof(head), from.in);
+
+        if (got < 0 || !data_member(head, (unsigned)got)) {
+            free_index(index);
+            return got < 0 ? Z_ERRNO : 0;
+        }
+    }
+
+    bld.index = NULL;
+    bld.idxFile = idxFile;
+    bld.ucsFile = ucsFile;
+    bld.have = have;
+    bld.flags = ZI_BUILD_GROWING | (index->lines != NULL ? ZI_BUILD_LINES : 0);
+    bld.lines = index->lines != NULL ? index->lines[have - 1] : 0;
+    bld.mark = index->nmarks ? index->marks[index->nmarks - 1].out : 0;
+    bld.zero = -1;
+    bld.blockZero = from.out % ZI_ZERO_BLOCK == 0;
+    bld.prvFile = NULL;
+    bld.from = &from;
+    bld.fromWindow = window;
+    bld.fromTrailer = trailer;
+    bld.rewrite = trailer ? -1 : last;
+
+    /* new windows go after the last one, new records after those of the
+       index, dropping what an update that failed left behind */
+    if (fflush(ucsFile) != 0 ||
+        fseeko(ucsFile, index->ucs_base + index->ucs_stride * (off_t)have,
+               SEEK_SET) != 0 ||
+        fflush(idxFile) != 0 || ftruncate(fileno(idxFile), end) != 0 ||
+        fseeko(idxFile, end, SEEK_SET) != 0 ||
+        fseeko(zFile, from.in - (trailer && from.bits ? 1 : 0), SEEK_SET) != 0) {
+        free_index(index);
+        return Z_ERRNO;
+    }
+    ret = build(zFile, NULL, span, &bld);
+    if (ret == Z_OK && fflush(ucsFile) != 0)
+        ret = Z_ERRNO;
+    free_index(index);
+    return ret == Z_OK ? (int)(bld.have - have) : ret;
+}
+
+/* Copy the window of access point k to window, from the index or from
+   ucsFile, all zeros if the point needs none.  Returns Z_OK, or Z_DATA_ERROR
+   if it cannot be read. */
+int read_window(struct access *index, FILE *ucsFile, size_t k,
+                unsigned char *window)
+{
+    off_t pos;
+
+    if (index->ucs_list != NULL) {
+        memcpy(window, index->ucs_list[k].window, WINSIZE);
+        return Z_OK;
+    }
+    pos = index->ucs_offset != NULL ? index->ucs_offset[k] :
+          index->ucs_base + index->ucs_stride * (off_t)k;
+    if (pos < 0) {
+        memset(window, 0, WINSIZE);
+        return Z_OK;
+    }
+    if (ucsFile == NULL || pread(fileno(ucsFile), window, WINSIZE, pos) != WINSIZE)
+        return Z_DATA_ERROR;
+    return Z_OK;
 }
 
+/* Write index in format 2 to idxFile and its windows to ucsFile, or only the
+   .idx part if ucsFile is NULL.  Returns the number of access points written,
+   less than index->have on error. */
 int write_index(struct access *index, FILE *idxFile, FILE *ucsFile)
 {
 	int ret;
-	size_t lenIdx, lenUcs, i;
+	size_t i;
 	struct idx_point *pIdx;
 	struct ucs_point *pUcs;
 	ret = 0;
-	if (index == NULL || idxFile == NULL || ucsFile == NULL)
+	if (index == NULL || idxFile == NULL || (ucsFile != NULL && index->ucs_list == NULL))
+		return ret;
+	if (fwrite(ZI_IDX_MAGIC, 8, 1u, idxFile) != 1u)
+		return ret;
+	if (index->store != NULL && (index->ucs_offset == NULL ||
+			put_record(idxFile, ZI_REC_STORE, (const unsigned char *) index->store,
+					   (uint32_t) strlen(index->store)) != Z_OK))
 		return ret;
 	for (i = 0; i < index->have; ++i)
 	{
 		pIdx = &index->idx_list[i];
-		pUcs = &index->ucs_list[i];
-		lenIdx = fwrite((void*) pIdx, sizeof(pIdx->out)+sizeof(pIdx->in), 1u, idxFile);
-		lenIdx = fwrite((void*) &pIdx->bits, sizeof(pIdx->bits), 1u, idxFile);
-		lenUcs = fwrite((void*) pUcs->window, WINSIZE, 1u, ucsFile);
-		if (lenUcs == 1u && lenIdx == 1u)
-			++ret;
-		else
+		if (put_point(idxFile, pIdx) != Z_OK)
 			break;
+		if (index->lines != NULL && put_lines(idxFile, i, index->lines[i]) != Z_OK)
+			break;
+		if (ucsFile == NULL && index->ucs_offset != NULL &&
+			put_window(idxFile, i, index->ucs_offset[i]) != Z_OK)
+			break;
+		/* the checksum of a span follows the point closing it */
+		if ((index->flags & ZI_HAVE_CRC) && i > 0 &&
+			put_crc(idxFile, i - 1, pIdx[-1].crc) != Z_OK)
+			break;
+		if (ucsFile != NULL) {
+			pUcs = &index->ucs_list[i];
+			if (fwrite((void*) pUcs->window, WINSIZE, 1u, ucsFile) != 1u)
+				break;
+		}
+		++ret;
 	}
+	for (i = 0; ret == (int) index->have && i < index->nmarks; ++i)
+		if (put_mark(idxFile, index->marks[i].line, index->marks[i].out) != Z_OK)
+			ret = 0;
+	for (i = 0; ret == (int) index->have && i < index->nzeros; ++i)
+		if (put_zero(idxFile, index->zeros[i].start, index->zeros[i].len) != Z_OK)
+			ret = 0;
+	if (ret == (int) index->have && index->zones != NULL &&
+		put_zones(idxFile, index->zones) != Z_OK)
+		ret = 0;
+	if (ret == (int) index->have && put_end(idxFile, index->have) != Z_OK)
+		ret = 0;
 	return ret;
 }
 
+/* Read the records of a format 2 .idx file following its magic. */
+local int read_records(FILE *idxFile, struct access **built)
+{
+	unsigned char head[8], rec[ZI_REC_MAX];
+	uint32_t type, len;
+	uint64_t span;
+	size_t crcs, lines, windows, closed;
+	char *store;
+	struct access *index;
+
+	index = NULL;
+	closed = 0;
+	crcs = 0;
+	lines = 0;
+	windows = 0;
+	store = NULL;
+	while (fread(head, 8, 1u, idxFile) == 1u) {
+		type = (uint32_t) zi_get_le(head, 4);
+		len = (uint32_t) zi_get_le(head + 4, 4);
+		if (len > sizeof(rec)) {	/* not one of ours, skip it */
+			if (fseeko(idxFile, (off_t) len, SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+		if (len && fread(rec, len, 1u, idxFile) != 1u)
+			break;
+		switch (type) {
+		case ZI_REC_POINT:
+			if (len < 20)
+				break;
+			index = addpoint(index, (int) zi_get_le(rec + 16, 4),
+					(off_t) zi_get_le(rec + 8, 8), (off_t) zi_get_le(rec, 8),
+					0, (unsigned char *) NULL);
+			if (index == NULL) {
+				free(store);
+				return Z_MEM_ERROR;
+			}
+			break;
+		case ZI_REC_CRC:
+			span = zi_get_le(rec, 8);
+			if (len < 12 || index == NULL || span >= index->have)
+				break;
+			index->idx_list[span].crc = (uint32_t) zi_get_le(rec + 8, 4);
+			++crcs;
+			break;
+		case ZI_REC_LINES:
+			span = zi_get_le(rec, 8);
+			if (len < 16 || index == NULL || span >= index->have)
+				break;
+			if (set_lines(index, (size_t) span, (off_t) zi_get_le(rec + 8, 8)) != Z_OK) {
+				free(store);
+				free_index(index);
+				return Z_MEM_ERROR;
+			}
+			++lines;
+			break;
+		case ZI_REC_STORE:
+			if (store == NULL && (store = (char *) malloc(len + 1)) != NULL) {
+				memcpy(store, rec, len);
+				store[len] = '\0';
+			}
+			break;
+		case ZI_REC_WINDOW:
+			span = zi_get_le(rec, 8);
+			if (len < 16 || index == NULL || span >= index->have)
+				break;
+			if (set_window(index, (size_t) span, (off_t) zi_get_le(rec + 8, 8)) != Z_OK) {
+				free(store);
+				free_index(index);
+				return Z_MEM_ERROR;
+			}
+			++windows;
+			break;
+		case ZI_REC_ZERO:
+			if (len < 16 || index == NULL)
+				break;
+			if (add_zero(index, (off_t) zi_get_le(rec, 8),
+					(off_t) zi_get_le(rec + 8, 8)) != Z_OK) {
+				free(store);
+				free_index(index);
+				return Z_MEM_ERROR;
+			}
+			break;
+		case ZI_REC_ZONES:
+			if (len < 20 || index == NULL || index->zones != NULL)
+				break;
+			index->zones = (struct zone_maps *) calloc(1, sizeof(struct zone_maps));
+			if (index->zones == NULL) {
+				free(store);
+				free_index(index);
+				return Z_MEM_ERROR;
+			}
+			index->zones->base = (off_t) zi_get_le(rec, 8);
+			index->zones->unit = (off_t) zi_get_le(rec + 8, 8);
+			index->zones->datatype = (int) zi_get_le(rec + 16, 4);
+			break;
+		case ZI_REC_ZONE:
+			if (len < 48 || index == NULL || index->zones == NULL)
+				break;
+			if (get_zone(index->zones, rec) != Z_OK) {
+				free(store);
+				free_index(index);
+				return Z_MEM_ERROR;
+			}
+			break;
+		case ZI_REC_LINE_MARK:
+			if (len < 16 || index == NULL)
+				break;
+			if (add_mark(index, (off_t) zi_get_le(rec, 8),
+					(off_t) zi_get_le(rec + 8, 8)) != Z_OK) {
+				free(store);
+				free_index(index);
+				return Z_MEM_ERROR;
+			}
+			break;
+		case ZI_REC_END:
+			if (len >= 8)
+				closed = (size_t) zi_get_le(rec, 8);
+			break;
+		case ZI_REC_OPEN:
+			if (len >= 12)
+				closed = (size_t) zi_get_le(rec, 8) + 1;
+			break;
+		}
+	}
+	if (index != NULL && (closed == 0 || closed > index->have)) {
+		/* never completed: a build that failed or is still going on */
+		free_index(index);
+		index = NULL;
+	}
+	if (index == NULL) {
+		free(store);
+		return 0;
+	}
+	if (closed < index->have)
+		index->have = closed;	/* points of an update still going on */
+	if (windows >= index->have)
+		index->store = store;	/* windows in the store, or placed in the .ucs */
+	else {
+		free(store);
+		free(index->ucs_offset);
+		index->ucs_offset = NULL;
+	}
+	if (crcs + 1 >= index->have)
+		index->flags |= ZI_HAVE_CRC;
+	if (lines < index->have) {	/* counts of some points missing */
+		free(index->lines);
+		index->lines = NULL;
+	}
+	*built = index;
+	return (int) index->have;
+}
+
+/* Read an .idx file of format 2, or of format 1 written by earlier versions,
+   return the number of access points, 0 if there are none, or negative on
+   error.  The windows are not read. */
 int read_index(FILE *idxFile, struct access **built)
 {
 	int ret, bits;
@@ -368,29 +2001,210 @@ int read_index(FILE *idxFile, struct access **built)
 	index = NULL;
 	if (idxFile == NULL)
 		return ret;
-	while (1) {
-		chunkSize = fread((void*) idxBuffer, sizeof(off_t), 2u, idxFile)
-				+ fread((void*) &bits, sizeof(int), 1u, idxFile);
-		if (feof(idxFile) || chunkSize < 3u)
-			break;
-		totout = idxBuffer[0];
-		totin = idxBuffer[1];
-		index = addpoint(index, bits, totin,
-						 totout, 0, (unsigned char *) NULL);
-		if (index == NULL) {
-			ret = Z_MEM_ERROR;
-			if (index != NULL)
-				free_index(index);
-			return ret;
+	if (fread((void*) idxBuffer, 8, 1u, idxFile) == 1u &&
+		memcmp(idxBuffer, ZI_IDX_MAGIC, 8) == 0)
+		ret = read_records(idxFile, &index);
+	else {
+		/* format 1: the first point starts at 0, never like the magic */
+		if (fseeko(idxFile, 0, SEEK_SET) != 0)
+			return Z_ERRNO;
+		while (1) {
+			chunkSize = fread((void*) idxBuffer, sizeof(off_t), 2u, idxFile)
+					+ fread((void*) &bits, sizeof(int), 1u, idxFile);
+			if (feof(idxFile) || chunkSize < 3u)
+				break;
+			totout = idxBuffer[0];
+			totin = idxBuffer[1];
+			index = addpoint(index, bits, totin,
+							 totout, 0, (unsigned char *) NULL);
+			if (index == NULL)
+				return Z_MEM_ERROR;
+			++ret;
 		}
-		++ret;
 	}
+	if (ret <= 0 || index == NULL)
+		return ret;
     index->idx_list = realloc(index->idx_list, sizeof(struct idx_point) * index->have);
+    if (index->lines != NULL)
+        index->lines = realloc(index->lines, sizeof(off_t) * index->have);
     index->size = index->have;
 	*built = index;
 	return index->size;
 }
 
+/* Write one empty gzip member carrying len bytes of data in subfield id of its
+   FEXTRA field; gunzip decompresses it to nothing. */
+local int put_member(FILE *out, const char *id, const unsigned char *data,
+                     unsigned len)
+{
+    unsigned char head[ZI_EMBED_HEAD] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 255 };
+    static const unsigned char foot[ZI_EMBED_FOOT] = {
+        3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    zi_put_le(head + 10, len + 4, 2);
+    head[12] = (unsigned char)id[0];
+    head[13] = (unsigned char)id[1];
+    zi_put_le(head + 14, len, 2);
+    if (fwrite(head, ZI_EMBED_HEAD, 1u, out) != 1u ||
+        (len && fwrite(data, len, 1u, out) != 1u) ||
+        fwrite(foot, ZI_EMBED_FOOT, 1u, out) != 1u)
+        return Z_ERRNO;
+    return Z_OK;
+}
+
+/* Read the locator of an embedded index from the end of zFile and fill in
+   where the windows and the .idx records start and how many bytes of records
+   there are.  Returns 1, or 0 if there is no embedded index. */
+local int get_locator(FILE *zFile, off_t *end, off_t *ucsBase,
+                      off_t *pointBase, uint64_t *count)
+{
+    unsigned char tail[ZI_EMBED_TAIL];
+    off_t size;
+    const unsigned char *loc = tail + ZI_EMBED_HEAD;
+
+    if (fseeko(zFile, 0, SEEK_END) != 0 || (size = ftello(zFile)) < ZI_EMBED_TAIL)
+        return 0;
+    if (pread(fileno(zFile), tail, ZI_EMBED_TAIL, size - ZI_EMBED_TAIL)
+        != ZI_EMBED_TAIL)
+        return 0;
+    if (tail[0] != 0x1f || tail[1] != 0x8b || tail[3] != 4 ||
+        tail[12] != 'Z' || tail[13] != 'L' || zi_get_le(tail + 14, 2) != 32 ||
+        memcmp(loc, ZI_EMBED_MAGIC, 8) != 0)
+        return 0;
+    *ucsBase = (off_t)zi_get_le(loc + 8, 8);
+    *pointBase = (off_t)zi_get_le(loc + 16, 8);
+    *count = zi_get_le(loc + 24, 8);
+    *end = size - ZI_EMBED_TAIL;
+    if (*ucsBase > *pointBase || *pointBase > *end || *count == 0)
+        return 0;
+    return 1;
+}
+
+/* Append index to the gzip file zFile (opened for update) as trailing empty
+   gzip members, so that zFile still decompresses to the same data: one per
+   window, then the .idx records in chunks, then the locator.  The windows
+   come from the index or from ucsFile.  An index embedded earlier is
+   replaced.  Returns the number of access points written, or negative on
+   error. */
+int write_index_embedded(struct access *index, FILE *ucsFile, FILE *zFile)
+{
+	off_t end, ucsBase, pointBase;
+	uint64_t count;
+	size_t i, n, size;
+	unsigned char window[WINSIZE];
+	char *points;
+	FILE *mem;
+	unsigned char loc[32];
+
+	if (index == NULL || zFile == NULL || (index->ucs_list == NULL && ucsFile == NULL))
+		return Z_STREAM_ERROR;
+	if (get_locator(zFile, &end, &ucsBase, &pointBase, &count)) {
+		fflush(zFile);
+		if (ftruncate(fileno(zFile), ucsBase) != 0)
+			return Z_ERRNO;
+	}
+	if (fseeko(zFile, 0, SEEK_END) != 0)
+		return Z_ERRNO;
+	ucsBase = ftello(zFile);
+
+	for (i = 0; i < index->have; ++i) {
+		if (index->ucs_list == NULL && read_window(index, ucsFile, i, window) != Z_OK)
+			return Z_DATA_ERROR;
+		if (put_member(zFile, "ZW", index->ucs_list != NULL ?
+				index->ucs_list[i].window : window, WINSIZE) != Z_OK)
+			return Z_ERRNO;
+	}
+
+	/* the .idx records, as they would be written to the .idx file */
+	points = NULL;
+	size = 0;
+	mem = open_memstream(&points, &size);
+	if (mem == NULL)
+		return Z_MEM_ERROR;
+	n = (size_t) write_index(index, mem, NULL);
+	if (fclose(mem) != 0 || n < index->have) {
+		free(points);
+		return Z_MEM_ERROR;
+	}
+	pointBase = ftello(zFile);
+	for (i = 0; i < size; i += n) {
+		n = size - i < ZI_EMBED_CHUNK ? size - i : ZI_EMBED_CHUNK;
+		if (put_member(zFile, "ZX", (unsigned char *) points + i, (unsigned) n) != Z_OK) {
+			free(points);
+			return Z_ERRNO;
+		}
+	}
+	free(points);
+
+	memcpy(loc, ZI_EMBED_MAGIC, 8);
+	zi_put_le(loc + 8, (uint64_t)ucsBase, 8);
+	zi_put_le(loc + 16, (uint64_t)pointBase, 8);
+	zi_put_le(loc + 24, (uint64_t)size, 8);
+	if (put_member(zFile, "ZL", loc, 32) != Z_OK || fflush(zFile) != 0)
+		return Z_ERRNO;
+	return (int)index->have;
+}
+
+/* Load an index embedded by write_index_embedded() from the end of zFile.  The
+   windows stay in zFile, at ucs_base and ucs_stride of the index.  Returns the
+   number of access points, 0 if zFile has no embedded index, or negative on
+   error. */
+int read_index_embedded(FILE *zFile, struct access **built)
+{
+	off_t end, ucsBase, pointBase, pos;
+	uint64_t count, i;
+	unsigned n;
+	int ret;
+	struct access *index;
+	unsigned char *points;
+	unsigned char head[ZI_EMBED_HEAD];
+	FILE *mem;
+
+	if (zFile == NULL)
+		return 0;
+	if (!get_locator(zFile, &end, &ucsBase, &pointBase, &count))
+		return 0;
+
+	/* reassemble the .idx records from the members */
+	if (count > (uint64_t)(end - pointBase))
+		return Z_DATA_ERROR;
+	points = (unsigned char *) malloc((size_t) count);
+	if (points == NULL)
+		return Z_MEM_ERROR;
+	for (i = 0, pos = pointBase; i < count; i += n) {
+		n = count - i < ZI_EMBED_CHUNK ? (unsigned)(count - i) : ZI_EMBED_CHUNK;
+		if (pos + ZI_EMBED_HEAD + n > end ||
+			pread(fileno(zFile), head, ZI_EMBED_HEAD, pos) != ZI_EMBED_HEAD ||
+			head[12] != 'Z' || head[13] != 'X' || zi_get_le(head + 14, 2) != n ||
+			pread(fileno(zFile), points + i, n, pos + ZI_EMBED_HEAD) != (ssize_t)n) {
+			free(points);
+			return Z_DATA_ERROR;
+		}
+		pos += ZI_EMBED_HEAD + n + ZI_EMBED_FOOT;
+	}
+	mem = fmemopen(points, (size_t) count, "rb");
+	if (mem == NULL) {
+		free(points);
+		return Z_MEM_ERROR;
+	}
+	index = NULL;
+	ret = read_index(mem, &index);
+	fclose(mem);
+	free(points);
+	if (ret <= 0)
+		return ret < 0 ? ret : Z_DATA_ERROR;
+	/* the windows are embedded, even if the index came from a store */
+	free(index->store);
+	index->store = NULL;
+	free(index->ucs_offset);
+	index->ucs_offset = NULL;
+	index->ucs_base = ucsBase + ZI_EMBED_HEAD;
+	index->ucs_stride = ZI_EMBED_WINDOW;
+	*built = index;
+	return (int)index->have;
+}
+
 /*local int zindex_read(FILE *inFile, FILE *idxFile, FILE *ucsFile, unsigned char *buffer, size_t chunkSize, off_t from)
 {
 	int len;
@@ -440,15 +2254,31 @@ zindexPtr ziopen_auto(const char *zPath, const char *mode)
 	strcpy(ucsName, zPath);
 	strcpy(ucsName+argLen, ucsExt);
 
-	idx = ziopen(zPath, idxName, ucsName, mode);
+	idx = ziopen_zst(zPath, mode);
+	if (idx == NULL)
+		idx = ziopen_chunks(zPath, mode);
+	if (idx == NULL)
+		idx = ziopen(zPath, idxName, ucsName, mode);
 	free(ucsName);
 	free(idxName);
+	if (idx == NULL)
+		idx = ziopen_embedded(zPath, mode);
+	if (idx == NULL &&
+			zi_cache_names(zPath, &idxName, &ucsName, 0) == Z_OK) {
+		/* data that could not have its index next to it */
+		idx = ziopen(zPath, idxName, ucsName, mode);
+		free(ucsName);
+		free(idxName);
+	}
+	if (idx == NULL)
+		idx = ziopen_foreign(zPath, mode);
 	return idx;
 }
 
 zindexPtr ziopen(const char *zPath, const char *idxPath, const char *ucsPath, const char *mode)
 {
 	zindexPtr idx;
+	struct stat st, ist;
 
 	if (!mode || !strlen(mode)) {
 		fprintf(stderr,"** ERROR: invalid ziopen call with mode \"%s\"\n", mode ? mode : "NULL");
@@ -466,37 +2296,137 @@ zindexPtr ziopen(const char *zPath, const char *idxPath, const char *ucsPath, co
 	idx->idxFile = NULL;
 	idx->ucsFile = NULL;
 	idx->data = NULL;
+	idx->io = NULL;
+	idx->pool = NULL;
 	if ((idx->idxFile = fopen(idxPath, mode)) == NULL) {
 		free(idx);
 		/* Give no error message here, fall back automatically, index will not be used. */
 		/* fprintf(stderr,"** ziopen: cannot open %s for read\n", idxPath); */
 		return NULL;
 	}
-	else if ((idx->ucsFile = fopen(ucsPath, mode)) == NULL) {
+	else if ((idx->zFile = fopen(zPath, mode)) == NULL) {
+		fclose(idx->idxFile);
+		free(idx);
+		fprintf(stderr,"** ziopen: cannot open %s for read\n", zPath);
+		return NULL;
+	}
+
+	if ( read_index( idx->idxFile, &(idx->data) ) <= 0 ) {
+		fclose(idx->zFile);
+		fclose(idx->idxFile);
+		free(idx);
+		fprintf(stderr,"** ziopen: index file %s empty or corrupted\n", idxPath);
+		return NULL;
+	}
+	/* the windows are in the .ucs file or in a shared window store */
+	if (idx->data->store != NULL)
+		ucsPath = idx->data->store;
+	if ((idx->ucsFile = idx->data->store != NULL ?
+			zi_store_windows(ucsPath, mode) : fopen(ucsPath, mode)) == NULL) {
+		fprintf(stderr,"** ziopen: cannot open windows %s for read\n", ucsPath);
+		free_index(idx->data);
+		fclose(idx->zFile);
 		fclose(idx->idxFile);
 		free(idx);
-		fprintf(stderr,"** ziopen: cannot open %s for read\n", ucsPath);
 		return NULL;
 	}
-	else if ((idx->zFile = fopen(zPath, mode)) == NULL) {
+	/* the store may have reused the windows of an index replaced before they
+	   were locked */
+	if (idx->data->store != NULL && (stat(idxPath, &st) != 0 ||
+			fstat(fileno(idx->idxFile), &ist) != 0 ||
+			st.st_dev != ist.st_dev || st.st_ino != ist.st_ino)) {
+		fprintf(stderr,"** ziopen: index file %s replaced while opened\n", idxPath);
+		free_index(idx->data);
+		fclose(idx->zFile);
 		fclose(idx->ucsFile);
 		fclose(idx->idxFile);
 		free(idx);
-		fprintf(stderr,"** ziopen: cannot open %s for read\n", zPath);
 		return NULL;
 	}
-
-	if ( read_index( idx->idxFile, &(idx->data) ) <= 0 ) {
+	if ((idx->io = ziio_open(ZI_IO_DEPTH)) == NULL) {
+		free_index(idx->data);
 		fclose(idx->zFile);
 		fclose(idx->ucsFile);
 		fclose(idx->idxFile);
 		free(idx);
-		fprintf(stderr,"** ziopen: index file %s empty or corrupted\n", idxPath);
+		fprintf(stderr,"** ERROR: ziopen failed to alloc input buffers\n");
+		return NULL;
+	}
+
+	idx->pos = 0;
+	idx->end = idx->data->idx_list[idx->data->have-1].out; /*last index entry is eof*/
+	idx->verify = getenv("ZINDEX_VERIFY") != NULL;
+	if (getenv("ZINDEX_MMAP") != NULL)
+		idx->zMap = ziio_mmap(fileno(idx->zFile), &idx->zMapSize, ZI_IO_RANDOM);
+	(void) zi_disk_cache(idx, getenv("ZINDEX_SPAN_CACHE"), 0);
+	if (getenv("ZINDEX_SHM_CACHE") != NULL)
+		(void) zi_shm_cache(idx, NULL, 0);
+	if (getenv("ZINDEX_HIST") != NULL) {
+		/* reads counted in file.idx.hist, for zindex adapt */
+		char *histPath = (char *) malloc(strlen(idxPath) + 6);
+
+		if (histPath != NULL) {
+			sprintf(histPath, "%s.hist", idxPath);
+			(void) zi_track(idx, histPath);
+			free(histPath);
+		}
+	}
+	return idx;
+}
+
+/* Open zPath using the index embedded at its end, NULL if there is none. */
+zindexPtr ziopen_embedded(const char *zPath, const char *mode)
+{
+	zindexPtr idx;
+
+	if (!mode || !strlen(mode)) {
+		fprintf(stderr,"** ERROR: invalid ziopen call with mode \"%s\"\n", mode ? mode : "NULL");
+		return NULL;
+	}
+	if (mode[0]!='r')
+		return NULL; /* writing is not yet supported */
+
+	idx = (zindexPtr) calloc(1,sizeof(struct zindex));
+	if (idx == NULL) {
+		fprintf(stderr,"** ERROR: ziopen failed to alloc zindex\n");
+		return NULL;
+	}
+	idx->zFile = NULL;
+	idx->idxFile = NULL;
+	idx->ucsFile = NULL;
+	idx->data = NULL;
+	idx->io = NULL;
+	idx->pool = NULL;
+	if ((idx->zFile = fopen(zPath, mode)) == NULL) {
+		free(idx);
+		return NULL;
+	}
+	/* Give no error message for a missing index, fall back automatically. */
+	if ( read_index_embedded( idx->zFile, &(idx->data) ) <= 0 ) {
+		fclose(idx->zFile);
+		free(idx);
+		return NULL;
+	}
+	/* windows are read from the data file through a handle of their own */
+	if ((idx->ucsFile = fopen(zPath, mode)) == NULL ||
+		(idx->io = ziio_open(ZI_IO_DEPTH)) == NULL) {
+		if (idx->ucsFile != NULL)
+			fclose(idx->ucsFile);
+		free_index(idx->data);
+		fclose(idx->zFile);
+		free(idx);
+		fprintf(stderr,"** ERROR: ziopen failed to open embedded index of %s\n", zPath);
 		return NULL;
 	}
 
 	idx->pos = 0;
 	idx->end = idx->data->idx_list[idx->data->have-1].out; /*last index entry is eof*/
+	idx->verify = getenv("ZINDEX_VERIFY") != NULL;
+	if (getenv("ZINDEX_MMAP") != NULL)
+		idx->zMap = ziio_mmap(fileno(idx->zFile), &idx->zMapSize, ZI_IO_RANDOM);
+	(void) zi_disk_cache(idx, getenv("ZINDEX_SPAN_CACHE"), 0);
+	if (getenv("ZINDEX_SHM_CACHE") != NULL)
+		(void) zi_shm_cache(idx, NULL, 0);
 	return idx;
 }
 
@@ -523,6 +2453,8 @@ zindexPtr zidopen(int zfd, int idxfd, int ucsfd, const char *mode)
 	idx->idxFile = NULL;
 	idx->ucsFile = NULL;
 	idx->data = NULL;
+	idx->io = NULL;
+	idx->pool = NULL;
 	if ((idx->idxFile = fdopen(idxfd, mode)) == NULL) {
 		free(idx);
 		fprintf(stderr,"** zidopen: cannot open idx file for read\n");
@@ -550,22 +2482,90 @@ zindexPtr zidopen(int zfd, int idxfd, int ucsfd, const char *mode)
 		fprintf(stderr,"** zidopen: index file empty or corrupted\n");
 		return NULL;
 	}
+	if ((idx->io = ziio_open(ZI_IO_DEPTH)) == NULL) {
+		free_index(idx->data);
+		fclose(idx->zFile);
+		fclose(idx->ucsFile);
+		fclose(idx->idxFile);
+		free(idx);
+		fprintf(stderr,"** ERROR: zidopen failed to alloc input buffers\n");
+		return NULL;
+	}
 
 	idx->pos = 0;
 	idx->end = idx->data->idx_list[idx->data->have-1].out; /*last index entry is eof*/
+	idx->verify = getenv("ZINDEX_VERIFY") != NULL;
 	return idx;
 #endif
 }
 
+/* Take up the access points that zi_update() added to the index of idx since
+   it was opened, and the new end of the data.  Not to be called while other
+   threads read idx with ziread(); asynchronous reads are held off meanwhile,
+   the pieces of them being decoded let finish first.  Returns the number of new access points, 0 if
+   there are none or idx does not read a sidecar index, or negative on
+   error. */
+int zi_refresh(zindexPtr idx)
+{
+	int ret;
+	size_t have;
+	struct access *index;
+
+	if (idx == NULL || idx->data == NULL)
+		return Z_STREAM_ERROR;
+	if (idx->idxFile == NULL || idx->data->store != NULL ||
+			(idx->data->flags & (ZI_ZSTD | ZI_CHUNKED)))
+		return 0;
+	clearerr(idx->idxFile);
+	if (fseeko(idx->idxFile, 0, SEEK_SET) != 0)
+		return Z_ERRNO;
+	index = NULL;
+	ret = read_index(idx->idxFile, &index);
+	if (ret <= 0)
+		return ret;
+	zi_pool_hold(idx);
+	have = idx->data->have;
+	if (index->have < have) {	/* caught in the middle of an update */
+		zi_pool_release(idx);
+		free_index(index);
+		return 0;
+	}
+	free_index(idx->data);
+	idx->data = index;
+	idx->end = index->idx_list[index->have-1].out;
+	if (idx->zMap != NULL) {	/* map what was appended too */
+		off_t size;
+		unsigned char *map = ziio_mmap(fileno(idx->zFile), &size, ZI_IO_RANDOM);
+
+		if (map != NULL) {
+			ziio_munmap(idx->zMap, idx->zMapSize);
+			idx->zMap = map;
+			idx->zMapSize = size;
+		}
+	}
+	zi_pool_release(idx);
+	return (int) (index->have - have);
+}
+
 int ziclose(zindexPtr * idx)
 {
 	int retval = 0;
 	if ((*idx) == NULL)
 		return retval;
 
+	zi_pool_close(*idx);	/* workers first, they still read the files */
+	zst_close(*idx);
+	chunks_close(*idx);
+	zi_maps_close(*idx);
+	zi_disk_close(*idx);
+	zi_shm_close(*idx);
+	ziio_munmap((*idx)->zMap, (*idx)->zMapSize);
 	if ((*idx)->zFile!=NULL) { retval = fclose((*idx)->zFile); }
 	if ((*idx)->idxFile!=NULL) { retval += fclose((*idx)->idxFile); }
 	if ((*idx)->ucsFile!=NULL) { retval += fclose((*idx)->ucsFile); }
+	ziio_close((*idx)->io);
+	(void)zi_hist_close((*idx)->hist);
+	free_index((*idx)->data);
 
 	free(*idx);
 	*idx = NULL;
@@ -579,8 +2579,10 @@ int ziread(zindexPtr idx, void* buf, unsigned len)
 
 	if (idx==NULL)
 		return 0;
-	nread = extract(idx->zFile, idx->data, idx->ucsFile,
-			 idx->pos, (unsigned char *)buf, len);
+	if (idx->hist != NULL)
+		zi_hist_count(idx->hist, idx->pos);
+	nread = extract(idx, idx->io, idx->pos, (unsigned char *)buf, len,
+			 NULL, idx->verify);
 	if( nread < 0 ) return nread; /* returns -1 on error */
 	idx->pos += nread;
 	return nread;
@@ -618,6 +2620,78 @@ long ziseek(zindexPtr idx, long offset, int whence)
 	return (long) idx->pos;
 }
 
+/* Move the position of idx to the start of line (counting from 0), decoding
+   only from the nearest line mark or access point before it.  Returns the new
+   position, the end of the data if there are fewer lines, or -1 on error or
+   if the index was built without line counts. */
+long zi_seek_line(zindexPtr idx, off_t line)
+{
+	struct access *index;
+	size_t lo, hi, mid;
+	off_t nl, pos;
+	unsigned char *buf, *p;
+	int got;
+
+	if (idx==NULL || idx->data->lines==NULL || line < 0)
+		return -1;
+	index = idx->data;
+
+	/* last access point with fewer newlines before it, then a closer mark */
+	lo = 0;
+	hi = index->have - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (index->lines[mid] < line)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	nl = index->lines[lo];
+	pos = index->idx_list[lo].out;
+	if (line == 0)
+		nl = pos = 0;
+	if (index->nmarks > 0 && index->marks[0].line <= line) {
+		lo = 0;
+		hi = index->nmarks - 1;
+		while (lo < hi) {
+			mid = lo + (hi - lo + 1) / 2;
+			if (index->marks[mid].line <= line)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		if (index->marks[lo].line == line || index->marks[lo].out > pos) {
+			nl = index->marks[lo].line;
+			pos = index->marks[lo].out;
+		}
+	}
+
+	/* count the remaining newlines */
+	buf = NULL;
+	if (nl < line && (buf = (unsigned char *) malloc(ZI_LINE_GAP)) == NULL)
+		return -1;
+	if (nl < line && idx->hist != NULL)
+		zi_hist_count(idx->hist, pos);
+	while (nl < line) {
+		got = extract(idx, idx->io, pos, buf, ZI_LINE_GAP, NULL, idx->verify);
+		if (got < 0) {
+			free(buf);
+			return -1;
+		}
+		if (got == 0)
+			break;
+		p = buf;
+		while (nl < line && (p = memchr(p, '\n', (size_t)(buf + got - p))) != NULL) {
+			++p;
+			++nl;
+		}
+		pos += nl == line ? p - buf : got;
+	}
+	free(buf);
+	idx->pos = pos;
+	return (long) pos;
+}
+
 int zirewind(zindexPtr idx)
 {
 	if (idx==NULL)
@@ -638,16 +2712,28 @@ int ziputs(zindexPtr idx, const char *str)
 	return 0;
 }
 
+/* Read a line like gzgets(): at most size - 1 bytes, up to and including a
+   newline, terminated with a null.  NULL at the end of the data or on error. */
 char * zigets(zindexPtr idx, char* str, int size)
 {
 	int nread;
-	if (idx==NULL)
+	char *eol;
+	if (idx==NULL || str==NULL || size < 1)
 		return NULL;
-	nread = extract(idx->zFile, idx->data, idx->ucsFile,
-					 idx->pos, (unsigned char *)str, size);
-	if (nread == size)
-	  return str;
-	return NULL;
+	if (idx->hist != NULL)
+		zi_hist_count(idx->hist, idx->pos);
+	nread = extract(idx, idx->io, idx->pos, (unsigned char *)str, size - 1,
+					 NULL, idx->verify);
+	if (nread <= 0 && size > 1)
+	  return NULL;
+	if (nread < 0)
+	  nread = 0;
+	eol = (char *) memchr(str, '\n', (size_t) nread);
+	if (eol != NULL)
+	  nread = (int) (eol - str) + 1;
+	str[nread] = '\0';
+	idx->pos += nread;
+	return str;
 }
 
 int ziflush(zindexPtr idx)
@@ -676,8 +2762,10 @@ int zigetc(zindexPtr idx)
 	int nread;
 	if (idx==NULL)
 		return 0;
-	nread = extract(idx->zFile, idx->data, idx->ucsFile,
-					 idx->pos, (unsigned char *) &ret, 1);
+	if (idx->hist != NULL)
+		zi_hist_count(idx->hist, idx->pos);
+	nread = extract(idx, idx->io, idx->pos, (unsigned char *) &ret, 1,
+					 NULL, idx->verify);
 	if (nread == 1)
 	  return (int) ret;
 	return 0;
@@ -13,16 +13,145 @@
 #include <string.h>
 #include <inttypes.h>
 #include "zlib.h"
+#include "ziio.h"
 
 #define SPAN 4194304L	/* desired distance between access points */
 #define WINSIZE 32768U      /* sliding window size */
 #define CHUNK 16384         /* file input buffer size */
+#define MAP_FEED 1073741824L    /* mapped input handed to inflate at once */
+
+#define ZI_CANCELED (-20)   /* read canceled before completion */
+#define ZI_CRC_ERROR (-21)  /* decoded span does not match its CRC-32 */
+
+/* .idx format 2: magic, then records of a 32-bit type and a 32-bit payload
+   length (little-endian), unknown types are skipped; format 1 (no magic) is
+   a bare list of native struct idx_point entries */
+#define ZI_IDX_MAGIC "ZINDEX2\n"
+#define ZI_REC_POINT 1      /* out (64 bits), in (64), bits (32) */
+#define ZI_REC_CRC 2        /* span number (64), CRC-32 of its output (32) */
+#define ZI_REC_LINES 3      /* point number (64), newlines before it (64) */
+#define ZI_REC_LINE_MARK 4  /* line number (64), offset of its start (64) */
+#define ZI_REC_STORE 5      /* path of the window store of zistore.c */
+#define ZI_REC_WINDOW 6     /* point number (64), window offset in store or
+                               .ucs (64) */
+#define ZI_REC_ZERO 7       /* start (64) and length (64) of all-zero output */
+#define ZI_REC_ZONES 8      /* voxel offset (64), zone size (64), datatype (32) */
+#define ZI_REC_ZONE 9       /* zone (64), min, max, sum (IEEE double, 64 each),
+                               voxels (64), non-zero voxels (64) */
+#define ZI_REC_OPEN 10      /* point number (64), trailer bytes (32): the input
+                               ends in a deflate stream after that point */
+#define ZI_REC_END 11       /* number of points (64): the index is complete up
+                               to there, the last point at the end of the data */
+#define ZI_REC_MAX 4096     /* longest record read */
+
+#define ZI_BUILD_LINES 1    /* build_index_flags(): count lines too */
+#define ZI_BUILD_STATS 2    /* and keep voxel statistics (zistats.c) */
+#define ZI_BUILD_GROWING 4  /* the input may end inside a stream (zi_update()) */
+#define ZI_LINE_GAP 65536L  /* output between consecutive line marks */
+#define ZI_ZERO_BLOCK 4096  /* zero runs are made of aligned blocks of this */
+#define ZI_ZERO_MIN 65536L  /* and recorded from this length on */
+#define ZI_REDUCE_CHUNK 131072L /* output reduced at a time per thread */
+#define ZI_REDUCE_HIST 1    /* zi_reduce(): fill in the histograms too */
+#define ZI_DT_BIG 0x10000   /* or'ed into a NIfTI datatype: big-endian data */
+#define ZI_HIST_BUCKET 262144L  /* reads counted per this much output */
+#define ZI_ADAPT_NEAR 65536L    /* no point added this close after another */
+#define ZI_CHUNK_BLOCK 8    /* zi_rechunk(): voxels on a side of a block */
+#define ZI_DISK_MB 10240L   /* zi_disk_cache(): default budget, megabytes */
+#define ZI_DISK_LOW 90      /* percent of it left after evicting */
+#define ZI_DISK_SPAN 67108864L  /* longer spans are not kept on disk */
+#define ZI_SHM_MB 1024L     /* zi_shm_cache(): default size of a new segment */
+#define ZI_SHM_SLOT (SPAN + SPAN / 8)  /* bytes per span there: a span ends at the
+                                         first block after SPAN, longer not kept */
+#define ZI_SHM_WAYS 8       /* places a span can go */
+#define ZI_SHM_STALE 60     /* seconds before a writer is taken for dead */
+#define ZI_PRIO_INTERACTIVE 0   /* ziread_prio(): someone waits for it */
+#define ZI_PRIO_NORMAL 1    /* the class of ziread_async() */
+#define ZI_PRIO_BULK 2      /* whole files, batch jobs */
+#define ZI_PRIO_CLASSES 3
+#define ZI_SCHED_PIECE 1048576L /* reads are decoded in pieces of about this */
+#define ZI_PRINT_BLOCK 65536L  /* zi_fingerprint(): bytes hashed at 3 places */
 
 /* access point entry */
 struct idx_point {
     off_t out;          /* corresponding offset in uncompressed data */
     off_t in;           /* offset in input file of first full byte */
     int bits;           /* number of bits (1-7) from byte at in - 1, or 0 */
+    uint32_t crc;       /* CRC-32 of the output up to the next access point */
+};
+
+/* start of a line, recorded about every ZI_LINE_GAP bytes */
+struct line_mark {
+    off_t line;         /* line number, counting from 0 */
+    off_t out;          /* offset of its first byte in uncompressed data */
+};
+
+/* range of the uncompressed data that is all zeros */
+struct zero_run {
+    off_t start;
+    off_t len;
+};
+
+/* voxel statistics of one zone, a volume or a slice */
+struct zone_stats {
+    double min, max, sum;   /* of the stored values, NaNs left out */
+    uint64_t count;         /* voxels */
+    uint64_t nonzero;
+};
+
+/* zone k covers the unit bytes at base + k * unit */
+struct zone_maps {
+    off_t base;             /* vox_offset of the NIfTI header */
+    off_t unit;
+    int datatype;           /* NIfTI datatype code */
+    size_t have;
+    struct zone_stats *list;
+};
+
+/* what zi_nifti_header() finds in a NIfTI-1 or NIfTI-2 header */
+struct zi_nifti {
+    off_t vox_offset;       /* start of the voxels */
+    off_t volume;           /* bytes of one volume */
+    off_t slice;            /* and of one slice */
+    off_t volumes;
+    off_t dim[3];           /* voxels along x, y and z */
+    int datatype;
+    int bytes;              /* of one voxel with statistics, 0 if none */
+    int big;                /* big-endian */
+};
+
+/* a part of the uncompressed data reduced by zi_reduce() (zireduce.c) */
+struct zi_region {
+    off_t offset;           /* of the first voxel */
+    off_t len;              /* bytes */
+    off_t unit;             /* one result per unit bytes (a volume), or 0 */
+    const unsigned char *mask;  /* voxels of a unit (or of all) to reduce
+                               where non-zero, or NULL for all */
+};
+
+/* result of zi_reduce() over a region or one unit of it */
+struct zi_reduction {
+    uint64_t count;         /* voxels reduced, NaNs and masked out left out */
+    double sum, sumsq;
+    double min, max;        /* 0 if count is 0 */
+    double lo, hi;          /* ZI_REDUCE_HIST: range binned, set by caller */
+    size_t bins;            /* number of bins, set by caller */
+    uint64_t *hist;         /* bins counts, allocated by the caller */
+};
+
+/* reads starting in every bucket bytes of uncompressed data (ziadapt.c) */
+struct zi_hist {
+    off_t bucket;
+    size_t n;
+    uint32_t *count;
+    char *path;             /* sidecar the counts go to at close, or NULL */
+};
+
+/* one level of the preview pyramid read by zi_preview() (zipreview.c) */
+struct zi_preview {
+    int axis;               /* held fixed: 0 sagittal, 1 coronal, 2 axial */
+    int factor;             /* 2, 4 or 8 */
+    size_t width, height;
+    float *data;            /* width * height block means, row after row */
 };
 
 struct ucs_point {
@@ -33,34 +162,132 @@ struct ucs_point {
 struct access {
     size_t have;           /* number of list entries filled in */
     size_t size;           /* number of list entries allocated */
+    int flags;             /* ZI_HAVE_... */
     struct idx_point *idx_list; /* allocated list */
     struct ucs_point *ucs_list; /* allocated list or NULL */
+    off_t ucs_base;        /* windows in a file: offset of the first one */
+    off_t ucs_stride;      /* and distance between consecutive ones */
+    off_t *ucs_offset;     /* or per point, -1 if it needs no window */
+    char *store;           /* window store the offsets are in, or NULL */
+    off_t *lines;          /* newlines before each point, or NULL */
+    struct line_mark *marks;    /* line starts in order, or NULL */
+    size_t nmarks;
+    struct zero_run *zeros;     /* in order, read without inflating */
+    size_t nzeros;
+    struct zone_maps *zones;    /* voxel statistics, or NULL */
 };
 
+#define ZI_HAVE_CRC 1       /* crc of the access points is valid */
+#define ZI_ZSTD 2           /* access points are frames of seekable zstd */
+#define ZI_CHUNKED 4        /* data rebuilt from the blocks of zichunk.c */
+
+/* index embedded in the gzip file: empty gzip members appended after the data,
+   carrying the windows, the access points and, in the last ZI_EMBED_TAIL
+   bytes, a locator in their FEXTRA field */
+#define ZI_EMBED_MAGIC "ZINDEX02"
+#define ZI_EMBED_HEAD 16    /* gzip header with FEXTRA up to subfield data */
+#define ZI_EMBED_FOOT 10    /* empty deflate block, CRC-32 and ISIZE */
+#define ZI_EMBED_WINDOW (ZI_EMBED_HEAD + WINSIZE + ZI_EMBED_FOOT)
+#define ZI_EMBED_CHUNK 65000    /* bytes of the .idx stream per member */
+#define ZI_EMBED_TAIL (ZI_EMBED_HEAD + 32 + ZI_EMBED_FOOT)
+
 struct zindex{
 	FILE * zFile;
 	FILE * idxFile;
 	FILE * ucsFile;
+	unsigned char * zMap;	/* zFile mapped (ZINDEX_MMAP), or NULL */
+	off_t zMapSize;
 	struct access * data;
+	struct zi_io * io;
+	struct zi_pool * pool;	/* async workers, started by first ziread_async */
+	struct zi_zst * zst;	/* decoders of a seekable zstd file, or NULL */
+	struct zi_chunks * chunks;	/* blocks of a chunked file, or NULL */
+	struct zi_disk * disk;	/* decoded spans kept on disk, or NULL */
+	struct zi_shm * shm;	/* decoded spans shared in memory, or NULL */
+	struct zi_maps * maps;	/* buffers pinned by zimap(), or NULL */
+	struct zi_hist * hist;	/* where reads start, counted by zi_track() */
 	off_t pos;
 	off_t end;
+	int verify;	/* check the CRC-32 of every span decoded by reads */
 };
 typedef struct zindex * zindexPtr;
 
+/* asynchronous reads: result is bytes read or negative error/ZI_CANCELED */
+struct zi_pool;
+struct zi_request;
+struct zi_zst;
+struct zi_chunks;
+struct zi_disk;
+struct zi_shm;
+struct zi_maps;
+struct zi_store;
+struct zi_zoner;
+struct zi_previewer;
+typedef void (*zi_callback)(zindexPtr idx, struct zi_request *req,
+		int result, void *user);
+typedef void (*zi_verify_report)(zindexPtr idx, size_t span, int error,
+		void *user);
+typedef int (*zi_sink)(const unsigned char *p, size_t n, void *user);
+
 void free_index(struct access *index);
 
+struct access *index_point(struct access *index, int bits, off_t in,
+		off_t out, off_t window);
+
+size_t find_point(struct access *index, off_t offset);
+
 int build_index(FILE *in, off_t span, struct access **built);
 
+int build_index_tee(FILE *in, FILE *out, off_t span, struct access **built);
+
+int build_index_stream(FILE *in, FILE *out, off_t span, FILE *idxFile,
+		FILE *ucsFile);
+
+int build_index_flags(FILE *in, FILE *out, off_t span, int flags,
+		FILE *idxFile, FILE *ucsFile);
+
+int build_index_preview(FILE *in, FILE *out, off_t span, int flags,
+		FILE *idxFile, FILE *ucsFile, FILE *prvFile);
+
+int zi_update(FILE *zFile, FILE *idxFile, FILE *ucsFile, off_t span);
+
 int write_index(struct access *index, FILE *idxFile, FILE *ucsFile);
 
 int read_index(FILE *idxFile, struct access **built);
 
+int write_index_embedded(struct access *index, FILE *ucsFile, FILE *zFile);
+
+int read_index_embedded(FILE *zFile, struct access **built);
+
+int read_window(struct access *index, FILE *ucsFile, size_t k,
+		unsigned char *window);
+
+int read_index_gzi(FILE *gziFile, FILE *zFile, off_t span,
+		struct access **built);
+
+int write_index_gzi(FILE *zFile, FILE *gziFile);
+
+int read_index_gzidx(FILE *gzidxFile, struct access **built);
+
+int write_index_gzidx(struct access *index, FILE *ucsFile, FILE *zFile,
+		FILE *gzidxFile);
+
 zindexPtr ziopen_auto(const char *path, const char *mode);
 
 zindexPtr ziopen(const char *zPath, const char *idxPath, const char *ucsPath, const char *mode);
 
+zindexPtr ziopen_embedded(const char *zPath, const char *mode);
+
+zindexPtr ziopen_foreign(const char *zPath, const char *mode);
+
+zindexPtr ziopen_zst(const char *zPath, const char *mode);
+
+zindexPtr ziopen_chunks(const char *zPath, const char *mode);
+
 zindexPtr zidopen(int zfd, int idxfd, int ucsfd, const char *mode);
 
+int zi_refresh(zindexPtr idx);
+
 int ziclose(zindexPtr * idx);
 
 int ziread(zindexPtr idx, void* buf, unsigned len);
@@ -69,6 +296,8 @@ int ziwrite(zindexPtr idx, const void* buf, unsigned len);
 
 long ziseek(zindexPtr idx, long offset, int whence);
 
+long zi_seek_line(zindexPtr idx, off_t line);
+
 int zirewind(zindexPtr idx);
 
 long zitell(zindexPtr idx);
@@ -85,6 +314,153 @@ int ziputc(zindexPtr idx, int c);
 
 int zigetc(zindexPtr idx);
 
+int zi_extract(zindexPtr idx, struct zi_io *io, off_t offset,
+		unsigned char *buf, int len, const volatile int *cancel);
+
+off_t zi_extract_each(zindexPtr idx, struct zi_io *io, off_t offset, off_t len,
+		unsigned char *buf, int size, zi_sink put, void *user,
+		const volatile int *cancel);
+
+struct zi_request * ziread_async(zindexPtr idx, off_t offset, unsigned len,
+		void *buf, zi_callback callback, void *user);
+
+struct zi_request * ziread_prio(zindexPtr idx, off_t offset, unsigned len,
+		void *buf, int prio, unsigned deadline, zi_callback callback,
+		void *user);
+
+int zi_wait(zindexPtr idx, struct zi_request *req);
+
+int zi_poll(zindexPtr idx);
+
+int zi_cancel(zindexPtr idx, struct zi_request *req);
+
+int zi_eventfd(zindexPtr idx);
+
+void zi_pool_close(zindexPtr idx);
+
+void zi_pool_hold(zindexPtr idx);
+
+void zi_pool_release(zindexPtr idx);
+
+int zi_set_verify(zindexPtr idx, int verify);
+
+int zi_verify_span(zindexPtr idx, struct zi_io *io, size_t span,
+		unsigned char *buf);
+
+long zi_verify(zindexPtr idx, int nthread, zi_verify_report report, void *user);
+
+uint32_t zi_crc32(uint32_t crc, const unsigned char *buf, size_t len);
+
+void zi_put_le(unsigned char *p, uint64_t val, int n);
+
+uint64_t zi_get_le(const unsigned char *p, int n);
+
+int read_index_zst(FILE *zFile, struct access **built);
+
+int zst_extract(zindexPtr idx, struct zi_io *io, size_t first, off_t offset,
+		unsigned char *buf, int len, const volatile int *cancel);
+
+void zst_close(zindexPtr idx);
+
+long zst_transcode(gzFile in, FILE *out, int nthread, int level);
+
+int chunks_extract(zindexPtr idx, off_t offset, unsigned char *buf, int len,
+		const volatile int *cancel);
+
+void chunks_close(zindexPtr idx);
+
+long zi_rechunk(gzFile in, FILE *out, int block, int nthread, int level);
+
+long zi_block(zindexPtr idx, const off_t *origin, const off_t *size, void *buf);
+
+long zi_series(zindexPtr idx, off_t x, off_t y, off_t z, void *buf);
+
+int zi_file_id(FILE *f, uint64_t *id);
+
+int zi_disk_cache(zindexPtr idx, const char *dir, off_t max);
+
+void zi_disk_close(zindexPtr idx);
+
+int zi_disk_get(struct zi_disk *disk, off_t start, off_t n, off_t from,
+		unsigned char *buf, size_t len);
+
+int zi_disk_put(struct zi_disk *disk, off_t start, const unsigned char *span,
+		size_t n);
+
+int zi_shm_cache(zindexPtr idx, const char *name, off_t max);
+
+void zi_shm_close(zindexPtr idx);
+
+int zi_shm_get(struct zi_shm *shm, off_t start, off_t n, off_t from,
+		unsigned char *buf, size_t len);
+
+int zi_shm_put(struct zi_shm *shm, off_t start, const unsigned char *span,
+		size_t n);
+
+int zi_fingerprint(FILE *f, uint64_t *print, off_t *size);
+
+int zi_cache_names(const char *zPath, char **idxName, char **ucsName, int make);
+
+struct zi_store * zi_store_open(const char *dir);
+
+long zi_store_add(struct zi_store *store, struct access *index, FILE *ucsFile);
+
+int zi_store_release(struct zi_store *store, struct access *index);
+
+int zi_store_sync(struct zi_store *store);
+
+int zi_store_close(struct zi_store *store);
+
+FILE * zi_store_windows(const char *dir, const char *mode);
+
+int zi_nifti_header(const unsigned char *h, size_t n, struct zi_nifti *nii);
+
+struct zi_zoner * zoner_open(void);
+
+int zi_voxel_bytes(int datatype);
+
+double zi_voxel_value(const struct zi_nifti *nii, const unsigned char *p);
+
+int zoner_feed(struct zi_zoner *zn, const unsigned char *p, size_t n);
+
+struct zone_maps * zoner_close(struct zi_zoner *zn);
+
+void free_zones(struct zone_maps *maps);
+
+const struct zone_maps * zi_zones(zindexPtr idx);
+
+long zi_zone_select(zindexPtr idx, double lo, double hi, unsigned char *keep);
+
+int zi_reduce(zindexPtr idx, const struct zi_region *region, int datatype,
+		int op, struct zi_reduction *out);
+
+int zi_track(zindexPtr idx, const char *path);
+
+void zi_hist_count(struct zi_hist *hist, off_t offset);
+
+int zi_hist_read(const char *path, struct zi_hist **hist);
+
+int zi_hist_close(struct zi_hist *hist);
+
+void free_hist(struct zi_hist *hist);
+
+long zi_densify(struct access *index, FILE *zFile, FILE *ucsIn, FILE *ucsOut,
+		const struct zi_hist *hist, unsigned long min, struct access **built);
+
+struct zi_previewer * previewer_open(void);
+
+int previewer_feed(struct zi_previewer *pv, const unsigned char *p, size_t n);
+
+int previewer_close(struct zi_previewer *pv, FILE *out);
+
+int zi_preview(const char *zPath, int axis, int factor, struct zi_preview *prv);
+
+const void * zimap(zindexPtr idx, off_t offset, size_t len);
+
+int ziunmap(zindexPtr idx, const void *ptr);
+
+void zi_maps_close(zindexPtr idx);
+
 #if !defined(WIN32)
 int ziprintf(zindexPtr idx, const char *format, ...);
 #endif
@@ -0,0 +1,325 @@
+/* zipreview.c -- preview pyramid of a NIfTI image, built with the index
+ *
+ *  build_index_preview() follows the data like the zone maps do and keeps
+ *  the three orthogonal slices through the centre of the middle volume
+ *  (sagittal, coronal and axial: axis 0, 1 and 2 is the one held fixed),
+ *  averaged over 2x2 blocks.  When the index is complete they are written to
+ *  a sidecar, file.gz.idx.prv, downsampled by 2, 4 and 8: the magic
+ *  "ZIPRVW1\n", the volume shown (64 bits) and the number of images (32),
+ *  then for each the axis, factor, width and height (32 bits each) and the
+ *  width * height block means as floats, little-endian, row after row.
+ *  Blocks of NaNs only are NaN; values are as stored, before scl_slope and
+ *  scl_inter.  zi_preview() reads one level back without opening the
+ *  compressed data, so a thumbnail costs a few kilobytes of I/O.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <math.h>
+#include "zindex.h"
+
+#define local static
+
+#define NII_HEAD 540        /* bytes needed to tell NIfTI-1 from NIfTI-2 */
+#define PRV_MAGIC "ZIPRVW1\n"
+#define PRV_HEAD 20         /* magic, volume and number of images */
+#define PRV_IMAGE 16        /* axis, factor, width and height */
+#define PRV_LEVELS 3        /* factors 2, 4 and 8 */
+
+/* one mid slice, as sums and counts of 2x2 blocks */
+struct prv_plane {
+    size_t w, h;                /* blocks across and down */
+    double *sum;
+    uint32_t *n;
+};
+
+/* preview slices while they are collected from the output */
+struct zi_previewer {
+    unsigned char head[NII_HEAD];
+    size_t headLen;             /* header bytes collected so far */
+    struct zi_nifti nii;        /* parsed header */
+    int on;                     /* an image to preview */
+    off_t pos;                  /* offset of the next byte fed */
+    off_t start;                /* of the middle volume */
+    off_t x, y, z;              /* voxel of the next whole voxel there */
+    unsigned char carry[8];     /* voxel split between two feeds */
+    int carryLen;
+    struct prv_plane plane[3];
+};
+
+struct zi_previewer *previewer_open(void)
+{
+    return calloc(1, sizeof(struct zi_previewer));
+}
+
+/* Start collecting once the header is complete, or give up. */
+local int previewer_start(struct zi_previewer *pv)
+{
+    const off_t *dim = pv->nii.dim;
+    struct prv_plane *pl;
+    int a;
+
+    if (!zi_nifti_header(pv->head, pv->headLen, &pv->nii) || pv->nii.bytes == 0)
+        return Z_OK;
+    for (a = 0; a < 3; ++a) {
+        pl = pv->plane + a;
+        pl->w = (size_t)(dim[a == 0 ? 1 : 0] + 1) / 2;
+        pl->h = (size_t)(dim[a == 2 ? 1 : 2] + 1) / 2;
+        pl->sum = calloc(pl->w * pl->h, sizeof(double));
+        pl->n = calloc(pl->w * pl->h, sizeof(uint32_t));
+        if (pl->sum == NULL || pl->n == NULL)
+            return Z_MEM_ERROR;
+    }
+    pv->start = pv->nii.vox_offset + pv->nii.volume * (pv->nii.volumes / 2);
+    pv->on = 1;
+    return Z_OK;
+}
+
+/* Add the value at p to block (i, j) of plane a. */
+local void plane_add(struct zi_previewer *pv, int a, off_t i, off_t j,
+                     const unsigned char *p)
+{
+    struct prv_plane *pl = pv->plane + a;
+    size_t k = (size_t)(j >> 1) * pl->w + (size_t)(i >> 1);
+    double v = zi_voxel_value(&pv->nii, p);
+
+    if (v == v) {
+        pl->sum[k] += v;
+        pl->n[k]++;
+    }
+}
+
+/* Add the whole voxels of the n bytes at p, all in the middle volume. */
+local void previewer_add(struct zi_previewer *pv, const unsigned char *p, size_t n)
+{
+    const off_t *dim = pv->nii.dim;
+    off_t cx = dim[0] / 2, cy = dim[1] / 2, cz = dim[2] / 2;
+    int b = pv->nii.bytes;
+
+    for (; n >= (size_t)b; p += b, n -= b) {
+        if (pv->x == cx)
+            plane_add(pv, 0, pv->y, pv->z, p);
+        if (pv->y == cy)
+            plane_add(pv, 1, pv->x, pv->z, p);
+        if (pv->z == cz)
+            plane_add(pv, 2, pv->x, pv->y, p);
+        if (++pv->x == dim[0]) {
+            pv->x = 0;
+            if (++pv->y == dim[1]) {
+                pv->y = 0;
+                pv->z++;
+            }
+        }
+    }
+}
+
+/* Add the n bytes at p, the data from offset pv->pos on. */
+local void previewer_voxels(struct zi_previewer *pv, const unsigned char *p, size_t n)
+{
+    off_t end = pv->start + pv->nii.volume;
+    size_t m;
+    int b = pv->nii.bytes;
+
+    if (pv->pos + (off_t)n <= pv->start || pv->pos >= end) {
+        pv->pos += (off_t)n;
+        return;
+    }
+    if (pv->pos < pv->start) {
+        m = (size_t)(pv->start - pv->pos);
+        p += m;
+        n -= m;
+        pv->pos += (off_t)m;
+    }
+    m = end - pv->pos < (off_t)n ? (size_t)(end - pv->pos) : n;
+    pv->pos += (off_t)n;
+    if (pv->carryLen) {                 /* complete the split voxel */
+        while (pv->carryLen < b && m > 0) {
+            pv->carry[pv->carryLen++] = *p++;
+            m--;
+        }
+        if (pv->carryLen < b)
+            return;
+        previewer_add(pv, pv->carry, (size_t)b);
+        pv->carryLen = 0;
+    }
+    previewer_add(pv, p, m);
+    memcpy(pv->carry, p + m - m % b, m % b);
+    pv->carryLen = (int)(m % b);
+}
+
+/* Follow the next n bytes of output at p. */
+int previewer_feed(struct zi_previewer *pv, const unsigned char *p, size_t n)
+{
+    size_t m;
+    int ret;
+
+    if (pv->headLen < NII_HEAD) {
+        m = NII_HEAD - pv->headLen < n ? NII_HEAD - pv->headLen : n;
+        memcpy(pv->head + pv->headLen, p, m);
+        pv->headLen += m;
+        p += m;
+        n -= m;
+        if (pv->headLen < NII_HEAD)
+            return Z_OK;
+        if ((ret = previewer_start(pv)) != Z_OK)
+            return ret;
+        if (pv->on)
+            previewer_voxels(pv, pv->head, NII_HEAD);
+    }
+    if (pv->on)
+        previewer_voxels(pv, p, n);
+    return Z_OK;
+}
+
+/* Write plane a downsampled by factor to out. */
+local int previewer_level(const struct zi_previewer *pv, int a, int factor, FILE *out)
+{
+    const struct prv_plane *pl = pv->plane + a;
+    size_t f = (size_t)factor / 2, w, h, i, j, k, l;
+    unsigned char head[PRV_IMAGE], *row;
+    double sum;
+    uint32_t word, cnt;
+    float v;
+
+    w = (pl->w + f - 1) / f;
+    h = (pl->h + f - 1) / f;
+    row = malloc(w * 4);
+    if (row == NULL)
+        return Z_MEM_ERROR;
+    zi_put_le(head, (uint64_t)a, 4);
+    zi_put_le(head + 4, (uint64_t)factor, 4);
+    zi_put_le(head + 8, (uint64_t)w, 4);
+    zi_put_le(head + 12, (uint64_t)h, 4);
+    if (fwrite(head, PRV_IMAGE, 1u, out) != 1u) {
+        free(row);
+        return Z_ERRNO;
+    }
+    for (j = 0; j < h; ++j) {
+        for (i = 0; i < w; ++i) {
+            sum = 0;
+            cnt = 0;
+            for (l = j * f; l < (j + 1) * f && l < pl->h; ++l)
+                for (k = i * f; k < (i + 1) * f && k < pl->w; ++k) {
+                    sum += pl->sum[l * pl->w + k];
+                    cnt += pl->n[l * pl->w + k];
+                }
+            v = cnt ? (float)(sum / cnt) : (float)NAN;
+            memcpy(&word, &v, 4);
+            zi_put_le(row + 4 * i, word, 4);
+        }
+        if (fwrite(row, 4, w, out) != w) {
+            free(row);
+            return Z_ERRNO;
+        }
+    }
+    free(row);
+    return Z_OK;
+}
+
+/* Finish: write the preview pyramid to out, if the data is a NIfTI image
+   with a supported datatype that was seen in full and out is not NULL.
+   Returns the number of images written, 0 if none, or a zlib error.  pv is
+   freed. */
+int previewer_close(struct zi_previewer *pv, FILE *out)
+{
+    unsigned char head[PRV_HEAD];
+    int ret, a, l;
+
+    if (pv == NULL)
+        return 0;
+    ret = Z_OK;
+    if (pv->headLen < NII_HEAD) {           /* a small NIfTI-1 file */
+        ret = previewer_start(pv);
+        if (ret == Z_OK && pv->on)
+            previewer_voxels(pv, pv->head, pv->headLen);
+    }
+    if (ret == Z_OK && out != NULL && pv->on &&
+        pv->pos >= pv->start + pv->nii.volume) {
+        memcpy(head, PRV_MAGIC, 8);
+        zi_put_le(head + 8, (uint64_t)(pv->nii.volumes / 2), 8);
+        zi_put_le(head + 16, 3 * PRV_LEVELS, 4);
+        if (fwrite(head, PRV_HEAD, 1u, out) != 1u)
+            ret = Z_ERRNO;
+        for (a = 0; a < 3 && ret == Z_OK; ++a)
+            for (l = 1; l <= PRV_LEVELS && ret == Z_OK; ++l)
+                ret = previewer_level(pv, a, 1 << l, out);
+        if (ret == Z_OK)
+            ret = 3 * PRV_LEVELS;
+    }
+    for (a = 0; a < 3; ++a) {
+        free(pv->plane[a].sum);
+        free(pv->plane[a].n);
+    }
+    free(pv);
+    return ret;
+}
+
+/* Read the preview of the image at zPath along axis (0 sagittal, 1 coronal,
+   2 axial) downsampled by factor (2, 4 or 8) from zPath.idx.prv into prv.
+   Returns Z_OK, Z_ERRNO if there is no preview, Z_DATA_ERROR if it is
+   damaged or Z_BUF_ERROR if it has no such level.  prv->data is allocated
+   and left to the caller to free. */
+int zi_preview(const char *zPath, int axis, int factor, struct zi_preview *prv)
+{
+    unsigned char head[PRV_HEAD];
+    char *name;
+    FILE *in;
+    uint32_t count, k, word;
+    size_t w, h, i;
+    int ret;
+
+    memset(prv, 0, sizeof(struct zi_preview));
+    name = malloc(strlen(zPath) + sizeof(".idx.prv"));
+    if (name == NULL)
+        return Z_MEM_ERROR;
+    strcpy(name, zPath);
+    strcat(name, ".idx.prv");
+    in = fopen(name, "rb");
+    free(name);
+    if (in == NULL)
+        return Z_ERRNO;
+    ret = Z_DATA_ERROR;
+    if (fread(head, PRV_HEAD, 1u, in) != 1u || memcmp(head, PRV_MAGIC, 8) != 0)
+        goto preview_ret;
+    count = (uint32_t)zi_get_le(head + 16, 4);
+    for (k = 0; k < count; ++k) {
+        if (fread(head, PRV_IMAGE, 1u, in) != 1u)
+            goto preview_ret;
+        w = (size_t)zi_get_le(head + 8, 4);
+        h = (size_t)zi_get_le(head + 12, 4);
+        if (w == 0 || h == 0 || w > ((size_t)-1 >> 2) / h)
+            goto preview_ret;
+        if ((int)zi_get_le(head, 4) == axis &&
+            (int)zi_get_le(head + 4, 4) == factor)
+            break;
+        if (fseeko(in, (off_t)(w * h * 4), SEEK_CUR) != 0)
+            goto preview_ret;
+    }
+    if (k == count) {
+        ret = Z_BUF_ERROR;
+        goto preview_ret;
+    }
+    prv->data = malloc(w * h * sizeof(float));
+    if (prv->data == NULL) {
+        ret = Z_MEM_ERROR;
+        goto preview_ret;
+    }
+    if (fread(prv->data, 4, w * h, in) != w * h) {
+        free(prv->data);
+        prv->data = NULL;
+        goto preview_ret;
+    }
+    for (i = 0; i < w * h; ++i) {       /* to host order */
+        word = (uint32_t)zi_get_le((unsigned char *)(prv->data + i), 4);
+        memcpy(prv->data + i, &word, 4);
+    }
+    prv->axis = axis;
+    prv->factor = factor;
+    prv->width = w;
+    prv->height = h;
+    ret = Z_OK;
+
+preview_ret:
+    fclose(in);
+    return ret;
+}
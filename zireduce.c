@@ -0,0 +1,351 @@
+/* zireduce.c -- reductions of voxel data evaluated while it is decoded
+ *
+ *  zi_reduce() computes the number, sum, sum of squares, minimum and maximum
+ *  (and with ZI_REDUCE_HIST a histogram) of the voxels in a region of the
+ *  uncompressed data, for the whole region or for every unit of it (volume),
+ *  optionally only over the voxels of a mask.  The spans of the region are
+ *  decoded in parallel, each by a worker through zi_extract_each() into a
+ *  buffer of ZI_REDUCE_CHUNK bytes that the kernels read while it is still in
+ *  cache; the region itself is never held in memory.  The kernels convert a
+ *  block of voxels to doubles with weights (0 for NaNs and voxels outside the
+ *  mask) and reduce it in four independent lanes, a form the compiler can
+ *  vectorize.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <float.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "zindex.h"
+
+#define local static
+
+#define BLOCK 512           /* voxels converted at a time */
+#define LANES 4
+
+/* shared state of the reducing threads */
+struct reduce_job {
+    zindexPtr idx;
+    const struct zi_region *region;
+    off_t len;                  /* whole voxels of the region in the data */
+    int datatype;               /* without ZI_DT_BIG */
+    int bytes;                  /* of a voxel */
+    int swap;                   /* byte order differs from ours */
+    int op;
+    size_t nunit;
+    struct zi_reduction *out;
+    pthread_mutex_t lock;
+    size_t next;                /* next span to hand out */
+    size_t last;                /* span after the region */
+    int ret;                    /* first error */
+    volatile int stop;          /* set on error, the others give up */
+};
+
+/* the results of one worker, reduced into out at its end */
+struct reduce_part {
+    struct reduce_job *job;
+    off_t pos;                  /* offset in the region of the next byte */
+    struct zi_reduction *acc;   /* nunit partial results */
+};
+
+/* Convert n voxels at p (byte swapped if needed) to values in t with weights
+   in w: 0 for NaNs and voxels outside mask, 1 for the others. */
+local void reduce_convert(const struct reduce_job *job, const unsigned char *p,
+                          size_t n, const unsigned char *mask, double *t,
+                          double *w)
+{
+    uint64_t raw[BLOCK];
+    unsigned char *q = (unsigned char *)raw, c;
+    size_t i;
+    int b = job->bytes, j;
+
+    memcpy(raw, p, n * b);
+    if (job->swap)
+        for (i = 0; i < n * b; i += b)
+            for (j = 0; j < b / 2; ++j) {
+                c = q[i + j];
+                q[i + j] = q[i + b - 1 - j];
+                q[i + b - 1 - j] = c;
+            }
+    switch (job->datatype) {
+    case 2:     for (i = 0; i < n; ++i) t[i] = ((const uint8_t *)raw)[i]; break;
+    case 256:   for (i = 0; i < n; ++i) t[i] = ((const int8_t *)raw)[i]; break;
+    case 4:     for (i = 0; i < n; ++i) t[i] = ((const int16_t *)raw)[i]; break;
+    case 512:   for (i = 0; i < n; ++i) t[i] = ((const uint16_t *)raw)[i]; break;
+    case 8:     for (i = 0; i < n; ++i) t[i] = ((const int32_t *)raw)[i]; break;
+    case 768:   for (i = 0; i < n; ++i) t[i] = ((const uint32_t *)raw)[i]; break;
+    case 1024:  for (i = 0; i < n; ++i) t[i] = (double)((const int64_t *)raw)[i]; break;
+    case 1280:  for (i = 0; i < n; ++i) t[i] = (double)((const uint64_t *)raw)[i]; break;
+    case 16:    for (i = 0; i < n; ++i) t[i] = ((const float *)raw)[i]; break;
+    default:    for (i = 0; i < n; ++i) t[i] = ((const double *)raw)[i]; break;
+    }
+    for (i = 0; i < n; ++i) {
+        w[i] = t[i] == t[i];            /* not NaN */
+        t[i] = w[i] != 0 ? t[i] : 0;
+    }
+    if (mask != NULL)
+        for (i = 0; i < n; ++i)
+            w[i] = mask[i] ? w[i] : 0;
+}
+
+/* Reduce n weighted values into r. */
+local void reduce_block(const double *t, const double *w, size_t n, int op,
+                        struct zi_reduction *r)
+{
+    double cnt[LANES], sum[LANES], sq[LANES], lo[LANES], hi[LANES];
+    double x, c, scale;
+    size_t i, b;
+    int j;
+
+    for (j = 0; j < LANES; ++j) {
+        cnt[j] = sum[j] = sq[j] = 0;
+        lo[j] = DBL_MAX;
+        hi[j] = -DBL_MAX;
+    }
+    for (i = 0; i + LANES <= n; i += LANES)
+        for (j = 0; j < LANES; ++j) {
+            x = t[i + j];
+            c = w[i + j];
+            cnt[j] += c;
+            sum[j] += c * x;
+            sq[j] += c * x * x;
+            lo[j] = c != 0 && x < lo[j] ? x : lo[j];
+            hi[j] = c != 0 && x > hi[j] ? x : hi[j];
+        }
+    for (j = 0; i < n; ++i, ++j) {      /* the rest in the first lanes */
+        x = t[i];
+        c = w[i];
+        cnt[j] += c;
+        sum[j] += c * x;
+        sq[j] += c * x * x;
+        lo[j] = c != 0 && x < lo[j] ? x : lo[j];
+        hi[j] = c != 0 && x > hi[j] ? x : hi[j];
+    }
+    for (j = 0; j < LANES; ++j) {
+        r->count += (uint64_t)cnt[j];
+        r->sum += sum[j];
+        r->sumsq += sq[j];
+        r->min = lo[j] < r->min ? lo[j] : r->min;
+        r->max = hi[j] > r->max ? hi[j] : r->max;
+    }
+
+    if (!(op & ZI_REDUCE_HIST) || r->hist == NULL || r->bins == 0 || !(r->hi > r->lo))
+        return;
+    scale = (double)r->bins / (r->hi - r->lo);
+    for (i = 0; i < n; ++i)
+        if (w[i] != 0 && t[i] >= r->lo && t[i] <= r->hi) {
+            b = (size_t)((t[i] - r->lo) * scale);
+            r->hist[b < r->bins ? b : r->bins - 1]++;
+        }
+}
+
+/* zi_sink of the workers: reduce n bytes of whole voxels at p, which follow
+   the bytes reduced before, unit by unit. */
+local int reduce_put(const unsigned char *p, size_t n, void *user)
+{
+    struct reduce_part *part = user;
+    struct reduce_job *job = part->job;
+    const struct zi_region *region = job->region;
+    double t[BLOCK], w[BLOCK];
+    const unsigned char *mask;
+    off_t unit, in;
+    size_t u, m, k, voxel;
+
+    if (job->stop)
+        return 1;
+    unit = region->unit > 0 ? region->unit : job->len;
+    while (n > 0) {
+        u = (size_t)(part->pos / unit);
+        in = part->pos - unit * (off_t)u;
+        m = (off_t)n < unit - in ? n : (size_t)(unit - in);
+        voxel = (size_t)(in / job->bytes);
+        for (k = 0; k < m / job->bytes; k += BLOCK) {
+            size_t c = m / job->bytes - k < BLOCK ? m / job->bytes - k : BLOCK;
+
+            mask = region->mask != NULL ? region->mask + voxel + k : NULL;
+            reduce_convert(job, p + k * job->bytes, c, mask, t, w);
+            reduce_block(t, w, c, job->op, part->acc + u);
+        }
+        p += m;
+        n -= m;
+        part->pos += (off_t)m;
+    }
+    return 0;
+}
+
+/* Fold the partial results of a worker into out. */
+local void reduce_merge(struct reduce_job *job, const struct zi_reduction *acc)
+{
+    struct zi_reduction *r;
+    size_t u, b;
+
+    for (u = 0; u < job->nunit; ++u) {
+        r = job->out + u;
+        r->count += acc[u].count;
+        r->sum += acc[u].sum;
+        r->sumsq += acc[u].sumsq;
+        r->min = acc[u].min < r->min ? acc[u].min : r->min;
+        r->max = acc[u].max > r->max ? acc[u].max : r->max;
+        if (acc[u].hist != NULL)
+            for (b = 0; b < r->bins; ++b)
+                r->hist[b] += acc[u].hist[b];
+    }
+}
+
+/* Start of the voxel at or after offset, counting from the region start. */
+local off_t voxel_at(const struct reduce_job *job, off_t offset)
+{
+    off_t from = job->region->offset, v = job->bytes;
+
+    if (offset <= from)
+        return 0;
+    offset = (offset - from + v - 1) / v * v;
+    return offset < job->len ? offset : job->len;
+}
+
+local void *reduce_worker(void *arg)
+{
+    struct reduce_job *job = arg;
+    struct access *index = job->idx->data;
+    struct reduce_part part;
+    struct zi_io *io;
+    unsigned char *buf;
+    uint64_t *hist;
+    size_t span, u, bins;
+    off_t from, to, got;
+    int ret;
+
+    /* partial results, with histograms of their own */
+    io = ziio_open(ZI_IO_DEPTH);
+    buf = (unsigned char *) malloc(ZI_REDUCE_CHUNK);
+    part.job = job;
+    part.acc = (struct zi_reduction *) calloc(job->nunit, sizeof(struct zi_reduction));
+    bins = 0;
+    for (u = 0; part.acc != NULL && u < job->nunit; ++u)
+        bins += (job->op & ZI_REDUCE_HIST) && job->out[u].hist != NULL ? job->out[u].bins : 0;
+    hist = (uint64_t *) calloc(bins ? bins : 1, sizeof(uint64_t));
+    ret = io == NULL || buf == NULL || part.acc == NULL || hist == NULL ? Z_MEM_ERROR : Z_OK;
+    for (u = 0, bins = 0; ret == Z_OK && u < job->nunit; ++u) {
+        part.acc[u] = job->out[u];
+        part.acc[u].count = 0;
+        part.acc[u].sum = part.acc[u].sumsq = 0;
+        part.acc[u].min = DBL_MAX;
+        part.acc[u].max = -DBL_MAX;
+        part.acc[u].hist = NULL;
+        if ((job->op & ZI_REDUCE_HIST) && job->out[u].hist != NULL) {
+            part.acc[u].hist = hist + bins;
+            bins += job->out[u].bins;
+        }
+    }
+
+    /* the whole voxels starting in each span handed out */
+    while (ret == Z_OK && !job->stop) {
+        pthread_mutex_lock(&job->lock);
+        span = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (span >= job->last)
+            break;
+        from = voxel_at(job, index->idx_list[span].out);
+        to = voxel_at(job, index->idx_list[span + 1].out);
+        if (from >= to)
+            continue;
+        part.pos = from;
+        got = zi_extract_each(job->idx, io, job->region->offset + from, to - from,
+                              buf, ZI_REDUCE_CHUNK, reduce_put, &part, &job->stop);
+        if (got < 0)
+            ret = (int)got;
+        else if (got != to - from)
+            ret = Z_DATA_ERROR;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (ret != Z_OK) {
+        if (job->ret == Z_OK)
+            job->ret = ret;
+        job->stop = 1;
+    }
+    else if (job->ret == Z_OK)
+        reduce_merge(job, part.acc);
+    pthread_mutex_unlock(&job->lock);
+    free(hist);
+    free(part.acc);
+    free(buf);
+    ziio_close(io);
+    return NULL;
+}
+
+/* Reduce the voxels of datatype (a NIfTI code, or'ed with ZI_DT_BIG for
+   big-endian data) in region of idx, into out[0] or, if region->unit is not
+   0, into out[k] for the unit k of the region -- the caller gives room for
+   all.  With ZI_REDUCE_HIST in op, the histograms whose lo, hi, bins and hist
+   the caller set in out are filled in as well.  Threads: ZINDEX_THREADS, or
+   one per processor.  Returns Z_OK, Z_STREAM_ERROR for a datatype without
+   statistics or a unit that is not whole voxels, or a read error. */
+int zi_reduce(zindexPtr idx, const struct zi_region *region, int datatype,
+              int op, struct zi_reduction *out)
+{
+    static const union { uint16_t u; unsigned char c[2]; } order = { 1 };
+    struct reduce_job job;
+    pthread_t *thread;
+    char *env;
+    long nthread;
+    size_t u;
+    int i;
+
+    if (idx == NULL || region == NULL || out == NULL || region->offset < 0 ||
+        region->len < 0)
+        return Z_STREAM_ERROR;
+    job.bytes = zi_voxel_bytes(datatype & ~ZI_DT_BIG);
+    if (job.bytes == 0 || region->unit < 0 || region->unit % job.bytes != 0)
+        return Z_STREAM_ERROR;
+    job.idx = idx;
+    job.region = region;
+    job.len = region->offset < idx->end ? idx->end - region->offset : 0;
+    if (job.len > region->len)
+        job.len = region->len;
+    job.len -= job.len % job.bytes;
+    job.datatype = datatype & ~ZI_DT_BIG;
+    job.swap = job.bytes > 1 && (!(datatype & ZI_DT_BIG) != (order.c[0] == 1));
+    job.op = op;
+    job.nunit = region->unit > 0 ? (size_t)((region->len + region->unit - 1) / region->unit) : 1;
+    job.out = out;
+    job.ret = Z_OK;
+    job.stop = 0;
+    for (u = 0; u < job.nunit; ++u) {
+        out[u].count = 0;
+        out[u].sum = out[u].sumsq = 0;
+        out[u].min = DBL_MAX;
+        out[u].max = -DBL_MAX;
+        if ((op & ZI_REDUCE_HIST) && out[u].hist != NULL)
+            memset(out[u].hist, 0, sizeof(uint64_t) * out[u].bins);
+    }
+    if (job.len > 0) {
+        job.next = find_point(idx->data, region->offset);
+        job.last = find_point(idx->data, region->offset + job.len - 1) + 1;
+
+        env = getenv("ZINDEX_THREADS");
+        nthread = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthread > (long)(job.last - job.next))
+            nthread = (long)(job.last - job.next);
+        if (nthread < 1)
+            nthread = 1;
+        thread = (pthread_t *) calloc((size_t)nthread, sizeof(pthread_t));
+        if (thread == NULL)
+            return Z_MEM_ERROR;
+        pthread_mutex_init(&job.lock, NULL);
+        for (i = 0; i < nthread; ++i)
+            if (pthread_create(thread + i, NULL, reduce_worker, &job) != 0)
+                break;
+        if (i == 0)
+            reduce_worker(&job);
+        while (i-- > 0)
+            pthread_join(thread[i], NULL);
+        pthread_mutex_destroy(&job.lock);
+        free(thread);
+    }
+    for (u = 0; u < job.nunit; ++u)
+        if (out[u].count == 0)
+            out[u].min = out[u].max = 0;
+    return job.ret;
+}
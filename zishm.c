@@ -0,0 +1,384 @@
+/* zishm.c -- decoded spans shared by the processes of a node in memory
+ *
+ *  A handle given the shared cache (zi_shm_cache(), or ZINDEX_SHM_CACHE in
+ *  the environment for ziopen()) looks for every span it reads in a POSIX
+ *  shared memory segment before decoding it, and puts every span it decodes
+ *  there, so that a span decoded by one process of the node is copied by
+ *  all the others.  The first process to come creates the segment with the
+ *  budget it asks for, fully allocated so that a full /dev/shm fails then
+ *  rather than later: a header, a table of ZI_SHM_WAYS entries per set, and
+ *  one slot of ZI_SHM_SLOT bytes per entry.  A span goes to the set given
+ *  by a hash of the identity of its file (zi_file_id()) and its offset,
+ *  into the way used least recently.
+ *
+ *  Lookups take no lock: every entry has a sequence word, even while the
+ *  entry is stable and odd while a writer fills it, and a reader copies the
+ *  span out between two reads of the word (and of the key of the span) and
+ *  throws the copy away if anything changed.  A writer claims an entry by
+ *  swapping in an odd word that holds its process id and the time, so that
+ *  whoever sees the claim sees who made it, and publishes the span by
+ *  swapping its own word for a new even one, giving up if it is no longer
+ *  there.  An entry left odd by a writer that died (its process is gone, or
+ *  it has held it ZI_SHM_STALE seconds) is claimed over it.  A segment is
+ *  waited for as long as its creator, named in its header before anything
+ *  else, is alive; one whose creator died before finishing it is removed and
+ *  made again.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zindex.h"
+
+#define local static
+
+#define SHM_READY 0x32304d4853495aULL   /* "ZISHM02" */
+#define SHM_HEAD 4096       /* header, then the table */
+#define SHM_WAIT 1000       /* ms for a creator to name itself in the header */
+
+struct shm_head {
+    uint64_t ready;             /* SHM_READY once set up */
+    uint64_t slot;              /* bytes per slot */
+    uint64_t nset;              /* sets of ZI_SHM_WAYS entries */
+    uint64_t clock;             /* uses counted, for the least recently */
+    uint64_t creator;           /* process id of whoever sets it up */
+};
+
+struct shm_entry {
+    uint64_t seq;               /* generation << 1 when stable, or the claim
+                                   of a writer: 1 | pid << 1 | seconds << 32 */
+    uint64_t id;                /* file identity */
+    uint64_t start;             /* uncompressed offset of the span */
+    uint64_t len;               /* its length, 0 if empty */
+    uint64_t used;              /* clock at last use */
+    uint64_t gen;               /* generations published, never reused */
+    uint64_t pad[2];
+};
+
+/* the segment, mapped once per process */
+struct shm_seg {
+    struct shm_head *head;
+    struct shm_entry *table;
+    unsigned char *data;
+    size_t size;
+};
+
+struct zi_shm {
+    struct shm_seg *seg;
+    uint64_t id;                /* identity of the compressed file */
+};
+
+local struct shm_seg segment;
+local pthread_mutex_t segLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create the segment name of size bytes, or open it if it exists; return the
+   mapping or NULL. */
+local void *shm_map(const char *name, off_t max, size_t *size, int retry)
+{
+    struct shm_head *head;
+    struct stat st;
+    struct timespec ms = {0, 1000000L};
+    uint64_t nset;
+    pid_t creator;
+    void *base;
+    int fd, i, mode;
+
+    mode = getenv("ZINDEX_SHM_NAME") != NULL ? 0666 : 0600;
+    nset = (uint64_t)max / ZI_SHM_SLOT / ZI_SHM_WAYS;
+    if (nset == 0)
+        nset = 1;
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+    if (fd >= 0) {
+        /* ours to set up: first say whose, then allocate all of it */
+        (void)fchmod(fd, mode);     /* past the umask */
+        base = ftruncate(fd, SHM_HEAD) == 0 ?
+               mmap(NULL, SHM_HEAD, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+               MAP_FAILED;
+        if (base != MAP_FAILED) {
+            __atomic_store_n(&((struct shm_head *)base)->creator,
+                             (uint64_t)getpid(), __ATOMIC_RELEASE);
+            munmap(base, SHM_HEAD);
+        }
+        *size = SHM_HEAD + nset * ZI_SHM_WAYS *
+                (sizeof(struct shm_entry) + (size_t)ZI_SHM_SLOT);
+        if (base == MAP_FAILED || posix_fallocate(fd, 0, (off_t)*size) != 0) {
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+        base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            shm_unlink(name);
+            return NULL;
+        }
+        head = base;
+        head->slot = ZI_SHM_SLOT;
+        head->nset = nset;
+        __atomic_store_n(&head->ready, SHM_READY, __ATOMIC_RELEASE);
+        return base;
+    }
+    if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0)
+        return NULL;
+
+    /* someone else's: wait for it to be set up, as long as whoever sets it
+       up lives -- allocating a big one takes a while */
+    head = MAP_FAILED;
+    for (i = 0; ; i++) {
+        if (fstat(fd, &st) != 0)
+            break;
+        if (head == MAP_FAILED && st.st_size >= SHM_HEAD) {
+            head = mmap(NULL, SHM_HEAD, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (head == MAP_FAILED)
+                break;
+        }
+        if (head != MAP_FAILED) {
+            if (__atomic_load_n(&head->ready, __ATOMIC_ACQUIRE) == SHM_READY)
+                break;
+            creator = (pid_t)__atomic_load_n(&head->creator, __ATOMIC_ACQUIRE);
+            if (creator > 0 ? kill(creator, 0) != 0 && errno == ESRCH :
+                i >= SHM_WAIT)
+                break;
+        }
+        else if (i >= SHM_WAIT)
+            break;                  /* died before even naming itself */
+        nanosleep(&ms, NULL);
+    }
+    base = MAP_FAILED;
+    if (head != MAP_FAILED &&
+        __atomic_load_n(&head->ready, __ATOMIC_ACQUIRE) == SHM_READY) {
+        munmap(head, SHM_HEAD);
+        if (fstat(fd, &st) == 0) {
+            *size = (size_t)st.st_size;
+            base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (base == MAP_FAILED)
+            return NULL;
+        head = base;
+        if (head->slot == ZI_SHM_SLOT &&
+            SHM_HEAD + head->nset * ZI_SHM_WAYS *
+            (sizeof(struct shm_entry) + (size_t)ZI_SHM_SLOT) <= *size)
+            return base;
+        munmap(base, *size);        /* of another version */
+        return NULL;
+    }
+    close(fd);
+    if (head != MAP_FAILED)
+        munmap(head, SHM_HEAD);
+
+    /* its creator died on the way: make it again, once */
+    if (!retry)
+        return NULL;
+    shm_unlink(name);
+    return shm_map(name, max, size, 0);
+}
+
+/* Start looking for the spans read by idx in the shared memory segment name
+   of the node, and putting there the ones decoded -- for name NULL,
+   ZINDEX_SHM_NAME from the environment or /zindex.uid.  If the segment is
+   made now, it takes max bytes, for max 0 ZINDEX_SHM_CACHE megabytes from
+   the environment or ZI_SHM_MB.  The segment stays mapped until the process
+   ends.  Returns Z_OK, Z_STREAM_ERROR for a handle other than of gzip data,
+   Z_ERRNO if there is no segment to be had, or Z_MEM_ERROR. */
+int zi_shm_cache(zindexPtr idx, const char *name, off_t max)
+{
+    struct zi_shm *shm;
+    const char *env;
+    char own[32];
+    uint64_t id;
+    void *base;
+    size_t size;
+
+    if (idx == NULL || (idx->data->flags & (ZI_ZSTD | ZI_CHUNKED)) ||
+        idx->zFile == NULL)
+        return Z_STREAM_ERROR;
+    if (name == NULL)
+        name = getenv("ZINDEX_SHM_NAME");
+    if (name == NULL) {
+        sprintf(own, "/zindex.%lu", (unsigned long)getuid());
+        name = own;
+    }
+    if (max <= 0) {
+        env = getenv("ZINDEX_SHM_CACHE");
+        max = (env != NULL && atol(env) > 0 ? atol(env) : ZI_SHM_MB) << 20;
+    }
+    if (zi_file_id(idx->zFile, &id) != Z_OK)
+        return Z_ERRNO;
+    pthread_mutex_lock(&segLock);
+    if (segment.head == NULL && (base = shm_map(name, max, &size, 1)) != NULL) {
+        segment.head = base;
+        segment.table = (struct shm_entry *)((unsigned char *)base + SHM_HEAD);
+        segment.data = (unsigned char *)(segment.table +
+                                         segment.head->nset * ZI_SHM_WAYS);
+        segment.size = size;
+    }
+    pthread_mutex_unlock(&segLock);
+    if (segment.head == NULL)
+        return Z_ERRNO;
+    shm = malloc(sizeof(struct zi_shm));
+    if (shm == NULL)
+        return Z_MEM_ERROR;
+    shm->seg = &segment;
+    shm->id = id;
+    zi_shm_close(idx);
+    idx->shm = shm;
+    return Z_OK;
+}
+
+/* Stop using the shared cache for idx. */
+void zi_shm_close(zindexPtr idx)
+{
+    free(idx->shm);
+    idx->shm = NULL;
+}
+
+/* Return the first entry of the set of the span at start. */
+local struct shm_entry *shm_set(const struct zi_shm *shm, off_t start)
+{
+    uint64_t h;
+
+    h = (shm->id ^ ((uint64_t)start * 0x9e3779b97f4a7c15ULL));
+    h ^= h >> 29;
+    return shm->seg->table + (h % shm->seg->head->nset) * ZI_SHM_WAYS;
+}
+
+/* Copy len bytes from offset from of the span of n bytes starting at start
+   to buf, if the span is in the shared cache.  Returns Z_OK, or Z_BUF_ERROR
+   if it is not there, or was being replaced while copied. */
+int zi_shm_get(struct zi_shm *shm, off_t start, off_t n, off_t from,
+               unsigned char *buf, size_t len)
+{
+    struct shm_entry *set, *e;
+    uint64_t seq;
+    int w;
+
+    set = shm_set(shm, start);
+    for (w = 0; w < ZI_SHM_WAYS; w++) {
+        e = set + w;
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) ||
+            __atomic_load_n(&e->id, __ATOMIC_RELAXED) != shm->id ||
+            __atomic_load_n(&e->start, __ATOMIC_RELAXED) != (uint64_t)start ||
+            __atomic_load_n(&e->len, __ATOMIC_RELAXED) != (uint64_t)n)
+            continue;
+        memcpy(buf, shm->seg->data + (size_t)(e - shm->seg->table) *
+               ZI_SHM_SLOT + from, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq ||
+            __atomic_load_n(&e->id, __ATOMIC_RELAXED) != shm->id ||
+            __atomic_load_n(&e->start, __ATOMIC_RELAXED) != (uint64_t)start ||
+            __atomic_load_n(&e->len, __ATOMIC_RELAXED) != (uint64_t)n)
+            return Z_BUF_ERROR;
+        __atomic_store_n(&e->used, __atomic_fetch_add(&shm->seg->head->clock, 1,
+                         __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        return Z_OK;
+    }
+    return Z_BUF_ERROR;
+}
+
+/* Return the claim of an entry by this process now. */
+local uint64_t shm_claim(void)
+{
+    return 1 | ((uint64_t)(getpid() & 0x7fffffff) << 1) |
+           ((uint64_t)(uint32_t)time(NULL) << 32);
+}
+
+/* Return 1 if the writer that made the odd word seq died on the way. */
+local int shm_stale(uint64_t seq)
+{
+    pid_t owner = (pid_t)((seq >> 1) & 0x7fffffff);
+
+    return (owner > 0 && kill(owner, 0) != 0 && errno == ESRCH) ||
+           (uint32_t)((uint32_t)time(NULL) - (uint32_t)(seq >> 32)) > ZI_SHM_STALE;
+}
+
+/* Publish e, claimed with the word seq, as a new generation.  Returns Z_OK, or
+   Z_BUF_ERROR if it was claimed over meanwhile. */
+local int shm_publish(struct shm_entry *e, uint64_t seq)
+{
+    uint64_t gen = __atomic_add_fetch(&e->gen, 1, __ATOMIC_RELAXED);
+
+    return __atomic_compare_exchange_n(&e->seq, &seq, gen << 1, 0,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED) ?
+           Z_OK : Z_BUF_ERROR;
+}
+
+/* Put the n bytes of the span starting at start in the shared cache, in
+   place of the span of its set used least recently.  This is only a cache:
+   returns Z_OK, or Z_BUF_ERROR if the span was not put there (too long, or
+   another process is writing where it would go). */
+int zi_shm_put(struct zi_shm *shm, off_t start, const unsigned char *span,
+               size_t n)
+{
+    struct shm_entry *set, *e, *victim;
+    uint64_t seq, vseq, used, least;
+    int w;
+
+    if ((off_t)n > ZI_SHM_SLOT || n == 0)
+        return Z_BUF_ERROR;
+    set = shm_set(shm, start);
+    victim = NULL;
+    vseq = 0;
+    least = UINT64_MAX;
+    for (w = 0; w < ZI_SHM_WAYS; w++) {
+        e = set + w;
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            if (!shm_stale(seq))
+                continue;
+            used = 0;               /* abandoned: first to go */
+        }
+        else if (__atomic_load_n(&e->len, __ATOMIC_RELAXED) == 0)
+            used = 0;
+        else if (__atomic_load_n(&e->id, __ATOMIC_RELAXED) == shm->id &&
+                 __atomic_load_n(&e->start, __ATOMIC_RELAXED) == (uint64_t)start)
+            return Z_OK;            /* someone put it there already */
+        else
+            used = __atomic_load_n(&e->used, __ATOMIC_RELAXED) + 1;
+        if (used < least) {
+            least = used;
+            victim = e;
+            vseq = seq;
+        }
+    }
+    if (victim == NULL)
+        return Z_BUF_ERROR;
+
+    /* claim it, with who and when in the same word */
+    seq = shm_claim();
+    if (seq == vseq || !__atomic_compare_exchange_n(&victim->seq, &vseq, seq, 0,
+                                                    __ATOMIC_ACQ_REL,
+                                                    __ATOMIC_RELAXED))
+        return Z_BUF_ERROR;
+    __atomic_store_n(&victim->len, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->id, shm->id, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->start, (uint64_t)start, __ATOMIC_RELAXED);
+    memcpy(shm->seg->data + (size_t)(victim - shm->seg->table) * ZI_SHM_SLOT,
+           span, n);
+    __atomic_store_n(&victim->len, (uint64_t)n, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->used, __atomic_fetch_add(&shm->seg->head->clock, 1,
+                     __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    if (shm_publish(victim, seq) == Z_OK)
+        return Z_OK;
+
+    /* taken over while copying, which may have spoiled what the other writer
+       put there: empty the entry if it can be had */
+    vseq = __atomic_load_n(&victim->seq, __ATOMIC_ACQUIRE);
+    seq = shm_claim();
+    if (!(vseq & 1) && vseq != seq &&
+        __atomic_compare_exchange_n(&victim->seq, &vseq, seq, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&victim->len, 0, __ATOMIC_RELAXED);
+        (void)shm_publish(victim, seq);
+    }
+    return Z_BUF_ERROR;
+}
@@ -0,0 +1,335 @@
+/* zistats.c -- NIfTI headers and voxel statistics of the index (zone maps)
+ *
+ *  With ZI_BUILD_STATS the indexer reads the NIfTI-1 or NIfTI-2 header at
+ *  the start of the data and keeps, for every volume (or every slice of an
+ *  image with a single volume), the minimum, maximum and sum of the stored
+ *  voxel values (before scl_slope and scl_inter), the number of voxels and
+ *  how many are non-zero.  Queries can then skip the volumes that cannot
+ *  hold what they look for without decoding anything.  NaNs are left out of
+ *  min, max and sum; complex and RGB data get no statistics.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <float.h>
+#include "zindex.h"
+
+#define local static
+
+#define NII_HEAD 540        /* bytes needed to tell NIfTI-1 from NIfTI-2 */
+
+/* zone maps while they are built from the output */
+struct zi_zoner {
+    unsigned char head[NII_HEAD];
+    size_t headLen;             /* header bytes collected so far */
+    struct zi_nifti nii;        /* parsed header, nii.bytes 0 if unusable */
+    off_t pos;                  /* offset of the next byte fed */
+    unsigned char carry[8];     /* voxel split between two feeds */
+    int carryLen;
+    struct zone_stats cur;      /* zone being accumulated */
+    struct zone_maps *maps;
+};
+
+/* Return the n byte integer at p, big-endian if big. */
+local uint64_t get_end(const unsigned char *p, int n, int big)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i = 0; i < n; ++i)
+        val = (val << 8) | p[big ? i : n - 1 - i];
+    return val;
+}
+
+/* Return the size of one voxel of a datatype with statistics, 0 for the
+   others (complex, RGB, unknown). */
+int zi_voxel_bytes(int datatype)
+{
+    switch (datatype) {
+    case 2: case 256:               return 1;   /* uint8, int8 */
+    case 4: case 512:               return 2;   /* int16, uint16 */
+    case 8: case 16: case 768:      return 4;   /* int32, float32, uint32 */
+    case 64: case 1024: case 1280:  return 8;   /* float64, int64, uint64 */
+    }
+    return 0;
+}
+
+/* Parse the NIfTI-1 or NIfTI-2 header in the first n bytes at h into nii:
+   where the voxels start, the size of one volume and one slice, the number
+   of volumes, the datatype and byte order.  nii->bytes is the size of a
+   voxel if statistics can be kept on it, else 0.  Returns 1 for a NIfTI
+   image, 0 for anything else. */
+int zi_nifti_header(const unsigned char *h, size_t n, struct zi_nifti *nii)
+{
+    uint64_t size, dim[8], bits;
+    uint32_t word;
+    float vox;
+    int big, nifti2, i;
+
+    memset(nii, 0, sizeof(struct zi_nifti));
+    if (n < 348)
+        return 0;
+    size = get_end(h, 4, 0);
+    big = size != 348 && size != 540;
+    if (big)
+        size = get_end(h, 4, 1);
+    if (size != 348 && size != 540)
+        return 0;
+    nifti2 = size == 540;
+    if (nifti2 && n < 540)
+        return 0;
+    for (i = 0; i < 8; ++i)
+        dim[i] = nifti2 ? get_end(h + 16 + 8 * i, 8, big) :
+                          get_end(h + 40 + 2 * i, 2, big);
+    bits = get_end(h + (nifti2 ? 14 : 72), 2, big);
+    nii->datatype = (int)get_end(h + (nifti2 ? 12 : 70), 2, big);
+    if (nifti2)
+        nii->vox_offset = (off_t)get_end(h + 168, 8, big);
+    else {
+        word = (uint32_t)get_end(h + 108, 4, big);
+        memcpy(&vox, &word, 4);
+        nii->vox_offset = vox >= 348 && vox < 1e9f ? (off_t)vox : 0;
+    }
+    if (dim[0] < 1 || dim[0] > 7 || bits < 1 || nii->vox_offset < (off_t)size)
+        return 0;
+    nii->big = big;
+    for (i = 1; i <= 3; ++i)
+        nii->dim[i - 1] = i <= (int)dim[0] && dim[i] > 0 ? (off_t)dim[i] : 1;
+    nii->volume = bits >= 8 ? (off_t)(bits / 8) : 1;
+    for (i = 1; i <= 3 && i <= (int)dim[0]; ++i) {
+        if (i == 3)
+            nii->slice = nii->volume;
+        if (dim[i] > 0)
+            nii->volume *= (off_t)dim[i];
+    }
+    if (nii->slice == 0)
+        nii->slice = nii->volume;
+    nii->volumes = 1;
+    for (i = 4; i <= (int)dim[0]; ++i)
+        if (dim[i] > 0)
+            nii->volumes *= (off_t)dim[i];
+    nii->bytes = zi_voxel_bytes(nii->datatype);
+    if ((uint64_t)nii->bytes * 8 != bits)
+        nii->bytes = 0;
+    return 1;
+}
+
+struct zi_zoner *zoner_open(void)
+{
+    return calloc(1, sizeof(struct zi_zoner));
+}
+
+/* Value of the voxel at p of an image with header nii (nii->bytes not 0). */
+double zi_voxel_value(const struct zi_nifti *nii, const unsigned char *p)
+{
+    uint64_t bits;
+    uint32_t word;
+    float f;
+    double d;
+
+    bits = get_end(p, nii->bytes, nii->big);
+    switch (nii->datatype) {
+    case 2:     return (double)(uint8_t)bits;
+    case 256:   return (double)(int8_t)bits;
+    case 4:     return (double)(int16_t)bits;
+    case 512:   return (double)(uint16_t)bits;
+    case 8:     return (double)(int32_t)bits;
+    case 768:   return (double)(uint32_t)bits;
+    case 1024:  return (double)(int64_t)bits;
+    case 1280:  return (double)bits;
+    case 16:
+        word = (uint32_t)bits;
+        memcpy(&f, &word, 4);
+        return (double)f;
+    default:
+        memcpy(&d, &bits, 8);
+        return d;
+    }
+}
+
+/* Close the current zone, appending it to the maps. */
+local int zone_emit(struct zi_zoner *zn)
+{
+    struct zone_maps *maps = zn->maps;
+    struct zone_stats *next;
+    size_t n = maps->have;
+
+    if (n == 0 || (n >= 16 && (n & (n - 1)) == 0)) {
+        next = realloc(maps->list, sizeof(struct zone_stats) * (n ? n << 1 : 16));
+        if (next == NULL)
+            return Z_MEM_ERROR;
+        maps->list = next;
+    }
+    maps->list[n] = zn->cur;
+    maps->have++;
+    zn->cur.min = DBL_MAX;
+    zn->cur.max = -DBL_MAX;
+    zn->cur.sum = 0;
+    zn->cur.count = 0;
+    zn->cur.nonzero = 0;
+    return Z_OK;
+}
+
+/* Add the whole voxels of the n bytes at p, all in the current zone. */
+local void zone_add(struct zi_zoner *zn, const unsigned char *p, size_t n)
+{
+    struct zone_stats *cur = &zn->cur;
+    double v;
+    int b = zn->nii.bytes;
+
+    for (; n >= (size_t)b; p += b, n -= b) {
+        v = zi_voxel_value(&zn->nii, p);
+        cur->count++;
+        if (v != 0)
+            cur->nonzero++;
+        if (v != v)                 /* NaN */
+            continue;
+        if (v < cur->min)
+            cur->min = v;
+        if (v > cur->max)
+            cur->max = v;
+        cur->sum += v;
+    }
+}
+
+/* Start the statistics once the header is complete, or give up. */
+local int zoner_start(struct zi_zoner *zn)
+{
+    if (!zi_nifti_header(zn->head, zn->headLen, &zn->nii) || zn->nii.bytes == 0)
+        return Z_OK;
+    zn->maps = calloc(1, sizeof(struct zone_maps));
+    if (zn->maps == NULL)
+        return Z_MEM_ERROR;
+    zn->maps->base = zn->nii.vox_offset;
+    zn->maps->unit = zn->nii.volumes > 1 ? zn->nii.volume : zn->nii.slice;
+    zn->maps->datatype = zn->nii.datatype;
+    zn->cur.min = DBL_MAX;
+    zn->cur.max = -DBL_MAX;
+    return Z_OK;
+}
+
+/* Add the n bytes at p, the data from offset zn->pos on, to the zones. */
+local int zoner_voxels(struct zi_zoner *zn, const unsigned char *p, size_t n)
+{
+    struct zone_maps *maps = zn->maps;
+    off_t end;
+    size_t m;
+    int ret, b;
+
+    b = zn->nii.bytes;
+    while (n > 0) {
+        if (zn->pos < maps->base) {         /* rest of the header, extensions */
+            m = maps->base - zn->pos < (off_t)n ? (size_t)(maps->base - zn->pos) : n;
+            p += m;
+            n -= m;
+            zn->pos += (off_t)m;
+            continue;
+        }
+        end = maps->base + maps->unit * (off_t)(maps->have + 1);
+        m = end - zn->pos < (off_t)n ? (size_t)(end - zn->pos) : n;
+        zn->pos += (off_t)m;
+        n -= m;
+        if (zn->carryLen) {                 /* complete the split voxel */
+            while (zn->carryLen < b && m > 0) {
+                zn->carry[zn->carryLen++] = *p++;
+                m--;
+            }
+            if (zn->carryLen < b)
+                continue;
+            zone_add(zn, zn->carry, (size_t)b);
+            zn->carryLen = 0;
+        }
+        zone_add(zn, p, m);
+        p += m - m % b;
+        memcpy(zn->carry, p, m % b);
+        zn->carryLen = (int)(m % b);
+        p += m % b;
+        if (zn->pos == end && (ret = zone_emit(zn)) != Z_OK)
+            return ret;
+    }
+    return Z_OK;
+}
+
+/* Follow the next n bytes of output at p. */
+int zoner_feed(struct zi_zoner *zn, const unsigned char *p, size_t n)
+{
+    size_t m;
+    int ret;
+
+    /* collect the header, then decide whether there is anything to do */
+    if (zn->headLen < NII_HEAD) {
+        m = NII_HEAD - zn->headLen < n ? NII_HEAD - zn->headLen : n;
+        memcpy(zn->head + zn->headLen, p, m);
+        zn->headLen += m;
+        p += m;
+        n -= m;
+        if (zn->headLen < NII_HEAD)
+            return Z_OK;
+        if ((ret = zoner_start(zn)) != Z_OK ||
+            (zn->maps != NULL && (ret = zoner_voxels(zn, zn->head, NII_HEAD)) != Z_OK))
+            return ret;
+    }
+    if (zn->maps == NULL)
+        return Z_OK;
+    return zoner_voxels(zn, p, n);
+}
+
+/* Finish: returns the zone maps, with a last partial zone, or NULL if the
+   data has none (no NIfTI, unsupported datatype).  zn is freed. */
+struct zone_maps *zoner_close(struct zi_zoner *zn)
+{
+    struct zone_maps *maps;
+    int ret;
+
+    if (zn == NULL)
+        return NULL;
+    ret = Z_OK;
+    if (zn->headLen < NII_HEAD) {           /* a small NIfTI-1 file */
+        ret = zoner_start(zn);
+        if (ret == Z_OK && zn->maps != NULL)
+            ret = zoner_voxels(zn, zn->head, zn->headLen);
+    }
+    maps = zn->maps;
+    if (maps != NULL && (ret != Z_OK || (zn->cur.count > 0 && zone_emit(zn) != Z_OK))) {
+        free_zones(maps);
+        maps = NULL;
+    }
+    free(zn);
+    return maps;
+}
+
+void free_zones(struct zone_maps *maps)
+{
+    if (maps != NULL) {
+        free(maps->list);
+        free(maps);
+    }
+}
+
+/* Return the zone maps of the index of idx, NULL if it has none.  Zone k
+   covers the unit bytes at base + k * unit of the uncompressed data. */
+const struct zone_maps *zi_zones(zindexPtr idx)
+{
+    return idx != NULL && idx->data != NULL ? idx->data->zones : NULL;
+}
+
+/* Set keep[k] for every zone that may hold voxel values in lo..hi, clear it
+   for the others, and return the number kept; negative if there are no zone
+   maps.  keep has room for zi_zones(idx)->have entries. */
+long zi_zone_select(zindexPtr idx, double lo, double hi, unsigned char *keep)
+{
+    const struct zone_maps *maps = zi_zones(idx);
+    const struct zone_stats *z;
+    size_t k;
+    long kept;
+
+    if (maps == NULL || keep == NULL)
+        return Z_STREAM_ERROR;
+    kept = 0;
+    for (k = 0; k < maps->have; ++k) {
+        z = maps->list + k;
+        keep[k] = z->count > 0 && z->max >= lo && z->min <= hi;
+        kept += keep[k];
+    }
+    return kept;
+}
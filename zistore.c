@@ -0,0 +1,419 @@
+/* zistore.c -- windows of many indexes in one deduplicated store
+ *
+ *  A store is a directory holding "windows", an array of WINSIZE byte slots,
+ *  and "windows.ref", the magic "ZISTORE1" followed by the hash (64 bits) and
+ *  reference count (32) of every slot, little-endian.  An .idx using the store
+ *  names it in a ZI_REC_STORE record and gives the slot offset of the window
+ *  of each access point in ZI_REC_WINDOW records; it has no .idx.ucs file.
+ *  Identical windows, within a file or across files, share one slot.  Changes
+ *  are made with the store locked, and made safe against a crash by order:
+ *  the windows and the table (replaced in one step) are on disk before an
+ *  .idx naming them is put in place, and an .idx is replaced or removed
+ *  before its references are dropped.
+ *
+ *  A slot whose count drops to zero may still be read by a handle opened
+ *  before its index was replaced.  Readers hold a shared lock on the windows
+ *  file, and check once they have it that their .idx is still the one in
+ *  place; such a slot is only freed (its space punched out where the file
+ *  system allows) for reuse when the store could take that lock exclusively
+ *  after the slot dropped to zero, and is kept until then.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "zindex.h"
+
+#define local static
+
+#define STORE_MAGIC "ZISTORE1"
+#define STORE_ENTRY 12      /* hash and count of a slot in windows.ref */
+
+struct zi_store {
+    char *dir;                  /* real path of the directory */
+    int lock;                   /* flock()ed for the lifetime of the store */
+    int pack;                   /* the windows */
+    size_t nslot;               /* slots in use or free */
+    size_t size;                /* allocated in hash and refs */
+    uint64_t *hash;
+    uint32_t *refs;             /* 0 if free */
+    unsigned char *held;        /* 0 refs, but perhaps read yet: not free */
+    size_t nheld;               /* slots held */
+    size_t *table;              /* hash table of slot + 1, 0 if empty */
+    size_t mask;                /* table size - 1 */
+    size_t entries;             /* filled in table */
+    size_t free;                /* no free slot below this */
+};
+
+local uint64_t window_hash(const unsigned char *window)
+{
+    return ((uint64_t)zi_crc32(0, window, WINSIZE / 2) << 32) |
+           zi_crc32(0, window, WINSIZE);
+}
+
+/* Return dir/name, or NULL if out of memory. */
+local char *store_path(const char *dir, const char *name)
+{
+    char *path;
+
+    path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path != NULL)
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/* Double the room for slots. */
+local int store_grow(struct zi_store *store)
+{
+    uint64_t *hash;
+    uint32_t *refs;
+    unsigned char *held;
+    size_t size;
+
+    size = store->size ? store->size << 1 : 1024;
+    hash = realloc(store->hash, sizeof(uint64_t) * size);
+    if (hash != NULL)
+        store->hash = hash;
+    refs = realloc(store->refs, sizeof(uint32_t) * size);
+    if (refs != NULL)
+        store->refs = refs;
+    held = realloc(store->held, size);
+    if (held != NULL)
+        store->held = held;
+    if (hash == NULL || refs == NULL || held == NULL)
+        return Z_MEM_ERROR;
+    store->size = size;
+    return Z_OK;
+}
+
+/* Rebuild the hash table from the live slots, at least twice their number. */
+local int table_build(struct zi_store *store)
+{
+    size_t n, i, k;
+
+    for (n = 1024; n < 2 * store->nslot + 2; n <<= 1)
+        ;
+    free(store->table);
+    store->table = calloc(n, sizeof(size_t));
+    if (store->table == NULL)
+        return Z_MEM_ERROR;
+    store->mask = n - 1;
+    store->entries = 0;
+    for (i = 0; i < store->nslot; ++i)
+        if (store->refs[i]) {
+            for (k = store->hash[i] & store->mask; store->table[k];
+                 k = (k + 1) & store->mask)
+                ;
+            store->table[k] = i + 1;
+            store->entries++;
+        }
+    return Z_OK;
+}
+
+/* Open the store in dir, creating it if needed, and lock it against other
+   processes changing it.  Returns NULL on error. */
+struct zi_store *zi_store_open(const char *dir)
+{
+    struct zi_store *store;
+    char real[PATH_MAX];
+    char *path;
+    FILE *ref;
+    unsigned char entry[STORE_ENTRY];
+    size_t i;
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        return NULL;
+    if (realpath(dir, real) == NULL)
+        return NULL;
+    store = calloc(1, sizeof(struct zi_store));
+    if (store == NULL)
+        return NULL;
+    store->lock = store->pack = -1;
+    store->dir = strdup(real);
+    path = store->dir != NULL ? store_path(real, "lock") : NULL;
+    if (path != NULL) {
+        store->lock = open(path, O_RDWR | O_CREAT, 0666);
+        free(path);
+    }
+    if (store->lock < 0 || flock(store->lock, LOCK_EX) != 0)
+        goto open_fail;
+    path = store_path(real, "windows");
+    if (path == NULL)
+        goto open_fail;
+    store->pack = open(path, O_RDWR | O_CREAT, 0666);
+    free(path);
+    if (store->pack < 0)
+        goto open_fail;
+
+    /* the slot table, empty for a new store */
+    path = store_path(real, "windows.ref");
+    if (path == NULL)
+        goto open_fail;
+    ref = fopen(path, "rb");
+    free(path);
+    if (ref != NULL) {
+        if (fread(entry, 8, 1u, ref) != 1u || memcmp(entry, STORE_MAGIC, 8) != 0) {
+            fclose(ref);
+            goto open_fail;
+        }
+        while (fread(entry, STORE_ENTRY, 1u, ref) == 1u) {
+            if (store->nslot == store->size && store_grow(store) != Z_OK) {
+                fclose(ref);
+                goto open_fail;
+            }
+            i = store->nslot++;
+            store->hash[i] = zi_get_le(entry, 8);
+            store->refs[i] = (uint32_t)zi_get_le(entry + 8, 4);
+            store->held[i] = store->refs[i] == 0;   /* until settled */
+            store->nheld += store->held[i];
+        }
+        fclose(ref);
+    }
+    if (table_build(store) != Z_OK)
+        goto open_fail;
+    return store;
+
+  open_fail:
+    if (store->pack >= 0)
+        close(store->pack);
+    if (store->lock >= 0)
+        close(store->lock);
+    free(store->hash);
+    free(store->refs);
+    free(store->held);
+    free(store->dir);
+    free(store);
+    return NULL;
+}
+
+/* Free the slots held, if no handle is reading the windows now: one opened
+   later finds its index replaced, or that it does not use them. */
+local void store_settle(struct zi_store *store)
+{
+    size_t slot;
+
+    if (store->nheld == 0 || flock(store->pack, LOCK_EX | LOCK_NB) != 0)
+        return;
+    flock(store->pack, LOCK_UN);
+    for (slot = 0; slot < store->nslot; ++slot)
+        if (store->held[slot]) {
+            store->held[slot] = 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+            (void)fallocate(store->pack, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            (off_t)slot * WINSIZE, WINSIZE);
+#endif
+            if (slot < store->free)
+                store->free = slot;
+        }
+    store->nheld = 0;
+}
+
+/* Return the slot of window in the store with one more reference, adding it
+   if it is new (and counting it in *added), or -1 on error. */
+local long store_put(struct zi_store *store, const unsigned char *window,
+                     long *added)
+{
+    unsigned char held[WINSIZE];
+    uint64_t h;
+    size_t k, slot;
+
+    /* look for the same window, the hash confirmed by the bytes */
+    h = window_hash(window);
+    for (k = h & store->mask; store->table[k]; k = (k + 1) & store->mask) {
+        slot = store->table[k] - 1;
+        if (store->hash[slot] == h && store->refs[slot] &&
+            pread(store->pack, held, WINSIZE, (off_t)slot * WINSIZE) == WINSIZE &&
+            memcmp(held, window, WINSIZE) == 0) {
+            store->refs[slot]++;
+            return (long)slot;
+        }
+    }
+
+    /* new: into the first free slot, or a new one at the end */
+    while (store->free < store->nslot &&
+           (store->refs[store->free] || store->held[store->free]))
+        store->free++;
+    slot = store->free;
+    if (slot == store->nslot) {
+        if (store->nslot == store->size && store_grow(store) != Z_OK)
+            return -1;
+        store->nslot++;
+    }
+    if (pwrite(store->pack, window, WINSIZE, (off_t)slot * WINSIZE) != WINSIZE)
+        return -1;
+    store->hash[slot] = h;
+    store->refs[slot] = 1;
+    store->held[slot] = 0;
+    (*added)++;
+    if (2 * (store->entries + 1) > store->mask + 1) {
+        if (table_build(store) != Z_OK)
+            return -1;
+    }
+    else {
+        for (k = h & store->mask; store->table[k]; k = (k + 1) & store->mask)
+            ;
+        store->table[k] = slot + 1;
+        store->entries++;
+    }
+    return (long)slot;
+}
+
+/* Move the windows of index, taken from the index or ucsFile, into the store:
+   afterwards the index names the store and the slots of its windows, to be
+   written with write_index() without a window file.  Returns the number of
+   windows that were not in the store yet, or negative on error. */
+long zi_store_add(struct zi_store *store, struct access *index, FILE *ucsFile)
+{
+    unsigned char window[WINSIZE];
+    off_t *offset;
+    size_t k;
+    long slot, added;
+
+    if (store == NULL || index == NULL)
+        return Z_STREAM_ERROR;
+    offset = malloc(sizeof(off_t) * (index->have ? index->have : 1));
+    if (offset == NULL)
+        return Z_MEM_ERROR;
+    store_settle(store);
+    added = 0;
+    for (k = 0; k < index->have; ++k) {
+        if (index->ucs_offset != NULL && index->ucs_offset[k] < 0) {
+            offset[k] = -1;                 /* needs no window */
+            continue;
+        }
+        if (read_window(index, ucsFile, k, window) != Z_OK) {
+            free(offset);
+            return Z_DATA_ERROR;
+        }
+        slot = store_put(store, window, &added);
+        if (slot < 0) {
+            free(offset);
+            return Z_ERRNO;
+        }
+        offset[k] = (off_t)slot * WINSIZE;
+    }
+    free(index->ucs_offset);
+    index->ucs_offset = offset;
+    free(index->ucs_list);
+    index->ucs_list = NULL;
+    free(index->store);
+    index->store = strdup(store->dir);
+    if (index->store == NULL)
+        return Z_MEM_ERROR;
+    return added;
+}
+
+/* Drop the references of index to its windows in the store, to be made once
+   the index is replaced or removed: the slots no other index uses are freed
+   when no handle can read them any more.  Returns Z_OK, or Z_STREAM_ERROR if
+   the index does not use this store. */
+int zi_store_release(struct zi_store *store, struct access *index)
+{
+    size_t k, slot;
+
+    if (store == NULL || index == NULL || index->store == NULL ||
+        index->ucs_offset == NULL || strcmp(index->store, store->dir) != 0)
+        return Z_STREAM_ERROR;
+    for (k = 0; k < index->have; ++k) {
+        if (index->ucs_offset[k] < 0)
+            continue;
+        slot = (size_t)(index->ucs_offset[k] / WINSIZE);
+        if (slot >= store->nslot || store->refs[slot] == 0)
+            continue;
+        if (--store->refs[slot] == 0) {
+            store->held[slot] = 1;
+            store->nheld++;
+        }
+    }
+    return Z_OK;
+}
+
+/* Put the windows and the slot table of the store on disk, the table replaced
+   in one step so that readers never see half of it: to be done before an
+   index using windows just added is written.  Returns Z_OK or Z_ERRNO. */
+int zi_store_sync(struct zi_store *store)
+{
+    unsigned char entry[STORE_ENTRY];
+    char *path, *tmp;
+    FILE *ref;
+    size_t i;
+    int ret;
+
+    if (store == NULL)
+        return Z_STREAM_ERROR;
+    ret = fsync(store->pack) == 0 ? Z_OK : Z_ERRNO;
+    path = store_path(store->dir, "windows.ref");
+    tmp = store_path(store->dir, "windows.ref.new");
+    ref = tmp != NULL ? fopen(tmp, "wb") : NULL;
+    if (path == NULL || ref == NULL || fwrite(STORE_MAGIC, 8, 1u, ref) != 1u)
+        ret = Z_ERRNO;
+    for (i = 0; ret == Z_OK && i < store->nslot; ++i) {
+        zi_put_le(entry, store->hash[i], 8);
+        zi_put_le(entry + 8, store->refs[i], 4);
+        if (fwrite(entry, STORE_ENTRY, 1u, ref) != 1u)
+            ret = Z_ERRNO;
+    }
+    if (ref != NULL && (fflush(ref) != 0 || fsync(fileno(ref)) != 0))
+        ret = Z_ERRNO;
+    if (ref != NULL && fclose(ref) != 0)
+        ret = Z_ERRNO;
+    if (ret == Z_OK && rename(tmp, path) != 0)
+        ret = Z_ERRNO;
+    if (ret != Z_OK && tmp != NULL)
+        remove(tmp);
+    free(tmp);
+    free(path);
+    return ret;
+}
+
+/* Write the slot table, dropping free slots at the end, and unlock and close
+   the store.  Returns Z_OK or Z_ERRNO. */
+int zi_store_close(struct zi_store *store)
+{
+    int ret;
+
+    if (store == NULL)
+        return Z_OK;
+    store_settle(store);
+    while (store->nslot > 0 && store->refs[store->nslot - 1] == 0 &&
+           !store->held[store->nslot - 1])
+        store->nslot--;
+    ret = ftruncate(store->pack, (off_t)store->nslot * WINSIZE) == 0 ? Z_OK : Z_ERRNO;
+    if (zi_store_sync(store) != Z_OK)
+        ret = Z_ERRNO;
+    close(store->pack);
+    close(store->lock);             /* and unlock */
+    free(store->table);
+    free(store->hash);
+    free(store->refs);
+    free(store->held);
+    free(store->dir);
+    free(store);
+    return ret;
+}
+
+/* Open the window file of the store in dir for reading, NULL if there is
+   none, with a shared lock that keeps the slots in use until it is closed.
+   The index read before must then be checked to be still in place. */
+FILE *zi_store_windows(const char *dir, const char *mode)
+{
+    char *path;
+    FILE *pack;
+
+    path = store_path(dir, "windows");
+    if (path == NULL)
+        return NULL;
+    pack = fopen(path, mode);
+    free(path);
+    if (pack != NULL && flock(fileno(pack), LOCK_SH) != 0) {
+        fclose(pack);
+        pack = NULL;
+    }
+    return pack;
+}
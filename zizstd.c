@@ -0,0 +1,585 @@
+/* zizstd.c -- seekable zstd files
+ *
+ *  A seekable zstd file is a series of independent zstd frames followed by a
+ *  skippable frame holding the seek table (zstd contrib/seekable_format): the
+ *  compressed and decompressed size of every frame (32 bits each, plus a
+ *  checksum if bit 7 of the descriptor is set), then the number of frames
+ *  (32), the descriptor (8) and the magic 0x8F92EAB1 (32), little-endian.
+ *  The frames become the access points of the index; they need no windows,
+ *  and a read decodes only the frames it covers.
+ *
+ *  zst_transcode() writes such a file from a gzip stream, with frames
+ *  holding whole NIfTI volumes (or slices of large ones) after one frame for
+ *  the header, compressed on several threads.
+ *
+ *  Part of zindex, copyright 2026 the zindex contributors under GNU GPLv3
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include "zindex.h"
+
+#define local static
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+
+#define ZST_SKIPPABLE 0x184D2A5EUL  /* magic of the seek table frame */
+#define ZST_SEEKABLE 0x8F92EAB1UL   /* magic at the very end */
+#define ZST_FOOTER 9
+#define ZST_SPARE 16                /* decoder contexts kept for reuse */
+
+/* decoding state shared by the reads of a handle */
+struct zi_zst {
+    pthread_mutex_t lock;
+    ZSTD_DCtx *spare[ZST_SPARE];    /* idle decoder contexts */
+    int nspare;
+    size_t frame;                   /* frame held in cache, if any */
+    unsigned char *cache;           /* its decompressed data, or NULL */
+};
+
+/* Load the seek table of the seekable zstd file zFile as an index with one
+   access point per frame.  Returns the number of access points, 0 if zFile
+   is not seekable zstd, or negative on error. */
+int read_index_zst(FILE *zFile, struct access **built)
+{
+    unsigned char foot[ZST_FOOTER], head[8];
+    unsigned char *table;
+    uint32_t nframes, k;
+    size_t esize, tsize;
+    off_t size, in, out;
+    struct access *index;
+
+    if (zFile == NULL || fseeko(zFile, 0, SEEK_END) != 0 ||
+        (size = ftello(zFile)) < ZST_FOOTER + 8)
+        return 0;
+    if (pread(fileno(zFile), foot, ZST_FOOTER, size - ZST_FOOTER) != ZST_FOOTER ||
+        zi_get_le(foot + 5, 4) != ZST_SEEKABLE || (foot[4] & 0x7c) != 0)
+        return 0;
+    nframes = (uint32_t)zi_get_le(foot, 4);
+    esize = foot[4] & 0x80 ? 12 : 8;
+    tsize = esize * nframes;
+    if ((off_t)(tsize + ZST_FOOTER + 8) > size ||
+        pread(fileno(zFile), head, 8, size - ZST_FOOTER - (off_t)tsize - 8) != 8 ||
+        zi_get_le(head, 4) != ZST_SKIPPABLE ||
+        zi_get_le(head + 4, 4) != tsize + ZST_FOOTER)
+        return 0;
+    table = malloc(tsize + 1);
+    if (table == NULL)
+        return Z_MEM_ERROR;
+    if (pread(fileno(zFile), table, tsize, size - ZST_FOOTER - (off_t)tsize) !=
+        (ssize_t)tsize) {
+        free(table);
+        return Z_ERRNO;
+    }
+    index = NULL;
+    in = out = 0;
+    for (k = 0; k <= nframes; ++k) {
+        index = index_point(index, 0, in, out, -1);
+        if (index == NULL) {
+            free(table);
+            return Z_MEM_ERROR;
+        }
+        if (k < nframes) {
+            in += (off_t)zi_get_le(table + esize * k, 4);
+            out += (off_t)zi_get_le(table + esize * k + 4, 4);
+        }
+    }
+    free(table);
+    if (in > size - ZST_FOOTER - (off_t)tsize - 8) {
+        free_index(index);
+        return Z_DATA_ERROR;
+    }
+    index->flags |= ZI_ZSTD;
+    *built = index;
+    return (int)index->have;
+}
+
+local ZSTD_DCtx *zst_get(struct zi_zst *zst)
+{
+    ZSTD_DCtx *dctx = NULL;
+
+    pthread_mutex_lock(&zst->lock);
+    if (zst->nspare > 0)
+        dctx = zst->spare[--zst->nspare];
+    pthread_mutex_unlock(&zst->lock);
+    return dctx != NULL ? dctx : ZSTD_createDCtx();
+}
+
+local void zst_put(struct zi_zst *zst, ZSTD_DCtx *dctx)
+{
+    pthread_mutex_lock(&zst->lock);
+    if (zst->nspare < ZST_SPARE) {
+        zst->spare[zst->nspare++] = dctx;
+        dctx = NULL;
+    }
+    pthread_mutex_unlock(&zst->lock);
+    ZSTD_freeDCtx(dctx);
+}
+
+/* Copy the bytes from..to of frame k out of the cache, return 1, or 0 if it
+   does not hold that frame. */
+local int zst_cached(struct zi_zst *zst, size_t k, size_t from, size_t to,
+                     unsigned char *buf)
+{
+    int hit;
+
+    pthread_mutex_lock(&zst->lock);
+    hit = zst->cache != NULL && zst->frame == k;
+    if (hit)
+        memcpy(buf, zst->cache + from, to - from);
+    pthread_mutex_unlock(&zst->lock);
+    return hit;
+}
+
+/* Queue the read of the compressed frame k. */
+local int zst_queue(struct zi_io *io, int fd, struct access *index, size_t k,
+                    struct zi_ioreq *req)
+{
+    req->fd = fd;
+    req->offset = index->idx_list[k].in;
+    req->len = (size_t)(index->idx_list[k + 1].in - req->offset);
+    req->buf = ziio_buffer(io, (unsigned)k, req->len);
+    if (req->buf == NULL)
+        return Z_MEM_ERROR;
+    return ziio_submit(io, req);
+}
+
+/* extract() for seekable zstd: read len bytes at offset into buf, starting
+   with frame first.  Frames covered entirely are decoded straight into buf,
+   partly read ones through a one frame cache, so that small sequential reads
+   decode each frame once.  Returns bytes read or negative error. */
+int zst_extract(zindexPtr idx, struct zi_io *io, size_t first, off_t offset,
+                unsigned char *buf, int len, const volatile int *cancel)
+{
+    struct access *index = idx->data;
+    struct zi_zst *zst = idx->zst;
+    struct zi_ioreq req[ZI_IO_DEPTH];
+    ZSTD_DCtx *dctx;
+    unsigned char *frame;
+    size_t k, next, last, from, to, size;
+    off_t stop;
+    long got;
+    int ret;
+
+    last = index->have - 1;
+    stop = offset + len;
+    if (stop > index->idx_list[last].out)
+        stop = index->idx_list[last].out;
+    if (zst == NULL)
+        return Z_STREAM_ERROR;
+
+    /* a read within the frame read last is served from the cache */
+    if (stop <= index->idx_list[first + 1].out &&
+        zst_cached(zst, first, (size_t)(offset - index->idx_list[first].out),
+                   (size_t)(stop - index->idx_list[first].out), buf))
+        return (int)(stop - offset);
+
+    dctx = zst_get(zst);
+    if (dctx == NULL)
+        return Z_MEM_ERROR;
+    ret = Z_OK;
+    for (next = first; ret == Z_OK && next < last && next - first < ZI_IO_DEPTH &&
+         index->idx_list[next].out < stop; ++next)
+        ret = zst_queue(io, fileno(idx->zFile), index, next, req + next % ZI_IO_DEPTH);
+    for (k = first; ret == Z_OK && k < next; ++k) {
+        if (cancel != NULL && *cancel) {
+            ret = ZI_CANCELED;
+            break;
+        }
+        got = ziio_wait(io, req + k % ZI_IO_DEPTH);
+        if (got < (long)req[k % ZI_IO_DEPTH].len) {
+            ret = got < 0 ? Z_ERRNO : Z_DATA_ERROR;
+            break;
+        }
+        size = (size_t)(index->idx_list[k + 1].out - index->idx_list[k].out);
+        from = offset > index->idx_list[k].out ?
+               (size_t)(offset - index->idx_list[k].out) : 0;
+        to = stop < index->idx_list[k + 1].out ?
+             (size_t)(stop - index->idx_list[k].out) : size;
+        if (from == 0 && to == size)
+            frame = buf + (index->idx_list[k].out - offset);
+        else if ((frame = malloc(size ? size : 1)) == NULL) {
+            ret = Z_MEM_ERROR;
+            break;
+        }
+        if (ZSTD_decompressDCtx(dctx, frame, size, req[k % ZI_IO_DEPTH].buf,
+                                req[k % ZI_IO_DEPTH].len) != size)
+            ret = Z_DATA_ERROR;
+        else if (from != 0 || to != size) {
+            /* keep the partly read frame for the reads that follow */
+            memcpy(buf + (index->idx_list[k].out + from - offset), frame + from,
+                   to - from);
+            pthread_mutex_lock(&zst->lock);
+            free(zst->cache);
+            zst->cache = frame;
+            zst->frame = k;
+            pthread_mutex_unlock(&zst->lock);
+            frame = NULL;
+        }
+        if (frame != NULL && frame != buf + (index->idx_list[k].out - offset))
+            free(frame);
+        if (ret == Z_OK && next < last && index->idx_list[next].out < stop) {
+            ret = zst_queue(io, fileno(idx->zFile), index, next,
+                            req + next % ZI_IO_DEPTH);
+            next++;
+        }
+    }
+    ziio_drain(io);
+    zst_put(zst, dctx);
+    return ret == Z_OK ? (int)(stop - offset) : ret;
+}
+
+/* Open the seekable zstd file zPath, NULL if it is not one. */
+zindexPtr ziopen_zst(const char *zPath, const char *mode)
+{
+    zindexPtr idx;
+
+    if (!mode || !strlen(mode) || mode[0]!='r')
+        return NULL; /* writing is not yet supported */
+
+    idx = (zindexPtr) calloc(1,sizeof(struct zindex));
+    if (idx == NULL) {
+        fprintf(stderr,"** ERROR: ziopen failed to alloc zindex\n");
+        return NULL;
+    }
+    if ((idx->zFile = fopen(zPath, mode)) == NULL) {
+        free(idx);
+        return NULL;
+    }
+    /* Give no error message for other files, fall back automatically. */
+    if ( read_index_zst( idx->zFile, &(idx->data) ) <= 0 ) {
+        fclose(idx->zFile);
+        free(idx);
+        return NULL;
+    }
+    idx->zst = (struct zi_zst *) calloc(1, sizeof(struct zi_zst));
+    if (idx->zst == NULL || (idx->io = ziio_open(ZI_IO_DEPTH)) == NULL) {
+        free(idx->zst);
+        free_index(idx->data);
+        fclose(idx->zFile);
+        free(idx);
+        fprintf(stderr,"** ERROR: ziopen failed to alloc zstd state of %s\n", zPath);
+        return NULL;
+    }
+    pthread_mutex_init(&idx->zst->lock, NULL);
+
+    idx->pos = 0;
+    idx->end = idx->data->idx_list[idx->data->have-1].out; /*last index entry is eof*/
+    return idx;
+}
+
+/* Free the decoding state of idx. */
+void zst_close(zindexPtr idx)
+{
+    struct zi_zst *zst = idx->zst;
+
+    if (zst == NULL)
+        return;
+    while (zst->nspare > 0)
+        ZSTD_freeDCtx(zst->spare[--zst->nspare]);
+    free(zst->cache);
+    pthread_mutex_destroy(&zst->lock);
+    free(zst);
+    idx->zst = NULL;
+}
+
+/* frame slots of the transcoding pipeline */
+#define ZST_EMPTY 0
+#define ZST_READY 1     /* filled, waiting for a compressor */
+#define ZST_BUSY 2
+#define ZST_DONE 3
+
+struct zst_slot {
+    unsigned char *raw;         /* uncompressed frame */
+    size_t rawSize;             /* allocated */
+    size_t rawLen;              /* used */
+    unsigned char *zst;         /* compressed frame */
+    size_t zstSize;             /* allocated */
+    size_t zstLen;              /* used, or a zstd error code */
+    int state;
+};
+
+/* shared state of the compressing threads */
+struct zst_job {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       /* a slot was filled, or stop */
+    pthread_cond_t done;        /* a slot was compressed */
+    struct zst_slot *slot;
+    size_t nslot;
+    size_t next;                /* next frame to compress */
+    size_t have;                /* frames filled so far */
+    int level;
+    int stop;
+};
+
+local void *zst_worker(void *arg)
+{
+    struct zst_job *job = arg;
+    struct zst_slot *slot;
+    ZSTD_CCtx *cctx;
+
+    cctx = ZSTD_createCCtx();
+    if (cctx != NULL) {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, job->level);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    }
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (job->next == job->have && !job->stop)
+            pthread_cond_wait(&job->ready, &job->lock);
+        if (job->next == job->have)
+            break;
+        slot = job->slot + job->next++ % job->nslot;
+        slot->state = ZST_BUSY;
+        pthread_mutex_unlock(&job->lock);
+
+        slot->zstLen = cctx == NULL ? (size_t)-1 :
+                       ZSTD_compress2(cctx, slot->zst, slot->zstSize,
+                                      slot->raw, slot->rawLen);
+
+        pthread_mutex_lock(&job->lock);
+        slot->state = ZST_DONE;
+        pthread_cond_broadcast(&job->done);
+    }
+    pthread_mutex_unlock(&job->lock);
+    ZSTD_freeCCtx(cctx);
+    return NULL;
+}
+
+/* Read up to len bytes of the gzip stream, the first peek bytes from head. */
+local long zst_fill(gzFile in, unsigned char *head, size_t *peek,
+                    unsigned char *buf, size_t len)
+{
+    size_t got = 0;
+    int n;
+
+    if (*peek > 0) {
+        got = len < *peek ? len : *peek;
+        memcpy(buf, head, got);
+        memmove(head, head + got, *peek - got);
+        *peek -= got;
+    }
+    while (got < len) {
+        n = gzread(in, buf + got, (unsigned)(len - got < 0x40000000 ? len - got : 0x40000000));
+        if (n < 0)
+            return Z_DATA_ERROR;
+        if (n == 0)
+            break;
+        got += (size_t)n;
+    }
+    return (long)got;
+}
+
+/* Write the compressed frame of slot to out and note its sizes in table. */
+local int zst_emit(struct zst_slot *slot, FILE *out, unsigned char **table,
+                   size_t *tsize, size_t k)
+{
+    unsigned char *grown;
+
+    if (ZSTD_isError(slot->zstLen) || slot->zstLen > 0xffffffffUL)
+        return Z_MEM_ERROR;
+    if (8 * (k + 1) > *tsize) {
+        grown = realloc(*table, *tsize * 2 + 8 * 1024);
+        if (grown == NULL)
+            return Z_MEM_ERROR;
+        *table = grown;
+        *tsize = *tsize * 2 + 8 * 1024;
+    }
+    zi_put_le(*table + 8 * k, slot->zstLen, 4);
+    zi_put_le(*table + 8 * k + 4, slot->rawLen, 4);
+    if (fwrite(slot->zst, 1, slot->zstLen, out) != slot->zstLen)
+        return Z_ERRNO;
+    slot->state = ZST_EMPTY;
+    return Z_OK;
+}
+
+/* Decompress the gzip (or plain) stream in and write it to out as seekable
+   zstd at the given level, compressing frames on nthread threads (0 for one
+   per processor).  A NIfTI image gets a frame for its header, then frames of
+   whole volumes, or of whole slices for volumes larger than SPAN.  Returns
+   the number of frames written, or negative on error. */
+long zst_transcode(gzFile in, FILE *out, int nthread, int level)
+{
+    struct zst_job job;
+    struct zst_slot *slot;
+    pthread_t *thread;
+    unsigned char head[540];
+    unsigned char *table;
+    unsigned char foot[8 + ZST_FOOTER];
+    size_t peek, tsize, k, done, frame, n;
+    off_t volume, slice, voxOffset;
+    struct zi_nifti nii;
+    long got;
+    int i, ret;
+
+    if (in == NULL || out == NULL)
+        return Z_STREAM_ERROR;
+    if (nthread <= 0)
+        nthread = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthread <= 0)
+        nthread = 1;
+
+    /* frame sizes from the NIfTI header, if any */
+    peek = 0;
+    got = zst_fill(in, head, &peek, head, sizeof(head));
+    if (got < 0)
+        return Z_DATA_ERROR;
+    peek = (size_t)got;
+    zi_nifti_header(head, peek, &nii);
+    voxOffset = nii.vox_offset;
+    volume = nii.volume;
+    slice = nii.slice;
+    if (voxOffset == 0)
+        frame = SPAN;
+    else if (volume <= SPAN)
+        frame = (size_t)(SPAN / volume * volume);
+    else
+        frame = slice <= SPAN ? (size_t)(SPAN / slice * slice) : (size_t)slice;
+
+    memset(&job, 0, sizeof(job));
+    job.nslot = 2 * (size_t)nthread;
+    job.level = level;
+    job.slot = calloc(job.nslot, sizeof(struct zst_slot));
+    thread = calloc((size_t)nthread, sizeof(pthread_t));
+    if (job.slot == NULL || thread == NULL) {
+        free(job.slot);
+        free(thread);
+        return Z_MEM_ERROR;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.ready, NULL);
+    pthread_cond_init(&job.done, NULL);
+    for (i = 0; i < nthread; ++i)
+        if (pthread_create(thread + i, NULL, zst_worker, &job) != 0)
+            break;
+    nthread = i;
+    ret = nthread > 0 ? Z_OK : Z_MEM_ERROR;
+    table = NULL;
+    tsize = 0;
+    done = 0;
+
+    /* fill the slots in turn, writing out the frame a slot held before */
+    for (k = 0; ret == Z_OK; ++k) {
+        slot = job.slot + k % job.nslot;
+        if (k >= job.nslot) {
+            pthread_mutex_lock(&job.lock);
+            while (slot->state != ZST_DONE)
+                pthread_cond_wait(&job.done, &job.lock);
+            pthread_mutex_unlock(&job.lock);
+            ret = zst_emit(slot, out, &table, &tsize, done++);
+            if (ret != Z_OK)
+                break;
+        }
+        n = k == 0 && voxOffset > 0 ? (size_t)voxOffset : frame;
+        if (slot->rawSize < n) {
+            free(slot->raw);
+            free(slot->zst);
+            slot->rawSize = n;
+            slot->raw = malloc(n);
+            slot->zstSize = ZSTD_compressBound(n);
+            slot->zst = malloc(slot->zstSize);
+            if (slot->raw == NULL || slot->zst == NULL) {
+                slot->rawSize = 0;
+                ret = Z_MEM_ERROR;
+                break;
+            }
+        }
+        got = zst_fill(in, head, &peek, slot->raw, n);
+        if (got <= 0) {
+            ret = got < 0 ? (int)got : Z_OK;
+            break;
+        }
+        slot->rawLen = (size_t)got;
+        pthread_mutex_lock(&job.lock);
+        slot->state = ZST_READY;
+        job.have++;
+        pthread_cond_signal(&job.ready);
+        pthread_mutex_unlock(&job.lock);
+        if ((size_t)got < n)
+            break;                      /* end of the stream */
+    }
+
+    /* let the workers finish, then write the rest and the seek table */
+    pthread_mutex_lock(&job.lock);
+    job.stop = 1;
+    pthread_cond_broadcast(&job.ready);
+    pthread_mutex_unlock(&job.lock);
+    for (i = 0; i < nthread; ++i)
+        pthread_join(thread[i], NULL);
+    n = job.have;
+    while (ret == Z_OK && done < n) {
+        ret = zst_emit(job.slot + done % job.nslot, out, &table, &tsize, done);
+        done++;
+    }
+    if (ret == Z_OK) {
+        zi_put_le(foot, ZST_SKIPPABLE, 4);
+        zi_put_le(foot + 4, 8 * n + ZST_FOOTER, 4);
+        if (fwrite(foot, 8, 1u, out) != 1u ||
+            (n && fwrite(table, 8 * n, 1u, out) != 1u))
+            ret = Z_ERRNO;
+        zi_put_le(foot, n, 4);
+        foot[4] = 0;
+        zi_put_le(foot + 5, ZST_SEEKABLE, 4);
+        if (ret == Z_OK && (fwrite(foot, ZST_FOOTER, 1u, out) != 1u ||
+                            fflush(out) != 0))
+            ret = Z_ERRNO;
+    }
+
+    for (k = 0; k < job.nslot; ++k) {
+        free(job.slot[k].raw);
+        free(job.slot[k].zst);
+    }
+    free(job.slot);
+    free(thread);
+    free(table);
+    pthread_cond_destroy(&job.done);
+    pthread_cond_destroy(&job.ready);
+    pthread_mutex_destroy(&job.lock);
+    return ret == Z_OK ? (long)n : ret;
+}
+
+#else   /* !HAVE_ZSTD */
+
+int read_index_zst(FILE *zFile, struct access **built)
+{
+    (void)zFile;
+    (void)built;
+    return 0;
+}
+
+int zst_extract(zindexPtr idx, struct zi_io *io, size_t first, off_t offset,
+                unsigned char *buf, int len, const volatile int *cancel)
+{
+    (void)idx;
+    (void)io;
+    (void)first;
+    (void)offset;
+    (void)buf;
+    (void)len;
+    (void)cancel;
+    return Z_STREAM_ERROR;
+}
+
+zindexPtr ziopen_zst(const char *zPath, const char *mode)
+{
+    (void)zPath;
+    (void)mode;
+    return NULL;
+}
+
+void zst_close(zindexPtr idx)
+{
+    (void)idx;
+}
+
+long zst_transcode(gzFile in, FILE *out, int nthread, int level)
+{
+    (void)in;
+    (void)out;
+    (void)nthread;
+    (void)level;
+    return Z_STREAM_ERROR;
+}
+
+#endif
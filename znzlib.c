@@ -26,6 +26,23 @@ NB: seeks for large files with compression got notably faster:
  */
 
 #include "znzlib.h"
+#if !defined(WIN32)
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* one mmap() of an uncompressed file */
+struct znz_map {
+  const char * ptr;   /* pointer handed out */
+  void * base;        /* page aligned start of the mapping */
+  size_t len;
+  struct znz_map * next;
+};
 
 /*
 znzlib.c  (zipped or non-zipped library)
@@ -50,6 +67,115 @@ znzlib.c  (zipped or non-zipped library)
    use_compression!=0 uses zlib (gzip) compression
 */
 
+/* the access trace, see znzlib.h */
+#if !defined(WIN32)
+static int znz_trace_fd = -1;
+static unsigned znz_trace_handles;
+static pthread_once_t znz_trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t znz_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void znz_trace_start(void)
+{
+  const char *path = getenv("ZNZ_TRACE");
+  struct stat st;
+
+  if (path == NULL || *path == '\0') return;
+  znz_trace_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if (znz_trace_fd < 0) return;
+  /* the first process to come writes the magic */
+  if (flock(znz_trace_fd, LOCK_EX) == 0) {
+    if (fstat(znz_trace_fd, &st) == 0 && st.st_size == 0 &&
+        write(znz_trace_fd, ZNZ_TRACE_MAGIC, 8) != 8) {
+      close(znz_trace_fd);
+      znz_trace_fd = -1;
+    }
+    (void)flock(znz_trace_fd, LOCK_UN);
+  }
+}
+
+static unsigned long long znz_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void znz_le(unsigned char *p, unsigned long long val, int n)
+{
+  while (n--) { *p++ = (unsigned char)(val & 0xff); val >>= 8; }
+}
+
+/* Give file a handle number if the trace is on, and trace its opening. */
+static void znz_trace_new(znzFile file, const char *path)
+{
+  unsigned char rec[ZNZ_TRACE_REC + 1024];
+  size_t len;
+
+  pthread_once(&znz_trace_once, znz_trace_start);
+  if (znz_trace_fd < 0) return;
+  pthread_mutex_lock(&znz_trace_mutex);
+  if (++znz_trace_handles > 0xffff) znz_trace_handles = 1;
+  file->trace = znz_trace_handles;
+  pthread_mutex_unlock(&znz_trace_mutex);
+  len = strlen(path);
+  if (len > sizeof(rec) - ZNZ_TRACE_REC) {   /* the end of a long path */
+    path += len - (sizeof(rec) - ZNZ_TRACE_REC);
+    len = sizeof(rec) - ZNZ_TRACE_REC;
+  }
+  memset(rec, 0, ZNZ_TRACE_REC);
+  rec[0] = ZNZ_TRACE_OPEN;
+#ifdef HAVE_ZLIB
+  rec[1] = file->idx != NULL ? ZNZ_TRACE_INDEXED : file->zfptr != NULL ? ZNZ_TRACE_GZ : ZNZ_TRACE_PLAIN;
+#endif
+  znz_le(rec + 2, file->trace, 2);
+  znz_le(rec + 4, (unsigned long long)getpid(), 4);
+  znz_le(rec + 8, znz_now(), 8);
+  znz_le(rec + 24, len, 4);
+  memcpy(rec + ZNZ_TRACE_REC, path, len);
+  (void)write(znz_trace_fd, rec, ZNZ_TRACE_REC + len);
+}
+
+/* Trace a call on file that started at start (znz_now()), one write() so
+   that the records of processes sharing the trace do not mix. */
+static void znz_trace(znzFile file, int type, long offset, size_t len,
+                      unsigned long long start)
+{
+  unsigned char rec[ZNZ_TRACE_REC];
+  unsigned long long now = znz_now();
+
+  memset(rec, 0, ZNZ_TRACE_REC);
+  rec[0] = (unsigned char)type;
+#ifdef HAVE_ZLIB
+  rec[1] = file->idx != NULL ? ZNZ_TRACE_INDEXED : file->zfptr != NULL ? ZNZ_TRACE_GZ : ZNZ_TRACE_PLAIN;
+#endif
+  znz_le(rec + 2, file->trace, 2);
+  znz_le(rec + 4, (unsigned long long)getpid(), 4);
+  znz_le(rec + 8, start, 8);
+  znz_le(rec + 16, (unsigned long long)offset, 8);
+  znz_le(rec + 24, len > 0xffffffffUL ? 0xffffffffUL : len, 4);
+  znz_le(rec + 28, now - start > 0xffffffffULL ? 0xffffffffULL : now - start, 4);
+  (void)write(znz_trace_fd, rec, ZNZ_TRACE_REC);
+}
+#define ZNZ_TRACED(f) ((f) != NULL && (f)->trace != 0)
+#else
+#define znz_trace_new(f, p)
+#define znz_trace(f, t, o, l, s)
+#define znz_now() 0ULL
+#define ZNZ_TRACED(f) 0
+#endif
+
+#ifdef HAVE_ZLIB
+/* .zst files are seekable zstd and .zch files chunked copies (zichunk.c),
+   opened through zindex whatever use_compression says */
+static int znz_is_zst(const char *path)
+{
+  size_t len = strlen(path);
+  return len > 4 && (strcmp(path + len - 4, ".zst") == 0 ||
+                     strcmp(path + len - 4, ".zch") == 0);
+}
+#endif
+
 znzFile znzopen(const char *path, const char *mode, int use_compression)
 {
   znzFile file;
@@ -64,10 +190,10 @@ znzFile znzopen(const char *path, const char *mode, int use_compression)
 #ifdef HAVE_ZLIB
   file->zfptr = NULL;
 
-  if (use_compression) {
+  if (use_compression || znz_is_zst(path)) {
     file->withz = 1;
     if ((file->idx = ziopen_auto(path,mode))==NULL ) {
-    	if ((file->zfptr = gzopen(path,mode))==NULL ) {
+    	if (znz_is_zst(path) || (file->zfptr = gzopen(path,mode))==NULL ) {
     		free(file);
     		file = NULL;
     	}
@@ -84,6 +210,7 @@ znzFile znzopen(const char *path, const char *mode, int use_compression)
 #ifdef HAVE_ZLIB
   }
 #endif
+  if (file != NULL) znz_trace_new(file, path);
   return file;
 }
 
@@ -112,6 +239,7 @@ znzFile znzdopen(int fd, const char *mode, int use_compression)
     file->idx = NULL;
   };
 #endif
+  znz_trace_new(file, "-");
   return file;
 }
 
@@ -120,6 +248,8 @@ int Xznzclose(znzFile * file)
 {
   int retval = 0;
   if (*file!=NULL) {
+    if (ZNZ_TRACED(*file)) znz_trace(*file, ZNZ_TRACE_CLOSE, 0L, 0, znz_now());
+    while ((*file)->maps!=NULL) { znzunmap(*file, (*file)->maps->ptr); }
 #ifdef HAVE_ZLIB
 	if ((*file)->idx != NULL) { retval = ziclose( &((*file)->idx) ); }
 	if ((*file)->zfptr!=NULL) { retval = gzclose((*file)->zfptr); }
@@ -137,7 +267,7 @@ int Xznzclose(znzFile * file)
 #undef ZNZ_MAX_BLOCK_SIZE
 #define ZNZ_MAX_BLOCK_SIZE (1<<30)
 
-size_t znzread(void* buf, size_t size, size_t nmemb, znzFile file)
+static size_t znz_read(void* buf, size_t size, size_t nmemb, znzFile file)
 {
   size_t     remain = size*nmemb;
   char     * cbuf = (char *)buf;
@@ -176,6 +306,20 @@ size_t znzread(void* buf, size_t size, size_t nmemb, znzFile file)
   return fread(buf,size,nmemb,file->nzfptr);
 }
 
+size_t znzread(void* buf, size_t size, size_t nmemb, znzFile file)
+{
+  size_t got;
+  long pos;
+  unsigned long long start;
+
+  if (!ZNZ_TRACED(file)) return znz_read(buf, size, nmemb, file);
+  pos = znztell(file);
+  start = znz_now();
+  got = znz_read(buf, size, nmemb, file);
+  znz_trace(file, ZNZ_TRACE_READ, pos, size*nmemb, start);
+  return got;
+}
+
 size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file)
 {
   size_t     remain = size*nmemb;
@@ -214,7 +358,7 @@ size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file)
   return fwrite(buf,size,nmemb,file->nzfptr);
 }
 
-long znzseek(znzFile file, long offset, int whence)
+static long znz_seek(znzFile file, long offset, int whence)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
@@ -224,7 +368,19 @@ long znzseek(znzFile file, long offset, int whence)
   return fseek(file->nzfptr,offset,whence);
 }
 
-int znzrewind(znzFile stream)
+long znzseek(znzFile file, long offset, int whence)
+{
+  long ret;
+  unsigned long long start;
+
+  if (!ZNZ_TRACED(file)) return znz_seek(file, offset, whence);
+  start = znz_now();
+  ret = znz_seek(file, offset, whence);
+  znz_trace(file, ZNZ_TRACE_SEEK, znztell(file), 0, start);
+  return ret;
+}
+
+static int znz_rewind(znzFile stream)
 {
   if (stream==NULL) { return 0; }
 #ifdef HAVE_ZLIB
@@ -240,6 +396,18 @@ int znzrewind(znzFile stream)
   return 0;
 }
 
+int znzrewind(znzFile stream)
+{
+  int ret;
+  unsigned long long start;
+
+  if (!ZNZ_TRACED(stream)) return znz_rewind(stream);
+  start = znz_now();
+  ret = znz_rewind(stream);
+  znz_trace(stream, ZNZ_TRACE_SEEK, 0L, 0, start);
+  return ret;
+}
+
 long znztell(znzFile file)
 {
   if (file==NULL) { return 0; }
@@ -250,6 +418,24 @@ long znztell(znzFile file)
   return ftell(file->nzfptr);
 }
 
+long znzseek_line(znzFile file, long line)
+{
+  char buf[16384];
+  long n;
+  size_t len;
+
+  if (file==NULL || line < 0) { return -1; }
+#ifdef HAVE_ZLIB
+  if (file->idx!=NULL && file->idx->data->lines!=NULL)
+    return zi_seek_line(file->idx, (off_t)line);
+#endif
+  /* no line counts: read lines from the start */
+  if (znzseek(file, 0L, SEEK_SET) < 0) return -1;
+  for (n = 0; n < line && znzgets(buf, sizeof(buf), file) != NULL; )
+    if ((len = strlen(buf)) > 0 && buf[len - 1] == '\n') n++;
+  return znztell(file);
+}
+
 int znzputs(const char * str, znzFile file)
 {
   if (file==NULL) { return 0; }
@@ -261,7 +447,7 @@ int znzputs(const char * str, znzFile file)
 }
 
 
-char * znzgets(char* str, int size, znzFile file)
+static char * znz_gets(char* str, int size, znzFile file)
 {
   if (file==NULL) { return NULL; }
 #ifdef HAVE_ZLIB
@@ -272,6 +458,21 @@ char * znzgets(char* str, int size, znzFile file)
 }
 
 
+char * znzgets(char* str, int size, znzFile file)
+{
+  char *ret;
+  long pos;
+  unsigned long long start;
+
+  if (!ZNZ_TRACED(file)) return znz_gets(str, size, file);
+  pos = znztell(file);
+  start = znz_now();
+  ret = znz_gets(str, size, file);
+  znz_trace(file, ZNZ_TRACE_READ, pos, size > 0 ? (size_t)size : 0, start);
+  return ret;
+}
+
+
 int znzflush(znzFile file)
 {
   if (file==NULL) { return 0; }
@@ -351,3 +552,74 @@ int znzprintf(znzFile stream, const char *format, ...)
 
 #endif
 
+static const void * znz_map_at(znzFile file, long offset, size_t len)
+{
+#if !defined(WIN32)
+  struct znz_map *map;
+  struct stat st;
+  long page, skip;
+#endif
+
+  if (file==NULL || offset < 0 || len == 0) { return NULL; }
+#ifdef HAVE_ZLIB
+  if (file->idx!=NULL) return zimap(file->idx, (off_t)offset, len);
+  if (file->zfptr!=NULL) return NULL; /* no index, no random access */
+#endif
+#if !defined(WIN32)
+  /* pending writes must reach the file first */
+  if (fflush(file->nzfptr) != 0 || fstat(fileno(file->nzfptr), &st) != 0 ||
+      (off_t)offset + (off_t)len > st.st_size)
+    return NULL;
+  map = (struct znz_map *)calloc(1, sizeof(struct znz_map));
+  if (map == NULL) return NULL;
+  page = sysconf(_SC_PAGESIZE);
+  skip = page > 0 ? offset % page : 0;
+  map->len = len + (size_t)skip;
+  map->base = mmap(NULL, map->len, PROT_READ, MAP_SHARED,
+                   fileno(file->nzfptr), (off_t)(offset - skip));
+  if (map->base == MAP_FAILED) {
+    free(map);
+    return NULL;
+  }
+  map->ptr = (const char *)map->base + skip;
+  map->next = file->maps;
+  file->maps = map;
+  return map->ptr;
+#else
+  return NULL;
+#endif
+}
+
+const void * znzmap(znzFile file, long offset, size_t len)
+{
+  const void *ret;
+  unsigned long long start;
+
+  if (!ZNZ_TRACED(file)) return znz_map_at(file, offset, len);
+  start = znz_now();
+  ret = znz_map_at(file, offset, len);
+  znz_trace(file, ZNZ_TRACE_MAP, offset, len, start);
+  return ret;
+}
+
+int znzunmap(znzFile file, const void * ptr)
+{
+#if !defined(WIN32)
+  struct znz_map *map, **link;
+#endif
+
+  if (file==NULL || ptr==NULL) { return -1; }
+#ifdef HAVE_ZLIB
+  if (file->idx!=NULL) return ziunmap(file->idx, ptr);
+#endif
+#if !defined(WIN32)
+  for (link = &file->maps; (map = *link) != NULL; link = &map->next)
+    if (map->ptr == (const char *)ptr) {
+      *link = map->next;
+      munmap(map->base, map->len);
+      free(map);
+      return 0;
+    }
+#endif
+  return -1;
+}
@@ -69,6 +69,8 @@ extern "C" {
 #include "zindex.h"
 #endif
 
+struct znz_map;
+
 struct znzptr {
   int withz;
   FILE* nzfptr;
@@ -76,8 +78,28 @@ struct znzptr {
   gzFile zfptr;
   zindexPtr idx;
 #endif
+  struct znz_map * maps;  /* mappings of an uncompressed file by znzmap() */
+  unsigned trace;         /* handle number in the access trace, 0 if none */
 } ;
 
+/* access trace: with ZNZ_TRACE naming a file, every open, seek, read and
+   close is appended to it after the magic, as a record of ZNZ_TRACE_REC
+   bytes, little-endian: type (8 bits), kind of file (8), handle (16),
+   process id (32), time of the call in ns (64, CLOCK_MONOTONIC), offset
+   (64), length (32) and duration of the call in ns (32); an open record is
+   followed by length bytes of the path.  The offset is where a read starts
+   or a seek ends.  "zindex replay" plays a trace back. */
+#define ZNZ_TRACE_MAGIC "ZNZTRC1\n"
+#define ZNZ_TRACE_REC 32
+#define ZNZ_TRACE_OPEN 1
+#define ZNZ_TRACE_SEEK 2
+#define ZNZ_TRACE_READ 3
+#define ZNZ_TRACE_MAP 4   /* a read by znzmap() */
+#define ZNZ_TRACE_CLOSE 5
+#define ZNZ_TRACE_PLAIN 0 /* kinds: uncompressed */
+#define ZNZ_TRACE_GZ 1    /* gzip read through */
+#define ZNZ_TRACE_INDEXED 2 /* read through zindex */
+
 /* the type for all file pointers */
 typedef struct znzptr * znzFile;
 
@@ -108,6 +130,10 @@ int znzrewind(znzFile stream);
 
 long znztell(znzFile file);
 
+/* go to the start of line (counting from 0): indexed files built with
+   "zindex -n" decode from the nearest line mark, others are read through */
+long znzseek_line(znzFile file, long line);
+
 int znzputs(const char *str, znzFile file);
 
 char * znzgets(char* str, int size, znzFile file);
@@ -116,6 +142,13 @@ int znzputc(int c, znzFile file);
 
 int znzgetc(znzFile file);
 
+/* read-only pointer to len bytes at offset, without a copy where possible:
+   the file itself is mapped if uncompressed, a decompressed span is pinned
+   if indexed; NULL if not possible (plain gzip) -- use znzread() then */
+const void * znzmap(znzFile file, long offset, size_t len);
+
+int znzunmap(znzFile file, const void * ptr);
+
 #if !defined(WIN32)
 int znzprintf(znzFile stream, const char *format, ...);
 #endif